@@ -0,0 +1,408 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ *  Copyright (C) 2024 Gary Sims
+ *
+ */
+
+/*
+ * Benchmark runner for KeyVa scripts
+ *
+ *   keyva_bench [options] INTERPRETER BENCHMARK_DIR
+ *
+ * Runs every NAME.kv in BENCHMARK_DIR with INTERPRETER, after some warmup
+ * runs, and reports the median and 95th percentile of the wall time. The
+ * output of the first run is checked against NAME.out when it exists, so
+ * a faster but wrong interpreter does not pass.
+ *
+ * With --baseline=FILE the medians are compared to those of an earlier
+ * run, written with --output=FILE, and the exit status is 1 if any is
+ * slower by more than the threshold. Times are only comparable on the same
+ * machine and for the same build: --build-type=TYPE is recorded in the
+ * output, and a baseline of another build type is not compared against.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define MAX_BENCHMARKS 256
+#define MAX_REPETITIONS 1000
+#define MAX_INTERPRETER_ARGS 16
+#define MAX_NAME_LENGTH 256
+
+typedef struct {
+    char name[MAX_NAME_LENGTH];
+    double median;
+    double p95;
+    double baseline;            // Median of the baseline, 0 if none
+    int failed;
+} Benchmark;
+
+typedef struct {
+    const char *interpreter;
+    const char *directory;
+    const char *baseline_path;
+    const char *output_path;
+    const char *filter;
+    const char *build_type;
+    const char *interpreter_args[MAX_INTERPRETER_ARGS];
+    int interpreter_arg_count;
+    int warmup;
+    int repetitions;
+    double threshold;           // Percent
+} Options;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *read_file(const char *path, size_t *length) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    size_t capacity = 4096;
+    size_t size = 0;
+    char *data = malloc(capacity);
+    while (data != NULL) {
+        size += fread(data + size, 1, capacity - size - 1, file);
+        if (size < capacity - 1) {
+            break;
+        }
+        capacity *= 2;
+        char *grown = realloc(data, capacity);
+        if (grown == NULL) {
+            free(data);
+        }
+        data = grown;
+    }
+    fclose(file);
+    if (data != NULL) {
+        data[size] = '\0';
+        if (length != NULL) {
+            *length = size;
+        }
+    }
+    return data;
+}
+
+// Runs the script once, returns its wall time or a negative value if it
+// failed. If output is not NULL, it receives what the script printed
+static double run_script(const Options *options, const char *script, char **output) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return -1;
+    }
+
+    double start = now();
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        const char *argv[MAX_INTERPRETER_ARGS + 3];
+        int argc = 0;
+        argv[argc++] = options->interpreter;
+        for (int i = 0; i < options->interpreter_arg_count; i++) {
+            argv[argc++] = options->interpreter_args[i];
+        }
+        argv[argc++] = script;
+        argv[argc] = NULL;
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execv(options->interpreter, (char * const *) argv);
+        _exit(127);
+    }
+    close(fds[1]);
+
+    // Always drained, so the script never blocks on a full pipe
+    size_t capacity = 4096;
+    size_t size = 0;
+    char *data = output != NULL ? malloc(capacity) : NULL;
+    char chunk[4096];
+    ssize_t n;
+    while ((n = read(fds[0], chunk, sizeof(chunk))) > 0) {
+        if (data == NULL) {
+            continue;
+        }
+        while (size + n + 1 > capacity) {
+            capacity *= 2;
+        }
+        char *grown = realloc(data, capacity);
+        if (grown == NULL) {
+            free(data);
+            data = NULL;
+            continue;
+        }
+        data = grown;
+        memcpy(data + size, chunk, n);
+        size += n;
+    }
+    close(fds[0]);
+
+    int status;
+    waitpid(pid, &status, 0);
+    double elapsed = now() - start;
+
+    if (data != NULL) {
+        data[size] = '\0';
+        *output = data;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return -1;
+    }
+    return elapsed;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// Nearest rank percentile of sorted times
+static double percentile(const double *times, int count, double p) {
+    int rank = (int) (p / 100.0 * count + 0.999999);
+    if (rank < 1) {
+        rank = 1;
+    }
+    return times[rank - 1];
+}
+
+static int run_benchmark(const Options *options, Benchmark *benchmark) {
+    char script[2 * MAX_NAME_LENGTH + 8];
+    char expected_path[2 * MAX_NAME_LENGTH + 8];
+    snprintf(script, sizeof(script), "%s/%s.kv", options->directory, benchmark->name);
+    snprintf(expected_path, sizeof(expected_path), "%s/%s.out", options->directory, benchmark->name);
+
+    // The first run checks the output, then warms up with the others
+    char *output = NULL;
+    if (run_script(options, script, &output) < 0) {
+        printf("Error: %s failed\n", benchmark->name);
+        free(output);
+        return 0;
+    }
+    char *expected = read_file(expected_path, NULL);
+    if (expected != NULL && (output == NULL || strcmp(output, expected) != 0)) {
+        printf("Error: %s printed something else than %s\n", benchmark->name, expected_path);
+        free(expected);
+        free(output);
+        return 0;
+    }
+    free(expected);
+    free(output);
+    for (int i = 1; i < options->warmup; i++) {
+        run_script(options, script, NULL);
+    }
+
+    double times[MAX_REPETITIONS];
+    for (int i = 0; i < options->repetitions; i++) {
+        times[i] = run_script(options, script, NULL);
+        if (times[i] < 0) {
+            printf("Error: %s failed\n", benchmark->name);
+            return 0;
+        }
+    }
+    qsort(times, options->repetitions, sizeof(double), compare_doubles);
+    benchmark->median = options->repetitions % 2 == 1
+        ? times[options->repetitions / 2]
+        : (times[options->repetitions / 2 - 1] + times[options->repetitions / 2]) / 2;
+    benchmark->p95 = percentile(times, options->repetitions, 95);
+    return 1;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(((const Benchmark *) a)->name, ((const Benchmark *) b)->name);
+}
+
+static int find_benchmarks(const Options *options, Benchmark benchmarks[]) {
+    DIR *dir = opendir(options->directory);
+    if (dir == NULL) {
+        printf("Error: Could not open '%s'\n", options->directory);
+        return -1;
+    }
+    int count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && count < MAX_BENCHMARKS) {
+        size_t length = strlen(entry->d_name);
+        if (length < 4 || length >= MAX_NAME_LENGTH || strcmp(entry->d_name + length - 3, ".kv") != 0) {
+            continue;
+        }
+        if (options->filter != NULL && strstr(entry->d_name, options->filter) == NULL) {
+            continue;
+        }
+        memset(&benchmarks[count], 0, sizeof(Benchmark));
+        memcpy(benchmarks[count].name, entry->d_name, length - 3);
+        count++;
+    }
+    closedir(dir);
+    qsort(benchmarks, count, sizeof(Benchmark), compare_names);
+    return count;
+}
+
+// Reads the median of each benchmark from a file written by write_results(),
+// of a run of the same build type
+static int read_baseline(const Options *options, Benchmark benchmarks[], int count) {
+    const char *path = options->baseline_path;
+    char *json = read_file(path, NULL);
+    if (json == NULL) {
+        printf("Error: Could not read baseline '%s', write one with --output=FILE\n", path);
+        return 0;
+    }
+    const char *build_type = options->build_type != NULL ? options->build_type : "";
+    const char *recorded = strstr(json, "\"build_type\": \"");
+    size_t length = strlen(build_type);
+    if (recorded == NULL || strncmp(recorded + 15, build_type, length) != 0 || recorded[15 + length] != '"') {
+        printf("Error: Baseline '%s' is not of a '%s' build, write a new one with --output=FILE\n", path, build_type);
+        free(json);
+        return 0;
+    }
+    for (int i = 0; i < count; i++) {
+        char quoted[MAX_NAME_LENGTH + 4];
+        // Names are shorter than MAX_NAME_LENGTH, see find_benchmarks()
+        snprintf(quoted, sizeof(quoted), "\"%.*s\"", MAX_NAME_LENGTH - 1, benchmarks[i].name);
+        const char *entry = strstr(json, quoted);
+        const char *median = entry != NULL ? strstr(entry, "\"median\":") : NULL;
+        if (median != NULL) {
+            benchmarks[i].baseline = strtod(median + 9, NULL);
+        }
+    }
+    free(json);
+    return 1;
+}
+
+static int write_results(const Options *options, const Benchmark benchmarks[], int count) {
+    FILE *out = fopen(options->output_path, "w");
+    if (out == NULL) {
+        printf("Error: Could not write '%s'\n", options->output_path);
+        return 0;
+    }
+    fprintf(out, "{\n");
+    fprintf(out, "  \"build_type\": \"%s\",\n", options->build_type != NULL ? options->build_type : "");
+    fprintf(out, "  \"repetitions\": %d,\n", options->repetitions);
+    fprintf(out, "  \"interpreter_args\": \"");
+    for (int i = 0; i < options->interpreter_arg_count; i++) {
+        fprintf(out, "%s%s", i > 0 ? " " : "", options->interpreter_args[i]);
+    }
+    fprintf(out, "\",\n");
+    fprintf(out, "  \"benchmarks\": {\n");
+    int written = 0;
+    for (int i = 0; i < count; i++) {
+        if (benchmarks[i].failed) {
+            continue;
+        }
+        fprintf(out, "%s    \"%s\": { \"median\": %.6f, \"p95\": %.6f }",
+                written++ > 0 ? ",\n" : "", benchmarks[i].name, benchmarks[i].median, benchmarks[i].p95);
+    }
+    fprintf(out, "\n  }\n}\n");
+    fclose(out);
+    return 1;
+}
+
+static void print_usage(const char *program) {
+    printf("Usage: %s [options] INTERPRETER BENCHMARK_DIR\n", program);
+    printf("Options:\n");
+    printf("  --warmup=N          Runs of each script before timing it (default 1)\n");
+    printf("  --repetitions=N     Timed runs of each script (default 5)\n");
+    printf("  --baseline=FILE     Fail if a median is slower than in FILE by more than the threshold\n");
+    printf("  --threshold=PCT     Allowed slowdown against the baseline, in percent (default 25)\n");
+    printf("  --output=FILE       Write the results to FILE, for use as a baseline\n");
+    printf("  --build-type=TYPE   Build type of the interpreter, kept in the output and checked in the baseline\n");
+    printf("  --filter=TEXT       Only run the scripts whose name contains TEXT\n");
+    printf("  --arg=ARG           Pass ARG to the interpreter, e.g. --arg=--jit\n");
+}
+
+int main(int argc, char *argv[]) {
+    Options options = {0};
+    options.warmup = 1;
+    options.repetitions = 5;
+    options.threshold = 25;
+
+    const char *positional[2];
+    int positional_count = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--warmup=", 9) == 0) {
+            options.warmup = atoi(argv[i] + 9);
+        } else if (strncmp(argv[i], "--repetitions=", 14) == 0) {
+            options.repetitions = atoi(argv[i] + 14);
+        } else if (strncmp(argv[i], "--baseline=", 11) == 0) {
+            options.baseline_path = argv[i] + 11;
+        } else if (strncmp(argv[i], "--threshold=", 12) == 0) {
+            options.threshold = atof(argv[i] + 12);
+        } else if (strncmp(argv[i], "--output=", 9) == 0) {
+            options.output_path = argv[i] + 9;
+        } else if (strncmp(argv[i], "--filter=", 9) == 0) {
+            options.filter = argv[i] + 9;
+        } else if (strncmp(argv[i], "--build-type=", 13) == 0) {
+            options.build_type = argv[i] + 13;
+        } else if (strncmp(argv[i], "--arg=", 6) == 0 && options.interpreter_arg_count < MAX_INTERPRETER_ARGS) {
+            options.interpreter_args[options.interpreter_arg_count++] = argv[i] + 6;
+        } else if (strcmp(argv[i], "--help") == 0) {
+            print_usage(argv[0]);
+            return 0;
+        } else if (argv[i][0] != '-' && positional_count < 2) {
+            positional[positional_count++] = argv[i];
+        } else {
+            printf("Error: Unknown option '%s'\n", argv[i]);
+            print_usage(argv[0]);
+            return 2;
+        }
+    }
+    if (positional_count != 2 || options.repetitions < 1 || options.repetitions > MAX_REPETITIONS) {
+        print_usage(argv[0]);
+        return 2;
+    }
+    options.interpreter = positional[0];
+    options.directory = positional[1];
+
+    static Benchmark benchmarks[MAX_BENCHMARKS];
+    int count = find_benchmarks(&options, benchmarks);
+    if (count <= 0) {
+        printf("Error: No benchmarks found in '%s'\n", options.directory);
+        return 1;
+    }
+    if (options.baseline_path != NULL && !read_baseline(&options, benchmarks, count)) {
+        return 1;
+    }
+
+    int failures = 0;
+    int regressions = 0;
+    printf("%-20s %12s %12s %12s %9s\n", "benchmark", "median (s)", "p95 (s)", "baseline (s)", "change");
+    for (int i = 0; i < count; i++) {
+        Benchmark *benchmark = &benchmarks[i];
+        fflush(stdout);
+        if (!run_benchmark(&options, benchmark)) {
+            benchmark->failed = 1;
+            failures++;
+            continue;
+        }
+        printf("%-20s %12.6f %12.6f", benchmark->name, benchmark->median, benchmark->p95);
+        if (benchmark->baseline > 0) {
+            double change = 100.0 * (benchmark->median - benchmark->baseline) / benchmark->baseline;
+            int regressed = change > options.threshold;
+            regressions += regressed;
+            printf(" %12.6f %+8.1f%%%s\n", benchmark->baseline, change, regressed ? "  REGRESSION" : "");
+        } else {
+            printf(" %12s %9s\n", "-", "-");
+        }
+    }
+
+    if (options.output_path != NULL && !write_results(&options, benchmarks, count)) {
+        return 1;
+    }
+    if (failures > 0 || regressions > 0) {
+        printf("%d failed, %d slower than the baseline by more than %.0f%%\n",
+               failures, regressions, options.threshold);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,204 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ *  Copyright (C) 2024 Gary Sims
+ *
+ */
+
+/*
+ * Contention benchmark of shared arrays
+ *
+ *   keyva_contention_bench [--json] [--threads=N,N,...] [--time=SECONDS]
+ *                          [--writes=PERCENT] [--keys=N]
+ *
+ * Each thread reads and writes random keys of one array through
+ * get_assoc_array_value() and set_assoc_array_value(), --writes percent of
+ * them writes, for --time seconds. The array is a shared array (kvshared.c)
+ * and, to compare, an ordinary array behind a mutex. The total operations
+ * per second are reported for each number of threads.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "kvlang_internals.h"
+#include "kvshared.h"
+
+#define MAX_THREADS 64
+#define MAX_KEYS 100000
+
+typedef struct {
+    const char *name;
+    int locked;                 // Guard the array with a mutex
+} Mode;
+
+static const Mode modes[] = {
+    { "shared", 0 },
+    { "mutex", 1 },
+    { NULL, 0 }
+};
+
+typedef struct {
+    AssocArray *array;
+    pthread_mutex_t *lock;      // NULL for a shared array
+    int writes;                 // Percent
+    int keys;
+    unsigned long seed;
+    volatile int *stop;
+    unsigned long operations;
+    pthread_t thread;
+} Worker;
+
+static char (*keys)[16];
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// xorshift64, so that threads do not share the state of rand()
+static unsigned long next_random(unsigned long *state) {
+    unsigned long x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+static void *run_worker(void *data) {
+    Worker *worker = (Worker *) data;
+    unsigned long operations = 0;
+    while (!__atomic_load_n(worker->stop, __ATOMIC_RELAXED)) {
+        unsigned long r = next_random(&worker->seed);
+        const char *key = keys[(r >> 8) % worker->keys];
+        int write = (int) (r % 100) < worker->writes;
+        if (worker->lock != NULL) {
+            pthread_mutex_lock(worker->lock);
+        }
+        if (write) {
+            set_assoc_array_value(worker->array, key, "42");
+        } else if (get_assoc_array_value(worker->array, key) == NULL) {
+            printf("Error: Key '%s' not found\n", key);
+        }
+        if (worker->lock != NULL) {
+            pthread_mutex_unlock(worker->lock);
+        }
+        operations++;
+    }
+    worker->operations = operations;
+    return NULL;
+}
+
+// Operations per second of threads working on array for seconds
+static double measure(AssocArray *array, pthread_mutex_t *lock, int threads, int writes, int key_count, double seconds) {
+    Worker workers[MAX_THREADS];
+    volatile int stop = 0;
+    int started = 0;
+    double start = now();
+    for (int i = 0; i < threads; i++) {
+        workers[i].array = array;
+        workers[i].lock = lock;
+        workers[i].writes = writes;
+        workers[i].keys = key_count;
+        workers[i].seed = 0x9E3779B97F4A7C15UL * (i + 1);
+        workers[i].stop = &stop;
+        workers[i].operations = 0;
+        if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) != 0) {
+            printf("Warning: Could only start %d threads\n", i);
+            break;
+        }
+        started++;
+    }
+
+    struct timespec pause = { (time_t) seconds, (long) ((seconds - (time_t) seconds) * 1e9) };
+    nanosleep(&pause, NULL);
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    double elapsed = now() - start;
+
+    unsigned long operations = 0;
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+        operations += workers[i].operations;
+    }
+    return operations / elapsed;
+}
+
+int main(int argc, char *argv[]) {
+    int json = 0;
+    double seconds = 0.5;
+    int writes = 5;
+    int key_count = 100;
+    int thread_counts[MAX_THREADS] = { 1, 2, 4, 8, 16, 32, 64 };
+    int thread_count_count = 7;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            json = 1;
+        } else if (strncmp(argv[i], "--time=", 7) == 0) {
+            seconds = atof(argv[i] + 7);
+        } else if (strncmp(argv[i], "--writes=", 9) == 0) {
+            writes = atoi(argv[i] + 9);
+        } else if (strncmp(argv[i], "--keys=", 7) == 0) {
+            key_count = atoi(argv[i] + 7);
+        } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+            thread_count_count = 0;
+            for (char *p = argv[i] + 10; *p != '\0' && thread_count_count < MAX_THREADS; ) {
+                int n = (int) strtol(p, &p, 10);
+                if (n >= 1 && n <= MAX_THREADS) {
+                    thread_counts[thread_count_count++] = n;
+                }
+                if (*p == ',') {
+                    p++;
+                } else {
+                    break;
+                }
+            }
+        } else {
+            printf("Usage: %s [--json] [--threads=N,N,...] [--time=SECONDS] [--writes=PERCENT] [--keys=N]\n", argv[0]);
+            return strcmp(argv[i], "--help") == 0 ? 0 : 2;
+        }
+    }
+    if (key_count < 1 || key_count > MAX_KEYS || writes < 0 || writes > 100 || thread_count_count == 0) {
+        printf("Error: --keys must be 1 to %d, --writes 0 to 100, --threads 1 to %d\n", MAX_KEYS, MAX_THREADS);
+        return 2;
+    }
+
+    keys = malloc(sizeof(*keys) * key_count);
+    for (int k = 0; k < key_count; k++) {
+        snprintf(keys[k], sizeof(keys[k]), "key%d", k);
+    }
+
+    if (!json) {
+        printf("%-8s %8s %8s %16s\n", "array", "threads", "writes", "ops/s");
+    }
+    for (const Mode *mode = modes; mode->name != NULL; mode++) {
+        AssocArray array;
+        pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+        init_assoc_array(&array);
+        if (!mode->locked) {
+            array.shared = shared_table("contention");
+        }
+        for (int k = 0; k < key_count; k++) {
+            set_assoc_array_value(&array, keys[k], "0");
+        }
+
+        for (int t = 0; t < thread_count_count; t++) {
+            double rate = measure(&array, mode->locked ? &lock : NULL, thread_counts[t], writes, key_count, seconds);
+            if (json) {
+                printf("{\"benchmark\": \"%s\", \"threads\": %d, \"writes\": %d, \"keys\": %d, \"ops_per_second\": %.0f}\n",
+                       mode->name, thread_counts[t], writes, key_count, rate);
+            } else {
+                printf("%-8s %8d %7d%% %16.0f\n", mode->name, thread_counts[t], writes, rate);
+            }
+            fflush(stdout);
+        }
+        free_assoc_array(&array);
+    }
+    free(keys);
+    return 0;
+}
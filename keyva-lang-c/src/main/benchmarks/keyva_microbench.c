@@ -0,0 +1,346 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ *  Copyright (C) 2024 Gary Sims
+ *
+ */
+
+/*
+ * Microbenchmarks of interpreter routines
+ *
+ *   keyva_microbench [--json] [--filter=TEXT] [--cpu=N] [--time=SECONDS]
+ *
+ * Each benchmark repeats one operation on fixed input, linked against
+ * libkeyva. The number of iterations is calibrated to run for
+ * about --time seconds, five times, and the median is reported as ns per
+ * operation, with TSC cycles per operation on x86. The process is pinned
+ * to one CPU so the TSC and the caches stay the same.
+ *
+ * When linked with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc (and
+ * KEYVA_COUNT_ALLOCATIONS defined), allocations per operation are counted
+ * too. --json prints one JSON object per benchmark, for trend tracking.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+
+#include "kvlang_internals.h"
+#include "kvreduce.h"
+#include "kvvector.h"
+#include "kvbuffer.h"
+
+#define SAMPLES 5
+#define MAX_BENCH_TOKENS 256
+
+#ifdef KEYVA_COUNT_ALLOCATIONS
+static unsigned long allocations = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    allocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    allocations++;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *p, size_t size) {
+    allocations++;
+    return __real_realloc(p, size);
+}
+#endif
+
+typedef struct {
+    const char *name;
+    void (*setup)(void);
+    void (*run)(unsigned long i);   // One operation, i counts the iterations
+} MicroBenchmark;
+
+typedef struct {
+    double ns_per_op;
+    double cycles_per_op;
+    double allocations_per_op;
+    unsigned long iterations;
+} MicroResult;
+
+static unsigned long long ticks() {
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Fixed inputs
+
+static const char *program_source =
+    "def area(w, h)\n"
+    "    return w * h\n"
+    "end\n"
+    "total = 0\n"
+    "for i in range(10)\n"
+    "    total = total + area(i, 2) - 1\n"
+    "end\n"
+    "print(total)\n";
+
+static Token tokens[MAX_BENCH_TOKENS];
+static int token_count;
+static AssocArray array;
+static char keys[100][16];
+static ASTNode *expression;
+
+static void tokenize_expression(const char *source) {
+    token_count = 0;
+    tokenize_line(source, tokens, &token_count);
+}
+
+static void setup_nothing(void) {
+}
+
+static void run_tokenize(unsigned long i) {
+    (void) i;
+    int count = 0;
+    tokenize_line(program_source, tokens, &count);
+}
+
+static void setup_parse(void) {
+    tokenize_expression("a * (b + 3) - c / 2 < total + 10");
+}
+
+static void run_parse(unsigned long i) {
+    (void) i;
+    int pos = 0;
+    free_ast(parse_expression(tokens, &pos, token_count));
+}
+
+static void setup_assoc(void) {
+    if (array.pairs != NULL) {
+        free_assoc_array(&array);
+    }
+    init_assoc_array(&array);
+    for (int k = 0; k < 100; k++) {
+        snprintf(keys[k], sizeof(keys[k]), "key%d", k);
+        set_assoc_array_value(&array, keys[k], "0");
+    }
+}
+
+static void run_assoc_set(unsigned long i) {
+    set_assoc_array_value(&array, keys[i % 100], "42");
+}
+
+static void run_assoc_get(unsigned long i) {
+    if (get_assoc_array_value(&array, keys[i % 100]) == NULL) {
+        printf("Error: Key '%s' not found\n", keys[i % 100]);
+    }
+}
+
+static void run_reduce(unsigned long i) {
+    (void) i;
+    Reduction reduction;
+    int bad;
+    if (!reduce_array(&array, &reduction, &bad)) {
+        printf("Error: Value '%s' is not a number\n", array.pairs[bad].value);
+    }
+}
+
+static AssocArray numbers;
+
+static void setup_buffer(void) {
+    free_assoc_array(&numbers);
+    init_assoc_array(&numbers);
+    numbers.buffer = buffer_create(BUFFER_F64, 100);
+}
+
+static void run_reduce_buffer(unsigned long i) {
+    (void) i;
+    Reduction reduction;
+    int bad;
+    reduce_array(&numbers, &reduction, &bad);
+}
+
+static AssocArray elements;
+
+static void run_elementwise(unsigned long i) {
+    (void) i;
+    if (!elementwise_arrays(OP_MULTIPLY, &array, &array, &elements)) {
+        printf("Error: Arrays could not be multiplied\n");
+    }
+}
+
+static void setup_evaluate(void) {
+    set_variable_value("a", NULL, "7");
+    set_variable_value("b", NULL, "5");
+    set_variable_value("c", NULL, "12");
+    tokenize_expression("a * (b + 3) - c / 2");
+    int pos = 0;
+    if (expression != NULL) {
+        free_ast(expression);
+    }
+    expression = parse_expression(tokens, &pos, token_count);
+}
+
+static void run_evaluate(unsigned long i) {
+    (void) i;
+    EvalResult result;
+    evaluate_expression(expression, &result, EVAL_ARITHMETIC);
+}
+
+static void run_scope(unsigned long i) {
+    (void) i;
+    push_scope();
+    pop_scope();
+}
+
+static void run_scope_with_variable(unsigned long i) {
+    (void) i;
+    push_scope();
+    set_variable_value("x", NULL, "1");
+    pop_scope();
+}
+
+static const MicroBenchmark benchmarks[] = {
+    { "tokenize_line", setup_nothing, run_tokenize },
+    { "parse_expression", setup_parse, run_parse },
+    { "set_assoc_array_value", setup_assoc, run_assoc_set },
+    { "get_assoc_array_value", setup_assoc, run_assoc_get },
+    { "reduce_array", setup_assoc, run_reduce },
+    { "reduce_buffer", setup_buffer, run_reduce_buffer },
+    { "elementwise_arrays", setup_assoc, run_elementwise },
+    { "evaluate_expression", setup_evaluate, run_evaluate },
+    { "push_pop_scope", setup_nothing, run_scope },
+    { "push_pop_scope_variable", setup_nothing, run_scope_with_variable },
+    { NULL, NULL, NULL }
+};
+
+static int compare_results(const void *a, const void *b) {
+    double x = ((const MicroResult *) a)->ns_per_op;
+    double y = ((const MicroResult *) b)->ns_per_op;
+    return (x > y) - (x < y);
+}
+
+static MicroResult measure(const MicroBenchmark *benchmark, double seconds) {
+    benchmark->setup();
+
+    // Double the iterations until a run takes a tenth of the time
+    unsigned long iterations = 1;
+    while (1) {
+        double start = now();
+        for (unsigned long i = 0; i < iterations; i++) {
+            benchmark->run(i);
+        }
+        if (now() - start >= seconds / 10 || iterations >= (1UL << 40)) {
+            break;
+        }
+        iterations *= 2;
+    }
+    iterations *= 10;
+
+    MicroResult samples[SAMPLES];
+    for (int s = 0; s < SAMPLES; s++) {
+#ifdef KEYVA_COUNT_ALLOCATIONS
+        unsigned long allocations_before = allocations;
+#endif
+        unsigned long long ticks_before = ticks();
+        double start = now();
+        for (unsigned long i = 0; i < iterations; i++) {
+            benchmark->run(i);
+        }
+        double elapsed = now() - start;
+        samples[s].cycles_per_op = (double) (ticks() - ticks_before) / iterations;
+        samples[s].ns_per_op = elapsed * 1e9 / iterations;
+#ifdef KEYVA_COUNT_ALLOCATIONS
+        samples[s].allocations_per_op = (double) (allocations - allocations_before) / iterations;
+#else
+        samples[s].allocations_per_op = -1;
+#endif
+        samples[s].iterations = iterations;
+    }
+    qsort(samples, SAMPLES, sizeof(MicroResult), compare_results);
+    return samples[SAMPLES / 2];
+}
+
+// Keeps the process on one CPU, the current one if cpu is negative
+static int pin_cpu(int cpu) {
+#ifdef __linux__
+    if (cpu < 0) {
+        cpu = sched_getcpu();
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (cpu < 0 || sched_setaffinity(0, sizeof(set), &set) != 0) {
+        printf("Warning: Could not pin to CPU %d\n", cpu);
+        return -1;
+    }
+    return cpu;
+#else
+    (void) cpu;
+    return -1;
+#endif
+}
+
+int main(int argc, char *argv[]) {
+    int json = 0;
+    int cpu = -1;
+    double seconds = 0.2;
+    const char *filter = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            json = 1;
+        } else if (strncmp(argv[i], "--filter=", 9) == 0) {
+            filter = argv[i] + 9;
+        } else if (strncmp(argv[i], "--cpu=", 6) == 0) {
+            cpu = atoi(argv[i] + 6);
+        } else if (strncmp(argv[i], "--time=", 7) == 0) {
+            seconds = atof(argv[i] + 7);
+        } else {
+            printf("Usage: %s [--json] [--filter=TEXT] [--cpu=N] [--time=SECONDS]\n", argv[0]);
+            return strcmp(argv[i], "--help") == 0 ? 0 : 2;
+        }
+    }
+    cpu = pin_cpu(cpu);
+
+    if (!json) {
+        printf("%-26s %12s %12s %12s %14s\n", "benchmark", "ns/op", "cycles/op", "allocs/op", "iterations");
+    }
+    for (const MicroBenchmark *benchmark = benchmarks; benchmark->name != NULL; benchmark++) {
+        if (filter != NULL && strstr(benchmark->name, filter) == NULL) {
+            continue;
+        }
+        MicroResult result = measure(benchmark, seconds);
+        if (json) {
+            printf("{\"benchmark\": \"%s\", \"ns_per_op\": %.3f, \"cycles_per_op\": %.1f, "
+                   "\"allocs_per_op\": %.3f, \"iterations\": %lu, \"cpu\": %d}\n",
+                   benchmark->name, result.ns_per_op, result.cycles_per_op,
+                   result.allocations_per_op, result.iterations, cpu);
+        } else {
+            printf("%-26s %12.1f %12.1f %12.3f %14lu\n", benchmark->name, result.ns_per_op,
+                   result.cycles_per_op, result.allocations_per_op, result.iterations);
+        }
+        fflush(stdout);
+    }
+    return 0;
+}
@@ -0,0 +1,133 @@
+# SPDX-License-Identifier: GPL-2.0-only
+# Copyright (C) 2024 Gary Sims
+#
+# Runs a script with keyva_lang and compares what it prints with the
+# expected output. ctest calls it for each test added in CMakeLists.txt:
+#   cmake -DKEYVA=keyva_lang -DSCRIPT=x.kv -DEXPECTED=x.out -DWORK_DIR=dir
+#         [-DOPTIONS="--a --b"] [-DMODE=run|cache|emit-c] -P check_script.cmake
+#
+# The script is copied to WORK_DIR first, so that script.kvc and script.c
+# are not written to the source tree. Each run must also exit with 0, which
+# a sanitizer that found something does not.
+#   cache    runs the script twice with --cache, writing and then reading
+#            script.kvc, and checks both runs
+#   emit-c   compiles the script with --emit-c, builds it with CC and CFLAGS
+#            against LIBKEYVA and checks what the program prints
+#   profile  runs the script with --profile, and checks the report without
+#            its times: the calls of each function and the count of each
+#            line, sorted by name and line
+#   sample-profile
+#            runs the script with --sample-profile=script.folded, checks
+#            what it prints without the number of samples, and that each
+#            line of script.folded is a stack of frames and a count, which
+#            add up to the number of samples
+
+if(NOT MODE)
+    set(MODE run)
+endif()
+separate_arguments(OPTIONS)
+separate_arguments(CFLAGS)
+
+get_filename_component(name ${SCRIPT} NAME_WE)
+file(REMOVE_RECURSE ${WORK_DIR})
+file(MAKE_DIRECTORY ${WORK_DIR})
+configure_file(${SCRIPT} ${WORK_DIR}/${name}.kv COPYONLY)
+file(READ ${EXPECTED} expected)
+
+function(check_output what output result)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "${what} exited with ${result}")
+    endif()
+    if(NOT output STREQUAL expected)
+        file(WRITE ${WORK_DIR}/${name}.actual "${output}")
+        message(FATAL_ERROR "${what} printed something else than ${EXPECTED}, "
+                            "see ${WORK_DIR}/${name}.actual:\n${output}")
+    endif()
+endfunction()
+
+if(MODE STREQUAL "emit-c")
+    execute_process(COMMAND ${KEYVA} --emit-c ${OPTIONS} ${name}.kv
+                    WORKING_DIRECTORY ${WORK_DIR} RESULT_VARIABLE result)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "keyva_lang --emit-c failed")
+    endif()
+    execute_process(COMMAND ${CC} -O1 ${CFLAGS} -I${INCLUDE_DIR} -o ${name} ${name}.c ${LIBKEYVA} -lm -lpthread
+                    WORKING_DIRECTORY ${WORK_DIR} RESULT_VARIABLE result)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "${name}.c does not compile")
+    endif()
+    execute_process(COMMAND ${WORK_DIR}/${name}
+                    WORKING_DIRECTORY ${WORK_DIR} OUTPUT_VARIABLE output RESULT_VARIABLE result)
+    check_output("The compiled ${name}" "${output}" "${result}")
+elseif(MODE STREQUAL "profile")
+    execute_process(COMMAND ${KEYVA} --profile ${OPTIONS} ${name}.kv
+                    WORKING_DIRECTORY ${WORK_DIR} OUTPUT_VARIABLE output RESULT_VARIABLE result)
+    # One line per element, for scripts without ';' or '[' which a list would split differently
+    string(REPLACE "\n" ";" lines "${output}")
+    set(report "")
+    set(functions "")
+    set(counts "")
+    set(in_report 0)
+    foreach(line IN LISTS lines)
+        if(line MATCHES "^Profile: ([0-9]+) statements in ")
+            set(in_report 1)
+            set(report "${report}Profile: ${CMAKE_MATCH_1} statements\n")
+        elseif(NOT in_report)
+            set(report "${report}${line}\n")
+        elseif(line MATCHES "^([A-Za-z_][A-Za-z0-9_]*) +([0-9]+) +[^ ]+ +[^ ]+% +[^ ]+ +[^ ]+%$")
+            list(APPEND functions "${CMAKE_MATCH_1} ${CMAKE_MATCH_2}")
+        elseif(line MATCHES "^( *[0-9]+) +([0-9]+) +[^ ]+ +[^ ]+%  (.*)$")
+            list(APPEND counts "${CMAKE_MATCH_1} ${CMAKE_MATCH_2}  ${CMAKE_MATCH_3}")
+        endif()
+    endforeach()
+    list(SORT functions)
+    list(SORT counts)
+    set(report "${report}\nfunction calls\n")
+    foreach(line IN LISTS functions)
+        set(report "${report}${line}\n")
+    endforeach()
+    set(report "${report}\n  line count  source\n")
+    foreach(line IN LISTS counts)
+        set(report "${report}${line}\n")
+    endforeach()
+    check_output("keyva_lang --profile ${OPTIONS}" "${report}" "${result}")
+elseif(MODE STREQUAL "sample-profile")
+    execute_process(COMMAND ${KEYVA} --sample-profile=${name}.folded ${OPTIONS} ${name}.kv
+                    WORKING_DIRECTORY ${WORK_DIR} OUTPUT_VARIABLE output RESULT_VARIABLE result)
+    if(NOT output MATCHES "Wrote ([0-9]+) samples to ${name}.folded\n$")
+        message(FATAL_ERROR "--sample-profile did not report the samples it wrote:\n${output}")
+    endif()
+    set(samples ${CMAKE_MATCH_1})
+    string(REGEX REPLACE "Wrote [0-9]+ samples to [^\n]*\n$" "" output "${output}")
+    check_output("keyva_lang --sample-profile" "${output}" "${result}")
+
+    file(STRINGS ${WORK_DIR}/${name}.folded stacks)
+    if(samples EQUAL 0 OR NOT stacks)
+        message(FATAL_ERROR "--sample-profile wrote no samples to ${name}.folded")
+    endif()
+    set(total 0)
+    set(frame "[A-Za-z_][A-Za-z0-9_]*(:[0-9]+)?")
+    foreach(stack IN LISTS stacks)
+        if(NOT stack MATCHES "^main(:[0-9]+)?(\\;${frame})* [0-9]+$")
+            message(FATAL_ERROR "${name}.folded has a malformed stack: ${stack}")
+        endif()
+        string(REGEX MATCH "[0-9]+$" count "${stack}")
+        math(EXPR total "${total} + ${count}")
+    endforeach()
+    if(NOT total EQUAL samples)
+        message(FATAL_ERROR "The stacks in ${name}.folded add up to ${total} samples, not ${samples}")
+    endif()
+elseif(MODE STREQUAL "cache")
+    foreach(run "The first run" "The run from the cache")
+        execute_process(COMMAND ${KEYVA} --cache ${OPTIONS} ${name}.kv
+                        WORKING_DIRECTORY ${WORK_DIR} OUTPUT_VARIABLE output RESULT_VARIABLE result)
+        check_output("${run}" "${output}" "${result}")
+    endforeach()
+    if(NOT EXISTS ${WORK_DIR}/${name}.kvc)
+        message(FATAL_ERROR "--cache did not write ${name}.kvc")
+    endif()
+else()
+    execute_process(COMMAND ${KEYVA} ${OPTIONS} ${name}.kv
+                    WORKING_DIRECTORY ${WORK_DIR} OUTPUT_VARIABLE output RESULT_VARIABLE result)
+    check_output("keyva_lang ${OPTIONS}" "${output}" "${result}")
+endif()
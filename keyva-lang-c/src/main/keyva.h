@@ -0,0 +1,101 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ *  Copyright (C) 2024 Gary Sims
+ *
+ */
+
+#ifndef KEYVA_H
+#define KEYVA_H
+
+/*
+ * Embedding API of the KeyVa interpreter (libkeyva)
+ *
+ * A host program compiles a script once with kv_compile() and runs it as
+ * often as it likes with kv_run(), without tokenizing or parsing it again.
+ * Between runs it reads and writes the top level variables of the scripts,
+ * and C functions it registers can be called by scripts like the built-in
+ * functions.
+ *
+ * Programs run in a context, an interpreter with its own variables and
+ * functions. A compiled program is not changed by running it, so any
+ * number of contexts can run it, each on its own thread at the same time.
+ * A context is used by one thread at a time. Passing NULL as the context
+ * uses the process's default context, which the command line interpreter
+ * runs in. The functions of a program are defined in a context when it
+ * first runs there, and the first definition of a name is kept.
+ *
+ * Host functions are shared by all contexts. They are registered before
+ * any context runs, and may be called by several threads at once.
+ *
+ * Functions returning int return 1 on success and 0 on failure. Errors are
+ * printed, as the command line interpreter prints them.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct KvProgram KvProgram;
+typedef struct KvContext KvContext;
+
+typedef enum {
+    KV_NUMBER,
+    KV_STRING,
+    KV_ARRAY
+} KvType;
+
+// An argument or result of a host function
+typedef struct {
+    KvType type;
+    double number;          // KV_NUMBER, or the number of elements of a KV_ARRAY
+    const char *string;     // KV_STRING
+} KvValue;
+
+/*
+ * A host function, called with its evaluated arguments. It sets *result,
+ * which is the number 0 when it is called. A string result is copied when
+ * the function returns. Returning 0 reports an error, and the call then
+ * evaluates to 0.
+ */
+typedef int (*kv_native_function)(int argc, const KvValue *argv, KvValue *result, void *user_data);
+
+// A new context, with no variables or functions, or NULL if out of memory
+KvContext *kv_create_context(void);
+void kv_free_context(KvContext *context);
+
+// Parses source, returns NULL if it does not parse
+KvProgram *kv_compile(const char *source);
+
+// Runs the statements of a compiled program
+int kv_run(KvContext *context, KvProgram *program);
+
+// Frees a compiled program, once no context is running it. Contexts
+// that ran it keep the functions it defined
+void kv_free_program(KvProgram *program);
+
+// Parses and runs source a statement at a time, as the REPL does
+int kv_eval(KvContext *context, const char *source);
+
+// Sets a top level variable, or one key of it
+int kv_set_number(KvContext *context, const char *name, double value);
+int kv_set_string(KvContext *context, const char *name, const char *value);
+int kv_set_element(KvContext *context, const char *name, const char *key, const char *value);
+
+// Reads a top level variable, or one key of it. Strings stay valid until
+// the variable is next written, or for a key of a shared array or a buffer
+// until the next read of one on the thread, and are NULL if it does not exist
+int kv_get_number(KvContext *context, const char *name, double *value);
+const char *kv_get_string(KvContext *context, const char *name);
+const char *kv_get_element(KvContext *context, const char *name, const char *key);
+
+// Makes function callable from scripts as name(...), with min_args to max_args
+// arguments. Calls are bound when they are parsed, so a function is registered
+// before the programs calling it are compiled
+int kv_register_function(const char *name, kv_native_function function,
+                         int min_args, int max_args, void *user_data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* KEYVA_H */
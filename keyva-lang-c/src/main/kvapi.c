@@ -0,0 +1,287 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ *  Copyright (C) 2024 Gary Sims
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NDEBUG 1
+#include "debug_print.h"
+
+#include "kvlang_internals.h"
+
+#include "kvstdlib.h"
+#include "kvopt.h"
+#include "kvbuffer.h"
+#include "keyva.h"
+
+/*
+ * The embedding API of keyva.h, on top of the interpreter in kvinterp.c
+ *
+ * A compiled program is the list of its parsed and optimized statements.
+ * It is parsed in a scratch context, so its functions can be inlined, and
+ * running it in a context defines them there and executes the statements
+ * as parse_and_execute() would. What the interpreter remembers between
+ * runs (hoisted values, machine code of hot loops) is kept by the context.
+ *
+ * Each call switches the thread to the context it is given and back, so
+ * a host function can use another context.
+ */
+
+struct KvProgram {
+    ASTNode **statements;
+    int count;
+};
+
+typedef struct {
+    char name[MAX_TOKEN_LENGTH];
+    kv_native_function function;
+    void *user_data;
+} HostFunction;
+
+// Tokens of a whole source. Every token takes at least one character
+static Token *tokenize_source(const char *source, int *token_count) {
+    Token *tokens = (Token *) malloc(sizeof(Token) * (strlen(source) + 1));
+    if (tokens == NULL) {
+        printf("Error: Out of memory\n");
+        return NULL;
+    }
+    tokenize_line(source, tokens, token_count);
+    return tokens;
+}
+
+// Makes context the current one, returns the one to restore
+static KvContext *enter_context(KvContext *context) {
+    KvContext *outer = kv_context;
+    if (context != NULL) {
+        kv_context = context;
+    }
+    return outer;
+}
+
+KvContext *kv_create_context(void) {
+    return create_context();
+}
+
+void kv_free_context(KvContext *context) {
+    free_context(context);
+}
+
+KvProgram *kv_compile(const char *source) {
+    int token_count = 0;
+    Token *tokens = tokenize_source(source, &token_count);
+    if (tokens == NULL) {
+        return NULL;
+    }
+    KvContext *scratch = create_context();
+    if (scratch == NULL) {
+        free(tokens);
+        return NULL;
+    }
+    KvContext *outer = enter_context(scratch);
+
+    KvProgram *program = (KvProgram *) malloc(sizeof(KvProgram));
+    int capacity = 16;
+    program->statements = (ASTNode **) malloc(sizeof(ASTNode *) * capacity);
+    program->count = 0;
+
+    int pos = 0;
+    declare_functions(tokens, token_count);
+    while (pos < token_count) {
+        ASTNode *node = parse_statement(tokens, &pos, token_count);
+        if (node == NULL) {
+            printf("Error: Failed to compile program\n");
+            kv_free_program(program);
+            program = NULL;
+            break;
+        }
+        if (program->count == capacity) {
+            capacity *= 2;
+            program->statements = (ASTNode **) realloc(program->statements, sizeof(ASTNode *) * capacity);
+        }
+        program->statements[program->count++] = node;
+    }
+    free(tokens);
+    if (program != NULL) {
+        for (int i = 0; i < program->count; i++) {
+            optimize_ast(program->statements[i]);
+        }
+    }
+    kv_context = outer;
+    free_context(scratch);
+    return program;
+}
+
+int kv_run(KvContext *context, KvProgram *program) {
+    if (program == NULL) {
+        return 0;
+    }
+    KvContext *outer = enter_context(context);
+    for (int i = 0; i < program->count; i++) {
+        register_functions(program->statements[i]);
+    }
+    for (int i = 0; i < program->count; i++) {
+        execute_ast(program->statements[i]);
+    }
+    kv_context = outer;
+    return 1;
+}
+
+void kv_free_program(KvProgram *program) {
+    if (program == NULL) {
+        return;
+    }
+    for (int i = 0; i < program->count; i++) {
+        free_ast(program->statements[i]);
+    }
+    free(program->statements);
+    free(program);
+}
+
+int kv_eval(KvContext *context, const char *source) {
+    int token_count = 0;
+    Token *tokens = tokenize_source(source, &token_count);
+    if (tokens == NULL) {
+        return 0;
+    }
+    KvContext *outer = enter_context(context);
+    int ok = parse_and_execute(tokens, token_count);
+    kv_context = outer;
+    free(tokens);
+    return ok;
+}
+
+int kv_set_number(KvContext *context, const char *name, double value) {
+    KvContext *outer = enter_context(context);
+    Variable *var = find_variable(name);
+    if (var == NULL) {
+        var = create_variable(name);
+    }
+    if (var != NULL) {
+        store_variable_number(var, value);
+    }
+    kv_context = outer;
+    return var != NULL;
+}
+
+int kv_set_string(KvContext *context, const char *name, const char *value) {
+    return kv_set_element(context, name, NULL, value);
+}
+
+int kv_set_element(KvContext *context, const char *name, const char *key, const char *value) {
+    if (strlen(name) >= MAX_TOKEN_LENGTH || strlen(value) >= MAX_TOKEN_LENGTH ||
+        (key != NULL && strlen(key) >= MAX_TOKEN_LENGTH)) {
+        printf("Error: Name, key or value of '%.32s' is too long\n", name);
+        return 0;
+    }
+    KvContext *outer = enter_context(context);
+    set_variable_value(name, key, value);
+    int ok = find_variable(name) != NULL;
+    kv_context = outer;
+    return ok;
+}
+
+int kv_get_number(KvContext *context, const char *name, double *value) {
+    KvContext *outer = enter_context(context);
+    Variable *var = find_variable(name);
+    kv_context = outer;
+    if (var == NULL) {
+        return 0;
+    }
+    if (var->is_number) {
+        *value = var->number_value;
+        return 1;
+    }
+    const char *string = get_assoc_array_value(&var->array, "");
+    if (string == NULL || string[0] == '\0') {
+        return 0;
+    }
+    char *end;
+    *value = strtod(string, &end);
+    return *end == '\0';
+}
+
+const char *kv_get_string(KvContext *context, const char *name) {
+    KvContext *outer = enter_context(context);
+    const char *value = get_variable_value(name);
+    kv_context = outer;
+    return value;
+}
+
+const char *kv_get_element(KvContext *context, const char *name, const char *key) {
+    KvContext *outer = enter_context(context);
+    Variable *var = get_variable(name);
+    kv_context = outer;
+    if (var == NULL) {
+        return NULL;
+    }
+    return get_assoc_array_value(&var->array, key);
+}
+
+// Converts between the interpreter's values and the KvValues of a host function
+static FunctionReturn call_host_function(void *data, int argc, const EvalResult *argv) {
+    HostFunction *host = (HostFunction *) data;
+    KvValue values[MAX_FUNC_PARAMS];
+    for (int i = 0; i < argc; i++) {
+        values[i].string = NULL;
+        values[i].number = 0;
+        if (argv[i].type == RESULT_NUMBER) {
+            values[i].type = KV_NUMBER;
+            values[i].number = argv[i].number_value;
+        } else if (argv[i].type == RESULT_STRING) {
+            values[i].type = KV_STRING;
+            values[i].string = argv[i].string_value;
+        } else {
+            values[i].type = KV_ARRAY;
+            values[i].number = argv[i].array_value->buffer != NULL ? argv[i].array_value->buffer->length
+                                                                   : argv[i].array_value->size;
+        }
+    }
+
+    KvValue value = { KV_NUMBER, 0, NULL };
+    FunctionReturn result = {0};
+    result.has_return = 1;
+    result.type = RESULT_NUMBER;
+    result.number_value = 0;
+    if (!host->function(argc, values, &value, host->user_data)) {
+        printf("Error: %s() failed\n", host->name);
+        return result;
+    }
+    if (value.type == KV_STRING && value.string != NULL) {
+        result.type = RESULT_STRING;
+        snprintf(result.string_value, MAX_TOKEN_LENGTH, "%s", value.string);
+    } else if (value.type == KV_NUMBER) {
+        result.number_value = value.number;
+    }
+    return result;
+}
+
+int kv_register_function(const char *name, kv_native_function function,
+                         int min_args, int max_args, void *user_data) {
+    if (name[0] == '\0' || strlen(name) >= MAX_TOKEN_LENGTH || function == NULL) {
+        printf("Error: Invalid host function\n");
+        return 0;
+    }
+    if (min_args < 0 || max_args < min_args || max_args > MAX_FUNC_PARAMS) {
+        printf("Error: %s() can take at most %d arguments\n", name, MAX_FUNC_PARAMS);
+        return 0;
+    }
+
+    HostFunction *host = (HostFunction *) malloc(sizeof(HostFunction));
+    if (host == NULL) {
+        printf("Error: Out of memory\n");
+        return 0;
+    }
+    strcpy(host->name, name);
+    host->function = function;
+    host->user_data = user_data;
+    if (kvstdlib_register(name, call_host_function, host, min_args, max_args) < 0) {
+        printf("Error: Cannot register function '%s'\n", name);
+        free(host);
+        return 0;
+    }
+    return 1;
+}
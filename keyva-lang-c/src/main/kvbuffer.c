@@ -0,0 +1,298 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ *  Copyright (C) 2024 Gary Sims
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+#define NDEBUG 1
+#include "debug_print.h"
+
+#include "kvlang_internals.h"
+
+#include "kvbuffer.h"
+
+/*
+ * Typed buffers: b = f64buf(n) and b = i64buf(n)
+ *
+ * An array holds its values as strings under string keys, 512 bytes a pair
+ * whatever they hold. A buffer holds n doubles or 64-bit integers in one
+ * block of 8 * n bytes, and b[i] finds number i without searching. The
+ * array of a variable refers to its buffer, and copying the array, to pass
+ * it to a function for instance, only adds a reference: the first write
+ * to a buffer that is shared copies it, so that it behaves as a value like
+ * any array does.
+ *
+ * fill() and dot() on doubles run kernels chosen once from what the CPU
+ * supports (AVX2, SSE2, or plain C). dot() adds the products in a
+ * different order than a for loop would, so its result may differ in the
+ * last bits.
+ */
+
+typedef struct {
+    void (*fill)(double *values, long n, double value);
+    double (*dot)(const double *a, const double *b, long n);
+} BufferKernels;
+
+static void fill_plain(double *values, long n, double value) {
+    for (long i = 0; i < n; i++) {
+        values[i] = value;
+    }
+}
+
+static double dot_plain(const double *a, const double *b, long n) {
+    double sum = 0;
+    for (long i = 0; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("sse2")))
+static void fill_sse2(double *values, long n, double value) {
+    __m128d v = _mm_set1_pd(value);
+    long i = 0;
+    for (; i + 2 <= n; i += 2) {
+        _mm_storeu_pd(values + i, v);
+    }
+    fill_plain(values + i, n - i, value);
+}
+
+__attribute__((target("sse2")))
+static double dot_sse2(const double *a, const double *b, long n) {
+    __m128d sum0 = _mm_setzero_pd();
+    __m128d sum1 = _mm_setzero_pd();
+    long i = 0;
+    for (; i + 4 <= n; i += 4) {
+        sum0 = _mm_add_pd(sum0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+        sum1 = _mm_add_pd(sum1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_add_pd(sum0, sum1));
+    return lanes[0] + lanes[1] + dot_plain(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void fill_avx2(double *values, long n, double value) {
+    __m256d v = _mm256_set1_pd(value);
+    long i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(values + i, v);
+    }
+    fill_plain(values + i, n - i, value);
+}
+
+__attribute__((target("avx2")))
+static double dot_avx2(const double *a, const double *b, long n) {
+    __m256d sum0 = _mm256_setzero_pd();
+    __m256d sum1 = _mm256_setzero_pd();
+    long i = 0;
+    for (; i + 8 <= n; i += 8) {
+        sum0 = _mm256_add_pd(sum0, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+        sum1 = _mm256_add_pd(sum1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4)));
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_add_pd(sum0, sum1));
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]) + dot_plain(a + i, b + i, n - i);
+}
+#endif
+
+static const BufferKernels plain_kernels = { fill_plain, dot_plain };
+#ifdef HAVE_X86_KERNELS
+static const BufferKernels sse2_kernels = { fill_sse2, dot_sse2 };
+static const BufferKernels avx2_kernels = { fill_avx2, dot_avx2 };
+#endif
+
+static const BufferKernels *buffer_kernels = NULL;
+
+// The widest kernels the CPU runs, looked up on first use
+static const BufferKernels *select_kernels(void) {
+    const BufferKernels *kernels = __atomic_load_n(&buffer_kernels, __ATOMIC_RELAXED);
+    if (kernels != NULL) {
+        return kernels;
+    }
+    kernels = &plain_kernels;
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        kernels = &avx2_kernels;
+    } else if (__builtin_cpu_supports("sse2")) {
+        kernels = &sse2_kernels;
+    }
+#endif
+    __atomic_store_n(&buffer_kernels, kernels, __ATOMIC_RELAXED);
+    return kernels;
+}
+
+TypedBuffer *buffer_create(BufferType type, long length) {
+    TypedBuffer *buffer = (TypedBuffer *) malloc(sizeof(TypedBuffer));
+    // Both types take 8 bytes a number
+    void *values = calloc(length > 0 ? length : 1, sizeof(double));
+    if (buffer == NULL || values == NULL) {
+        printf("Error: Memory allocation failed for a buffer of %ld numbers\n", length);
+        free(buffer);
+        free(values);
+        return NULL;
+    }
+    buffer->references = 1;
+    buffer->type = type;
+    buffer->length = length;
+    if (type == BUFFER_F64) {
+        buffer->f64 = (double *) values;
+    } else {
+        buffer->i64 = (long long *) values;
+    }
+    return buffer;
+}
+
+TypedBuffer *buffer_retain(TypedBuffer *buffer) {
+    if (buffer != NULL) {
+        __atomic_add_fetch(&buffer->references, 1, __ATOMIC_RELAXED);
+    }
+    return buffer;
+}
+
+void buffer_release(TypedBuffer *buffer) {
+    if (buffer != NULL && __atomic_sub_fetch(&buffer->references, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (buffer->type == BUFFER_F64) {
+            free(buffer->f64);
+        } else {
+            free(buffer->i64);
+        }
+        free(buffer);
+    }
+}
+
+TypedBuffer *buffer_writable(TypedBuffer **buffer) {
+    if (__atomic_load_n(&(*buffer)->references, __ATOMIC_ACQUIRE) == 1) {
+        return *buffer;
+    }
+    TypedBuffer *copy = buffer_slice(*buffer, 0, (*buffer)->length);
+    if (copy == NULL) {
+        return NULL;
+    }
+    buffer_release(*buffer);
+    *buffer = copy;
+    return copy;
+}
+
+int buffer_index(const TypedBuffer *buffer, double number, long *index) {
+    if (!(number >= 0 && number < buffer->length) || number != (long) number) {
+        return 0;
+    }
+    *index = (long) number;
+    return 1;
+}
+
+int buffer_key_index(const TypedBuffer *buffer, const char *key, long *index) {
+    char *end;
+    double number = strtod(key, &end);
+    return end != key && *end == '\0' && buffer_index(buffer, number, index);
+}
+
+double buffer_get(const TypedBuffer *buffer, long index) {
+    return buffer->type == BUFFER_F64 ? buffer->f64[index] : (double) buffer->i64[index];
+}
+
+const double *buffer_doubles(const TypedBuffer *buffer, long first, int n, double *scratch) {
+    if (buffer->type == BUFFER_F64) {
+        return buffer->f64 + first;
+    }
+    for (int i = 0; i < n; i++) {
+        scratch[i] = (double) buffer->i64[first + i];
+    }
+    return scratch;
+}
+
+// The whole part of value, limited to the range of the type
+static long long to_integer(double value) {
+    if (value != value) {
+        return 0;
+    }
+    if (value >= 9.2233720368547758e18) {
+        return LLONG_MAX;
+    }
+    if (value <= -9.2233720368547758e18) {
+        return LLONG_MIN;
+    }
+    return (long long) value;
+}
+
+void buffer_set(TypedBuffer *buffer, long index, double value) {
+    if (buffer->type == BUFFER_F64) {
+        buffer->f64[index] = value;
+    } else {
+        buffer->i64[index] = to_integer(value);
+    }
+}
+
+void buffer_format(const TypedBuffer *buffer, long index, char *text) {
+    if (buffer->type == BUFFER_F64) {
+        format_number(buffer->f64[index], text);
+    } else {
+        snprintf(text, MAX_TOKEN_LENGTH, "%lld", buffer->i64[index]);
+    }
+}
+
+void buffer_fill(TypedBuffer *buffer, double value) {
+    if (buffer->type == BUFFER_F64) {
+        select_kernels()->fill(buffer->f64, buffer->length, value);
+        return;
+    }
+    long long integer = to_integer(value);
+    for (long i = 0; i < buffer->length; i++) {
+        buffer->i64[i] = integer;
+    }
+}
+
+double buffer_dot(const TypedBuffer *a, const TypedBuffer *b) {
+    if (a->type == BUFFER_F64 && b->type == BUFFER_F64) {
+        return select_kernels()->dot(a->f64, b->f64, a->length);
+    }
+    if (a->type == BUFFER_I64 && b->type == BUFFER_I64) {
+        // Exact while the sum fits in 64 bits, wrapping around past that
+        unsigned long long sum = 0;
+        for (long i = 0; i < a->length; i++) {
+            sum += (unsigned long long) a->i64[i] * (unsigned long long) b->i64[i];
+        }
+        return (double) (long long) sum;
+    }
+    double sum = 0;
+    for (long i = 0; i < a->length; i++) {
+        sum += buffer_get(a, i) * buffer_get(b, i);
+    }
+    return sum;
+}
+
+TypedBuffer *buffer_slice(const TypedBuffer *buffer, long start, long stop) {
+    long length = stop > start ? stop - start : 0;
+    TypedBuffer *slice = buffer_create(buffer->type, length);
+    if (slice != NULL && length > 0) {
+        if (buffer->type == BUFFER_F64) {
+            memcpy(slice->f64, buffer->f64 + start, sizeof(double) * length);
+        } else {
+            memcpy(slice->i64, buffer->i64 + start, sizeof(long long) * length);
+        }
+    }
+    return slice;
+}
+
+void buffer_merge(TypedBuffer *into, const TypedBuffer *after, const unsigned char *written) {
+    const char *a = after->type == BUFFER_F64 ? (const char *) after->f64 : (const char *) after->i64;
+    char *to = into->type == BUFFER_F64 ? (char *) into->f64 : (char *) into->i64;
+    for (long i = 0; i < after->length; i++) {
+        if (written[i]) {
+            memcpy(to + i * 8, a + i * 8, 8);
+        }
+    }
+}
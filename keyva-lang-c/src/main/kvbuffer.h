@@ -0,0 +1,75 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ *  Copyright (C) 2024 Gary Sims
+ *
+ */
+
+#ifndef KVBUFFER_H
+#define KVBUFFER_H
+
+#include "kvlang_internals.h"
+
+typedef enum {
+    BUFFER_F64,                 // f64buf(n): doubles
+    BUFFER_I64                  // i64buf(n): 64-bit integers
+} BufferType;
+
+/*
+ * A typed buffer: length numbers of one type, stored one after the other
+ * and indexed from 0. It is the value of an array whose buffer is set, and
+ * copies of that array share it until one of them writes to it, see
+ * buffer_writable().
+ */
+typedef struct TypedBuffer {
+    int references;             // Arrays sharing the buffer
+    BufferType type;
+    long length;
+    union {
+        double *f64;
+        long long *i64;
+    };
+} TypedBuffer;
+
+// A buffer of length zeros, or NULL after printing an error
+TypedBuffer *buffer_create(BufferType type, long length);
+
+// Another reference to buffer, which may be NULL
+TypedBuffer *buffer_retain(TypedBuffer *buffer);
+
+// Drops a reference, freeing the buffer with the last one
+void buffer_release(TypedBuffer *buffer);
+
+// The buffer an array refers to, copied first if another array shares it.
+// NULL after printing an error if the copy cannot be allocated
+TypedBuffer *buffer_writable(TypedBuffer **buffer);
+
+// The index number or key names: 0 unless it is a whole number from 0 to
+// the length of buffer
+int buffer_index(const TypedBuffer *buffer, double number, long *index);
+int buffer_key_index(const TypedBuffer *buffer, const char *key, long *index);
+
+double buffer_get(const TypedBuffer *buffer, long index);
+
+// Numbers first to first + n of buffer as doubles: the buffer's own, or
+// its integers converted into scratch
+const double *buffer_doubles(const TypedBuffer *buffer, long first, int n, double *scratch);
+
+// Integer buffers keep the whole part of value
+void buffer_set(TypedBuffer *buffer, long index, double value);
+
+// The number at index as a string: a double as format_number() stores it, an integer in full
+void buffer_format(const TypedBuffer *buffer, long index, char *text);
+
+void buffer_fill(TypedBuffer *buffer, double value);
+
+// Sum of the products of the numbers of a and b, which have the same length
+double buffer_dot(const TypedBuffer *a, const TypedBuffer *b);
+
+// A new buffer of the numbers from start up to, not including, stop
+TypedBuffer *buffer_slice(const TypedBuffer *buffer, long start, long stop);
+
+// Writes to into the numbers of after that written marks, after being of
+// the same length
+void buffer_merge(TypedBuffer *into, const TypedBuffer *after, const unsigned char *written);
+
+#endif /* KVBUFFER_H */
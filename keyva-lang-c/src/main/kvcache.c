@@ -0,0 +1,515 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ *  Copyright (C) 2024 Gary Sims
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define NDEBUG 1
+#include "debug_print.h"
+
+#include "kvlang_internals.h"
+#include "kvstdlib.h"
+#include "kvopt.h"
+
+#include "kvcache.h"
+
+/*
+ * On-disk cache of parsed programs
+ *
+ * The cache holds the statements exactly as parse_statement() returned
+ * them, before optimize_ast(), so a run from the cache optimizes and
+ * executes the same trees as a run from source. Nodes are flattened into
+ * fixed size records which refer to each other by index, followed by a
+ * pool of their NUL terminated names and literals:
+ *
+ *   CacheHeader
+ *   int32_t    statements[statement_count]     Index of each top-level statement
+ *   CachedNode nodes[node_count]
+ *   char       text[text_size]
+ *
+ * Nodes are written in preorder, so every child has a larger index than
+ * its parent. The loader relies on that, and on every node having at most
+ * one parent, to reject a damaged file instead of building a cyclic tree.
+ * A damaged name or literal still makes a valid tree, so the header also
+ * holds a hash of everything after it, and a file whose hash differs is
+ * ignored like a stale one.
+ *
+ * The file is mapped read only and never modified, a new cache is written
+ * to a temporary file and renamed over the old one.
+ */
+
+// Bump when the parser or the meaning of the records changes
+#define KVCACHE_FORMAT 6
+
+typedef struct {
+    char magic[4];              // "KVC\n"
+    uint32_t interpreter;       // cache_interpreter_key() of the writer
+    uint64_t source_hash;
+    uint64_t source_length;
+    uint32_t statement_count;
+    uint32_t node_count;
+    uint32_t text_size;
+    uint32_t reserved;
+    uint64_t payload_hash;      // Of the statements, nodes and text
+} CacheHeader;
+
+typedef struct {
+    int32_t type;
+    int32_t value;              // Binary operators: operator, definitions: memoize, for: parallel,
+                                // calls: 1 if bound to a built-in or host function
+    int32_t left;
+    int32_t right;
+    int32_t nextblock;
+    int32_t child[3];           // Child nodes in the data union, see node_fields()
+    int32_t text;               // Offset of the name or literal in the text pool, or -1
+    int32_t line;
+    int32_t column;
+} CachedNode;
+
+typedef struct {
+    CachedNode *nodes;
+    int node_count;
+    int node_capacity;
+    int32_t *statements;
+    int statement_count;
+    int statement_capacity;
+    char *text;
+    size_t text_size;
+    size_t text_capacity;
+    int failed;
+} CacheWriter;
+
+#define CACHE_HASH_START 14695981039346656037ULL
+
+// FNV-1a of data, continuing from hash
+static uint64_t cache_hash_more(uint64_t hash, const void *data, size_t length) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static uint64_t cache_hash(const char *data, size_t length) {
+    return cache_hash_more(CACHE_HASH_START, data, length);
+}
+
+// Identifies interpreters which read and write the same caches
+static uint32_t cache_interpreter_key() {
+    char key[64];
+    int length = snprintf(key, sizeof(key), "%d %zu %d %d", KVCACHE_FORMAT,
+                          sizeof(ASTNode), MAX_TOKEN_LENGTH, AST_SPAWN);
+    return (uint32_t) cache_hash(key, (size_t) length);
+}
+
+// script.kv is cached in script.kvc, anything else in <name>.kvc
+static char *cache_path(const char *script_path) {
+    size_t length = strlen(script_path);
+    char *path = malloc(length + 5);
+    if (path == NULL) {
+        return NULL;
+    }
+    strcpy(path, script_path);
+    if (length >= 3 && strcmp(script_path + length - 3, ".kv") == 0) {
+        strcat(path, "c");
+    } else {
+        strcat(path, ".kvc");
+    }
+    return path;
+}
+
+// The child nodes held in the data union of node and its name or literal.
+// Returns the number of children, pointers to them are stored in children
+static int node_fields(ASTNode *node, ASTNode **children[3], char **text) {
+    *text = NULL;
+    switch (node->type) {
+        case AST_LITERAL:
+            *text = node->data.string_value;
+            return 0;
+        case AST_IDENTIFIER:
+        case AST_ARRAY_ACCESS:
+            *text = node->data.identifier;
+            return 0;
+        case AST_FUNCTION_CALL:
+            *text = node->data.func_call.name;
+            children[0] = &node->data.func_call.arguments;
+            return 1;
+        case AST_FUNCTION_DEFINITION:
+            *text = node->data.func_def.name;
+            children[0] = &node->data.func_def.parameters;
+            children[1] = &node->data.func_def.body;
+            return 2;
+        case AST_RETURN_STATEMENT:
+            children[0] = &node->data.ret_stmt.expression;
+            return 1;
+        case AST_IF_STATEMENT:
+            children[0] = &node->data.if_stmt.condition;
+            children[1] = &node->data.if_stmt.then_branch;
+            children[2] = &node->data.if_stmt.else_branch;
+            return 3;
+        case AST_FOR_STATEMENT:
+            *text = node->data.for_stmt.loop_var;
+            children[0] = &node->data.for_stmt.expression;
+            children[1] = &node->data.for_stmt.body;
+            return 2;
+        case AST_WHILE_STATEMENT:
+            children[0] = &node->data.while_stmt.condition;
+            children[1] = &node->data.while_stmt.body;
+            return 2;
+        default:
+            return 0;
+    }
+}
+
+static void *grow(void *array, int *capacity, size_t element_size) {
+    int new_capacity = *capacity > 0 ? *capacity * 2 : 256;
+    void *new_array = realloc(array, (size_t) new_capacity * element_size);
+    if (new_array != NULL) {
+        *capacity = new_capacity;
+    }
+    return new_array;
+}
+
+static int32_t save_text(CacheWriter *w, const char *text) {
+    size_t length = strlen(text) + 1;
+    if (w->text_size + length > w->text_capacity) {
+        size_t new_capacity = w->text_capacity > 0 ? w->text_capacity * 2 : 4096;
+        while (new_capacity < w->text_size + length) {
+            new_capacity *= 2;
+        }
+        char *new_text = realloc(w->text, new_capacity);
+        if (new_text == NULL) {
+            w->failed = 1;
+            return -1;
+        }
+        w->text = new_text;
+        w->text_capacity = new_capacity;
+    }
+    memcpy(w->text + w->text_size, text, length);
+    w->text_size += length;
+    return (int32_t) (w->text_size - length);
+}
+
+static int32_t save_node(CacheWriter *w, ASTNode *node) {
+    if (node == NULL || w->failed) {
+        return -1;
+    }
+    if (w->node_count == w->node_capacity) {
+        CachedNode *nodes = grow(w->nodes, &w->node_capacity, sizeof(CachedNode));
+        if (nodes == NULL) {
+            w->failed = 1;
+            return -1;
+        }
+        w->nodes = nodes;
+    }
+    int32_t index = w->node_count++;
+
+    // Children are saved first, they may move w->nodes
+    CachedNode record = { .type = node->type, .text = -1,
+                          .child = { -1, -1, -1 },
+                          .line = node->line, .column = node->column };
+    ASTNode **children[3];
+    char *text;
+    int child_count = node_fields(node, children, &text);
+    if (text != NULL) {
+        record.text = save_text(w, text);
+    }
+    if (node->type == AST_BINARY_OP) {
+        record.value = node->data.operator;
+    } else if (node->type == AST_FUNCTION_DEFINITION) {
+        record.value = node->data.func_def.memoize;
+    } else if (node->type == AST_FOR_STATEMENT) {
+        record.value = node->data.for_stmt.parallel;
+    } else if (node->type == AST_FUNCTION_CALL) {
+        record.value = node->data.func_call.builtin >= 0;
+    }
+    record.left = save_node(w, node->left);
+    record.right = save_node(w, node->right);
+    for (int i = 0; i < child_count; i++) {
+        record.child[i] = save_node(w, *children[i]);
+    }
+    record.nextblock = save_node(w, node->nextblock);
+
+    w->nodes[index] = record;
+    return index;
+}
+
+static void save_statement(CacheWriter *w, ASTNode *node) {
+    if (w->failed) {
+        return;
+    }
+    if (w->statement_count == w->statement_capacity) {
+        int32_t *statements = grow(w->statements, &w->statement_capacity, sizeof(int32_t));
+        if (statements == NULL) {
+            w->failed = 1;
+            return;
+        }
+        w->statements = statements;
+    }
+    w->statements[w->statement_count++] = save_node(w, node);
+}
+
+static void write_cache(const char *script_path, const char *source, size_t length, CacheWriter *w) {
+    char *path = cache_path(script_path);
+    if (path == NULL) {
+        return;
+    }
+    char *temp_path = malloc(strlen(path) + 32);
+    if (temp_path == NULL) {
+        free(path);
+        return;
+    }
+    sprintf(temp_path, "%s.%ld.tmp", path, (long) getpid());
+
+    CacheHeader header = {0};
+    memcpy(header.magic, "KVC\n", 4);
+    header.interpreter = cache_interpreter_key();
+    header.source_hash = cache_hash(source, length);
+    header.source_length = length;
+    header.statement_count = (uint32_t) w->statement_count;
+    header.node_count = (uint32_t) w->node_count;
+    header.text_size = (uint32_t) w->text_size;
+    uint64_t hash = cache_hash_more(CACHE_HASH_START, w->statements, sizeof(int32_t) * w->statement_count);
+    hash = cache_hash_more(hash, w->nodes, sizeof(CachedNode) * w->node_count);
+    header.payload_hash = cache_hash_more(hash, w->text, w->text_size);
+
+    // A cache that cannot be written is not an error, the next run parses again
+    FILE *out = fopen(temp_path, "wb");
+    if (out != NULL) {
+        int ok = fwrite(&header, sizeof(header), 1, out) == 1 &&
+                 fwrite(w->statements, sizeof(int32_t), w->statement_count, out) == (size_t) w->statement_count &&
+                 fwrite(w->nodes, sizeof(CachedNode), w->node_count, out) == (size_t) w->node_count &&
+                 fwrite(w->text, 1, w->text_size, out) == w->text_size;
+        if (fclose(out) != 0 || !ok || rename(temp_path, path) != 0) {
+            remove(temp_path);
+        }
+    }
+    free(temp_path);
+    free(path);
+}
+
+void cache_parse_and_execute(const char *script_path, const char *source, size_t length,
+                             Token tokens[], int token_count) {
+    CacheWriter w = {0};
+    int pos = 0;
+    int complete = 1;
+
+    declare_functions(tokens, token_count);
+    while (pos < token_count) {
+        ASTNode *node = parse_statement(tokens, &pos, token_count);
+        if (node != NULL) {
+            save_statement(&w, node);
+            optimize_ast(node);
+            execute_ast(node);
+            free_ast(node);
+        } else {
+            // Skip the rest of the line on error, and keep the error for the next run
+            complete = 0;
+            break;
+        }
+    }
+
+    if (complete && !w.failed) {
+        write_cache(script_path, source, length, &w);
+    }
+    free(w.nodes);
+    free(w.statements);
+    free(w.text);
+}
+
+// Checks the references of a record, marking its children as used
+static int check_record(const CachedNode *record, int32_t index, int32_t node_count,
+                        const char *text, uint32_t text_size, unsigned char *used) {
+    if (record->type < AST_PRINT || record->type > AST_SPAWN) {
+        return 0;
+    }
+    if (record->type == AST_BINARY_OP &&
+        (record->value < OP_ADD || record->value > OP_GREATER_EQUAL)) {
+        return 0;
+    }
+    if (record->line < 0 || record->column < 0) {
+        return 0;
+    }
+    if (record->text >= 0) {
+        if ((uint32_t) record->text >= text_size) {
+            return 0;
+        }
+        size_t room = text_size - (uint32_t) record->text;
+        if (memchr(text + record->text, '\0', room < MAX_TOKEN_LENGTH ? room : MAX_TOKEN_LENGTH) == NULL) {
+            return 0;
+        }
+    }
+
+    int32_t links[6] = { record->left, record->right, record->nextblock,
+                         record->child[0], record->child[1], record->child[2] };
+    for (int i = 0; i < 6; i++) {
+        if (links[i] == -1) {
+            continue;
+        }
+        if (links[i] <= index || links[i] >= node_count || used[links[i]]) {
+            return 0;
+        }
+        used[links[i]] = 1;
+    }
+    return 1;
+}
+
+// Builds the trees of a validated cache, returns NULL if out of memory
+static ASTNode **load_nodes(const CachedNode *records, int32_t node_count, const char *text) {
+    ASTNode **nodes = calloc(node_count > 0 ? node_count : 1, sizeof(ASTNode *));
+    if (nodes == NULL) {
+        return NULL;
+    }
+    // Nodes are allocated one by one, free_ast() frees them as usual
+    for (int32_t i = 0; i < node_count; i++) {
+        nodes[i] = calloc(1, sizeof(ASTNode));
+        if (nodes[i] == NULL) {
+            for (int32_t j = 0; j < i; j++) {
+                free(nodes[j]);
+            }
+            free(nodes);
+            return NULL;
+        }
+    }
+
+    for (int32_t i = 0; i < node_count; i++) {
+        const CachedNode *record = &records[i];
+        ASTNode *node = nodes[i];
+        node->type = (ASTNodeType) record->type;
+        node->line = record->line;
+        node->column = record->column;
+        node->left = record->left >= 0 ? nodes[record->left] : NULL;
+        node->right = record->right >= 0 ? nodes[record->right] : NULL;
+        node->nextblock = record->nextblock >= 0 ? nodes[record->nextblock] : NULL;
+
+        ASTNode **children[3];
+        char *node_text;
+        int child_count = node_fields(node, children, &node_text);
+        for (int c = 0; c < child_count; c++) {
+            *children[c] = record->child[c] >= 0 ? nodes[record->child[c]] : NULL;
+        }
+        if (node_text != NULL && record->text >= 0) {
+            strcpy(node_text, text + record->text);
+        }
+        if (node->type == AST_BINARY_OP) {
+            node->data.operator = (OperatorType) record->value;
+        } else if (node->type == AST_FUNCTION_DEFINITION) {
+            node->data.func_def.memoize = record->value;
+        } else if (node->type == AST_FOR_STATEMENT) {
+            node->data.for_stmt.parallel = record->value;
+        } else if (node->type == AST_FUNCTION_CALL) {
+            // Built-in and host functions are found by name again, their
+            // index may differ between runs
+            node->data.func_call.builtin = record->value ? kvstdlib_find(node->data.func_call.name) : -1;
+        }
+    }
+
+    // Calls were bound by the parser, their arity was checked when the cache was written
+    for (int32_t i = 0; i < node_count; i++) {
+        ASTNode *node = nodes[i];
+        if (node->type == AST_FUNCTION_CALL) {
+            int argc = 0;
+            for (ASTNode *arg = node->data.func_call.arguments; arg != NULL; arg = arg->nextblock) {
+                argc++;
+            }
+            node->data.func_call.arg_count = argc;
+        }
+    }
+    return nodes;
+}
+
+int cache_run_program(const char *script_path, const char *source, size_t length) {
+    char *path = cache_path(script_path);
+    if (path == NULL) {
+        return 0;
+    }
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if (fd < 0) {
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(CacheHeader)) {
+        close(fd);
+        return 0;
+    }
+    size_t size = (size_t) st.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return 0;
+    }
+
+    // Stale or damaged caches are ignored, the program is parsed from source
+    const CacheHeader *header = map;
+    int valid = memcmp(header->magic, "KVC\n", 4) == 0 &&
+                header->interpreter == cache_interpreter_key() &&
+                header->source_length == length &&
+                header->node_count < INT32_MAX / sizeof(CachedNode) &&
+                header->statement_count < INT32_MAX / sizeof(int32_t) &&
+                size == sizeof(CacheHeader) +
+                        (size_t) header->statement_count * sizeof(int32_t) +
+                        (size_t) header->node_count * sizeof(CachedNode) +
+                        header->text_size &&
+                header->source_hash == cache_hash(source, length) &&
+                header->payload_hash == cache_hash_more(CACHE_HASH_START, header + 1, size - sizeof(CacheHeader));
+    if (!valid) {
+        munmap(map, size);
+        return 0;
+    }
+
+    int32_t statement_count = (int32_t) header->statement_count;
+    int32_t node_count = (int32_t) header->node_count;
+    const int32_t *statements = (const int32_t *) (header + 1);
+    const CachedNode *records = (const CachedNode *) (statements + statement_count);
+    const char *text = (const char *) (records + node_count);
+
+    unsigned char *used = calloc(node_count > 0 ? node_count : 1, 1);
+    if (used == NULL) {
+        munmap(map, size);
+        return 0;
+    }
+    for (int32_t i = 0; i < statement_count && valid; i++) {
+        int32_t root = statements[i];
+        valid = root >= 0 && root < node_count && !used[root];
+        if (valid) {
+            used[root] = 1;
+        }
+    }
+    for (int32_t i = 0; i < node_count && valid; i++) {
+        valid = check_record(&records[i], i, node_count, text, header->text_size, used);
+    }
+    // Every node belongs to a statement, so none is leaked
+    for (int32_t i = 0; i < node_count && valid; i++) {
+        valid = used[i];
+    }
+    free(used);
+
+    ASTNode **nodes = valid ? load_nodes(records, node_count, text) : NULL;
+    if (nodes == NULL) {
+        munmap(map, size);
+        return 0;
+    }
+
+    // Statements run one by one, as parse_and_execute() runs them
+    for (int32_t i = 0; i < statement_count; i++) {
+        ASTNode *node = nodes[statements[i]];
+        register_functions(node);
+        optimize_ast(node);
+        execute_ast(node);
+        free_ast(node);
+    }
+    free(nodes);
+    munmap(map, size);
+    return 1;
+}
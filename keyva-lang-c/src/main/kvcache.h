@@ -0,0 +1,28 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ *  Copyright (C) 2024 Gary Sims
+ *
+ */
+
+#ifndef KVCACHE_H
+#define KVCACHE_H
+
+#include "kvlang_internals.h"
+
+/*
+ * On-disk cache of parsed programs (--cache)
+ *
+ * script.kv is cached in script.kvc, next to it. The cache is only used if
+ * it was written by an interpreter with the same AST layout and standard
+ * lib, for exactly the same source, and is not damaged.
+ */
+
+// Runs the program from its cache, returns 0 without running anything if
+// there is no usable cache for source
+int cache_run_program(const char *script_path, const char *source, size_t length);
+
+// parse_and_execute(), which also writes the cache if the whole program parsed
+void cache_parse_and_execute(const char *script_path, const char *source, size_t length,
+                             Token tokens[], int token_count);
+
+#endif /* KVCACHE_H */
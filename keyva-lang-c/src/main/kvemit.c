@@ -0,0 +1,529 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ *  Copyright (C) 2024 Gary Sims
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NDEBUG 1
+#include "debug_print.h"
+
+#include "kvlang_internals.h"
+
+#include "kvemit.h"
+
+/*
+ * Ahead-of-time compiler from KeyVa to C (--emit-c)
+ *
+ * The parsed program is written out as a static array of ASTNodes, and
+ * its statements as C code. Control flow (statement sequences, if, while
+ * and return) becomes C control flow. Everything else calls the same
+ * runtime functions the interpreter uses, from libkeyva, so the
+ * compiled program behaves exactly like the interpreted one: expressions
+ * are evaluated by evaluate_expression() with its numeric fast paths, and
+ * for loops and function calls keep their frame handling. Function bodies
+ * and for loop bodies are compiled to C functions which the runtime calls
+ * through ASTNode.compiled.
+ *
+ * No tokenizing or parsing happens at run time. The program still runs
+ * optimize_ast() on each top-level statement before executing it, like
+ * the interpreter does.
+ */
+
+typedef struct {
+    ASTNode **nodes;            // Index in the emitted array -> node
+    int count;
+    int capacity;
+    ASTNode **table;            // Open addressing, node -> index in index_table
+    int *index_table;
+    int table_size;
+    char *compiled;             // By index: a block the runtime calls through ASTNode.compiled
+} NodeIndex;
+
+static unsigned long hash_pointer(const void *p) {
+    unsigned long h = (unsigned long) p;
+    h ^= h >> 17;
+    h *= 0x9E3779B97F4A7C15UL;
+    return h ^ (h >> 29);
+}
+
+static void index_grow(NodeIndex *index);
+
+static int index_find(NodeIndex *index, ASTNode *node) {
+    if (index->table_size == 0) {
+        return -1;
+    }
+    unsigned long i = hash_pointer(node) % index->table_size;
+    while (index->table[i] != NULL) {
+        if (index->table[i] == node) {
+            return index->index_table[i];
+        }
+        i = (i + 1) % index->table_size;
+    }
+    return -1;
+}
+
+static void index_insert(NodeIndex *index, ASTNode *node, int value) {
+    unsigned long i = hash_pointer(node) % index->table_size;
+    while (index->table[i] != NULL) {
+        i = (i + 1) % index->table_size;
+    }
+    index->table[i] = node;
+    index->index_table[i] = value;
+}
+
+static void index_grow(NodeIndex *index) {
+    ASTNode **old_table = index->table;
+    int *old_index = index->index_table;
+    int old_size = index->table_size;
+
+    index->table_size = old_size > 0 ? old_size * 2 : 256;
+    index->table = (ASTNode **) calloc(index->table_size, sizeof(ASTNode *));
+    index->index_table = (int *) calloc(index->table_size, sizeof(int));
+    for (int i = 0; i < old_size; i++) {
+        if (old_table[i] != NULL) {
+            index_insert(index, old_table[i], old_index[i]);
+        }
+    }
+    free(old_table);
+    free(old_index);
+}
+
+// Numbers every node reachable from node, children before their siblings
+static void number_nodes(NodeIndex *index, ASTNode *node) {
+    if (node == NULL || index_find(index, node) >= 0) {
+        return;
+    }
+    if (index->count == index->capacity) {
+        index->capacity = index->capacity > 0 ? index->capacity * 2 : 256;
+        index->nodes = (ASTNode **) realloc(index->nodes, sizeof(ASTNode *) * index->capacity);
+    }
+    if ((index->count + 1) * 2 > index->table_size) {
+        index_grow(index);
+    }
+    index->nodes[index->count] = node;
+    index_insert(index, node, index->count);
+    index->count++;
+
+    number_nodes(index, node->left);
+    number_nodes(index, node->right);
+    switch (node->type) {
+        case AST_FUNCTION_CALL:
+            number_nodes(index, node->data.func_call.arguments);
+            break;
+        case AST_FUNCTION_DEFINITION:
+            number_nodes(index, node->data.func_def.parameters);
+            number_nodes(index, node->data.func_def.body);
+            break;
+        case AST_RETURN_STATEMENT:
+            number_nodes(index, node->data.ret_stmt.expression);
+            break;
+        case AST_IF_STATEMENT:
+            number_nodes(index, node->data.if_stmt.condition);
+            number_nodes(index, node->data.if_stmt.then_branch);
+            number_nodes(index, node->data.if_stmt.else_branch);
+            break;
+        case AST_FOR_STATEMENT:
+            number_nodes(index, node->data.for_stmt.expression);
+            number_nodes(index, node->data.for_stmt.body);
+            break;
+        case AST_WHILE_STATEMENT:
+            number_nodes(index, node->data.while_stmt.condition);
+            number_nodes(index, node->data.while_stmt.body);
+            break;
+        default:
+            break;
+    }
+    number_nodes(index, node->nextblock);
+}
+
+static void emit_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char) *s;
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c < 32 || c >= 127) {
+            fprintf(out, "\\%03o", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static void emit_ref(FILE *out, NodeIndex *index, ASTNode *node) {
+    if (node == NULL) {
+        fprintf(out, "NULL");
+    } else {
+        fprintf(out, "&n[%d]", index_find(index, node));
+    }
+}
+
+static const char *node_type_name(ASTNodeType type) {
+    static const char *names[] = {
+        "AST_PRINT", "AST_LITERAL", "AST_IDENTIFIER", "AST_ASSIGNMENT", "AST_ARRAY_ACCESS",
+        "AST_BINARY_OP", "AST_IF_STATEMENT", "AST_BLOCK", "AST_FOR_STATEMENT",
+        "AST_WHILE_STATEMENT", "AST_FUNCTION_DEFINITION", "AST_FUNCTION_CALL",
+        "AST_RETURN_STATEMENT", "AST_SPAWN",
+    };
+    return names[type];
+}
+
+static const char *operator_name(OperatorType op) {
+    static const char *names[] = {
+        "OP_ADD", "OP_SUBTRACT", "OP_MULTIPLY", "OP_DIVIDE", "OP_LESS_THAN", "OP_GREATER_THAN",
+        "OP_EQUAL", "OP_NOT_EQUAL", "OP_LESS_EQUAL", "OP_GREATER_EQUAL",
+    };
+    return names[op];
+}
+
+// Blocks the runtime calls through ASTNode.compiled: function and for loop bodies
+static void find_compiled_blocks(NodeIndex *index) {
+    index->compiled = (char *) calloc(index->count > 0 ? index->count : 1, 1);
+    for (int i = 0; i < index->count; i++) {
+        ASTNode *owner = index->nodes[i];
+        ASTNode *body = NULL;
+        if (owner->type == AST_FUNCTION_DEFINITION) {
+            body = owner->data.func_def.body;
+        } else if (owner->type == AST_FOR_STATEMENT) {
+            body = owner->data.for_stmt.body;
+        }
+        if (body != NULL) {
+            index->compiled[index_find(index, body)] = 1;
+        }
+    }
+}
+
+static void emit_node(FILE *out, NodeIndex *index, int i, const char *compiled) {
+    ASTNode *node = index->nodes[i];
+
+    fprintf(out, "    [%d] = { .type = %s", i, node_type_name(node->type));
+    if (node->left != NULL) {
+        fprintf(out, ", .left = ");
+        emit_ref(out, index, node->left);
+    }
+    if (node->right != NULL) {
+        fprintf(out, ", .right = ");
+        emit_ref(out, index, node->right);
+    }
+    if (node->nextblock != NULL) {
+        fprintf(out, ", .nextblock = ");
+        emit_ref(out, index, node->nextblock);
+    }
+    if (compiled != NULL) {
+        fprintf(out, ", .compiled = %s", compiled);
+    }
+    if (node->line > 0) {
+        fprintf(out, ", .line = %d, .column = %d", node->line, node->column);
+    }
+
+    switch (node->type) {
+        case AST_LITERAL:
+            fprintf(out, ", .data.string_value = ");
+            emit_string(out, node->data.string_value);
+            break;
+        case AST_IDENTIFIER:
+        case AST_ARRAY_ACCESS:
+            fprintf(out, ", .data.identifier = ");
+            emit_string(out, node->data.identifier);
+            break;
+        case AST_BINARY_OP:
+            fprintf(out, ", .data.operator = %s", operator_name(node->data.operator));
+            break;
+        case AST_FUNCTION_CALL:
+            fprintf(out, ",\n        .data.func_call = { .name = ");
+            emit_string(out, node->data.func_call.name);
+            fprintf(out, ", .arguments = ");
+            emit_ref(out, index, node->data.func_call.arguments);
+            fprintf(out, ", .arg_count = %d, .builtin = %d }",
+                    node->data.func_call.arg_count, node->data.func_call.builtin);
+            break;
+        case AST_FUNCTION_DEFINITION:
+            fprintf(out, ",\n        .data.func_def = { .name = ");
+            emit_string(out, node->data.func_def.name);
+            fprintf(out, ", .parameters = ");
+            emit_ref(out, index, node->data.func_def.parameters);
+            fprintf(out, ", .body = ");
+            emit_ref(out, index, node->data.func_def.body);
+            fprintf(out, ", .memoize = %d }", node->data.func_def.memoize);
+            break;
+        case AST_RETURN_STATEMENT:
+            fprintf(out, ", .data.ret_stmt = { .expression = ");
+            emit_ref(out, index, node->data.ret_stmt.expression);
+            fprintf(out, " }");
+            break;
+        case AST_IF_STATEMENT:
+            fprintf(out, ",\n        .data.if_stmt = { .condition = ");
+            emit_ref(out, index, node->data.if_stmt.condition);
+            fprintf(out, ", .then_branch = ");
+            emit_ref(out, index, node->data.if_stmt.then_branch);
+            fprintf(out, ", .else_branch = ");
+            emit_ref(out, index, node->data.if_stmt.else_branch);
+            fprintf(out, " }");
+            break;
+        case AST_FOR_STATEMENT:
+            fprintf(out, ",\n        .data.for_stmt = { .loop_var = ");
+            emit_string(out, node->data.for_stmt.loop_var);
+            fprintf(out, ", .expression = ");
+            emit_ref(out, index, node->data.for_stmt.expression);
+            fprintf(out, ", .body = ");
+            emit_ref(out, index, node->data.for_stmt.body);
+            fprintf(out, ", .parallel = %d }", node->data.for_stmt.parallel);
+            break;
+        case AST_WHILE_STATEMENT:
+            fprintf(out, ",\n        .data.while_stmt = { .condition = ");
+            emit_ref(out, index, node->data.while_stmt.condition);
+            fprintf(out, ", .body = ");
+            emit_ref(out, index, node->data.while_stmt.body);
+            fprintf(out, " }");
+            break;
+        default:
+            break;
+    }
+    fprintf(out, " },\n");
+}
+
+/*
+ * Statements, with the semantics of execute_block_with_return(). A return
+ * leaves the C function straight away, after restoring the activations of
+ * the while loops it leaves, as execute_ast_with_return() would.
+ */
+typedef struct {
+    FILE *out;
+    NodeIndex *index;
+    int loops[64];          // Enclosing while loops in the C function being emitted
+    int loop_count;
+} Emitter;
+
+static void indent(Emitter *e, int depth) {
+    for (int i = 0; i < depth; i++) {
+        fprintf(e->out, "    ");
+    }
+}
+
+static void emit_leave_loops(Emitter *e, int depth) {
+    for (int i = e->loop_count - 1; i >= 0; i--) {
+        indent(e, depth);
+        fprintf(e->out, "leave_loop(&n[%d], outer_activation_%d);\n", e->loops[i], e->loops[i]);
+    }
+}
+
+static void emit_propagate_return(Emitter *e, int depth) {
+    indent(e, depth);
+    fprintf(e->out, "if (r.has_return) {\n");
+    emit_leave_loops(e, depth + 1);
+    indent(e, depth + 1);
+    fprintf(e->out, "return r;\n");
+    indent(e, depth);
+    fprintf(e->out, "}\n");
+}
+
+static void emit_statements(Emitter *e, ASTNode *node, int depth);
+
+static void emit_statement(Emitter *e, ASTNode *node, int depth) {
+    int i = index_find(e->index, node);
+
+    switch (node->type) {
+        case AST_PRINT:
+            indent(e, depth);
+            fprintf(e->out, "evaluate_and_print(n[%d].left);\n", i);
+            break;
+        case AST_ASSIGNMENT:
+            indent(e, depth);
+            fprintf(e->out, "execute_assignment(&n[%d]);\n", i);
+            break;
+        case AST_FUNCTION_CALL:
+            indent(e, depth);
+            fprintf(e->out, "execute_function_call(&n[%d]);\n", i);
+            break;
+        case AST_FUNCTION_DEFINITION:
+            // Registered before the statement runs, as if just parsed
+            break;
+        case AST_IF_STATEMENT:
+            indent(e, depth);
+            fprintf(e->out, "if (evaluate_if_condition(&n[%d], &c)) {\n", i);
+            indent(e, depth + 1);
+            fprintf(e->out, "if (c) {\n");
+            emit_statements(e, node->data.if_stmt.then_branch, depth + 2);
+            if (node->data.if_stmt.else_branch != NULL) {
+                indent(e, depth + 1);
+                fprintf(e->out, "} else {\n");
+                emit_statements(e, node->data.if_stmt.else_branch, depth + 2);
+            }
+            indent(e, depth + 1);
+            fprintf(e->out, "}\n");
+            indent(e, depth);
+            fprintf(e->out, "}\n");
+            break;
+        case AST_WHILE_STATEMENT:
+            if (e->loop_count < (int) (sizeof(e->loops) / sizeof(e->loops[0]))) {
+                indent(e, depth);
+                fprintf(e->out, "unsigned long outer_activation_%d = enter_loop(&n[%d]);\n", i, i);
+                indent(e, depth);
+                fprintf(e->out, "while (evaluate_while_condition(&n[%d], &c) && c) {\n", i);
+                e->loops[e->loop_count++] = i;
+                emit_statements(e, node->data.while_stmt.body, depth + 1);
+                e->loop_count--;
+                indent(e, depth);
+                fprintf(e->out, "}\n");
+                indent(e, depth);
+                fprintf(e->out, "leave_loop(&n[%d], outer_activation_%d);\n", i, i);
+                break;
+            }
+            // Nested too deep to track, run it in the runtime
+            // fall through
+        default:
+            // for loops, return and anything else run in the runtime
+            indent(e, depth);
+            fprintf(e->out, "r = execute_ast_with_return(&n[%d]);\n", i);
+            if (node->type == AST_RETURN_STATEMENT) {
+                emit_leave_loops(e, depth);
+                indent(e, depth);
+                fprintf(e->out, "return r;\n");
+            } else {
+                emit_propagate_return(e, depth);
+            }
+            break;
+    }
+}
+
+static void emit_statements(Emitter *e, ASTNode *node, int depth) {
+    for (; node != NULL; node = node->nextblock) {
+        emit_statement(e, node, depth);
+    }
+}
+
+static void emit_block_function(Emitter *e, ASTNode *node, const char *name) {
+    fprintf(e->out, "static FunctionReturn %s(void) {\n", name);
+    fprintf(e->out, "    FunctionReturn r = {0};\n");
+    fprintf(e->out, "    int c = 0;\n");
+    fprintf(e->out, "    (void) r;\n");
+    fprintf(e->out, "    (void) c;\n");
+    e->loop_count = 0;
+    emit_statements(e, node, 1);
+    fprintf(e->out, "    return (FunctionReturn) {0};\n");
+    fprintf(e->out, "}\n\n");
+}
+
+// Functions are registered when the parser finishes their definition, so
+// a definition nested in another is registered first
+static void emit_registrations(Emitter *e, ASTNode *node) {
+    for (; node != NULL; node = node->nextblock) {
+        switch (node->type) {
+            case AST_FUNCTION_DEFINITION:
+                emit_registrations(e, node->data.func_def.body);
+                fprintf(e->out, "    register_function(&n[%d]);\n", index_find(e->index, node));
+                break;
+            case AST_IF_STATEMENT:
+                emit_registrations(e, node->data.if_stmt.then_branch);
+                emit_registrations(e, node->data.if_stmt.else_branch);
+                break;
+            case AST_FOR_STATEMENT:
+                emit_registrations(e, node->data.for_stmt.body);
+                break;
+            case AST_WHILE_STATEMENT:
+                emit_registrations(e, node->data.while_stmt.body);
+                break;
+            case AST_BLOCK:
+                emit_registrations(e, node->left);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+int emit_c_program(ASTNode *statements[], int count, const char *source_name, FILE *out) {
+    NodeIndex index = {0};
+    for (int i = 0; i < count; i++) {
+        number_nodes(&index, statements[i]);
+    }
+    find_compiled_blocks(&index);
+
+    Emitter e = {0};
+    e.out = out;
+    e.index = &index;
+
+    fprintf(out, EMIT_C_HEADER " from %s, do not edit */\n\n", source_name);
+    fprintf(out, "#include <stdio.h>\n\n");
+    fprintf(out, "#include \"kvlang_internals.h\"\n");
+    fprintf(out, "#include \"kvopt.h\"\n");
+    fprintf(out, "#include \"kvtask.h\"\n\n");
+
+    // Prototypes of the blocks the AST refers to
+    char name[64];
+    for (int i = 0; i < index.count; i++) {
+        if (index.compiled[i]) {
+            fprintf(out, "static FunctionReturn block_%d(void);\n", i);
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        int k = index_find(&index, statements[i]);
+        if (statements[i]->type == AST_IF_STATEMENT || statements[i]->type == AST_WHILE_STATEMENT) {
+            fprintf(out, "static FunctionReturn statement_%d(void);\n", k);
+        }
+    }
+    fprintf(out, "\n");
+
+    fprintf(out, "static ASTNode n[%d] = {\n", index.count > 0 ? index.count : 1);
+    for (int i = 0; i < index.count; i++) {
+        if (index.compiled[i]) {
+            snprintf(name, sizeof(name), "block_%d", i);
+            emit_node(out, &index, i, name);
+        } else {
+            emit_node(out, &index, i, NULL);
+        }
+    }
+    fprintf(out, "};\n\n");
+
+    for (int i = 0; i < index.count; i++) {
+        if (index.compiled[i]) {
+            snprintf(name, sizeof(name), "block_%d", i);
+            emit_block_function(&e, index.nodes[i], name);
+        }
+    }
+
+    // Top-level if and while statements, a return in them is an error
+    for (int i = 0; i < count; i++) {
+        if (statements[i]->type == AST_IF_STATEMENT || statements[i]->type == AST_WHILE_STATEMENT) {
+            int k = index_find(&index, statements[i]);
+            snprintf(name, sizeof(name), "statement_%d", k);
+            ASTNode *next = statements[i]->nextblock;
+            statements[i]->nextblock = NULL;
+            emit_block_function(&e, statements[i], name);
+            statements[i]->nextblock = next;
+        }
+    }
+
+    fprintf(out, "int main(void) {\n");
+    fprintf(out, "    optimize_options.static_ast = 1;\n");
+    for (int i = 0; i < count; i++) {
+        int k = index_find(&index, statements[i]);
+        ASTNode *next = statements[i]->nextblock;
+        statements[i]->nextblock = NULL;
+        emit_registrations(&e, statements[i]);
+        statements[i]->nextblock = next;
+
+        fprintf(out, "    optimize_ast(&n[%d]);\n", k);
+        if (statements[i]->type == AST_IF_STATEMENT || statements[i]->type == AST_WHILE_STATEMENT) {
+            fprintf(out, "    if (statement_%d().has_return) {\n", k);
+            fprintf(out, "        printf(\"Error: 'return' outside of a function\\n\");\n");
+            fprintf(out, "    }\n");
+        } else {
+            fprintf(out, "    execute_ast(&n[%d]);\n", k);
+        }
+    }
+    fprintf(out, "    task_drain(kv_context);\n");
+    fprintf(out, "    return 0;\n");
+    fprintf(out, "}\n");
+
+    free(index.nodes);
+    free(index.table);
+    free(index.index_table);
+    free(index.compiled);
+    return ferror(out) ? 0 : 1;
+}
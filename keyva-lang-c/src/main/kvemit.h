@@ -0,0 +1,23 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ *  Copyright (C) 2024 Gary Sims
+ *
+ */
+
+#ifndef KVEMIT_H
+#define KVEMIT_H
+
+#include <stdio.h>
+
+#include "kvlang_internals.h"
+
+// The first line of every file emit_c_program() writes
+#define EMIT_C_HEADER "/* Generated by keyva_lang --emit-c"
+
+/*
+ * Write a C program that runs the parsed top-level statements, to be linked
+ * with libkeyva. Returns 0 if writing failed.
+ */
+int emit_c_program(ASTNode *statements[], int count, const char *source_name, FILE *out);
+
+#endif /* KVEMIT_H */
@@ -0,0 +1,3627 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ *  Copyright (C) 2024 Gary Sims
+ *
+ */
+
+/*
+ * The interpreter: tokenizer, parser and evaluator
+ *
+ * Built into libkeyva with the modules it uses. The command line program
+ * is main.c, and host programs use the API of keyva.h, see kvapi.c.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <pthread.h>
+
+#define NDEBUG 1
+//#define DEBUG 1
+#include "debug_print.h"
+
+#include "kvlang_internals.h"
+
+#include "kvstdlib.h"
+#include "kvopt.h"
+#include "kvmemo.h"
+#include "kvjit.h"
+#include "kvprof.h"
+#include "kvpar.h"
+#include "kvtask.h"
+#include "kvshared.h"
+#include "kvvector.h"
+#include "kvbuffer.h"
+
+// The context of programs run without one of their own, such as the
+// command line interpreter's
+static KvContext default_context = {
+    .variables = default_context.scope_variables_stack[0]
+};
+
+_Thread_local KvContext *kv_context = &default_context;
+
+// NodeState indexes are shared by all contexts. Indexes of freed nodes are
+// handed out again, each time with a new serial
+static pthread_mutex_t node_state_lock = PTHREAD_MUTEX_INITIALIZER;
+static int node_state_count = 0;
+static int *free_node_states = NULL;
+static int free_node_state_count = 0;
+static int free_node_state_capacity = 0;
+static unsigned long node_state_serial = 0;
+static unsigned long context_count = 0;
+
+// Keyword, operator, and delimiter definitions
+const char *keywords[] = {
+    "def", "return", "end", "if", "else", "print", "for", "pfor", "in", "while", "memo", "spawn", NULL
+};
+
+const char *operators[] = {
+    "+", "-", "*", "/", "=", "<", ">", "<=", ">=", "==", "!=", NULL
+};
+
+const char *delimiters = "(),[]";
+
+int is_keyword(const char *str) {
+    for (int i = 0; keywords[i] != NULL; i++) {
+        if (strcmp(str, keywords[i]) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+// Whether the next word on the line after pos is word, or any word when word
+// is NULL, for keywords that are only keywords in front of another one, such
+// as 'memo' in 'memo def', 'pfor' in 'pfor i in x' and 'spawn' in 'spawn f(x)'
+static int next_word_is(const char *line, int pos, const char *word) {
+    while (line[pos] == ' ' || line[pos] == '\t') {
+        pos++;
+    }
+    if (word == NULL) {
+        return isalpha(line[pos]) || line[pos] == '_';
+    }
+    int len = strlen(word);
+    return strncmp(line + pos, word, len) == 0 && !isalnum(line[pos + len]) && line[pos + len] != '_';
+}
+
+int is_operator_char(char c) {
+    return strchr("+-*/=<>!", c) != NULL;
+}
+
+int is_operator(const char *str) {
+    for (int i = 0; operators[i] != NULL; i++) {
+        if (strcmp(str, operators[i]) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+int is_delimiter_char(char c) {
+    return strchr(delimiters, c) != NULL;
+}
+
+void tokenize_line(const char *line, Token tokens[], int *token_count) {
+    int pos = 0;
+    int length = strlen(line);
+    int line_number = 1;
+    int line_start = 0;
+    *token_count = 0;
+
+    while (pos < length) {
+        char c = line[pos];
+        int column = pos - line_start + 1;
+
+        // Skip whitespace
+        if (isspace(c)) {
+            if (c == '\n') {
+                line_number++;
+                line_start = pos + 1;
+            }
+            pos++;
+            continue;
+        }
+
+        // Comments
+        if (c == '#') {
+            // Rest of the line is a comment
+            Token token;
+            token.type = TOKEN_COMMENT;
+            strncpy(token.value, line + pos, MAX_TOKEN_LENGTH - 1);
+            token.value[MAX_TOKEN_LENGTH - 1] = '\0';
+            token.line = line_number;
+            token.column = column;
+            tokens[(*token_count)++] = token;
+            break; // Ignore rest of the line
+        }
+
+        // String literals
+        if (c == '"' || c == '\'') {
+            char quote = c;
+            int start = ++pos;
+            while (pos < length && line[pos] != quote) {
+                pos++;
+            }
+            if (pos >= length) {
+                printf("Error: Unterminated string literal\n");
+                return;
+            }
+            Token token;
+            token.type = TOKEN_STRING;
+            int str_length = pos - start;
+            strncpy(token.value, line + start, str_length);
+            token.value[str_length] = '\0';
+            token.line = line_number;
+            token.column = column;
+            tokens[(*token_count)++] = token;
+            pos++; // Skip closing quote
+            continue;
+        }
+
+        // Numbers
+        if (isdigit(c)) {
+            int start = pos;
+            while (pos < length && isdigit(line[pos])) {
+                pos++;
+            }
+            Token token;
+            token.type = TOKEN_NUMBER;
+            int num_length = pos - start;
+            strncpy(token.value, line + start, num_length);
+            token.value[num_length] = '\0';
+            token.line = line_number;
+            token.column = column;
+            tokens[(*token_count)++] = token;
+            continue;
+        }
+
+        // Identifiers and keywords
+        if (isalpha(c) || c == '_') {
+            int start = pos;
+            while (pos < length && (isalnum(line[pos]) || line[pos] == '_')) {
+                pos++;
+            }
+            int id_length = pos - start;
+            char id[MAX_TOKEN_LENGTH];
+            strncpy(id, line + start, id_length);
+            id[id_length] = '\0';
+
+            Token token;
+            if (is_keyword(id) && (strcmp(id, "memo") != 0 || next_word_is(line, pos, "def")) &&
+                ((strcmp(id, "pfor") != 0 && strcmp(id, "spawn") != 0) || next_word_is(line, pos, NULL))) {
+                token.type = TOKEN_KEYWORD;
+            } else {
+                token.type = TOKEN_IDENTIFIER;
+            }
+            strcpy(token.value, id);
+            token.line = line_number;
+            token.column = column;
+            tokens[(*token_count)++] = token;
+            continue;
+        }
+
+        // Operators
+        if (is_operator_char(c)) {
+            int start = pos;
+            while (pos < length && is_operator_char(line[pos])) {
+                pos++;
+            }
+            int op_length = pos - start;
+            char op[MAX_TOKEN_LENGTH];
+            strncpy(op, line + start, op_length);
+            op[op_length] = '\0';
+
+            // Check if it's a valid operator
+            if (is_operator(op)) {
+                Token token;
+                token.type = TOKEN_OPERATOR;
+                strcpy(token.value, op);
+                token.line = line_number;
+                token.column = column;
+                tokens[(*token_count)++] = token;
+            } else {
+                printf("Error: Unknown operator '%s'\n", op);
+            }
+            continue;
+        }
+
+        // Delimiters
+        if (is_delimiter_char(c)) {
+            Token token;
+            token.type = TOKEN_DELIMITER;
+            token.value[0] = c;
+            token.value[1] = '\0';
+            token.line = line_number;
+            token.column = column;
+            tokens[(*token_count)++] = token;
+            pos++;
+            continue;
+        }
+
+        // Unknown character
+        printf("Error: Unknown character '%c'\n", c);
+        pos++;
+    }
+}
+
+void init_assoc_array(AssocArray *array) {
+    array->size = 0;
+    array->capacity = 4; // Initial capacity
+    array->pairs = (KeyValuePair *)malloc(sizeof(KeyValuePair) * array->capacity);
+    array->shared = NULL;
+    array->buffer = NULL;
+    array->written = NULL;
+}
+
+void free_assoc_array(AssocArray *array) {
+    free(array->pairs);
+    array->pairs = NULL;
+    array->size = 0;
+    array->capacity = 0;
+    array->shared = NULL;
+    buffer_release(array->buffer);
+    array->buffer = NULL;
+    free(array->written);
+    array->written = NULL;
+}
+
+// A pfor chunk tracks which pairs or numbers of its copies of the variables
+// it writes, so that only those are merged, see kvpar.c. Writes that
+// replace the array as a whole leave it untracked
+void track_array_writes(AssocArray *array) {
+    long length = array->buffer != NULL ? array->buffer->length : array->capacity;
+    free(array->written);
+    array->written = (unsigned char *) calloc(length + 1, 1);
+}
+
+// Index -1 marks every pair or number
+void mark_array_written(AssocArray *array, long index) {
+    if (array->written == NULL) {
+        return;
+    }
+    if (index < 0) {
+        memset(array->written, 1, array->buffer != NULL ? array->buffer->length : array->capacity);
+    } else {
+        array->written[index] = 1;
+    }
+}
+
+// A copy of a shared array refers to the same table, and one of a buffer
+// shares it until either is written
+void duplicate_assoc_array(AssocArray *dup, AssocArray *array) {
+    dup->capacity = array->capacity;
+    dup->size = array->size;
+    dup->pairs = (KeyValuePair *)malloc(sizeof(KeyValuePair) * array->capacity);
+    if (array->pairs != NULL) {
+        memcpy(dup->pairs, array->pairs, sizeof(KeyValuePair) * array->capacity);
+    }
+    dup->shared = array->shared;
+    dup->buffer = buffer_retain(array->buffer);
+    dup->written = NULL;
+}
+
+// Writes the number in value at the index key names
+static void set_buffer_value(AssocArray *array, const char *key, const char *value) {
+    long index;
+    if (!buffer_key_index(array->buffer, key, &index)) {
+        printf("Error: Index '%s' is outside the buffer of %ld numbers\n", key, array->buffer->length);
+        return;
+    }
+    char *end;
+    double number = strtod(value, &end);
+    if (end == value || *end != '\0') {
+        printf("Error: A buffer holds numbers, not '%s'\n", value);
+        return;
+    }
+    TypedBuffer *buffer = buffer_writable(&array->buffer);
+    if (buffer != NULL) {
+        buffer_set(buffer, index, number);
+        mark_array_written(array, index);
+    }
+}
+
+void set_assoc_array_value(AssocArray *array, const char *key, const char *value) {
+    if (array->shared != NULL) {
+        shared_set(array->shared, key, value);
+        return;
+    }
+    if (array->buffer != NULL) {
+        set_buffer_value(array, key, value);
+        return;
+    }
+    // Check if key exists
+    for (int i = 0; i < array->size; i++) {
+        if (strcmp(array->pairs[i].key, key) == 0) {
+            strcpy(array->pairs[i].value, value);
+            mark_array_written(array, i);
+            return;
+        }
+    }
+    // Add new key-value pair
+    if (array->size == array->capacity) {
+        int old_capacity = array->capacity;
+        array->capacity = array->capacity > 0 ? array->capacity * 2 : 4;
+        array->pairs = (KeyValuePair *)realloc(array->pairs, sizeof(KeyValuePair) * array->capacity);
+        if (array->written != NULL) {
+            array->written = (unsigned char *) realloc(array->written, array->capacity);
+            memset(array->written + old_capacity, 0, array->capacity - old_capacity);
+        }
+    }
+    strcpy(array->pairs[array->size].key, key);
+    strcpy(array->pairs[array->size].value, value);
+    mark_array_written(array, array->size);
+    array->size++;
+}
+
+// The value of a shared array or a buffer is copied, and is valid until the
+// next call on this thread
+char* get_assoc_array_value(AssocArray *array, const char *key) {
+    static _Thread_local char copied_value[MAX_TOKEN_LENGTH];
+    if (array->shared != NULL) {
+        return shared_get(array->shared, key, copied_value) ? copied_value : NULL;
+    }
+    if (array->buffer != NULL) {
+        long index;
+        if (!buffer_key_index(array->buffer, key, &index)) {
+            return NULL;
+        }
+        buffer_format(array->buffer, index, copied_value);
+        return copied_value;
+    }
+    for (int i = 0; i < array->size; i++) {
+        if (strcmp(array->pairs[i].key, key) == 0) {
+            return array->pairs[i].value;
+        }
+    }
+    return NULL; // Key not found
+}
+
+char* get_first_assoc_array_value(AssocArray *array) {
+    return array->pairs[0].value;
+}
+
+ASTNode* parse_array_access(Token tokens[], int *pos, int token_count) {
+    // tokens[*pos] should be an identifier
+    if (tokens[*pos].type != TOKEN_IDENTIFIER) {
+        printf("Error: Expected identifier for array access\n");
+        return NULL;
+    }
+    ASTNode *node = (ASTNode*)calloc(1, sizeof(ASTNode));
+    node->type = AST_ARRAY_ACCESS;
+    node->left = NULL;
+    node->right = NULL;
+    node->nextblock = NULL;
+    // DEBUG_PRINT("Add AST_ARRAY_ACCESS Node of %d", node->type);
+    strcpy(node->data.identifier, tokens[*pos].value);
+    (*pos)++;
+
+    // Expect '['
+    if (*pos < token_count && tokens[*pos].type == TOKEN_DELIMITER && tokens[*pos].value[0] == '[') {
+        (*pos)++;
+        // Parse the key expression inside brackets
+        ASTNode *key_expr = parse_expression(tokens, pos, token_count);
+        if (key_expr == NULL) {
+            printf("Error: Expected expression inside '[]'\n");
+            free_ast(node);
+            return NULL;
+        }
+        node->left = key_expr;
+        node->right = NULL;
+        node->nextblock = NULL;
+
+        // Expect ']'
+        if (*pos < token_count && tokens[*pos].type == TOKEN_DELIMITER && tokens[*pos].value[0] == ']') {
+            (*pos)++;
+            return node;
+        } else {
+            printf("Error: Expected ']' after array index\n");
+            free_ast(node);
+            return NULL;
+        }
+    } else {
+        printf("Error: Expected '[' after identifier for array access\n");
+        free_ast(node);
+        return NULL;
+    }
+}
+
+ASTNode* parse_assignment_statement(Token tokens[], int *pos, int token_count) {
+    // Expect an identifier
+    if (tokens[*pos].type == TOKEN_IDENTIFIER) {
+        ASTNode *target = NULL;
+
+        // Check for array access (e.g., a["lemon"])
+        if ((*pos + 1) < token_count && tokens[*pos + 1].type == TOKEN_DELIMITER && tokens[*pos + 1].value[0] == '[') {
+            target = parse_array_access(tokens, pos, token_count);
+        } else {
+            // Simple identifier
+            target = (ASTNode*)calloc(1, sizeof(ASTNode));
+            target->type = AST_IDENTIFIER;
+            // DEBUG_PRINT("Add AST_IDENTIFIER Node of %d", target->type);
+            strcpy(target->data.identifier, tokens[*pos].value);
+            target->left = target->right = NULL;
+            target->nextblock = NULL;
+            (*pos)++;
+        }
+
+        // Expect '=' operator
+        if (*pos < token_count && tokens[*pos].type == TOKEN_OPERATOR && strcmp(tokens[*pos].value, "=") == 0) {
+            (*pos)++;
+            // Parse the expression on the right-hand side
+            ASTNode *expr = parse_expression(tokens, pos, token_count);
+            if (expr == NULL) {
+                printf("Error: Expected expression after '='\n");
+                free_ast(target);
+                return NULL;
+            }
+            // Create assignment node
+            ASTNode *node = (ASTNode*)calloc(1, sizeof(ASTNode));
+            node->type = AST_ASSIGNMENT;
+            // DEBUG_PRINT("Add AST_ASSIGNMENT Node of %d", node->type);
+            node->left = target;
+            node->right = expr;
+            node->nextblock = NULL;
+            return node;
+        } else {
+            printf("Error: Expected '=' after identifier\n");
+            free_ast(target);
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+
+// Runs each statement as soon as it is parsed, returns 0 if one does not parse
+int parse_and_execute(Token tokens[], int token_count) {
+    int pos = 0;
+
+    declare_functions(tokens, token_count);
+    while (pos < token_count) {
+        ASTNode *node = parse_statement(tokens, &pos, token_count);
+        if (node != NULL) {
+            optimize_ast(node);
+            execute_ast(node);
+            free_ast(node);
+        } else {
+            // Skip the rest of the line on error
+            return 0;
+        }
+    }
+    return 1;
+}
+
+ASTNode* parse_phrase(Token tokens[], int *pos, int token_count) {
+    if (*pos >= token_count) {
+        printf("Error: Unexpected end of input in term\n");
+        return NULL;
+    }
+
+    Token token = tokens[*pos];
+
+    if (token.type == TOKEN_NUMBER || token.type == TOKEN_STRING) {
+        // Literal
+        ASTNode *node = (ASTNode*)calloc(1, sizeof(ASTNode));
+        if (node == NULL) {
+            printf("Error: Memory allocation failed\n");
+            return NULL;
+        }
+        node->type = AST_LITERAL;
+        // DEBUG_PRINT("Add AST_LITERAL Node of %d", node->type);
+        node->left = NULL;
+        node->right = NULL;
+        node->nextblock = NULL;
+        strcpy(node->data.string_value, token.value);
+        (*pos)++;
+        return node;
+    } else if (token.type == TOKEN_IDENTIFIER) {
+        // Check for array access
+        if ((*pos + 1) < token_count &&
+            tokens[*pos + 1].type == TOKEN_DELIMITER &&
+            tokens[*pos + 1].value[0] == '[') {
+            return parse_array_access(tokens, pos, token_count);
+        } else if ((*pos + 1) < token_count &&
+            tokens[*pos + 1].type == TOKEN_DELIMITER &&
+            tokens[*pos + 1].value[0] == '(') {
+            // Function call
+            char ident[MAX_TOKEN_LENGTH];
+            strcpy(ident, tokens[*pos].value);
+            (*pos)++;
+
+            // Parse arguments
+            (*pos)++;
+            ASTNode *arg_list = NULL;
+            ASTNode **current = &arg_list;
+            while (*pos < token_count && !(tokens[*pos].type == TOKEN_DELIMITER && tokens[*pos].value[0] == ')')) {
+                ASTNode *arg = parse_expression(tokens, pos, token_count);
+                if (arg == NULL) {
+                    printf("Error: Expected expression in function call arguments\n");
+                    free_ast(arg_list);
+                    return NULL;
+                }
+                // Arguments are chained through nextblock, as right belongs to the expression
+                *current = arg;
+                arg->nextblock = NULL;
+                current = &arg->nextblock;
+
+                // Check for comma
+                if (*pos < token_count && tokens[*pos].type == TOKEN_DELIMITER && tokens[*pos].value[0] == ',') {
+                    (*pos)++;
+                }
+            }
+
+            // Expect ')'
+            if (*pos >= token_count || !(tokens[*pos].type == TOKEN_DELIMITER && tokens[*pos].value[0] == ')')) {
+                printf("Error: Expected ')' after function call arguments\n");
+                //free_ast(arg_list);
+                return NULL;
+            }
+            (*pos)++;
+
+            // Create function call node
+            ASTNode *call_node = (ASTNode*)calloc(1, sizeof(ASTNode));
+            call_node->type = AST_FUNCTION_CALL;
+            // DEBUG_PRINT("Add AST_FUNCTION_CALL Node of %d", call_node->type);
+            call_node->left = call_node->right = NULL;
+            call_node->nextblock = NULL;
+            strcpy(call_node->data.func_call.name, ident);
+            call_node->data.func_call.arguments = arg_list;
+            //call_node->data.func_call.arguments = NULL;
+            bind_function_call(call_node);
+            return call_node;
+        } else {
+            // Simple identifier
+            ASTNode *node = (ASTNode*)calloc(1, sizeof(ASTNode));
+            if (node == NULL) {
+                printf("Error: Memory allocation failed\n");
+                return NULL;
+            }
+            node->type = AST_IDENTIFIER;
+            // DEBUG_PRINT("Add AST_IDENTIFIER Node of %d", node->type);
+            node->left = NULL;
+            node->right = NULL;
+            node->nextblock = NULL;
+            strcpy(node->data.identifier, token.value);
+            (*pos)++;
+            return node;
+        }
+    } else if (token.type == TOKEN_DELIMITER && token.value[0] == '(') {
+        // Parenthesized expression
+        (*pos)++;
+        ASTNode *node = parse_expression(tokens, pos, token_count);
+        if (node == NULL) {
+            return NULL;
+        }
+        if (*pos >= token_count ||
+            tokens[*pos].type != TOKEN_DELIMITER ||
+            tokens[*pos].value[0] != ')') {
+            printf("Error: Expected ')' after expression\n");
+            free_ast(node);
+            return NULL;
+        }
+        (*pos)++;
+        return node;
+    }
+
+    printf("Error: Unexpected token '%s' in term\n", token.value);
+    return NULL;
+}
+
+// ASTNode* parse_comparison(Token tokens[], int *pos, int token_count) {
+//     ASTNode *left = parse_phrase(tokens, pos, token_count);
+//     if (left == NULL) {
+//         return NULL;
+//     }
+
+//     while (*pos < token_count) {
+//         Token token = tokens[*pos];
+
+//         OperatorType op_type;
+//         int is_comparison = 0;
+
+//         if (token.type == TOKEN_OPERATOR) {
+//             if (strcmp(token.value, "<") == 0) {
+//                 op_type = OP_LESS_THAN;
+//                 is_comparison = 1;
+//             } else if (strcmp(token.value, ">") == 0) {
+//                 op_type = OP_GREATER_THAN;
+//                 is_comparison = 1;
+//             } else if (strcmp(token.value, "==") == 0) {
+//                 op_type = OP_EQUAL;
+//                 is_comparison = 1;
+//             } else if (strcmp(token.value, "!=") == 0) {
+//                 op_type = OP_NOT_EQUAL;
+//                 is_comparison = 1;
+//             } else if (strcmp(token.value, "<=") == 0) {
+//                 op_type = OP_LESS_EQUAL;
+//                 is_comparison = 1;
+//             } else if (strcmp(token.value, ">=") == 0) {
+//                 op_type = OP_GREATER_EQUAL;
+//                 is_comparison = 1;
+//             }
+//         }
+
+//         if (!is_comparison) {
+//             break; // No more comparison operators
+//         }
+
+//         (*pos)++; // Consume operator
+//         ASTNode *right = parse_phrase(tokens, pos, token_count);
+//         if (right == NULL) {
+//             free_ast(left);
+//             return NULL;
+//         }
+
+//         // Create binary operation node
+//         ASTNode *op_node = (ASTNode*)calloc(1, sizeof(ASTNode));
+//         op_node->type = AST_BINARY_OP;
+//         // DEBUG_PRINT("Add AST_BINARY_OP Node of %d", op_node->type);
+//         op_node->data.operator = op_type;
+//         op_node->left = left;
+//         op_node->right = right;
+//         op_node->nextblock = NULL;
+
+//         left = op_node; // Update left node for the next iteration
+//     }
+
+//     return left;
+// }
+
+// ASTNode* parse_expression(Token tokens[], int *pos, int token_count) {
+//     ASTNode *left = parse_comparison(tokens, pos, token_count);
+//     if (left == NULL) {
+//         return NULL;
+//     }
+
+//     while (*pos < token_count) {
+//         Token token = tokens[*pos];
+
+//         if (token.type == TOKEN_OPERATOR && (strcmp(token.value, "+") == 0 || strcmp(token.value, "-") == 0)) {
+//             OperatorType op_type = (strcmp(token.value, "+") == 0) ? OP_ADD : OP_SUBTRACT;
+//             (*pos)++; // Consume operator
+//             ASTNode *right = parse_comparison(tokens, pos, token_count);
+//             if (right == NULL) {
+//                 free_ast(left);
+//                 return NULL;
+//             }
+
+//             // Create binary operation node
+//             ASTNode *op_node = (ASTNode*)calloc(1, sizeof(ASTNode));
+//             op_node->type = AST_BINARY_OP;
+//             // DEBUG_PRINT("Add AST_BINARY_OP Node of %d", op_node->type);
+//             op_node->data.operator = op_type;
+//             op_node->left = left;
+//             op_node->right = right;
+//             op_node->nextblock = NULL;
+
+//             left = op_node; // Update left node for the next iteration
+//         } else {
+//             break; // No more operators at this precedence level
+//         }
+//     }
+
+//     return left;
+// }
+
+ASTNode* parse_expression(Token tokens[], int *pos, int token_count) {
+    // comparisons have the lowest precedence after arithmetic
+    return parse_comparison(tokens, pos, token_count);
+}
+
+ASTNode* parse_comparison(Token tokens[], int *pos, int token_count) {
+    ASTNode *left = parse_additive(tokens, pos, token_count);
+    if (left == NULL) {
+        return NULL;
+    }
+
+    while (*pos < token_count && tokens[*pos].type == TOKEN_OPERATOR) {
+        OperatorType op_type;
+        int is_comparison = 0;
+
+        if (strcmp(tokens[*pos].value, "<") == 0) {
+            op_type = OP_LESS_THAN;
+            is_comparison = 1;
+        } else if (strcmp(tokens[*pos].value, ">") == 0) {
+            op_type = OP_GREATER_THAN;
+            is_comparison = 1;
+        } else if (strcmp(tokens[*pos].value, "<=") == 0) {
+            op_type = OP_LESS_EQUAL;
+            is_comparison = 1;
+        } else if (strcmp(tokens[*pos].value, ">=") == 0) {
+            op_type = OP_GREATER_EQUAL;
+            is_comparison = 1;
+        } else if (strcmp(tokens[*pos].value, "==") == 0) {
+            op_type = OP_EQUAL;
+            is_comparison = 1;
+        } else if (strcmp(tokens[*pos].value, "!=") == 0) {
+            op_type = OP_NOT_EQUAL;
+            is_comparison = 1;
+        }
+
+        if (!is_comparison) {
+            // Not a comparison operator
+            break;
+        }
+
+        (*pos)++; // consume operator
+        ASTNode *right = parse_additive(tokens, pos, token_count);
+        if (right == NULL) {
+            free_ast(left);
+            return NULL;
+        }
+
+        ASTNode *op_node = (ASTNode*)calloc(1, sizeof(ASTNode));
+        op_node->type = AST_BINARY_OP;
+        op_node->data.operator = op_type;
+        op_node->left = left;
+        op_node->right = right;
+        op_node->nextblock = NULL;
+
+        left = op_node; // chain comparisons if multiple
+    }
+
+    return left;
+}
+
+ASTNode* parse_additive(Token tokens[], int *pos, int token_count) {
+    ASTNode *left = parse_term(tokens, pos, token_count);
+    if (left == NULL) {
+        return NULL;
+    }
+
+    while (*pos < token_count && tokens[*pos].type == TOKEN_OPERATOR) {
+        if (strcmp(tokens[*pos].value, "+") == 0 || strcmp(tokens[*pos].value, "-") == 0) {
+            OperatorType op_type;
+            if (strcmp(tokens[*pos].value, "+") == 0) {
+                op_type = OP_ADD;
+            } else {
+                op_type = OP_SUBTRACT;
+            }
+
+            (*pos)++; // Consume operator
+            ASTNode *right = parse_term(tokens, pos, token_count);
+            if (right == NULL) {
+                free_ast(left);
+                return NULL;
+            }
+
+            ASTNode *op_node = (ASTNode*)calloc(1, sizeof(ASTNode));
+            op_node->type = AST_BINARY_OP;
+            op_node->data.operator = op_type;
+            op_node->left = left;
+            op_node->right = right;
+            op_node->nextblock = NULL;
+
+            left = op_node; // Update left node
+        } else {
+            break;
+        }
+    }
+
+    return left;
+}
+
+ASTNode* parse_term(Token tokens[], int *pos, int token_count) {
+    ASTNode *left = parse_factor(tokens, pos, token_count);
+    if (left == NULL) {
+        return NULL;
+    }
+
+    while (*pos < token_count && tokens[*pos].type == TOKEN_OPERATOR) {
+        if (strcmp(tokens[*pos].value, "*") == 0 || strcmp(tokens[*pos].value, "/") == 0) {
+            OperatorType op_type;
+            if (strcmp(tokens[*pos].value, "*") == 0) {
+                op_type = OP_MULTIPLY;
+            } else {
+                op_type = OP_DIVIDE;
+            }
+
+            (*pos)++; // Consume operator
+            ASTNode *right = parse_factor(tokens, pos, token_count);
+            if (right == NULL) {
+                free_ast(left);
+                return NULL;
+            }
+
+            ASTNode *op_node = (ASTNode*)calloc(1, sizeof(ASTNode));
+            op_node->type = AST_BINARY_OP;
+            op_node->data.operator = op_type;
+            op_node->left = left;
+            op_node->right = right;
+            op_node->nextblock = NULL;
+
+            left = op_node; // Continue chaining
+        } else {
+            break;
+        }
+    }
+
+    return left;
+}
+
+// ASTNode* parse_factor(Token tokens[], int *pos, int token_count) {
+//     if (*pos >= token_count) {
+//         printf("Error: Unexpected end of input in factor\n");
+//         return NULL;
+//     }
+
+//     Token token = tokens[*pos];
+
+//     // Parenthesized expression
+//     if (token.type == TOKEN_DELIMITER && token.value[0] == '(') {
+//         (*pos)++;
+//         ASTNode *node = parse_expression(tokens, pos, token_count);
+//         if (node == NULL) {
+//             return NULL;
+//         }
+//         // Expect ')'
+//         if (*pos >= token_count || tokens[*pos].type != TOKEN_DELIMITER || tokens[*pos].value[0] != ')') {
+//             printf("Error: Expected ')' after expression\n");
+//             free_ast(node);
+//             return NULL;
+//         }
+//         (*pos)++;
+//         return node;
+//     }
+
+//     // Number or String literal
+//     if (token.type == TOKEN_NUMBER || token.type == TOKEN_STRING) {
+//         ASTNode *node = (ASTNode*)calloc(1, sizeof(ASTNode));
+//         node->type = AST_LITERAL;
+//         node->left = node->right = NULL;
+//         strcpy(node->data.string_value, token.value);
+//         (*pos)++;
+//         return node;
+//     }
+
+//     // Identifier or Function call
+//     if (token.type == TOKEN_IDENTIFIER) {
+//         char ident[MAX_TOKEN_LENGTH];
+//         strcpy(ident, token.value);
+//         (*pos)++;
+
+//         // Check for function call
+//         if (*pos < token_count && tokens[*pos].type == TOKEN_DELIMITER && tokens[*pos].value[0] == '(') {
+//             (*pos)++;
+//             // Parse arguments
+//             ASTNode *arg_list = NULL;
+//             ASTNode **current = &arg_list;
+//             while (*pos < token_count && !(tokens[*pos].type == TOKEN_DELIMITER && tokens[*pos].value[0] == ')')) {
+//                 ASTNode *arg = parse_expression(tokens, pos, token_count);
+//                 if (arg == NULL) {
+//                     free_ast(arg_list);
+//                     return NULL;
+//                 }
+//                 *current = arg;
+//                 current = &arg->right;
+
+//                 // Check for comma
+//                 if (*pos < token_count && tokens[*pos].type == TOKEN_DELIMITER && tokens[*pos].value[0] == ',') {
+//                     (*pos)++;
+//                 }
+//             }
+
+//             // Expect ')'
+//             if (*pos >= token_count || !(tokens[*pos].type == TOKEN_DELIMITER && tokens[*pos].value[0] == ')')) {
+//                 printf("Error: Expected ')' after function call arguments\n");
+//                 free_ast(arg_list);
+//                 return NULL;
+//             }
+//             (*pos)++;
+
+//             // Create function call node
+//             ASTNode *call_node = (ASTNode*)calloc(1, sizeof(ASTNode));
+//             call_node->type = AST_FUNCTION_CALL;
+//             call_node->left = call_node->right = NULL;
+//             strcpy(call_node->data.func_call.name, ident);
+//             call_node->data.func_call.arguments = arg_list;
+//             return call_node;
+//         } else {
+//             // Just a variable (identifier)
+//             ASTNode *node = (ASTNode*)calloc(1, sizeof(ASTNode));
+//             node->type = AST_IDENTIFIER;
+//             node->left = node->right = NULL;
+//             strcpy(node->data.identifier, ident);
+//             return node;
+//         }
+//     }
+
+//     printf("Error: Unexpected token '%s' in factor\n", token.value);
+//     return NULL;
+// }
+
+ASTNode* parse_factor(Token tokens[], int *pos, int token_count) {
+    if (*pos >= token_count) {
+        printf("Error: Unexpected end of input in factor\n");
+        return NULL;
+    }
+
+    Token token = tokens[*pos];
+
+    // spawn f(...) runs a call of a user-defined function as a task, see kvtask.c
+    if (token.type == TOKEN_KEYWORD && strcmp(token.value, "spawn") == 0) {
+        (*pos)++;
+        ASTNode *call_node = parse_factor(tokens, pos, token_count);
+        if (call_node == NULL) return NULL;
+        if (call_node->type != AST_FUNCTION_CALL || call_node->data.func_call.builtin >= 0) {
+            printf("Error: Expected a call of a user-defined function after 'spawn'\n");
+            free_ast(call_node);
+            return NULL;
+        }
+        ASTNode *node = (ASTNode*)calloc(1, sizeof(ASTNode));
+        node->type = AST_SPAWN;
+        node->left = call_node;
+        return node;
+    }
+
+    // Parenthesized expression
+    if (token.type == TOKEN_DELIMITER && token.value[0] == '(') {
+        (*pos)++;
+        ASTNode *node = parse_expression(tokens, pos, token_count);
+        if (node == NULL) return NULL;
+
+        // Expect ')'
+        if (*pos >= token_count || tokens[*pos].type != TOKEN_DELIMITER || tokens[*pos].value[0] != ')') {
+            printf("Error: Expected ')' after expression\n");
+            free_ast(node);
+            return NULL;
+        }
+        (*pos)++;
+        return node;
+    }
+
+    // Number or String literal
+    if (token.type == TOKEN_NUMBER || token.type == TOKEN_STRING) {
+        ASTNode *node = (ASTNode*)calloc(1, sizeof(ASTNode));
+        node->type = AST_LITERAL;
+        node->left = node->right = NULL;
+        node->nextblock = NULL;
+        strcpy(node->data.string_value, token.value);
+        (*pos)++;
+        return node;
+    }
+
+    // Identifier or Function call or Array access
+    if (token.type == TOKEN_IDENTIFIER) {
+        char ident[MAX_TOKEN_LENGTH];
+        strcpy(ident, token.value);
+        (*pos)++;
+
+        // Check for function call (identifier followed by '(')
+        if (*pos < token_count && tokens[*pos].type == TOKEN_DELIMITER && tokens[*pos].value[0] == '(') {
+            (*pos)++;
+            // Parse arguments
+            ASTNode *arg_list = NULL;
+            ASTNode **current = &arg_list;
+            while (*pos < token_count && !(tokens[*pos].type == TOKEN_DELIMITER && tokens[*pos].value[0] == ')')) {
+                ASTNode *arg = parse_expression(tokens, pos, token_count);
+                if (arg == NULL) {
+                    free_ast(arg_list);
+                    return NULL;
+                }
+                // Arguments are chained through nextblock, as right belongs to the expression
+                *current = arg;
+                arg->nextblock = NULL;
+                current = &arg->nextblock;
+
+                // Check for comma
+                if (*pos < token_count && tokens[*pos].type == TOKEN_DELIMITER && tokens[*pos].value[0] == ',') {
+                    (*pos)++;
+                }
+            }
+
+            // Expect ')'
+            if (*pos >= token_count || !(tokens[*pos].type == TOKEN_DELIMITER && tokens[*pos].value[0] == ')')) {
+                printf("Error: Expected ')' after function call arguments\n");
+                free_ast(arg_list);
+                return NULL;
+            }
+            (*pos)++;
+
+            // Create function call node
+            ASTNode *call_node = (ASTNode*)calloc(1, sizeof(ASTNode));
+            call_node->type = AST_FUNCTION_CALL;
+            call_node->left = call_node->right = NULL;
+            call_node->nextblock = NULL;
+            strcpy(call_node->data.func_call.name, ident);
+            call_node->data.func_call.arguments = arg_list;
+            bind_function_call(call_node);
+            return call_node;
+        }
+
+        // Check for array access (identifier followed by '[')
+        if (*pos < token_count && tokens[*pos].type == TOKEN_DELIMITER && tokens[*pos].value[0] == '[') {
+            (*pos)++;
+            // Parse the index expression inside []
+            ASTNode *index_expr = parse_expression(tokens, pos, token_count);
+            if (index_expr == NULL) {
+                return NULL;
+            }
+
+            // Expect ']'
+            if (*pos >= token_count || tokens[*pos].type != TOKEN_DELIMITER || tokens[*pos].value[0] != ']') {
+                printf("Error: Expected ']' after array index\n");
+                free_ast(index_expr);
+                return NULL;
+            }
+            (*pos)++;
+
+            // Create AST_ARRAY_ACCESS node
+            ASTNode *access_node = (ASTNode*)calloc(1, sizeof(ASTNode));
+            access_node->type = AST_ARRAY_ACCESS;
+            strcpy(access_node->data.identifier, ident);
+            access_node->left = index_expr;
+            access_node->right = NULL;
+            access_node->nextblock = NULL;
+            return access_node;
+        }
+
+        // Just a variable (identifier)
+        ASTNode *node = (ASTNode*)calloc(1, sizeof(ASTNode));
+        node->type = AST_IDENTIFIER;
+        node->left = node->right = NULL;
+        node->nextblock = NULL;
+        strcpy(node->data.identifier, ident);
+        return node;
+    }
+
+    printf("Error: Unexpected token '%s' in factor\n", token.value);
+    return NULL;
+}
+
+ASTNode* parse_print_statement(Token tokens[], int *pos, int token_count) {
+    if (tokens[*pos].type == TOKEN_KEYWORD && strcmp(tokens[*pos].value, "print") == 0) {
+        (*pos)++;
+        if (*pos < token_count && tokens[*pos].type == TOKEN_DELIMITER && tokens[*pos].value[0] == '(') {
+            (*pos)++;
+            // Parse the expression inside the parentheses
+            ASTNode *expr = parse_expression(tokens, pos, token_count);
+            if (expr == NULL) {
+                printf("Error: Expected expression after 'print('\n");
+                return NULL;
+            }
+            if (*pos < token_count && tokens[*pos].type == TOKEN_DELIMITER && tokens[*pos].value[0] == ')') {
+                (*pos)++;
+                // Successfully parsed 'print' statement
+                ASTNode *node = (ASTNode*)calloc(1, sizeof(ASTNode));
+                node->type = AST_PRINT;
+                // DEBUG_PRINT("Add AST_PRINT Node of %d", node->type);
+                node->left = expr; // Expression to print
+                node->right = NULL;
+                node->nextblock = NULL;
+                return node;
+            } else {
+                printf("Error: Expected ')' after expression\n");
+                free_ast(expr);
+                return NULL;
+            }
+        } else {
+            printf("Error: Expected '(' after 'print'\n");
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+ASTNode* parse_if_statement(Token tokens[], int *pos, int token_count) {
+    if (tokens[*pos].type == TOKEN_KEYWORD && strcmp(tokens[*pos].value, "if") == 0) {
+        (*pos)++;
+        // Parse the condition expression
+        ASTNode *condition = parse_expression(tokens, pos, token_count);
+        if (condition == NULL) {
+            printf("Error: Expected condition after 'if'\n");
+            return NULL;
+        }
+        // Parse the 'then' branch
+        ASTNode *then_branch = parse_block(tokens, pos, token_count);
+        if (then_branch == NULL) {
+            printf("Error: Expected block after 'if' condition\n");
+            free_ast(condition);
+            return NULL;
+        }
+        // Check for 'else' clause
+        ASTNode *else_branch = NULL;
+        if (*pos < token_count && tokens[*pos].type == TOKEN_KEYWORD && strcmp(tokens[*pos].value, "else") == 0) {
+            (*pos)++;
+            else_branch = parse_block(tokens, pos, token_count);
+            if (else_branch == NULL) {
+                printf("Error: Expected block after 'else'\n");
+                free_ast(condition);
+                free_ast(then_branch);
+                return NULL;
+            }
+        }
+        // Expect 'end' keyword
+        if (*pos < token_count && tokens[*pos].type == TOKEN_KEYWORD && strcmp(tokens[*pos].value, "end") == 0) {
+            (*pos)++;
+            // Create the if statement node
+            ASTNode *node = (ASTNode*)calloc(1, sizeof(ASTNode));
+            node->type = AST_IF_STATEMENT;
+            // DEBUG_PRINT("Add AST_IF_STATEMENT Node of %d", node->type);
+            node->left = NULL;
+            node->right = NULL;
+            node->nextblock = NULL;
+            node->data.if_stmt.condition = condition;
+            node->data.if_stmt.then_branch = then_branch;
+            node->data.if_stmt.else_branch = else_branch;
+            return node;
+        } else {
+            printf("Error: Expected 'end' after 'if' statement\n");
+            free_ast(condition);
+            free_ast(then_branch);
+            if (else_branch) free_ast(else_branch);
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+ASTNode* parse_for_statement(Token tokens[], int *pos, int token_count) {
+    // Expect 'for'
+    if (*pos < token_count && tokens[*pos].type == TOKEN_KEYWORD &&
+        (strcmp(tokens[*pos].value, "for") == 0 || strcmp(tokens[*pos].value, "pfor") == 0)) {
+        // 'pfor' runs the iterations on several threads, see kvpar.c
+        int parallel = tokens[*pos].value[0] == 'p' ? PARALLEL_PFOR : 0;
+        (*pos)++;
+
+        // Expect identifier for loop variable
+        if (*pos >= token_count || tokens[*pos].type != TOKEN_IDENTIFIER) {
+            printf("Error: Expected identifier after '%s'\n", parallel ? "pfor" : "for");
+            return NULL;
+        }
+        char loop_var[MAX_TOKEN_LENGTH];
+        strcpy(loop_var, tokens[*pos].value);
+        (*pos)++;
+
+        // Expect 'in'
+        if (*pos >= token_count || tokens[*pos].type != TOKEN_KEYWORD || strcmp(tokens[*pos].value, "in") != 0) {
+            printf("Error: Expected 'in' after loop variable\n");
+            return NULL;
+        }
+        (*pos)++;
+
+        // Parse expression that should yield an array
+        ASTNode *expr = parse_expression(tokens, pos, token_count);
+        if (expr == NULL) {
+            printf("Error: Expected expression after 'in'\n");
+            return NULL;
+        }
+
+        // Parse the block of statements until 'end'
+        ASTNode *body = parse_block(tokens, pos, token_count);
+        if (body == NULL) {
+            printf("Error: Expected block after 'for' statement\n");
+            free_ast(expr);
+            return NULL;
+        }
+
+        // Expect 'end'
+        if (*pos >= token_count || tokens[*pos].type != TOKEN_KEYWORD || strcmp(tokens[*pos].value, "end") != 0) {
+            printf("Error: Expected 'end' after 'for' block\n");
+            free_ast(expr);
+            free_ast(body);
+            return NULL;
+        }
+        (*pos)++;
+
+        // Create the for statement node
+        ASTNode *node = (ASTNode*)calloc(1, sizeof(ASTNode));
+        node->type = AST_FOR_STATEMENT;
+        // DEBUG_PRINT("Add AST_FOR_STATEMENT Node of %d", node->type);
+        node->left = node->right = NULL;
+        node->nextblock = NULL;
+        strcpy(node->data.for_stmt.loop_var, loop_var);
+        node->data.for_stmt.expression = expr;
+        node->data.for_stmt.body = body;
+        node->data.for_stmt.parallel = parallel;
+        return node;
+    }
+
+    return NULL; // Not a for statement
+}
+
+ASTNode* parse_while_statement(Token tokens[], int *pos, int token_count) {
+    if (*pos < token_count && tokens[*pos].type == TOKEN_KEYWORD && strcmp(tokens[*pos].value, "while") == 0) {
+        (*pos)++;
+
+        // Parse the condition expression
+        ASTNode *condition = parse_expression(tokens, pos, token_count);
+        if (condition == NULL) {
+            printf("Error: Expected condition after 'while'\n");
+            return NULL;
+        }
+
+        // Parse the block of statements until 'end'
+        ASTNode *body = parse_block(tokens, pos, token_count);
+        if (body == NULL) {
+            printf("Error: Expected block after 'while' condition\n");
+            free_ast(condition);
+            return NULL;
+        }
+
+        // Expect 'end'
+        if (*pos >= token_count || tokens[*pos].type != TOKEN_KEYWORD || strcmp(tokens[*pos].value, "end") != 0) {
+            printf("Error: Expected 'end' after 'while' block\n");
+            free_ast(condition);
+            free_ast(body);
+            return NULL;
+        }
+        (*pos)++;
+
+        // Create the while statement node
+        ASTNode *node = (ASTNode*)calloc(1, sizeof(ASTNode));
+        node->type = AST_WHILE_STATEMENT;
+        // DEBUG_PRINT("Add AST_WHILE_STATEMENT Node of %d", node->type);
+        node->left = node->right = NULL;
+        node->nextblock = NULL;
+        node->data.while_stmt.condition = condition;
+        node->data.while_stmt.body = body;
+        return node;
+    }
+
+    return NULL; // Not a while statement
+}
+
+// Index of the 'end' of the function body starting at pos, or -1 if the body
+// has to be parsed now: it is empty or incomplete, or defines functions, which
+// are registered as soon as they are parsed
+static int find_function_end(Token tokens[], int pos, int token_count) {
+    int depth = 1;
+    for (int i = pos; i < token_count; i++) {
+        if (tokens[i].type != TOKEN_KEYWORD) {
+            continue;
+        }
+        if (strcmp(tokens[i].value, "def") == 0) {
+            return -1;
+        } else if (strcmp(tokens[i].value, "if") == 0 || strcmp(tokens[i].value, "for") == 0 ||
+                   strcmp(tokens[i].value, "pfor") == 0 || strcmp(tokens[i].value, "while") == 0) {
+            depth++;
+        } else if (strcmp(tokens[i].value, "end") == 0 && --depth == 0) {
+            return i > pos ? i : -1;
+        }
+    }
+    return -1;
+}
+
+ASTNode* parse_function_definition(Token tokens[], int *pos, int token_count) {
+    KvContext *ctx = kv_context;
+    // 'memo def' caches the results of the function by argument values
+    int memoize = 0;
+    if (*pos < token_count && tokens[*pos].type == TOKEN_KEYWORD && strcmp(tokens[*pos].value, "memo") == 0) {
+        if (*pos + 1 >= token_count || tokens[*pos + 1].type != TOKEN_KEYWORD || strcmp(tokens[*pos + 1].value, "def") != 0) {
+            printf("Error: Expected 'def' after 'memo'\n");
+            return NULL;
+        }
+        memoize = 1;
+        (*pos)++;
+    }
+
+    if (*pos < token_count && tokens[*pos].type == TOKEN_KEYWORD && strcmp(tokens[*pos].value, "def") == 0) {
+        (*pos)++;
+        // Expect function name
+        if (*pos >= token_count || tokens[*pos].type != TOKEN_IDENTIFIER) {
+            printf("Error: Expected function name after 'def'\n");
+            return NULL;
+        }
+
+        char func_name[MAX_TOKEN_LENGTH];
+        strcpy(func_name, tokens[*pos].value);
+        (*pos)++;
+
+        // Parse parameter list
+        // Expect '('
+        if (*pos >= token_count || tokens[*pos].type != TOKEN_DELIMITER || tokens[*pos].value[0] != '(') {
+            printf("Error: Expected '(' after function name\n");
+            return NULL;
+        }
+        (*pos)++;
+
+        // Parse parameters (identifiers separated by commas)
+        ASTNode *param_list = NULL;
+        ASTNode **current = &param_list;
+        while (*pos < token_count && !(tokens[*pos].type == TOKEN_DELIMITER && tokens[*pos].value[0] == ')')) {
+            if (tokens[*pos].type == TOKEN_IDENTIFIER) {
+                ASTNode *param = (ASTNode*)calloc(1, sizeof(ASTNode));
+                param->type = AST_IDENTIFIER;
+                // DEBUG_PRINT("Add AST_IDENTIFIER Node of %d", param->type);
+                strcpy(param->data.identifier, tokens[*pos].value);
+                param->left = param->right = NULL;
+                param->nextblock = NULL;
+                (*pos)++;
+                *current = param;
+                current = &param->right;
+
+                // Check for comma
+                if (*pos < token_count && tokens[*pos].type == TOKEN_DELIMITER && tokens[*pos].value[0] == ',') {
+                    (*pos)++;
+                    continue;
+                }
+            } else {
+                printf("Error: Expected parameter name or ')' in function definition\n");
+                free_ast(param_list);
+                return NULL;
+            }
+        }
+
+        // Expect ')'
+        if (*pos >= token_count || tokens[*pos].type != TOKEN_DELIMITER || tokens[*pos].value[0] != ')') {
+            printf("Error: Expected ')' after parameters\n");
+            free_ast(param_list);
+            return NULL;
+        }
+        (*pos)++;
+
+        ASTNode *body = NULL;
+        Token *body_tokens = NULL;
+        int body_token_count = 0;
+        int body_end = ctx->lazy_function_bodies ? find_function_end(tokens, *pos, token_count) : -1;
+        if (body_end >= 0) {
+            // Keep the tokens of the body and its 'end', load_function_body() parses them
+            body_token_count = body_end - *pos + 1;
+            body_tokens = (Token*)malloc(body_token_count * sizeof(Token));
+            if (body_tokens == NULL) {
+                printf("Error: Memory allocation failed\n");
+                free_ast(param_list);
+                return NULL;
+            }
+            memcpy(body_tokens, &tokens[*pos], body_token_count * sizeof(Token));
+            *pos = body_end + 1;
+        } else {
+            // Parse the body block until 'end'
+            body = parse_block(tokens, pos, token_count);
+            if (body == NULL) {
+                printf("Error: Expected block after function definition\n");
+                free_ast(param_list);
+                return NULL;
+            }
+
+            // Expect 'end'
+            if (*pos >= token_count || tokens[*pos].type != TOKEN_KEYWORD || strcmp(tokens[*pos].value, "end") != 0) {
+                printf("Error: Expected 'end' after function body\n");
+                free_ast(param_list);
+                free_ast(body);
+                return NULL;
+            }
+            (*pos)++;
+        }
+
+        // Create function definition node
+        ASTNode *node = (ASTNode*)calloc(1, sizeof(ASTNode));
+        node->type = AST_FUNCTION_DEFINITION;
+        // DEBUG_PRINT("Add AST_FUNCTION_DEFINITION Node of %d", node->type);
+        node->left = node->right = NULL;
+        node->nextblock = NULL;
+        strcpy(node->data.func_def.name, func_name);
+        node->data.func_def.parameters = param_list;
+        node->data.func_def.body = body;
+        node->data.func_def.memoize = memoize;
+        node->data.func_def.body_tokens = body_tokens;
+        node->data.func_def.body_token_count = body_token_count;
+
+        register_function(node);
+        return node;
+    }
+
+    return NULL;
+}
+
+ASTNode* parse_return_statement(Token tokens[], int *pos, int token_count) {
+    if (*pos < token_count && tokens[*pos].type == TOKEN_KEYWORD && strcmp(tokens[*pos].value, "return") == 0) {
+        (*pos)++;
+        // Parse expression after return
+        ASTNode *expr = parse_expression(tokens, pos, token_count);
+        if (expr == NULL) {
+            // No expression means return 0
+            // We'll handle this by setting expr to a literal 0 node
+            ASTNode *zero_node = (ASTNode*)calloc(1, sizeof(ASTNode));
+            zero_node->type = AST_LITERAL;
+            // DEBUG_PRINT("Add AST_LITERAL Node of %d", zero_node->type);
+            zero_node->left = zero_node->right = NULL;
+            zero_node->nextblock = NULL;
+            strcpy(zero_node->data.string_value, "0");
+            expr = zero_node;
+        }
+        ASTNode *node = (ASTNode*)calloc(1, sizeof(ASTNode));
+        node->type = AST_RETURN_STATEMENT;
+        // DEBUG_PRINT("Add AST_RETURN_STATEMENT Node of %d", node->type);
+        node->left = node->right = NULL;
+        node->nextblock = NULL;
+        node->data.ret_stmt.expression = expr;
+        return node;
+    }
+    return NULL;
+}
+
+ASTNode* parse_function_call(Token tokens[], int *pos, int token_count) {
+    if (tokens[*pos].type == TOKEN_IDENTIFIER) {
+        if ((*pos + 1) < token_count &&
+        tokens[*pos + 1].type == TOKEN_DELIMITER &&
+        tokens[*pos + 1].value[0] == '(') {
+            // Function call
+            char ident[MAX_TOKEN_LENGTH];
+            strcpy(ident, tokens[*pos].value);
+            (*pos)++;
+
+            // Parse arguments
+            (*pos)++;
+            ASTNode *arg_list = NULL;
+            ASTNode **current = &arg_list;
+            while (*pos < token_count && !(tokens[*pos].type == TOKEN_DELIMITER && tokens[*pos].value[0] == ')')) {
+                ASTNode *arg = parse_expression(tokens, pos, token_count);
+                if (arg == NULL) {
+                    printf("Error: Expected expression in function call arguments\n");
+                    free_ast(arg_list);
+                    return NULL;
+                }
+                // Arguments are chained through nextblock, as right belongs to the expression
+                *current = arg;
+                arg->nextblock = NULL;
+                current = &arg->nextblock;
+
+                // Check for comma
+                if (*pos < token_count && tokens[*pos].type == TOKEN_DELIMITER && tokens[*pos].value[0] == ',') {
+                    (*pos)++;
+                }
+            }
+
+            // Expect ')'
+            if (*pos >= token_count || !(tokens[*pos].type == TOKEN_DELIMITER && tokens[*pos].value[0] == ')')) {
+                printf("Error: Expected ')' after function call arguments\n");
+                //free_ast(arg_list);
+                return NULL;
+            }
+            (*pos)++;
+
+            // Create function call node
+            ASTNode *call_node = (ASTNode*)calloc(1, sizeof(ASTNode));
+            call_node->type = AST_FUNCTION_CALL;
+            // DEBUG_PRINT("Add AST_FUNCTION_CALL Node of %d", call_node->type);
+            call_node->left = call_node->right = NULL;
+            call_node->nextblock = NULL;
+            strcpy(call_node->data.func_call.name, ident);
+            call_node->data.func_call.arguments = arg_list;
+            //call_node->data.func_call.arguments = NULL;
+            bind_function_call(call_node);
+            return call_node;
+        }
+    }
+
+    return NULL; // Not a function call
+}
+
+static ASTNode* parse_statement_node(Token tokens[], int *pos, int token_count) {
+    ASTNode *node = NULL;
+
+    if (*pos >= token_count) return NULL;
+    // DEBUG_PRINT(">>> %s", tokens[*pos].value);
+    // Check if it's a for statement
+    node = parse_for_statement(tokens, pos, token_count);
+    if (node != NULL) {
+        return node;
+    }
+
+    // Try to parse an 'if' statement
+    node = parse_if_statement(tokens, pos, token_count);
+    if (node != NULL) {
+        return node;
+    }
+
+    // Try while statement
+    node = parse_while_statement(tokens, pos, token_count);
+    if (node != NULL) return node;
+
+    // Try to parse a function definition
+    node = parse_function_definition(tokens, pos, token_count);
+    if (node != NULL) {
+        return node;
+    }
+
+    // Try to parse a return in a function
+    node = parse_return_statement(tokens, pos, token_count);
+    if (node != NULL) {
+        return node;
+    }
+
+    // Try to parse a function call
+    // Note this must be tried before parse_assignment_statement() as both
+    // start with an TOKEN_IDENTIFIER
+    node = parse_function_call(tokens, pos, token_count);
+    if (node != NULL) {
+        return node;
+    }
+
+    // Try to parse a 'print' statement
+    node = parse_print_statement(tokens, pos, token_count);
+    if (node != NULL) {
+        return node;
+    }
+
+    // Try to parse an assignment statement
+    node = parse_assignment_statement(tokens, pos, token_count);
+    if (node != NULL) {
+        return node;
+    }
+
+    // Unrecognized statement, or the end of the input inside one
+    if (*pos >= token_count) {
+        printf("Error: Unexpected end of input in statement\n");
+        return NULL;
+    }
+    printf("Error: Unrecognized statement starting with '%s'\n", tokens[*pos].value);
+    return NULL;
+}
+
+// Statements remember where they start in the source, for --profile. A
+// statement with an arity error is parsed to its end and then dropped, so
+// that the error is the only one reported for it
+ASTNode* parse_statement(Token tokens[], int *pos, int token_count) {
+    KvContext *ctx = kv_context;
+    if (*pos >= token_count) return NULL;
+
+    if (ctx->parse_depth == 0) {
+        ctx->bind_errors = 0;
+    }
+    Token *first = &tokens[*pos];
+    ctx->parse_depth++;
+    ASTNode *node = parse_statement_node(tokens, pos, token_count);
+    ctx->parse_depth--;
+    if (node != NULL && ctx->parse_depth == 0 && ctx->bind_errors > 0) {
+        free_ast(node);
+        return NULL;
+    }
+    if (node != NULL) {
+        node->line = first->line;
+        node->column = first->column;
+    }
+    return node;
+}
+
+ASTNode* parse_block(Token tokens[], int *pos, int token_count) {
+    ASTNode *statements = NULL; // This will be a linked list of statements
+    ASTNode **current = &statements;
+
+    while (*pos < token_count) {
+        if (tokens[*pos].type == TOKEN_KEYWORD &&
+            (strcmp(tokens[*pos].value, "else") == 0 || strcmp(tokens[*pos].value, "end") == 0)) {
+            // End of the block
+            break;
+        }
+
+        ASTNode *stmt = parse_statement(tokens, pos, token_count);
+        if (stmt == NULL) {
+            printf("Error: Failed to parse statement in block\n");
+            free_ast(statements);
+            return NULL;
+        }
+
+        *current = stmt;
+        //current = &(stmt->right); // Use the 'right' pointer to link statements
+        current = &(stmt->nextblock); // Use the 'nextblock' pointer to link statements
+    }
+
+    return statements;
+}
+
+// Returns 0 if the condition of an if statement cannot be evaluated, the
+// statement is then skipped
+int evaluate_if_condition(ASTNode *node, int *condition_true) {
+    EvalResult condition_result;
+    if (!evaluate_expression(node->data.if_stmt.condition, &condition_result, EVAL_ARITHMETIC)) {
+        printf("Error: Failed to evaluate condition in if statement\n");
+        return 0;
+    }
+
+    // Interpret any non-zero number as true
+    if (condition_result.type == RESULT_NUMBER) {
+        *condition_true = (condition_result.number_value != 0);
+    } else if (condition_result.type == RESULT_STRING) {
+        // Empty string is false, non-empty string is true
+        *condition_true = (strlen(condition_result.string_value) > 0);
+    } else {
+        printf("Error: Invalid condition type in if statement\n");
+        return 0;
+    }
+    return 1;
+}
+
+FunctionReturn execute_if_statement_with_return(ASTNode *node) {
+    FunctionReturn result = {0};
+    if (node == NULL || node->type != AST_IF_STATEMENT) return result;
+
+    int condition_true;
+    if (!evaluate_if_condition(node, &condition_true)) {
+        return result;
+    }
+
+    if (condition_true) {
+        // Execute the then branch
+        return execute_block_with_return(node->data.if_stmt.then_branch);
+    } else if (node->data.if_stmt.else_branch != NULL) {
+        // Execute the else branch
+        return execute_block_with_return(node->data.if_stmt.else_branch);
+    }
+    return result;
+}
+
+// A for loop over range(...), which counts instead of building an array
+int is_range_loop(ASTNode *node) {
+    ASTNode *expr = node->data.for_stmt.expression;
+    return expr->type == AST_FUNCTION_CALL && expr->data.func_call.builtin >= 0 &&
+           kvstdlib_entry(expr->data.func_call.builtin)->func == kvstdlib_range;
+}
+
+// The values of a range(...) loop are start + i * step for i below count.
+// Returns 0 if the arguments are not numbers
+int evaluate_range(ASTNode *call_node, double *start_value, double *step_value, long *count) {
+    // bind_function_call() checked that there are 1 to 3 arguments
+    double args[3] = {0};
+    int argc = 0;
+    for (ASTNode *arg = call_node->data.func_call.arguments; arg != NULL; arg = arg->nextblock) {
+        EvalResult arg_result;
+        if (!evaluate_expression(arg, &arg_result, EVAL_ARITHMETIC)) {
+            printf("Error: Failed to evaluate argument in range()\n");
+            return 0;
+        }
+        if (arg_result.type != RESULT_NUMBER) {
+            printf("Error: range() arguments must be numbers\n");
+            return 0;
+        }
+        args[argc++] = arg_result.number_value;
+    }
+
+    double start = 0, stop, step = 1;
+    if (argc == 1) {
+        stop = args[0];
+    } else {
+        start = args[0];
+        stop = args[1];
+        if (argc == 3) {
+            step = args[2];
+        }
+    }
+    if (step == 0) {
+        printf("Error: range() step must not be zero\n");
+        return 0;
+    }
+
+    // Computing each value from the count avoids accumulating rounding errors
+    double steps = ceil((stop - start) / step);
+    *count = steps > 0 ? (long) steps : 0;
+    *start_value = start;
+    *step_value = step;
+    return 1;
+}
+
+// for i in range(...) counts with a native number instead of building an array
+FunctionReturn execute_for_range_with_return(ASTNode *node) {
+    FunctionReturn body_ret = {0};
+    double start, step;
+    long count;
+    if (!evaluate_range(node->data.for_stmt.expression, &start, &step, &count)) {
+        return body_ret;
+    }
+    return run_range_loop(node, start, step, count);
+}
+
+// Runs a range(...) loop whose values have been evaluated
+FunctionReturn run_range_loop(ASTNode *node, double start, double step, long count) {
+    FunctionReturn body_ret = {0};
+    clear_variable_assoc_array(node->data.for_stmt.loop_var);
+    Variable *var = find_variable(node->data.for_stmt.loop_var);
+    if (var == NULL) {
+        set_variable_value(node->data.for_stmt.loop_var, NULL, "0");
+        var = find_variable(node->data.for_stmt.loop_var);
+        if (var == NULL) {
+            return body_ret;
+        }
+    }
+
+    for (long i = 0; i < count; i++) {
+        set_variable_number(var, start + i * step);
+
+        body_ret = execute_block_with_return(node->data.for_stmt.body);
+        if (body_ret.has_return) {
+            break;
+        }
+    }
+
+    // Like other for loops, the loop variable is left empty
+    clear_variable_assoc_array(node->data.for_stmt.loop_var);
+    return body_ret;
+}
+
+// Operators and built-in calls keep an array they compute in their NodeState,
+// until they are evaluated again
+static int keeps_result(ASTNode *node) {
+    return node->type == AST_BINARY_OP ||
+           (node->type == AST_FUNCTION_CALL && node->data.func_call.builtin >= 0 &&
+            kvstdlib_entry(node->data.func_call.builtin)->func != NULL);
+}
+
+// Evaluates the expression of a for loop to the array it iterates. A single
+// value is wrapped in temp_array. Returns 0 if it cannot be evaluated
+int evaluate_for_array(ASTNode *node, AssocArray *temp_array, AssocArray **array) {
+    // Evaluate the expression to get the array
+    EvalResult result;
+    if (!evaluate_expression(node->data.for_stmt.expression, &result, EVAL_PRINT)) {
+        printf("Error: Failed to evaluate expression in for statement\n");
+        return 0;
+    }
+    // DEBUG_PRINT("result.type %d", result.type);
+    if (result.type == RESULT_ASSOC_ARRAY && keeps_result(node->data.for_stmt.expression)) {
+        // Computed by arithmetic on arrays or a built-in, which the body may
+        // evaluate again: the loop takes the array over
+        *temp_array = *result.array_value;
+        memset(result.array_value, 0, sizeof(AssocArray));
+        *array = temp_array;
+    } else if (result.type == RESULT_ASSOC_ARRAY) {
+        // Use the existing associative array
+        // We'll just reference result.array_value directly
+        *array = result.array_value;
+    } else if (result.type == RESULT_STRING) {
+        // Wrap the single string in an associative array
+        set_assoc_array_value(temp_array, "", result.string_value);
+        *array = temp_array;
+    } else if (result.type == RESULT_NUMBER) {
+        // Convert the number to a string and wrap it
+        char num_str[MAX_TOKEN_LENGTH];
+        format_number(result.number_value, num_str);
+        set_assoc_array_value(temp_array, "", num_str);
+        *array = temp_array;
+    } else {
+        printf("Error: For loop expression must be a variable or array\n");
+        return 0;
+    }
+    return 1;
+}
+
+FunctionReturn execute_for_statement_with_return(ASTNode *node) {
+    FunctionReturn body_ret = {0};
+    if (node == NULL || node->type != AST_FOR_STATEMENT) return body_ret;
+
+    if (node->data.for_stmt.parallel && parallel_loop_possible()) {
+        return execute_pfor_statement_with_return(node);
+    }
+    if (is_range_loop(node)) {
+        return execute_for_range_with_return(node);
+    }
+    // DEBUG_PRINT("execute_for_statement");
+    // Only allocated if a single value has to be wrapped
+    AssocArray temp_array = {0};
+    AssocArray *array;
+    if (!evaluate_for_array(node, &temp_array, &array)) {
+        return body_ret;
+    }
+    return run_array_loop(node, array, &temp_array);
+}
+
+// Runs a loop over the array evaluate_for_array() returned, and frees temp_array
+FunctionReturn run_array_loop(ASTNode *node, AssocArray *array, AssocArray *temp_array) {
+    FunctionReturn body_ret = {0};
+    Variable *var = find_variable(node->data.for_stmt.loop_var);
+    if (var == NULL) {
+        var = create_variable(node->data.for_stmt.loop_var);
+        if (var == NULL) {
+            free_assoc_array(temp_array);
+            return body_ret;
+        }
+    }
+
+    if (array->buffer != NULL) {
+        // The loop holds the buffer, so that the body may write to it,
+        // which copies it, or assign the variable it came from
+        TypedBuffer *buffer = buffer_retain(array->buffer);
+        for (long i = 0; i < buffer->length; i++) {
+            set_variable_element(var, buffer, i);
+            body_ret = execute_block_with_return(node->data.for_stmt.body);
+            if (body_ret.has_return) {
+                break;
+            }
+        }
+        buffer_release(buffer);
+        free_variable_array(var);
+        free_assoc_array(temp_array);
+        return body_ret;
+    }
+
+    if (array == &var->array) {
+        // Iterating the loop variable itself, which is about to become a view
+        duplicate_assoc_array(temp_array, &var->array);
+        array = temp_array;
+    }
+
+    // Iterate over each key-value pair in the array. The loop variable views
+    // the current pair, so nothing is copied or allocated per iteration.
+    for (int i = 0; i < array->size; i++) {
+        attach_variable_view(var, array, i);
+
+        // Execute the body
+        // DEBUG_PRINT("About to execute_block");
+        body_ret = execute_block_with_return(node->data.for_stmt.body);
+
+        if (body_ret.has_return) {
+            break;
+        }
+    }
+
+    // The loop variable is left empty
+    free_variable_array(var);
+
+    // If we used a temporary array, free it
+    if (array == temp_array) {
+        free_assoc_array(temp_array);
+    }
+    return body_ret;
+}
+
+// Returns 0 if the condition of a while statement cannot be evaluated, the
+// loop then ends
+int evaluate_while_condition(ASTNode *node, int *condition_true) {
+    EvalResult condition_result;
+    // Evaluate condition in arithmetic context (to handle numbers easily)
+    if (!evaluate_expression(node->data.while_stmt.condition, &condition_result, EVAL_ARITHMETIC)) {
+        printf("Error: Failed to evaluate condition in while statement\n");
+        return 0;
+    }
+
+    if (condition_result.type == RESULT_NUMBER) {
+        *condition_true = (condition_result.number_value != 0);
+    } else if (condition_result.type == RESULT_STRING) {
+        // Empty string = false, non-empty = true
+        *condition_true = (strlen(condition_result.string_value) > 0);
+    } else if (condition_result.type == RESULT_ASSOC_ARRAY) {
+        // Arrays are true if they have at least one element
+        AssocArray *array = condition_result.array_value;
+        *condition_true = array->buffer != NULL ? array->buffer->length > 0 : array->size > 0;
+    } else {
+        *condition_true = 0; // Treat as false
+    }
+    return 1;
+}
+
+FunctionReturn execute_while_statement_with_return(ASTNode *node) {
+    FunctionReturn body_ret = {0};
+    if (node == NULL || node->type != AST_WHILE_STATEMENT) return body_ret;
+
+    // A loop that was hot before runs as machine code right away
+    NodeState *state = node_state(node);
+    if (state->jit != NULL && jit_run_loop(state->jit)) {
+        return body_ret;
+    }
+
+    while (1) {
+        // Once hot, the rest of the loop runs as machine code, starting
+        // with the condition of this iteration
+        if (jit_enabled && !state->jit_failed && ++state->exec_count >= JIT_HOT_LOOP) {
+            state->exec_count = 0;
+            if (state->jit == NULL) {
+                state->jit = jit_compile_loop(node);
+                state->jit_failed = (state->jit == NULL);
+            }
+            if (state->jit != NULL && jit_run_loop(state->jit)) {
+                return body_ret;
+            }
+        }
+
+        int condition_true;
+        if (!evaluate_while_condition(node, &condition_true)) {
+            return body_ret;
+        }
+
+        if (!condition_true) {
+            break; // Exit loop if condition is false
+        }
+
+        // Execute the body block
+        body_ret = execute_block_with_return(node->data.while_stmt.body);
+        if (body_ret.has_return) {
+            break;
+        }
+    }
+    return body_ret;
+}
+
+void execute_block(ASTNode *node) {
+    while (node != NULL) {
+        // DEBUG_PRINT("execute_block type %d", node->type);
+        // DEBUG_PRINT("execute_block left %p", node->left);
+        // DEBUG_PRINT("execute_block right %p", node->right);
+        execute_ast(node);
+        //node = node->right; // Move to the next statement in the block
+        node = node->nextblock; // Move to the next statement in the block
+    }
+}
+
+void execute_ast(ASTNode *node)
+{
+    if (node == NULL)
+        return;
+
+    ProfileMark mark;
+    if (profile_enabled) {
+        profile_begin_statement(&mark, node);
+    }
+
+    // printf("execute_ast %d\n", node->type);
+
+    switch (node->type) {
+        case AST_PRINT:
+            // Evaluate the expression and print the result
+            evaluate_and_print(node->left);
+            break;
+        case AST_ASSIGNMENT:
+            execute_assignment(node);
+            break;
+        case AST_BLOCK:
+            execute_block(node);
+            break;
+        case AST_IF_STATEMENT:
+        case AST_FOR_STATEMENT:
+        case AST_WHILE_STATEMENT: {
+            // These may contain a return, which is only meaningful inside a function
+            FunctionReturn stmt_res = execute_ast_with_return(node);
+            if (stmt_res.has_return) {
+                printf("Error: 'return' outside of a function\n");
+            }
+            break;
+        }
+        case AST_FUNCTION_DEFINITION:
+            // Already handled at parse time; no run-time needed unless we allow redef.
+            break;
+        case AST_FUNCTION_CALL: {
+            FunctionReturn call_res = execute_function_call(node);
+            // If called as a statement, ignore return value
+            break;
+        }
+        default:
+            printf("Error: While executing the AST - Unknown AST node type (%d)\n", node->type);
+            break;
+    }
+
+    if (profile_enabled) {
+        profile_end_statement(&mark);
+    }
+}
+
+FunctionReturn execute_ast_with_return(ASTNode *node) {
+    FunctionReturn result = {0};
+    if (node == NULL) return result;
+
+    switch (node->type) {
+        // handle statements
+        case AST_PRINT:
+            evaluate_and_print(node->left);
+            break;
+        case AST_ASSIGNMENT:
+            execute_assignment(node);
+            break;
+        case AST_IF_STATEMENT:
+            return execute_if_statement_with_return(node);
+        case AST_FOR_STATEMENT:
+        case AST_WHILE_STATEMENT: {
+            unsigned long outer_activation = enter_loop(node);
+            if (node->type == AST_FOR_STATEMENT) {
+                result = execute_for_statement_with_return(node);
+            } else {
+                result = execute_while_statement_with_return(node);
+            }
+            leave_loop(node, outer_activation);
+            return result;
+        }
+        case AST_BLOCK:
+            return execute_block_with_return(node);
+        case AST_FUNCTION_DEFINITION:
+            // Already handled at parse time; no run-time needed unless we allow redef.
+            break;
+        case AST_FUNCTION_CALL: {
+            FunctionReturn call_res = execute_function_call(node);
+            // If called as a statement, ignore return value
+            break;
+        }
+        case AST_RETURN_STATEMENT: {
+            // A call in return position is a tail call, the caller's frame is reused for it
+            if (kv_context->scope_depth > 0 && prepare_tail_call(node->data.ret_stmt.expression)) {
+                result.has_return = 1;
+                result.is_tail_call = 1;
+                return result;
+            }
+
+            // Evaluate the return expression
+            EvalResult val;
+            if (!evaluate_expression(node->data.ret_stmt.expression, &val, EVAL_ARITHMETIC)) {
+                printf("Error: Failed to evaluate return expression\n");
+                // return 0 by default
+                result.has_return = 1;
+                //result.return_is_number = 1;
+                result.type = RESULT_NUMBER;
+                result.number_value = 0;
+                //strcpy(result.return_value, "0");
+                return result;
+            }
+            result.has_return = 1;
+            if (val.type == RESULT_NUMBER) {
+                //result.return_is_number = 1;
+                result.type = RESULT_NUMBER;
+                //snprintf(result.return_value, MAX_TOKEN_LENGTH, "%g", val.number_value);
+                result.number_value = val.number_value;
+            } else if (val.type == RESULT_STRING) {
+                //result.return_is_number = 0;
+                result.type = RESULT_STRING;
+                strcpy(result.string_value, val.string_value);
+            } else if (val.type == RESULT_ASSOC_ARRAY) {
+                //result.return_is_number = 0;
+                result.type = RESULT_ASSOC_ARRAY;
+                result.array_value = (AssocArray *) malloc(sizeof(AssocArray)); // Where does this get freed?
+                duplicate_assoc_array(result.array_value, val.array_value);
+            } else {
+                // If other, decide how to return them
+                // For simplicity, return "0"
+                // result.return_is_number = 1;
+                // strcpy(result.return_value, "0");
+                result.type = RESULT_NUMBER;
+                result.number_value = 0;
+            }
+            return result;
+        }
+        default:
+            printf("Error: While executing the AST (with return) - Unknown AST node type\n");
+            DEBUG_PRINT("node->type %d", node->type);
+            break;
+    }
+    return result;
+}
+
+static int evaluate_node(ASTNode *node, EvalResult *result, EvalContext context);
+static int evaluate_spawn(ASTNode *call_node, EvalResult *result);
+
+// A failed call reports the error and returns 0, and so does its inlined body
+static int evaluate_inlined(ASTNode *node, EvalResult *result, EvalContext context) {
+    if (!evaluate_node(node, result, context)) {
+        printf("Error: Failed to evaluate return expression\n");
+        result->type = RESULT_NUMBER;
+        result->number_value = 0;
+    }
+    return 1;
+}
+
+/*
+ * Fast path for expressions kvopt.c inferred to be numeric: literals,
+ * variables and operators only, on doubles, with no EvalResult, context or
+ * string handling. Returns 0 without side effects when a variable does not
+ * hold a native number, the caller then uses evaluate_node() instead.
+ */
+int evaluate_number(ASTNode *node, double *value) {
+    switch (node->type) {
+        case AST_LITERAL:
+            *value = node->number;
+            return 1;
+        case AST_IDENTIFIER: {
+            Variable *var = lookup_identifier(node);
+            if (var == NULL || !var->is_number) {
+                return 0;
+            }
+            *value = var->number_value;
+            return 1;
+        }
+        case AST_BINARY_OP: {
+            double left, right;
+            if (!evaluate_number(node->left, &left) || !evaluate_number(node->right, &right)) {
+                return 0;
+            }
+            switch (node->data.operator) {
+                case OP_ADD:           *value = left + right; return 1;
+                case OP_SUBTRACT:      *value = left - right; return 1;
+                case OP_MULTIPLY:      *value = left * right; return 1;
+                case OP_DIVIDE:        *value = left / right; return 1;
+                case OP_LESS_THAN:     *value = left < right; return 1;
+                case OP_GREATER_THAN:  *value = left > right; return 1;
+                case OP_EQUAL:         *value = left == right; return 1;
+                case OP_NOT_EQUAL:     *value = left != right; return 1;
+                case OP_LESS_EQUAL:    *value = left <= right; return 1;
+                case OP_GREATER_EQUAL: *value = left >= right; return 1;
+                default:               return 0;
+            }
+        }
+        default:
+            return 0;
+    }
+}
+
+static int evaluate_uncached(ASTNode *node, EvalResult *result, EvalContext context) {
+    // Printing reads variables as strings, and comparisons see them that way,
+    // only arithmetic is the same in both contexts
+    if (__atomic_load_n(&node->numeric, __ATOMIC_RELAXED) &&
+        (context == EVAL_ARITHMETIC || (node->type == AST_BINARY_OP && node->data.operator <= OP_DIVIDE))) {
+        if (evaluate_number(node, &result->number_value)) {
+            result->type = RESULT_NUMBER;
+            return 1;
+        }
+        // The inferred type was wrong at run time, stop speculating on this node.
+        // Contexts running the same program on other threads may do the same
+        __atomic_store_n(&node->numeric, 0, __ATOMIC_RELAXED);
+    }
+    if (node->inlined) {
+        return evaluate_inlined(node, result, context);
+    }
+    return evaluate_node(node, result, context);
+}
+
+// The index key names in the buffer of var, 0 after printing an error
+static int element_index(Variable *var, const EvalResult *key, long *index) {
+    TypedBuffer *buffer = var->array.buffer;
+    if (key->type == RESULT_NUMBER) {
+        if (buffer_index(buffer, key->number_value, index)) {
+            return 1;
+        }
+        printf("Error: Index %g is outside buffer '%s' of %ld numbers\n", key->number_value, var->name, buffer->length);
+    } else if (key->type == RESULT_STRING) {
+        if (buffer_key_index(buffer, key->string_value, index)) {
+            return 1;
+        }
+        printf("Error: Index '%s' is outside buffer '%s' of %ld numbers\n", key->string_value, var->name, buffer->length);
+    } else {
+        printf("Error: Array index must be a string or number\n");
+    }
+    return 0;
+}
+
+// Gives an operator back the array it computed, unless it computed another since
+static void restore_elements(AssocArray *owner, AssocArray *elements) {
+    if (owner->pairs == NULL && owner->buffer == NULL) {
+        *owner = *elements;
+    } else {
+        free_assoc_array(elements);
+    }
+}
+
+/*
+ * Arithmetic with an array operand, value by value, see kvvector.c. The
+ * result is kept in the operator's NodeState, and is valid until the
+ * operator is evaluated again, as the array of a variable is until it is
+ * written. Sets handled unless the operands are for the caller to report
+ */
+static int evaluate_elementwise(ASTNode *node, EvalResult *left, EvalResult *right, EvalResult *result, int *handled) {
+    OperatorType op = node->data.operator;
+    if (op != OP_ADD && op != OP_SUBTRACT && op != OP_MULTIPLY && op != OP_DIVIDE) {
+        return 1;
+    }
+    AssocArray *elements = &node_state(node)->elements;
+    TypedBuffer *x = left->type == RESULT_ASSOC_ARRAY ? left->array_value->buffer : NULL;
+    TypedBuffer *y = right->type == RESULT_ASSOC_ARRAY ? right->array_value->buffer : NULL;
+    int ok;
+    if ((x != NULL || y != NULL) && left->type == RESULT_ASSOC_ARRAY && right->type == RESULT_ASSOC_ARRAY) {
+        if (x == NULL || y == NULL) {
+            printf("Error: Arithmetic between a buffer and an array, which has to be a buffer too\n");
+            ok = 0;
+        } else {
+            ok = elementwise_buffers(op, x, y, elements);
+        }
+    } else if (x != NULL && right->type == RESULT_NUMBER) {
+        ok = elementwise_buffer_number(op, x, right->number_value, 0, elements);
+    } else if (y != NULL && left->type == RESULT_NUMBER) {
+        ok = elementwise_buffer_number(op, y, left->number_value, 1, elements);
+    } else if (x != NULL || y != NULL) {
+        return 1;
+    } else if (left->type == RESULT_ASSOC_ARRAY && right->type == RESULT_ASSOC_ARRAY) {
+        ok = elementwise_arrays(op, left->array_value, right->array_value, elements);
+    } else if (left->type == RESULT_ASSOC_ARRAY && right->type == RESULT_NUMBER) {
+        ok = elementwise_number(op, left->array_value, right->number_value, 0, elements);
+    } else if (left->type == RESULT_NUMBER && right->type == RESULT_ASSOC_ARRAY) {
+        ok = elementwise_number(op, right->array_value, left->number_value, 1, elements);
+    } else {
+        return 1;
+    }
+    *handled = 1;
+    if (ok) {
+        result->type = RESULT_ASSOC_ARRAY;
+        result->array_value = elements;
+    }
+    return ok;
+}
+
+int evaluate_expression(ASTNode *node, EvalResult *result, EvalContext context) {
+    if (node == NULL) return 0;
+
+    HoistedValue *h = node->hoisted;
+    if (h == NULL) {
+        return evaluate_uncached(node, result, context);
+    }
+
+    // Loop-invariant, reuse the value from earlier in this run of the loop
+    NodeState *state = node_state(node);
+    unsigned long activation = node_state(h->loop)->activation;
+    if (activation != 0 && state->activation == activation && state->context == context) {
+        *result = state->value;
+        return 1;
+    }
+    unsigned long reads = shared_reads;
+    if (!evaluate_uncached(node, result, context)) {
+        return 0;
+    }
+    // Arrays are owned by their variable, only cache scalars. Other threads
+    // may change a shared array while the loop runs, so nothing read from
+    // one is cached either
+    if (result->type != RESULT_ASSOC_ARRAY && shared_reads == reads) {
+        state->activation = activation;
+        state->context = context;
+        state->value = *result;
+    }
+    return 1;
+}
+
+static int evaluate_node(ASTNode *node, EvalResult *result, EvalContext context) {
+DEBUG_PRINT("evaluate_expression node->type %d", node->type);
+    switch (node->type) {
+        case AST_LITERAL:
+            // Check if it's a number
+            if (isdigit(node->data.string_value[0]) || (node->data.string_value[0] == '-' && isdigit(node->data.string_value[1]))) {
+                result->type = RESULT_NUMBER;
+                result->number_value = atof(node->data.string_value);
+            } else {
+                result->type = RESULT_STRING;
+                strcpy(result->string_value, node->data.string_value);
+            }
+            return 1;
+        case AST_IDENTIFIER: {
+            Variable *var = lookup_identifier(node);
+            if (var != NULL && var->is_number) {
+                // Native numbers need no parsing, and are only formatted for printing
+                if (context == EVAL_ARITHMETIC) {
+                    result->type = RESULT_NUMBER;
+                    result->number_value = var->number_value;
+                } else {
+                    result->type = RESULT_STRING;
+                    snprintf(result->string_value, MAX_TOKEN_LENGTH, "%g", var->number_value);
+                }
+                return 1;
+            }
+            if (var != NULL) {
+                if (var->array.shared != NULL) {
+                    shared_snapshot(var->array.shared, &var->array);
+                }
+                if (context == EVAL_ARITHMETIC) {
+                    // if (var->array.size == 1 && strcmp(var->array.pairs[0].key, "") == 0) {
+                    //     // Always use the default key "" for arithmetic expressions
+                    if (var->array.size == 1) {
+                        // Always use the only key
+                        // char *value = get_assoc_array_value(&var->array, "");
+                        char *value = get_first_assoc_array_value(&var->array);
+                        if (value != NULL) {
+                            // Determine if value is a number
+                            if (isdigit(value[0]) || (value[0] == '-' && isdigit(value[1]))) {
+                                result->type = RESULT_NUMBER;
+                                result->number_value = atof(value);
+                            } else {
+                                result->type = RESULT_STRING;
+                                strcpy(result->string_value, value);
+                            }
+                            return 1;
+                        } else {
+                            printf("Error: Variable '%s' has no default value and cannot be used in expressions\n", node->data.identifier);
+                            return 0;
+                        }
+                    } else {
+                        // Return the associative array
+                        result->type = RESULT_ASSOC_ARRAY;
+                        result->array_value = &var->array;
+                        return 1;
+                    }
+                } else if (context == EVAL_PRINT) {
+                    // For printing, return the entire associative array or the default value
+                    // if (var->array.size == 1 && strcmp(var->array.pairs[0].key, "") == 0) {
+                    //     // Only default key, treat as simple variable
+                    if (var->array.size == 1) {
+                        // Only item, treat as simple variable
+                        result->type = RESULT_STRING;
+                        strcpy(result->string_value, var->array.pairs[0].value);
+                    } else {
+                        // Multiple keys, return the associative array
+                        result->type = RESULT_ASSOC_ARRAY;
+                        result->array_value = &var->array;
+                    }
+                    return 1;
+                }
+            } else {
+                printf("Error: Undefined variable '%s'\n", node->data.identifier);
+                return 0;
+            }
+        }
+
+        case AST_ARRAY_ACCESS: {
+            EvalResult key_result;
+            if (!evaluate_expression(node->left, &key_result, EVAL_ARITHMETIC)) {
+                printf("Error: Failed to evaluate array index\n");
+                DEBUG_PRINT("Error: Failed to evaluate array index");
+                return 0;
+            }
+            if (key_result.type != RESULT_STRING && key_result.type != RESULT_NUMBER) {
+                printf("Error: Array index must be a string or number\n");
+                return 0;
+            }
+
+            Variable *var = get_variable(node->data.identifier);
+            if (var == NULL) {
+                printf("Error: Undefined variable '%s'\n", node->data.identifier);
+                return 0;
+            }
+            if (var->array.buffer != NULL) {
+                // A buffer is indexed directly, its numbers need no parsing
+                long index;
+                if (!element_index(var, &key_result, &index)) {
+                    return 0;
+                }
+                result->type = RESULT_NUMBER;
+                result->number_value = buffer_get(var->array.buffer, index);
+                return 1;
+            }
+
+            // Convert numeric index to string if necessary
+            char key[MAX_TOKEN_LENGTH];
+            if (key_result.type == RESULT_NUMBER) {
+                snprintf(key, MAX_TOKEN_LENGTH, "%g", key_result.number_value);
+            } else {
+                strcpy(key, key_result.string_value);
+            }
+
+            char *value = get_assoc_array_value(&var->array, key);
+            if (value != NULL) {
+                // Determine if value is a number
+                if (isdigit(value[0]) || (value[0] == '-' && isdigit(value[1]))) {
+                    result->type = RESULT_NUMBER;
+                    result->number_value = atof(value);
+                } else {
+                    result->type = RESULT_STRING;
+                    strcpy(result->string_value, value);
+                }
+                return 1;
+            } else {
+                printf("Error: Key '%s' not found in variable '%s'\n", key, node->data.identifier);
+                return 0;
+            }
+        }
+
+        case AST_BINARY_OP: {
+            EvalResult left_result, right_result;
+            // For relational operators, we need to determine the context
+            EvalContext op_context = (node->data.operator == OP_ADD || node->data.operator == OP_SUBTRACT ||
+                                    node->data.operator == OP_MULTIPLY || node->data.operator == OP_DIVIDE)
+                                    ? EVAL_ARITHMETIC : context;
+
+            if (!evaluate_expression(node->left, &left_result, op_context)) {
+                return 0;
+            }
+            // An array computed by the left operand is set aside, as the right
+            // one may compute it again in a recursive call
+            AssocArray left_elements;
+            AssocArray *left_owner = NULL;
+            if (left_result.type == RESULT_ASSOC_ARRAY && keeps_result(node->left)) {
+                left_owner = left_result.array_value;
+                left_elements = *left_owner;
+                memset(left_owner, 0, sizeof(AssocArray));
+                left_result.array_value = &left_elements;
+            }
+            int elementwise = 0;
+            int ok = evaluate_expression(node->right, &right_result, op_context);
+            if (ok && (left_result.type == RESULT_ASSOC_ARRAY || right_result.type == RESULT_ASSOC_ARRAY)) {
+                ok = evaluate_elementwise(node, &left_result, &right_result, result, &elementwise);
+            }
+            if (left_owner != NULL) {
+                restore_elements(left_owner, &left_elements);
+            }
+            if (!ok || elementwise) {
+                return ok;
+            }
+
+            // Handle arithmetic and relational operators
+            if (left_result.type == RESULT_NUMBER && right_result.type == RESULT_NUMBER) {
+                switch (node->data.operator) {
+                    case OP_ADD:
+                        result->type = RESULT_NUMBER;
+                        result->number_value = left_result.number_value + right_result.number_value;
+                        return 1;
+                    case OP_SUBTRACT:
+                        result->type = RESULT_NUMBER;
+                        result->number_value = left_result.number_value - right_result.number_value;
+                        return 1;
+                    case OP_MULTIPLY:
+                        result->type = RESULT_NUMBER;
+                        result->number_value = left_result.number_value * right_result.number_value;
+                        return 1;
+                    case OP_DIVIDE:
+                        result->type = RESULT_NUMBER;
+                        result->number_value = left_result.number_value / right_result.number_value;
+                        return 1;
+                    case OP_LESS_THAN:
+                        result->type = RESULT_NUMBER;
+                        result->number_value = (left_result.number_value < right_result.number_value) ? 1 : 0;
+                        return 1;
+                    case OP_GREATER_THAN:
+                        result->type = RESULT_NUMBER;
+                        result->number_value = (left_result.number_value > right_result.number_value) ? 1 : 0;
+                        return 1;
+                    case OP_EQUAL:
+                        result->type = RESULT_NUMBER;
+                        result->number_value = (left_result.number_value == right_result.number_value) ? 1 : 0;
+                        return 1;
+                    case OP_NOT_EQUAL:
+                        result->type = RESULT_NUMBER;
+                        result->number_value = (left_result.number_value != right_result.number_value) ? 1 : 0;
+                        return 1;
+                    case OP_LESS_EQUAL:
+                        result->type = RESULT_NUMBER;
+                        result->number_value = (left_result.number_value <= right_result.number_value) ? 1 : 0;
+                        return 1;
+                    case OP_GREATER_EQUAL:
+                        result->type = RESULT_NUMBER;
+                        result->number_value = (left_result.number_value >= right_result.number_value) ? 1 : 0;
+                        return 1;
+                    // Handle other operators...
+                    default:
+                        printf("Error: Unsupported operator\n");
+                        return 0;
+                }
+            } else {
+                printf("Error: Both operands must be numbers for arithmetic or relational operations\n");
+                return 0;
+            }
+        }
+        case AST_FUNCTION_CALL: {
+            FunctionReturn call_res = execute_function_call(node);
+            // BTW: the return value is IMPORTANT!
+            if(call_res.has_return == 0) {
+                result->type = RESULT_NUMBER;
+                result->number_value = 0;
+            } else {
+                if(call_res.type == RESULT_NUMBER) {
+                    result->type = RESULT_NUMBER;
+                    result->number_value = call_res.number_value;
+                } else if (call_res.type == RESULT_ASSOC_ARRAY) {
+                    result->type = RESULT_ASSOC_ARRAY;
+                    result->array_value = call_res.array_value;
+                    if (keeps_result(node)) {
+                        // A built-in's new array is kept, and freed, like an operator's
+                        AssocArray *elements = &node_state(node)->elements;
+                        free_assoc_array(elements);
+                        *elements = *call_res.array_value;
+                        free(call_res.array_value);
+                        result->array_value = elements;
+                    }
+                } else {
+                    result->type = RESULT_STRING;
+                    strcpy(result->string_value, call_res.string_value);
+                }
+            }
+            return 1;
+            break;
+        }
+
+        case AST_SPAWN:
+            return evaluate_spawn(node->left, result);
+
+        default:
+            printf("Error: While evaluating expression - Unknown AST node type\n");
+            DEBUG_PRINT("DEBUG: While evaluating expression - Unknown AST node type (%d)\n", node->type);
+            break;
+    }
+}
+
+void clear_variable_assoc_array(const char *name) {
+    Variable *var = find_variable(name);
+
+    if (var != NULL) {
+        free_variable_array(var);
+        init_assoc_array(&var->array);
+    }
+
+}
+
+void set_variable_assoc_array(const char *name, AssocArray *array_value) {
+    Variable *var = find_variable(name);
+    if (var != NULL && &var->array == array_value) {
+        // Assigning a variable to itself
+        return;
+    }
+
+    if (var == NULL) {
+        // Create new variable
+        var = create_variable(name);
+        if (var == NULL) {
+            return;
+        }
+    } else {
+        // Free existing array
+        free_variable_array(var);
+        init_assoc_array(&var->array);
+    }
+
+    // Copy the associative array
+    for (int i = 0; i < array_value->size; i++) {
+        set_assoc_array_value(&var->array, array_value->pairs[i].key, array_value->pairs[i].value);
+    }
+    var->array.shared = array_value->shared;
+    var->array.buffer = buffer_retain(array_value->buffer);
+}
+
+// Free the variables of the current frame so it can be reused or popped
+void release_frame_variables() {
+    KvContext *ctx = kv_context;
+    for (int i = 0; i < ctx->variable_count; i++) {
+        free_variable_array(&ctx->variables[i]);
+    }
+    ctx->variable_count = 0;
+}
+
+// push_scope switches to a new, empty frame of variables
+int push_scope() {
+    KvContext *ctx = kv_context;
+    if (ctx->scope_depth >= MAX_SCOPES) {
+        printf("Error: Scope stack overflow\n");
+        return 0;
+    }
+    ctx->scope_count_stack[ctx->scope_depth++] = ctx->variable_count;
+    ctx->variables = ctx->scope_variables_stack[ctx->scope_depth];
+    ctx->variable_count = 0;
+    return 1;
+}
+
+// pop_scope frees the current frame and returns to the one below it
+void pop_scope() {
+    KvContext *ctx = kv_context;
+    if (ctx->scope_depth <= 0) {
+        printf("Error: Scope stack underflow\n");
+        return;
+    }
+
+    release_frame_variables();
+    ctx->variables = ctx->scope_variables_stack[--ctx->scope_depth];
+    ctx->variable_count = ctx->scope_count_stack[ctx->scope_depth];
+}
+
+// A new interpreter, with no variables or functions
+KvContext* create_context() {
+    KvContext *context = (KvContext *) calloc(1, sizeof(KvContext));
+    if (context == NULL) {
+        printf("Error: Out of memory\n");
+        return NULL;
+    }
+    context->variables = context->scope_variables_stack[0];
+    context->id = __atomic_add_fetch(&context_count, 1, __ATOMIC_RELAXED);
+    return context;
+}
+
+// Frees a context that is not running, with its variables, functions and NodeStates
+void free_context(KvContext *context) {
+    if (context == NULL || context == &default_context) {
+        return;
+    }
+    task_drain(context);
+    for (int i = 0; i < context->variable_count; i++) {
+        free_variable_array(&context->variables[i]);
+    }
+    for (int i = 0; i < context->function_count; i++) {
+        FunctionEntry *function = &context->functions[i];
+        if (function->memo != NULL) {
+            memo_free(function->memo);
+        }
+        jit_free(function->jit);
+        free(function->body_tokens);
+    }
+    for (int i = 0; i < context->node_state_chunks; i++) {
+        if (context->node_states[i] != NULL) {
+            for (int j = 0; j < NODE_STATE_CHUNK; j++) {
+                jit_free(context->node_states[i][j].jit);
+                free_assoc_array(&context->node_states[i][j].elements);
+            }
+            free(context->node_states[i]);
+        }
+    }
+    free(context->node_states);
+    free(context->shadowed_builtins);
+    free(context);
+}
+
+// Gives node an index when it is first run, in whichever context that is
+static int assign_node_state(ASTNode *node) {
+    pthread_mutex_lock(&node_state_lock);
+    int index = node->state;
+    if (index == 0) {
+        index = free_node_state_count > 0 ? free_node_states[--free_node_state_count] : ++node_state_count;
+        node->state_serial = ++node_state_serial;
+        __atomic_store_n(&node->state, index, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&node_state_lock);
+    return index;
+}
+
+// The state at index in ctx, NULL if its chunk was never allocated
+static NodeState *find_node_state(KvContext *ctx, int index) {
+    int chunk = index / NODE_STATE_CHUNK;
+    if (chunk >= ctx->node_state_chunks || ctx->node_states[chunk] == NULL) {
+        return NULL;
+    }
+    return &ctx->node_states[chunk][index % NODE_STATE_CHUNK];
+}
+
+static void clear_node_state(NodeState *state) {
+    jit_free(state->jit);
+    free_assoc_array(&state->elements);
+    memset(state, 0, sizeof(NodeState));
+}
+
+/*
+ * The NodeState of a node in the current context. Its index may have been
+ * another node's, which this context ran before that node was freed: the
+ * serial tells, and the state is then cleared.
+ */
+NodeState* node_state(ASTNode *node) {
+    KvContext *ctx = kv_context;
+    int index = __atomic_load_n(&node->state, __ATOMIC_ACQUIRE);
+    if (index == 0) {
+        index = assign_node_state(node);
+    }
+
+    int chunk = index / NODE_STATE_CHUNK;
+    if (chunk >= ctx->node_state_chunks) {
+        int chunks = ctx->node_state_chunks > 0 ? ctx->node_state_chunks : 16;
+        while (chunks <= chunk) {
+            chunks *= 2;
+        }
+        ctx->node_states = (NodeState **) realloc(ctx->node_states, sizeof(NodeState *) * chunks);
+        memset(ctx->node_states + ctx->node_state_chunks, 0,
+               sizeof(NodeState *) * (chunks - ctx->node_state_chunks));
+        ctx->node_state_chunks = chunks;
+    }
+    if (ctx->node_states[chunk] == NULL) {
+        ctx->node_states[chunk] = (NodeState *) calloc(NODE_STATE_CHUNK, sizeof(NodeState));
+    }
+    NodeState *state = &ctx->node_states[chunk][index % NODE_STATE_CHUNK];
+    if (state->serial != node->state_serial) {
+        clear_node_state(state);
+        state->serial = node->state_serial;
+    }
+    return state;
+}
+
+// Frees the state of a node that is being freed and hands its index out
+// again. Only the current context can still be running the node, others
+// clear what they kept for it when the index comes up again
+void release_node_state(ASTNode *node) {
+    NodeState *state = find_node_state(kv_context, node->state);
+    if (state != NULL && state->serial == node->state_serial) {
+        clear_node_state(state);
+    }
+
+    pthread_mutex_lock(&node_state_lock);
+    if (free_node_state_count == free_node_state_capacity) {
+        free_node_state_capacity = free_node_state_capacity > 0 ? free_node_state_capacity * 2 : 256;
+        free_node_states = (int *) realloc(free_node_states, sizeof(int) * free_node_state_capacity);
+    }
+    free_node_states[free_node_state_count++] = node->state;
+    pthread_mutex_unlock(&node_state_lock);
+    node->state = 0;
+}
+
+// Values hoisted out of a loop are only valid for one run of it, and a
+// recursive call running the same loop gets its own activation. Returns
+// the activation to restore with leave_loop()
+unsigned long enter_loop(ASTNode *loop) {
+    NodeState *state = node_state(loop);
+    unsigned long outer_activation = state->activation;
+    state->activation = ++kv_context->loop_activation_count;
+    return outer_activation;
+}
+
+void leave_loop(ASTNode *loop, unsigned long outer_activation) {
+    node_state(loop)->activation = outer_activation;
+}
+
+// b[i] = value for a buffer b. The index is evaluated as a number, which
+// printing it as a key would round past a million
+static void assign_buffer_element(Variable *var, ASTNode *index_expr, const EvalResult *value) {
+    EvalResult key_result;
+    if (!evaluate_expression(index_expr, &key_result, EVAL_ARITHMETIC)) {
+        printf("Error: Failed to evaluate array index\n");
+        return;
+    }
+    long index;
+    if (!element_index(var, &key_result, &index)) {
+        return;
+    }
+    double number;
+    if (value->type == RESULT_NUMBER) {
+        number = value->number_value;
+    } else if (value->type == RESULT_STRING) {
+        char *end;
+        number = strtod(value->string_value, &end);
+        if (end == value->string_value || *end != '\0') {
+            printf("Error: A buffer holds numbers, not '%s'\n", value->string_value);
+            return;
+        }
+    } else {
+        printf("Error: Cannot assign an associative array to an array element\n");
+        return;
+    }
+    TypedBuffer *buffer = buffer_writable(&var->array.buffer);
+    if (buffer != NULL) {
+        buffer_set(buffer, index, number);
+        mark_array_written(&var->array, index);
+    }
+}
+
+void execute_assignment(ASTNode *node) {
+    if (node == NULL || node->type != AST_ASSIGNMENT) return;
+DEBUG_PRINT("execute_assignment");
+    ASTNode *target = node->left;
+    ASTNode *expr = node->right;
+
+    // Evaluate the expression
+    EvalResult result;
+    if (!evaluate_expression(expr, &result, EVAL_ARITHMETIC)) {
+        printf("Error: Failed to evaluate expression in assignment\n");
+        DEBUG_PRINT("Error: Failed to evaluate expression in assignment");
+        return;
+    }
+
+    DEBUG_PRINT("target->type %d result.type %d", target->type, result.type);
+    if (target->type == AST_IDENTIFIER) {
+        // Simple variable assignment
+        if (result.type == RESULT_STRING) {
+            set_variable_value(target->data.identifier, NULL, result.string_value);
+        } else if (result.type == RESULT_NUMBER) {
+            assign_variable_number(target, result.number_value);
+        } else if (result.type == RESULT_ASSOC_ARRAY) {
+            set_variable_assoc_array(target->data.identifier, result.array_value);
+        }
+    } else if (target->type == AST_ARRAY_ACCESS) {
+        Variable *var = find_variable(target->data.identifier);
+        if (var != NULL && var->array.buffer != NULL) {
+            assign_buffer_element(var, target->left, &result);
+            return;
+        }
+        // Array element assignment
+        EvalResult key_result;
+        if (!evaluate_expression(target->left, &key_result, EVAL_PRINT)) {
+            printf("Error: Failed to evaluate array index\n");
+            DEBUG_PRINT("Error: Failed to evaluate array index");
+            return;
+        }
+        if ( (key_result.type != RESULT_STRING) && (key_result.type != RESULT_NUMBER) ){
+            printf("Assignment Error: Array index must be a string or number\n");
+            return;
+        }
+        char key_str[MAX_TOKEN_LENGTH];
+        if (key_result.type == RESULT_NUMBER) {
+            snprintf(key_str, MAX_TOKEN_LENGTH, "%g", key_result.number_value);
+        } else {
+            strcpy(key_str, key_result.string_value);
+        }
+        if (result.type == RESULT_STRING) {
+            set_variable_value(target->data.identifier, key_str, result.string_value);
+        } else if (result.type == RESULT_NUMBER) {
+            char num_str[MAX_TOKEN_LENGTH];
+            format_number(result.number_value, num_str);
+            set_variable_value(target->data.identifier, key_str, num_str);
+        } else if (result.type == RESULT_ASSOC_ARRAY) {
+            printf("Error: Cannot assign an associative array to an array element\n");
+        }
+    } else {
+        printf("Error: Invalid assignment target\n");
+    }
+}
+
+int find_function(const char *name) {
+    KvContext *ctx = kv_context;
+    for (int i = 0; i < ctx->function_count; i++) {
+        if (strcmp(ctx->functions[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1; // Not found
+}
+
+// Functions are registered when they are parsed, not when the definition is executed.
+// The first definition of a name is the one called, later ones are ignored
+void register_function(ASTNode *def_node) {
+    KvContext *ctx = kv_context;
+    if (find_function(def_node->data.func_def.name) >= 0) {
+        return;
+    }
+    if (ctx->function_count < MAX_FUNCTIONS) {
+        strcpy(ctx->functions[ctx->function_count].name, def_node->data.func_def.name);
+        ctx->functions[ctx->function_count].parameters = def_node->data.func_def.parameters;
+        ctx->functions[ctx->function_count].body = def_node->data.func_def.body;
+        ctx->functions[ctx->function_count].body_tokens = def_node->data.func_def.body_tokens;
+        ctx->functions[ctx->function_count].body_token_count = def_node->data.func_def.body_token_count;
+        ctx->functions[ctx->function_count].memo = def_node->data.func_def.memoize ? memo_create(MEMO_CAPACITY) : NULL;
+        ctx->function_count++;
+    } else {
+        printf("Error: Too many functions defined\n");
+    }
+}
+
+// Registers the functions defined in a parsed program, in the order the
+// parser registered them: a definition nested in another is registered first
+void register_functions(ASTNode *node) {
+    for (; node != NULL; node = node->nextblock) {
+        switch (node->type) {
+            case AST_FUNCTION_DEFINITION:
+                register_functions(node->data.func_def.body);
+                register_function(node);
+                break;
+            case AST_IF_STATEMENT:
+                register_functions(node->data.if_stmt.then_branch);
+                register_functions(node->data.if_stmt.else_branch);
+                break;
+            case AST_FOR_STATEMENT:
+                register_functions(node->data.for_stmt.body);
+                break;
+            case AST_WHILE_STATEMENT:
+                register_functions(node->data.while_stmt.body);
+                break;
+            case AST_BLOCK:
+                register_functions(node->left);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+// Parses the body of a function defined with --lazy-functions, on its first call.
+// A body that does not parse is reported once, the function then returns 0
+void load_function_body(FunctionEntry *function) {
+    if (function->body_tokens == NULL) {
+        return;
+    }
+    Token *tokens = function->body_tokens;
+    int token_count = function->body_token_count;
+    function->body_tokens = NULL;
+    function->body_token_count = 0;
+
+    // The body is one statement as far as arity errors go
+    KvContext *ctx = kv_context;
+    int pos = 0;
+    ctx->bind_errors = 0;
+    ctx->parse_depth++;
+    ASTNode *body = parse_block(tokens, &pos, token_count);
+    ctx->parse_depth--;
+    if (body != NULL && ctx->bind_errors > 0) {
+        free_ast(body);
+        body = NULL;
+    } else if (body != NULL && pos < token_count - 1) {
+        // Stopped at an 'else' outside of an if statement
+        printf("Error: Expected 'end' after function body\n");
+        free_ast(body);
+        body = NULL;
+    }
+    free(tokens);
+    if (body == NULL) {
+        printf("Error: Failed to parse body of function '%s'\n", function->name);
+        return;
+    }
+
+    // Optimized as optimize_ast() optimizes the bodies of definitions
+    ASTNode definition = {0};
+    definition.type = AST_FUNCTION_DEFINITION;
+    strcpy(definition.data.func_def.name, function->name);
+    definition.data.func_def.parameters = function->parameters;
+    definition.data.func_def.body = body;
+    optimize_ast(&definition);
+    function->body = definition.data.func_def.body;
+}
+
+FunctionEntry* get_function(const char *name) {
+    KvContext *ctx = kv_context;
+    int idx = find_function(name);
+    return idx >= 0 ? &ctx->functions[idx] : NULL;
+}
+
+void print_memo_stats() {
+    KvContext *ctx = kv_context;
+    for (int i = 0; i < ctx->function_count; i++) {
+        if (ctx->functions[i].memo != NULL) {
+            memo_print_stats(ctx->functions[i].name, ctx->functions[i].memo);
+        }
+    }
+}
+
+void set_variable_from_eval_result(const char *name, EvalResult *result) {
+    if (result->type == RESULT_NUMBER) {
+        Variable *var = find_variable(name);
+        if (var == NULL) {
+            var = create_variable(name);
+            if (var == NULL) {
+                return;
+            }
+        }
+        store_variable_number(var, result->number_value);
+    } else if (result->type == RESULT_STRING) {
+        set_variable_value(name, NULL, result->string_value);
+    } else if (result->type == RESULT_ASSOC_ARRAY) {
+        // Assign entire associative array to the variable
+        set_variable_assoc_array(name, result->array_value);
+    } else {
+        // Unknown or unsupported type, default to "0"
+        set_variable_value(name, NULL, "0");
+    }
+}
+
+// Notes the built-in functions that the script in tokens defines functions
+// of the same name as. Calls are bound when they are parsed, which may be
+// before the definition or inside it, and calls of such a name are calls of
+// the script's function
+void declare_functions(Token tokens[], int token_count) {
+    KvContext *ctx = kv_context;
+    for (int i = 0; i + 1 < token_count; i++) {
+        if (tokens[i].type != TOKEN_KEYWORD || strcmp(tokens[i].value, "def") != 0 ||
+            tokens[i + 1].type != TOKEN_IDENTIFIER) {
+            continue;
+        }
+        int builtin = kvstdlib_find(tokens[i + 1].value);
+        if (builtin < 0) {
+            continue;
+        }
+        if (builtin >= ctx->shadowed_builtin_count) {
+            unsigned char *shadowed = (unsigned char *) realloc(ctx->shadowed_builtins, builtin + 1);
+            if (shadowed == NULL) {
+                printf("Error: Memory allocation failed\n");
+                return;
+            }
+            memset(shadowed + ctx->shadowed_builtin_count, 0, builtin + 1 - ctx->shadowed_builtin_count);
+            ctx->shadowed_builtins = shadowed;
+            ctx->shadowed_builtin_count = builtin + 1;
+        }
+        ctx->shadowed_builtins[builtin] = 1;
+    }
+}
+
+// Resolve a call to a standard lib function once, at parse time, and check its arity.
+// A call with the wrong number of arguments still parses, parse_statement() drops
+// the statement it is in
+void bind_function_call(ASTNode *call_node) {
+    KvContext *ctx = kv_context;
+    int argc = 0;
+    for (ASTNode *arg = call_node->data.func_call.arguments; arg != NULL; arg = arg->nextblock) {
+        argc++;
+    }
+    call_node->data.func_call.arg_count = argc;
+    int builtin = kvstdlib_find(call_node->data.func_call.name);
+    if (builtin >= 0 && builtin < ctx->shadowed_builtin_count && ctx->shadowed_builtins[builtin]) {
+        // The script defines a function of this name, see declare_functions()
+        builtin = -1;
+    }
+    call_node->data.func_call.builtin = builtin;
+    if (builtin < 0) {
+        // Not a built-in, user-defined functions are looked up when called
+        return;
+    }
+
+    const kvstdlib_lookup_entry_t *entry = kvstdlib_entry(call_node->data.func_call.builtin);
+    if (argc < entry->min_args || argc > entry->max_args) {
+        if (entry->min_args == entry->max_args) {
+            printf("Error: %s() requires exactly %d argument%s\n", entry->name,
+                   entry->min_args, entry->min_args == 1 ? "" : "s");
+        } else {
+            printf("Error: %s() requires between %d and %d arguments\n", entry->name,
+                   entry->min_args, entry->max_args);
+        }
+        ctx->bind_errors++;
+    }
+}
+
+// Evaluate an argument of a KVSTDLIB_KEY_ARGS function to the key it names
+int evaluate_key_argument(ASTNode *arg, EvalResult *result) {
+    result->type = RESULT_STRING;
+    strcpy(result->string_value, "");
+
+    if (arg->type == AST_IDENTIFIER) {
+        Variable *var = get_variable(arg->data.identifier);
+        if (var != NULL && var->array.shared != NULL) {
+            shared_snapshot(var->array.shared, &var->array);
+        }
+        if (var != NULL && var->array.size > 0) {
+            strcpy(result->string_value, var->array.pairs[0].key);
+        }
+    } else if (arg->type == AST_ARRAY_ACCESS) {
+        EvalResult key_result;
+        if (!evaluate_expression(arg->left, &key_result, EVAL_ARITHMETIC)) {
+            printf("Error: Failed to evaluate array index\n");
+            return 0;
+        }
+        if (key_result.type == RESULT_NUMBER) {
+            snprintf(result->string_value, MAX_TOKEN_LENGTH, "%g", key_result.number_value);
+        } else if (key_result.type == RESULT_STRING) {
+            strcpy(result->string_value, key_result.string_value);
+        } else {
+            printf("Error: Array index must be a string or number\n");
+            return 0;
+        }
+    }
+    return 1;
+}
+
+FunctionReturn execute_builtin_call(ASTNode *call_node) {
+    const kvstdlib_lookup_entry_t *entry = kvstdlib_entry(call_node->data.func_call.builtin);
+    EvalResult argv[MAX_FUNC_PARAMS];
+    int argc = 0;
+
+    // Calls with the wrong number of arguments never run, see bind_function_call()
+    for (ASTNode *arg = call_node->data.func_call.arguments; arg != NULL; arg = arg->nextblock) {
+        int ok;
+        if (entry->flags & KVSTDLIB_KEY_ARGS) {
+            ok = evaluate_key_argument(arg, &argv[argc]);
+        } else {
+            ok = evaluate_expression(arg, &argv[argc], EVAL_ARITHMETIC);
+        }
+        if (!ok) {
+            FunctionReturn result = {0};
+            printf("Error: Failed to evaluate argument in %s()\n", entry->name);
+            result.has_return = 1;
+            result.type = RESULT_NUMBER;
+            result.number_value = 0;
+            return result;
+        }
+        argc++;
+    }
+
+    return kvstdlib_call(call_node->data.func_call.builtin, argc, argv);
+}
+
+// Evaluate the arguments of a call to functions[idx] in the caller's frame
+int evaluate_call_arguments(int idx, ASTNode *call_node, EvalResult args[], int *argc) {
+    KvContext *ctx = kv_context;
+    ASTNode *param = ctx->functions[idx].parameters;
+    ASTNode *arg = call_node->data.func_call.arguments;
+
+    *argc = 0;
+    while (param != NULL && arg != NULL) {
+        if (!evaluate_expression(arg, &args[*argc], EVAL_ARITHMETIC)) {
+            printf("Error: Failed to evaluate argument\n");
+            return 0;
+        }
+        (*argc)++;
+        param = param->right;
+        arg = arg->nextblock;
+    }
+    return 1;
+}
+
+// Assign evaluated arguments to the parameters of functions[idx] in the current frame
+void bind_parameters(int idx, EvalResult args[], int argc) {
+    KvContext *ctx = kv_context;
+    ASTNode *param = ctx->functions[idx].parameters;
+    int i = 0;
+    while (i<argc) {
+
+        // Assign arg_val to param->identifier
+        set_variable_from_eval_result(param->data.identifier, &args[i++]);
+        param = param->right;
+    }
+
+    // If fewer arguments than parameters or vice versa, decide how to handle
+    // For now, missing arguments -> empty string
+    while (param != NULL) {
+        set_variable_value(param->data.identifier, NULL, "0");
+        param = param->right;
+    }
+}
+
+// If expr is a call to a user-defined function, evaluate its arguments into
+// pending_tail_call so the current frame can be reused for it
+int prepare_tail_call(ASTNode *expr) {
+    KvContext *ctx = kv_context;
+    if (expr == NULL || expr->type != AST_FUNCTION_CALL || expr->data.func_call.builtin >= 0) {
+        return 0;
+    }
+    int idx = find_function(expr->data.func_call.name);
+    if (idx < 0 || ctx->functions[idx].memo != NULL) {
+        // Memoized functions are looked up in their cache by execute_function_call()
+        return 0;
+    }
+    load_function_body(&ctx->functions[idx]);
+
+    EvalResult args[MAX_FUNC_PARAMS];
+    int argc = 0;
+    if (!evaluate_call_arguments(idx, expr, args, &argc)) {
+        return 0;
+    }
+
+    // Arrays point into the frame that is about to be released, so copy them
+    for (int i = 0; i < argc; i++) {
+        ctx->pending_tail_call.args[i] = args[i];
+        if (args[i].type == RESULT_ASSOC_ARRAY) {
+            ctx->pending_tail_call.args[i].array_value = (AssocArray *) malloc(sizeof(AssocArray));
+            duplicate_assoc_array(ctx->pending_tail_call.args[i].array_value, args[i].array_value);
+        }
+    }
+    ctx->pending_tail_call.function = idx;
+    ctx->pending_tail_call.argc = argc;
+    return 1;
+}
+
+static FunctionReturn call_user_function(int idx, EvalResult args[], int argc);
+
+FunctionReturn execute_function_call(ASTNode *call_node) {
+    KvContext *ctx = kv_context;
+
+    // Built-in functions were resolved when the call was parsed
+    if (call_node->data.func_call.builtin >= 0) {
+        return execute_builtin_call(call_node);
+    }
+
+    // If not a built-in, proceed with user-defined functions
+    FunctionReturn result = {0};
+
+    int idx = find_function(call_node->data.func_call.name);
+    if (idx < 0) {
+        printf("Error: Undefined function '%s'\n", call_node->data.func_call.name);
+        // return default 0
+        result.has_return = 1;
+        // result.return_is_number = 1;
+        // strcpy(result.return_value, "0");
+        result.type = RESULT_NUMBER;
+        result.number_value = 0;
+        return result;
+    }
+    load_function_body(&ctx->functions[idx]);
+
+    EvalResult args[MAX_FUNC_PARAMS];
+    int argc = 0;
+
+    if (!evaluate_call_arguments(idx, call_node, args, &argc)) {
+        result.has_return = 1;
+        result.type = RESULT_NUMBER;
+        result.number_value = 0;
+        return result;
+    }
+
+    return call_function(idx, args, argc);
+}
+
+// Calls functions[idx] with arguments evaluated by the caller, in a frame of its own
+FunctionReturn call_function(int idx, EvalResult args[], int argc) {
+    // The call is profiled from here
+    if (profile_enabled) {
+        profile_enter_function(&kv_context->functions[idx]);
+        FunctionReturn result = call_user_function(idx, args, argc);
+        profile_leave_function();
+        return result;
+    }
+    return call_user_function(idx, args, argc);
+}
+
+// spawn f(...) evaluates the arguments in this frame, and to the handle of
+// the task making the call
+static int evaluate_spawn(ASTNode *call_node, EvalResult *result) {
+    int idx = find_function(call_node->data.func_call.name);
+    if (idx < 0) {
+        printf("Error: Undefined function '%s'\n", call_node->data.func_call.name);
+        return 0;
+    }
+    load_function_body(&kv_context->functions[idx]);
+
+    EvalResult args[MAX_FUNC_PARAMS];
+    int argc = 0;
+    if (!evaluate_call_arguments(idx, call_node, args, &argc)) {
+        return 0;
+    }
+    result->type = RESULT_NUMBER;
+    result->number_value = spawn_task(idx, args, argc);
+    return 1;
+}
+
+static FunctionReturn call_user_function(int idx, EvalResult args[], int argc) {
+    KvContext *ctx = kv_context;
+    FunctionReturn result = {0};
+
+    MemoCache *memo = ctx->functions[idx].memo;
+    if (memo != NULL && memo_lookup(memo, args, argc, &result)) {
+        return result;
+    }
+
+    // Hot numeric functions run as machine code, without a frame
+    FunctionEntry *function = &ctx->functions[idx];
+    if (jit_enabled && function->jit == NULL && !function->jit_failed && ++function->calls >= JIT_HOT_CALLS) {
+        function->jit = jit_compile_function(function);
+        function->jit_failed = (function->jit == NULL);
+    }
+    if (function->jit != NULL && jit_run_function(function->jit, args, argc, &result.number_value)) {
+        result.has_return = 1;
+        result.type = RESULT_NUMBER;
+        if (memo != NULL) {
+            memo_store(memo, args, argc, &result);
+        }
+        return result;
+    }
+
+    if (!push_scope()) {
+        result.has_return = 1;
+        result.type = RESULT_NUMBER;
+        result.number_value = 0;
+        return result;
+    }
+
+    bind_parameters(idx, args, argc);
+
+    // Execute the function body, then any tail calls it makes, in this frame
+    FunctionReturn body_ret;
+    while (1) {
+        body_ret = execute_block_with_return(ctx->functions[idx].body);
+        if (!body_ret.is_tail_call) {
+            break;
+        }
+
+        release_frame_variables();
+        idx = ctx->pending_tail_call.function;
+        bind_parameters(idx, ctx->pending_tail_call.args, ctx->pending_tail_call.argc);
+        for (int i = 0; i < ctx->pending_tail_call.argc; i++) {
+            if (ctx->pending_tail_call.args[i].type == RESULT_ASSOC_ARRAY) {
+                free_assoc_array(ctx->pending_tail_call.args[i].array_value);
+                free(ctx->pending_tail_call.args[i].array_value);
+            }
+        }
+    }
+
+    pop_scope();
+
+    if (!body_ret.has_return) {
+        // No return encountered, return 0
+        body_ret.has_return = 1;
+        // body_ret.return_is_number = 1;
+        // strcpy(body_ret.return_value, "0");
+        body_ret.type = RESULT_NUMBER;
+        body_ret.number_value = 0;
+    }
+
+    if (memo != NULL) {
+        memo_store(memo, args, argc, &body_ret);
+    }
+
+    return body_ret;
+}
+
+FunctionReturn execute_block_with_return(ASTNode *node) {
+    FunctionReturn result = {0};
+    // Blocks of a program built with --emit-c run as C code
+    if (node != NULL && node->compiled != NULL) {
+        return node->compiled();
+    }
+    while (node != NULL) {
+        FunctionReturn stmt_result;
+        if (profile_enabled) {
+            ProfileMark mark;
+            profile_begin_statement(&mark, node);
+            stmt_result = execute_ast_with_return(node);
+            profile_end_statement(&mark);
+        } else {
+            stmt_result = execute_ast_with_return(node);
+        }
+        if (stmt_result.has_return) {
+            return stmt_result; // bubble up the return
+        }
+        node = node->nextblock;
+    }
+    return result; // no return encountered
+}
+
+void print_assoc_array(AssocArray *array) {
+    if (array->buffer != NULL) {
+        // Printed like the array of its numbers keyed by index
+        char value[MAX_TOKEN_LENGTH];
+        printf("{");
+        for (long i = 0; i < array->buffer->length; i++) {
+            buffer_format(array->buffer, i, value);
+            printf("%s\"%ld\": \"%s\"", i > 0 ? ", " : "", i, value);
+        }
+        printf("}\n");
+        return;
+    }
+    printf("{");
+    for (int i = 0; i < array->size; i++) {
+        // Print key-value pairs
+        printf("\"%s\": \"%s\"", array->pairs[i].key, array->pairs[i].value);
+        if (i < array->size - 1) {
+            printf(", ");
+        }
+    }
+    printf("}\n");
+}
+
+void evaluate_and_print(ASTNode *node) {
+    EvalResult result;
+    if (evaluate_expression(node, &result, EVAL_PRINT)) {
+        if (result.type == RESULT_STRING) {
+            printf("%s\n", result.string_value);
+        } else if (result.type == RESULT_NUMBER) {
+            printf("%g\n", result.number_value);
+        } else if (result.type == RESULT_ASSOC_ARRAY) {
+            print_assoc_array(result.array_value);
+        }
+    }
+}
+
+void set_variable_value(const char *name, const char *key, const char *value) {
+    Variable *var = find_variable(name);
+
+    if (var == NULL) {
+        // Create new variable
+        var = create_variable(name);
+        if (var == NULL) {
+            return;
+        }
+    } else {
+        // Writes go to a private copy of a loop variable's pair
+        detach_variable_view(var);
+        // Other keys of a native number must see its value as a string
+        sync_variable_string(var);
+        if (key == NULL && var->array.buffer != NULL) {
+            // A string replaces a buffer, as a number does
+            free_variable_array(var);
+            init_assoc_array(&var->array);
+        }
+    }
+
+    if (key == NULL) {
+        // Assign to default key
+        set_assoc_array_value(&var->array, "", value);
+    } else {
+        // Assign to specified key
+        set_assoc_array_value(&var->array, key, value);
+    }
+}
+
+// Add a new, empty variable to the current frame
+Variable* create_variable(const char *name) {
+    KvContext *ctx = kv_context;
+    if (ctx->variable_count >= MAX_VARIABLES) {
+        printf("Error: Maximum number of variables reached\n");
+        return NULL;
+    }
+    Variable *var = &ctx->variables[ctx->variable_count++];
+    strcpy(var->name, name);
+    init_assoc_array(&var->array);
+    var->is_number = 0;
+    var->view = NULL;
+    return var;
+}
+
+// find_variable() for an identifier node, which remembers the slot the
+// variable was found in. Frames are small, so a slot is often right again.
+// The slot is only a hint, so contexts running the same program share it
+Variable* lookup_identifier(ASTNode *node) {
+    KvContext *ctx = kv_context;
+    int slot = __atomic_load_n(&node->slot, __ATOMIC_RELAXED);
+    if (slot < ctx->variable_count && strcmp(ctx->variables[slot].name, node->data.identifier) == 0) {
+        if (ctx->variables[slot].view != NULL) {
+            refresh_variable_view(&ctx->variables[slot]);
+        }
+        return &ctx->variables[slot];
+    }
+
+    Variable *var = find_variable(node->data.identifier);
+    if (var != NULL) {
+        __atomic_store_n(&node->slot, (int) (var - ctx->variables), __ATOMIC_RELAXED);
+    }
+    return var;
+}
+
+// Look up a variable without formatting a native number into its array
+Variable* find_variable(const char *name) {
+    KvContext *ctx = kv_context;
+    for (int i = 0; i < ctx->variable_count; i++) {
+        if (strcmp(ctx->variables[i].name, name) == 0) {
+            if (ctx->variables[i].view != NULL) {
+                refresh_variable_view(&ctx->variables[i]);
+            }
+            return &ctx->variables[i];
+        }
+    }
+    return NULL; // Variable not found
+}
+
+/*
+ * A for loop variable is a view of the current pair of the array being
+ * iterated: its array borrows that single pair rather than copying it.
+ * The pair is found again on every lookup, as the body may grow (and so
+ * reallocate) the array it is iterating.
+ */
+void attach_variable_view(Variable *var, AssocArray *array, int index) {
+    if (var->view == NULL) {
+        free_variable_array(var);
+    }
+    var->is_number = 0;
+    var->view = array;
+    var->view_index = index;
+}
+
+void refresh_variable_view(Variable *var) {
+    var->array.capacity = 0;
+    if (var->view_index < var->view->size) {
+        var->array.pairs = &var->view->pairs[var->view_index];
+        var->array.size = 1;
+    } else {
+        var->array.pairs = NULL;
+        var->array.size = 0;
+    }
+}
+
+// Give a loop variable its own copy of the pair it views, before it is written to
+void detach_variable_view(Variable *var) {
+    if (var->view == NULL) {
+        return;
+    }
+    AssocArray copy;
+    init_assoc_array(&copy);
+    refresh_variable_view(var);
+    if (var->array.size == 1) {
+        set_assoc_array_value(&copy, var->array.pairs[0].key, var->array.pairs[0].value);
+    }
+    var->view = NULL;
+    var->array = copy;
+}
+
+// Free a variable's array unless it is borrowed from the array a loop is iterating
+void free_variable_array(Variable *var) {
+    if (var->view != NULL) {
+        var->view = NULL;
+        var->array.pairs = NULL;
+        var->array.size = 0;
+        var->array.capacity = 0;
+        var->array.shared = NULL;
+        var->array.buffer = NULL;
+        var->array.written = NULL;
+    } else {
+        free_assoc_array(&var->array);
+    }
+    var->is_number = 0;
+}
+
+Variable* get_variable(const char *name) {
+    Variable *var = find_variable(name);
+    if (var != NULL) {
+        sync_variable_string(var);
+    }
+    return var;
+}
+
+// Assigning a number to a scalar keeps it native, assigning one to an
+// array sets its default key like any other value
+void store_variable_number(Variable *var, double value) {
+    int scalar = var->is_number ||
+                 (var->view == NULL && var->array.shared == NULL && (var->array.size == 0 ||
+                                        (var->array.size == 1 && var->array.pairs[0].key[0] == '\0')));
+    if (scalar) {
+        set_variable_number(var, value);
+        return;
+    }
+
+    char num_str[MAX_TOKEN_LENGTH];
+    format_number(value, num_str);
+    detach_variable_view(var);
+    set_assoc_array_value(&var->array, "", num_str);
+}
+
+void assign_variable_number(ASTNode *target, double value) {
+    Variable *var = lookup_identifier(target);
+    if (var == NULL) {
+        var = create_variable(target->data.identifier);
+        if (var == NULL) {
+            return;
+        }
+    }
+    store_variable_number(var, value);
+}
+
+// Store a number in a scalar variable without formatting it as a string
+void set_variable_number(Variable *var, double value) {
+    if (var->view != NULL || var->array.shared != NULL || var->array.buffer != NULL) {
+        free_variable_array(var);
+    }
+    if (var->array.capacity == 0) {
+        init_assoc_array(&var->array);
+    }
+    // A native number is always the single default pair
+    var->array.size = 1;
+    var->array.pairs[0].key[0] = '\0';
+    var->is_number = 1;
+    var->number_value = value;
+    mark_array_written(&var->array, 0);
+}
+
+// A for loop variable over a buffer holds a number of it natively, with
+// its index as the key rather than the default one
+void set_variable_element(Variable *var, TypedBuffer *buffer, long index) {
+    set_variable_number(var, buffer_get(buffer, index));
+    snprintf(var->array.pairs[0].key, MAX_TOKEN_LENGTH, "%ld", index);
+}
+
+// A number as it is stored in an array: as snprintf("%g") if that reads back as
+// the same number, which whole numbers under a million do, else with the fewest
+// digits that do, so that arithmetic on an element sees the number it stored
+void format_number(double value, char *text) {
+    if (value > -1e6 && value < 1e6 && value == (long) value && (value != 0 || !signbit(value))) {
+        char digits[8];
+        long n = value < 0 ? -(long) value : (long) value;
+        int count = 0;
+        do {
+            digits[count++] = (char) ('0' + n % 10);
+            n /= 10;
+        } while (n > 0);
+        if (value < 0) {
+            *text++ = '-';
+        }
+        while (count > 0) {
+            *text++ = digits[--count];
+        }
+        *text = '\0';
+        return;
+    }
+    snprintf(text, MAX_TOKEN_LENGTH, "%g", value);
+    for (int precision = 15; precision <= 17 && value == value && strtod(text, NULL) != value; precision++) {
+        snprintf(text, MAX_TOKEN_LENGTH, "%.*g", precision, value);
+    }
+}
+
+// Write a native number back into the variable's array, making the string authoritative again
+void sync_variable_string(Variable *var) {
+    if (var->is_number) {
+        format_number(var->number_value, var->array.pairs[0].value);
+        var->is_number = 0;
+    }
+}
+
+char* get_variable_value(const char *name) {
+    // Lookup variable
+    Variable *var = get_variable(name);
+    if (var == NULL) {
+        return NULL; // Variable not found
+    }
+
+    // Get value from default key
+    char *value = get_assoc_array_value(&var->array, "");
+    if (value != NULL) {
+        return value;
+    } else {
+        // If no default key, return a representation of the array
+        return "[Associative Array]";
+    }
+}
+
+
+// The parameters and body of a function definition belong to the function
+// table once it is registered, so they are not freed with the definition
+void free_ast(ASTNode *node) {
+    if (node == NULL) return;
+    free_ast(node->left);
+    free_ast(node->right);
+    free_ast(node->nextblock);
+    switch (node->type) {
+        case AST_FUNCTION_CALL:
+            free_ast(node->data.func_call.arguments);
+            break;
+        case AST_RETURN_STATEMENT:
+            free_ast(node->data.ret_stmt.expression);
+            break;
+        case AST_IF_STATEMENT:
+            free_ast(node->data.if_stmt.condition);
+            free_ast(node->data.if_stmt.then_branch);
+            free_ast(node->data.if_stmt.else_branch);
+            break;
+        case AST_FOR_STATEMENT:
+            free_ast(node->data.for_stmt.expression);
+            free_ast(node->data.for_stmt.body);
+            break;
+        case AST_WHILE_STATEMENT:
+            free_ast(node->data.while_stmt.condition);
+            free_ast(node->data.while_stmt.body);
+            break;
+        default:
+            break;
+    }
+    free(node->hoisted);
+    if (node->state != 0) {
+        release_node_state(node);
+    }
+    free(node);
+}
@@ -0,0 +1,485 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ *  Copyright (C) 2024 Gary Sims
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NDEBUG 1
+#include "debug_print.h"
+
+#include "kvlang_internals.h"
+
+#include "kvjit.h"
+
+/*
+ * Copy-and-patch JIT for numeric loops and functions on x86-64
+ *
+ * Machine code is built by copying stencils, short pre-assembled x86-64
+ * instruction sequences, one after another and patching the holes in them:
+ * frame slot offsets, constants and jump displacements. No register
+ * allocation is done. Expressions leave their value in xmm0, the left
+ * operand of an operator is kept on the machine stack while the right one
+ * is evaluated.
+ *
+ * The generated code is a function double f(double *slots). Every variable
+ * the code uses gets a slot. jit_run_loop() and jit_run_function() copy the
+ * variables into the slots, run the code, and copy back the slots the code
+ * assigns. As the
+ * code only ever stores numbers, variables that are numbers on entry stay
+ * numbers, and no type checks are needed inside it.
+ */
+
+int jit_enabled = 0;
+
+#define JIT_MAX_SLOTS 64
+
+struct JitCode {
+    double (*entry)(double *slots);
+    void *memory;
+    size_t size;
+    int slot_count;
+    int param_count;                        // Functions: parameters are the first slots
+    const char *slot_names[JIT_MAX_SLOTS];  // Point into the AST being compiled
+    unsigned char slot_stored[JIT_MAX_SLOTS];   // The code assigns the variable
+};
+
+#if defined(__x86_64__) && !defined(_WIN32)
+
+#include <sys/mman.h>
+
+typedef struct {
+    const unsigned char *bytes;
+    int length;
+    int hole;       // Offset of the patched value, -1 for none
+    int hole_size;  // 4 (displacement) or 8 (double)
+} Stencil;
+
+#define STENCIL(name, hole, hole_size, ...) \
+    static const unsigned char name##_bytes[] = { __VA_ARGS__ }; \
+    static const Stencil name = { name##_bytes, sizeof(name##_bytes), hole, hole_size }
+
+// movsd xmm0, [rdi + slot]
+STENCIL(load_slot, 4, 4, 0xF2, 0x0F, 0x10, 0x87, 0, 0, 0, 0);
+// movsd xmm1, [rdi + slot]
+STENCIL(load_slot_right, 4, 4, 0xF2, 0x0F, 0x10, 0x8F, 0, 0, 0, 0);
+// mov rax, imm64; movq xmm0, rax
+STENCIL(load_const, 2, 8, 0x48, 0xB8, 0, 0, 0, 0, 0, 0, 0, 0, 0x66, 0x48, 0x0F, 0x6E, 0xC0);
+// mov rax, imm64; movq xmm1, rax
+STENCIL(load_const_right, 2, 8, 0x48, 0xB8, 0, 0, 0, 0, 0, 0, 0, 0, 0x66, 0x48, 0x0F, 0x6E, 0xC8);
+// movsd [rdi + slot], xmm0
+STENCIL(store_slot, 4, 4, 0xF2, 0x0F, 0x11, 0x87, 0, 0, 0, 0);
+// sub rsp, 8; movsd [rsp], xmm0
+STENCIL(push_left, -1, 0, 0x48, 0x83, 0xEC, 0x08, 0xF2, 0x0F, 0x11, 0x04, 0x24);
+// movapd xmm1, xmm0; movsd xmm0, [rsp]; add rsp, 8
+STENCIL(pop_left, -1, 0, 0x66, 0x0F, 0x28, 0xC8, 0xF2, 0x0F, 0x10, 0x04, 0x24, 0x48, 0x83, 0xC4, 0x08);
+
+// addsd/subsd/mulsd/divsd xmm0, xmm1
+STENCIL(op_add, -1, 0, 0xF2, 0x0F, 0x58, 0xC1);
+STENCIL(op_subtract, -1, 0, 0xF2, 0x0F, 0x5C, 0xC1);
+STENCIL(op_multiply, -1, 0, 0xF2, 0x0F, 0x59, 0xC1);
+STENCIL(op_divide, -1, 0, 0xF2, 0x0F, 0x5E, 0xC1);
+
+// Comparisons: cmpsd makes a mask of all ones or zeros, which is and'ed
+// with 1.0. NaN compares like it does in C. For > and >= the operands are
+// swapped (cmpsd xmm1, xmm0) and the result moved to xmm0.
+#define ONE_AS_MASK 0x48, 0xB8, 0, 0, 0, 0, 0, 0, 0xF0, 0x3F, 0x66, 0x48, 0x0F, 0x6E, 0xD0, 0x66, 0x0F, 0x54, 0xC2
+STENCIL(op_equal, -1, 0, 0xF2, 0x0F, 0xC2, 0xC1, 0x00, ONE_AS_MASK);
+STENCIL(op_less_than, -1, 0, 0xF2, 0x0F, 0xC2, 0xC1, 0x01, ONE_AS_MASK);
+STENCIL(op_less_equal, -1, 0, 0xF2, 0x0F, 0xC2, 0xC1, 0x02, ONE_AS_MASK);
+STENCIL(op_not_equal, -1, 0, 0xF2, 0x0F, 0xC2, 0xC1, 0x04, ONE_AS_MASK);
+STENCIL(op_greater_than, -1, 0, 0xF2, 0x0F, 0xC2, 0xC8, 0x01, 0x66, 0x0F, 0x28, 0xC1, ONE_AS_MASK);
+STENCIL(op_greater_equal, -1, 0, 0xF2, 0x0F, 0xC2, 0xC8, 0x02, 0x66, 0x0F, 0x28, 0xC1, ONE_AS_MASK);
+
+// xorpd xmm1, xmm1; ucomisd xmm0, xmm1; jp +6; jz rel32
+// Only 0 is false, NaN is unordered and true like in the interpreter
+STENCIL(jump_if_false, 12, 4, 0x66, 0x0F, 0x57, 0xC9, 0x66, 0x0F, 0x2E, 0xC1, 0x7A, 0x06, 0x0F, 0x84, 0, 0, 0, 0);
+// jmp rel32
+STENCIL(jump, 1, 4, 0xE9, 0, 0, 0, 0);
+// ret, with the value in xmm0
+STENCIL(return_value, -1, 0, 0xC3);
+// xorpd xmm0, xmm0; ret
+STENCIL(return_zero, -1, 0, 0x66, 0x0F, 0x57, 0xC0, 0xC3);
+
+typedef struct {
+    unsigned char *code;
+    size_t length;
+    size_t capacity;
+    int failed;
+    int function_mode;      // return statements are allowed
+    JitCode *unit;
+} JitBuilder;
+
+// Copies a stencil and returns the offset of its hole in the code
+static size_t emit(JitBuilder *b, const Stencil *stencil, const void *patch) {
+    if (b->length + stencil->length > b->capacity) {
+        b->capacity = b->capacity > 0 ? b->capacity * 2 : 256;
+        while (b->length + stencil->length > b->capacity) {
+            b->capacity *= 2;
+        }
+        b->code = (unsigned char *) realloc(b->code, b->capacity);
+    }
+    size_t start = b->length;
+    memcpy(b->code + start, stencil->bytes, stencil->length);
+    b->length += stencil->length;
+    if (stencil->hole >= 0 && patch != NULL) {
+        memcpy(b->code + start + stencil->hole, patch, stencil->hole_size);
+    }
+    return start + stencil->hole;
+}
+
+// Point the rel32 at hole to target, rel32 is the last field of its instruction
+static void patch_jump(JitBuilder *b, size_t hole, size_t target) {
+    int rel = (int) ((long) target - (long) (hole + 4));
+    memcpy(b->code + hole, &rel, 4);
+}
+
+static int slot_offset(JitBuilder *b, const char *name) {
+    JitCode *unit = b->unit;
+    for (int i = 0; i < unit->slot_count; i++) {
+        if (strcmp(unit->slot_names[i], name) == 0) {
+            return i * (int) sizeof(double);
+        }
+    }
+    if (unit->slot_count >= JIT_MAX_SLOTS) {
+        b->failed = 1;
+        return 0;
+    }
+    unit->slot_names[unit->slot_count] = name;
+    return unit->slot_count++ * (int) sizeof(double);
+}
+
+static int is_numeric_literal(ASTNode *node) {
+    const char *value = node->data.string_value;
+    return (value[0] >= '0' && value[0] <= '9') || (value[0] == '-' && value[1] >= '0' && value[1] <= '9');
+}
+
+// Loads a literal or a variable into xmm0 (right == 0) or xmm1, returns 0 for other nodes
+static int compile_leaf(JitBuilder *b, ASTNode *node, int right) {
+    if (node->type == AST_LITERAL && is_numeric_literal(node)) {
+        double value = atof(node->data.string_value);
+        emit(b, right ? &load_const_right : &load_const, &value);
+        return 1;
+    }
+    if (node->type == AST_IDENTIFIER) {
+        int offset = slot_offset(b, node->data.identifier);
+        emit(b, right ? &load_slot_right : &load_slot, &offset);
+        return 1;
+    }
+    return 0;
+}
+
+static void compile_expression(JitBuilder *b, ASTNode *node) {
+    if (b->failed) {
+        return;
+    }
+    if (compile_leaf(b, node, 0)) {
+        return;
+    }
+    if (node->type != AST_BINARY_OP) {
+        DEBUG_PRINT("jit: unsupported expression type %d", node->type);
+        b->failed = 1;
+        return;
+    }
+
+    compile_expression(b, node->left);
+    if (node->right->type == AST_LITERAL || node->right->type == AST_IDENTIFIER) {
+        // A leaf can go straight to xmm1 without spilling the left operand
+        if (!compile_leaf(b, node->right, 1)) {
+            b->failed = 1;
+            return;
+        }
+    } else {
+        emit(b, &push_left, NULL);
+        compile_expression(b, node->right);
+        emit(b, &pop_left, NULL);
+    }
+
+    switch (node->data.operator) {
+        case OP_ADD:           emit(b, &op_add, NULL); break;
+        case OP_SUBTRACT:      emit(b, &op_subtract, NULL); break;
+        case OP_MULTIPLY:      emit(b, &op_multiply, NULL); break;
+        case OP_DIVIDE:        emit(b, &op_divide, NULL); break;
+        case OP_LESS_THAN:     emit(b, &op_less_than, NULL); break;
+        case OP_GREATER_THAN:  emit(b, &op_greater_than, NULL); break;
+        case OP_EQUAL:         emit(b, &op_equal, NULL); break;
+        case OP_NOT_EQUAL:     emit(b, &op_not_equal, NULL); break;
+        case OP_LESS_EQUAL:    emit(b, &op_less_equal, NULL); break;
+        case OP_GREATER_EQUAL: emit(b, &op_greater_equal, NULL); break;
+        default:               b->failed = 1; break;
+    }
+}
+
+static void compile_block(JitBuilder *b, ASTNode *node);
+
+static void compile_while(JitBuilder *b, ASTNode *node) {
+    size_t top = b->length;
+    compile_expression(b, node->data.while_stmt.condition);
+    size_t exit_jump = emit(b, &jump_if_false, NULL);
+    compile_block(b, node->data.while_stmt.body);
+    size_t back_jump = emit(b, &jump, NULL);
+    patch_jump(b, back_jump, top);
+    patch_jump(b, exit_jump, b->length);
+}
+
+static void compile_block(JitBuilder *b, ASTNode *node) {
+    for (; node != NULL && !b->failed; node = node->nextblock) {
+        switch (node->type) {
+            case AST_ASSIGNMENT: {
+                if (node->left->type != AST_IDENTIFIER) {
+                    b->failed = 1;
+                    break;
+                }
+                compile_expression(b, node->right);
+                int offset = slot_offset(b, node->left->data.identifier);
+                b->unit->slot_stored[offset / (int) sizeof(double)] = 1;
+                emit(b, &store_slot, &offset);
+                break;
+            }
+            case AST_IF_STATEMENT: {
+                compile_expression(b, node->data.if_stmt.condition);
+                size_t else_jump = emit(b, &jump_if_false, NULL);
+                compile_block(b, node->data.if_stmt.then_branch);
+                if (node->data.if_stmt.else_branch != NULL) {
+                    size_t end_jump = emit(b, &jump, NULL);
+                    patch_jump(b, else_jump, b->length);
+                    compile_block(b, node->data.if_stmt.else_branch);
+                    patch_jump(b, end_jump, b->length);
+                } else {
+                    patch_jump(b, else_jump, b->length);
+                }
+                break;
+            }
+            case AST_WHILE_STATEMENT:
+                compile_while(b, node);
+                break;
+            case AST_BLOCK:
+                compile_block(b, node->left);
+                break;
+            case AST_RETURN_STATEMENT:
+                if (!b->function_mode) {
+                    b->failed = 1;
+                    break;
+                }
+                compile_expression(b, node->data.ret_stmt.expression);
+                emit(b, &return_value, NULL);
+                break;
+            default:
+                // Printing, calls, for loops and arrays stay interpreted
+                DEBUG_PRINT("jit: unsupported statement type %d", node->type);
+                b->failed = 1;
+                break;
+        }
+    }
+}
+
+static JitCode *finish(JitBuilder *b) {
+    JitCode *unit = b->unit;
+    if (b->failed) {
+        free(b->code);
+        free(unit);
+        return NULL;
+    }
+
+    void *memory = mmap(NULL, b->length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        free(b->code);
+        free(unit);
+        return NULL;
+    }
+    memcpy(memory, b->code, b->length);
+    free(b->code);
+    if (mprotect(memory, b->length, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, b->length);
+        free(unit);
+        return NULL;
+    }
+
+    unit->memory = memory;
+    unit->size = b->length;
+    unit->entry = (double (*)(double *)) memory;
+    DEBUG_PRINT("jit: compiled %zu bytes, %d slots", unit->size, unit->slot_count);
+    return unit;
+}
+
+int jit_supported(void) {
+    return 1;
+}
+
+JitCode *jit_compile_loop(ASTNode *loop) {
+    JitBuilder b = {0};
+    b.unit = (JitCode *) calloc(1, sizeof(JitCode));
+
+    compile_while(&b, loop);
+    emit(&b, &return_zero, NULL);
+    return finish(&b);
+}
+
+// Whether every variable the expression reads is in the assigned set
+static int reads_assigned(ASTNode *node, const char **assigned, int count) {
+    if (node == NULL) {
+        return 1;
+    }
+    if (node->type == AST_IDENTIFIER) {
+        for (int i = 0; i < count; i++) {
+            if (strcmp(assigned[i], node->data.identifier) == 0) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+    return reads_assigned(node->left, assigned, count) && reads_assigned(node->right, assigned, count);
+}
+
+/*
+ * A function is called with a fresh frame, so a local that could be read
+ * before it is assigned would be an undefined variable error. Compiled
+ * code has no such check, so every read must follow an assignment on all
+ * paths. Assignments inside if and while only count inside them.
+ */
+static int definitely_assigned(ASTNode *node, const char **assigned, int count) {
+    for (; node != NULL; node = node->nextblock) {
+        switch (node->type) {
+            case AST_ASSIGNMENT:
+                if (node->left->type != AST_IDENTIFIER || !reads_assigned(node->right, assigned, count)) {
+                    return 0;
+                }
+                if (count >= JIT_MAX_SLOTS) {
+                    return 0;
+                }
+                assigned[count++] = node->left->data.identifier;
+                break;
+            case AST_IF_STATEMENT:
+                if (!reads_assigned(node->data.if_stmt.condition, assigned, count) ||
+                    !definitely_assigned(node->data.if_stmt.then_branch, assigned, count) ||
+                    !definitely_assigned(node->data.if_stmt.else_branch, assigned, count)) {
+                    return 0;
+                }
+                break;
+            case AST_WHILE_STATEMENT:
+                if (!reads_assigned(node->data.while_stmt.condition, assigned, count) ||
+                    !definitely_assigned(node->data.while_stmt.body, assigned, count)) {
+                    return 0;
+                }
+                break;
+            case AST_RETURN_STATEMENT:
+                if (!reads_assigned(node->data.ret_stmt.expression, assigned, count)) {
+                    return 0;
+                }
+                break;
+            default:
+                // Rejected by compile_block() anyway
+                return 0;
+        }
+    }
+    return 1;
+}
+
+JitCode *jit_compile_function(FunctionEntry *function) {
+    const char *assigned[JIT_MAX_SLOTS];
+    int count = 0;
+    for (ASTNode *param = function->parameters; param != NULL; param = param->right) {
+        if (count >= JIT_MAX_SLOTS) {
+            return NULL;
+        }
+        assigned[count++] = param->data.identifier;
+    }
+    // A NULL body failed to parse with --lazy-functions
+    if (function->body == NULL || !definitely_assigned(function->body, assigned, count)) {
+        return NULL;
+    }
+
+    JitBuilder b = {0};
+    b.unit = (JitCode *) calloc(1, sizeof(JitCode));
+    b.function_mode = 1;
+
+    // Parameters take the first slots, in order
+    for (ASTNode *param = function->parameters; param != NULL; param = param->right) {
+        slot_offset(&b, param->data.identifier);
+    }
+    b.unit->param_count = b.unit->slot_count;
+    if (b.unit->param_count != count) {
+        // The same name used twice
+        b.failed = 1;
+    }
+
+    compile_block(&b, function->body);
+    // Falling off the end returns 0
+    emit(&b, &return_zero, NULL);
+    return finish(&b);
+}
+
+void jit_free(JitCode *code) {
+    if (code == NULL) {
+        return;
+    }
+    munmap(code->memory, code->size);
+    free(code);
+}
+
+#else /* Not x86-64 */
+
+int jit_supported(void) {
+    return 0;
+}
+
+JitCode *jit_compile_loop(ASTNode *loop) {
+    (void) loop;
+    return NULL;
+}
+
+JitCode *jit_compile_function(FunctionEntry *function) {
+    (void) function;
+    return NULL;
+}
+
+void jit_free(JitCode *code) {
+    (void) code;
+}
+
+#endif
+
+int jit_run_loop(JitCode *code) {
+    double slots[JIT_MAX_SLOTS];
+    Variable *vars[JIT_MAX_SLOTS];
+
+    for (int i = 0; i < code->slot_count; i++) {
+        vars[i] = find_variable(code->slot_names[i]);
+        if (vars[i] == NULL || !vars[i]->is_number) {
+            return 0;
+        }
+        slots[i] = vars[i]->number_value;
+    }
+
+    code->entry(slots);
+
+    // Variables the loop only reads are left alone, see kvpar.c
+    for (int i = 0; i < code->slot_count; i++) {
+        if (code->slot_stored[i]) {
+            set_variable_number(vars[i], slots[i]);
+        }
+    }
+    return 1;
+}
+
+int jit_run_function(JitCode *code, const EvalResult args[], int argc, double *result) {
+    double slots[JIT_MAX_SLOTS];
+
+    if (argc != code->param_count) {
+        return 0;
+    }
+    for (int i = 0; i < argc; i++) {
+        if (args[i].type != RESULT_NUMBER) {
+            return 0;
+        }
+        slots[i] = args[i].number_value;
+    }
+
+    // Locals are always assigned before they are read, and the frame they
+    // would live in is discarded on return anyway
+    *result = code->entry(slots);
+    return 1;
+}
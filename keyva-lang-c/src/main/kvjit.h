@@ -0,0 +1,40 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ *  Copyright (C) 2024 Gary Sims
+ *
+ */
+
+#ifndef KVJIT_H
+#define KVJIT_H
+
+#include "kvlang_internals.h"
+
+// Iterations of a while loop, and calls of a function, before it is compiled
+#define JIT_HOT_LOOP 1000
+#define JIT_HOT_CALLS 100
+
+extern int jit_enabled;
+
+// Returns 0 if this build cannot generate machine code for the host
+int jit_supported(void);
+
+/*
+ * Compile a while loop, or the body of a function, to machine code. Only
+ * numeric code is supported: assignments to variables, if, while and
+ * return, with numbers, variables and operators in expressions. Anything
+ * else returns NULL and the code stays interpreted.
+ */
+JitCode *jit_compile_loop(ASTNode *loop);
+JitCode *jit_compile_function(FunctionEntry *function);
+
+/*
+ * Run compiled code on the current frame. Every variable it uses must hold
+ * a native number, otherwise nothing is run and 0 is returned so the
+ * interpreter can carry on.
+ */
+int jit_run_loop(JitCode *code);
+int jit_run_function(JitCode *code, const EvalResult args[], int argc, double *result);
+
+void jit_free(JitCode *code);
+
+#endif /* KVJIT_H */
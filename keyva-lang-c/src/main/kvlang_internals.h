@@ -12,6 +12,9 @@
 #define MAX_TOKENS_PER_LINE 100
 #define MAX_TOKENS MAX_TOKENS_PER_LINE
 #define MAX_FUNC_PARAMS 10
+#define MAX_FUNCTIONS 100
+#define MAX_VARIABLES 100
+#define MAX_SCOPES 100
 
 // Token definitions
 typedef enum {
@@ -34,6 +37,8 @@ typedef enum {
 typedef struct {
     TokenType type;
     char value[MAX_TOKEN_LENGTH];
+    int line;                    // Position in the source, both start at 1
+    int column;
 } Token;
 
 typedef enum {
@@ -50,6 +55,7 @@ typedef enum {
     AST_FUNCTION_DEFINITION,    // 10
     AST_FUNCTION_CALL,          // 11
     AST_RETURN_STATEMENT,       // 12
+    AST_SPAWN,                  // 13: spawn of the call in left, see kvtask.c
     // ... other AST node types ...
 } ASTNodeType;
 
@@ -67,28 +73,51 @@ typedef enum {
     // ... other operators ...
 } OperatorType;
 
+// Values of for_stmt.parallel
+#define PARALLEL_PFOR 1                 // Written as 'pfor'
+#define PARALLEL_AUTO 2                 // A for loop kvopt.c found to have independent iterations
+
 struct ASTNode;
 
 typedef struct {
     char name[MAX_TOKEN_LENGTH];
     struct ASTNode *parameters;  // Linked list of parameter identifiers
     struct ASTNode *body;        // Block of statements
+    int memoize;                 // Defined with 'memo def'
+    Token *body_tokens;          // --lazy-functions: tokens of the body, which is NULL until parsed
+    int body_token_count;
 } FunctionDefinition;
 
 typedef struct {
     char name[MAX_TOKEN_LENGTH];
     struct ASTNode *arguments;    // Linked list of expressions for arguments
+    int arg_count;                // Number of arguments, counted at bind time
+    int builtin;                  // Built-in or host function, see kvstdlib_find(), -1 for user functions
 } FunctionCall;
 
 typedef struct {
     struct ASTNode *expression;   // Expression to return
 } ReturnStatement;
 
+struct HoistedValue;
+struct JitCode;
+typedef struct JitCode JitCode;
+
 typedef struct ASTNode {
     ASTNodeType type;
     struct ASTNode *left;
     struct ASTNode *right;
     struct ASTNode *nextblock;
+    struct HoistedValue *hoisted;   // Set by kvopt.c on loop-invariant expressions
+    int state;                      // Loops and hoisted expressions: index of their NodeState, 0 until run
+    unsigned long state_serial;     // Tells the node apart from earlier ones given the same index
+    int inlined;                    // Inlined function body, evaluates to 0 on errors like the call did
+    int numeric;                    // Inferred to be a number by kvopt.c, see evaluate_number()
+    double number;                  // Value of a numeric literal
+    int slot;                       // Identifiers: index the variable was last found at in its frame
+    struct FunctionReturn (*compiled)(void);    // First statement of a block compiled by --emit-c
+    int line;                       // Statements: position of their first token
+    int column;
     union {
         // For binary operators
         OperatorType operator;
@@ -112,6 +141,7 @@ typedef struct ASTNode {
             char loop_var[MAX_TOKEN_LENGTH];  // Name of the loop variable
             struct ASTNode *expression;       // Expression that should yield an array
             struct ASTNode *body;             // Block of statements
+            int parallel;                     // PARALLEL_PFOR or PARALLEL_AUTO, 0 for a for loop
         } for_stmt;
         struct {
             struct ASTNode *condition; // The condition expression
@@ -130,11 +160,18 @@ typedef struct {
     KeyValuePair *pairs;
     int size;
     int capacity;
+    struct SharedTable *shared;     // Set for shared(name), then pairs is a snapshot of the table
+    struct TypedBuffer *buffer;     // Set for f64buf(n) and i64buf(n), then pairs is empty, see kvbuffer.c
+    unsigned char *written;         // Pairs (or numbers of the buffer) written since track_array_writes(), or NULL
 } AssocArray;
 
 typedef struct {
     char name[MAX_TOKEN_LENGTH];
     AssocArray array;
+    int is_number;          // Scalar held in number_value, array.pairs[0].value is stale
+    double number_value;
+    AssocArray *view;       // For loop variables: array borrows pair view_index of view
+    int view_index;
 } Variable;
 
 typedef enum {
@@ -152,15 +189,46 @@ typedef struct {
     };
 } EvalResult;
 
+// A loop-invariant expression, its value is kept in its NodeState
+typedef struct HoistedValue {
+    struct ASTNode *loop;
+} HoistedValue;
+
+/*
+ * What the interpreter remembers about a node while it runs. It is kept
+ * by each context, not in the node, so that a parsed program is not
+ * written to by running it and several contexts can run it at once.
+ */
+typedef struct {
+    unsigned long serial;       // state_serial of the node the state is for, see node_state()
+    unsigned long activation;   // Loops: id of the running activation, 0 if not running.
+                                // Hoisted expressions: the activation value is valid for
+    EvalContext context;        // Hoisted expressions: how value was evaluated
+    EvalResult value;
+    unsigned int exec_count;    // While loops: iterations since the last attempt to compile
+    JitCode *jit;               // While loops: machine code, see kvjit.c
+    int jit_failed;             // While loops: cannot be compiled
+    AssocArray elements;        // Binary operators: their last result on arrays, see kvvector.c
+} NodeState;
+
+
+struct MemoCache;
 
 typedef struct {
     char name[MAX_TOKEN_LENGTH];
     struct ASTNode *parameters;
     struct ASTNode *body;
+    struct MemoCache *memo;      // Result cache of 'memo def' functions, NULL otherwise
+    unsigned int calls;          // Calls before the body is compiled, see kvjit.c
+    JitCode *jit;
+    int jit_failed;
+    Token *body_tokens;          // Body not parsed yet, see load_function_body()
+    int body_token_count;
 } FunctionEntry;
 
-typedef struct {
+typedef struct FunctionReturn {
     int has_return;
+    int is_tail_call;   // Returned via pending_tail_call, only seen by execute_function_call
     ResultType type;
     union {
         char string_value[MAX_TOKEN_LENGTH];
@@ -172,11 +240,83 @@ typedef struct {
     // If you have a Value struct, store it instead
 } FunctionReturn;
 
+// A 'return f(...)' inside a function leaves the evaluated call here and
+// unwinds to execute_function_call(), which then runs f in the same frame.
+typedef struct {
+    int function;                       // Index into functions[]
+    int argc;
+    EvalResult args[MAX_FUNC_PARAMS];   // Array arguments are owned copies
+} TailCall;
+
+#define NODE_STATE_CHUNK 256
+
+/*
+ * An interpreter: everything a running program changes. Each thread runs
+ * the context kv_context points to, which is the process's default context
+ * unless the thread was given another one, see kv_run(). Contexts share
+ * only parsed programs, which they do not write to, and the options and
+ * host functions set up before they run.
+ */
+typedef struct KvContext {
+    FunctionEntry functions[MAX_FUNCTIONS];
+    int function_count;
+
+    // Every function call runs in its own frame of variables. Frame 0 holds the
+    // top level variables and `variables` always points at the current frame.
+    Variable scope_variables_stack[MAX_SCOPES + 1][MAX_VARIABLES];
+    int scope_count_stack[MAX_SCOPES + 1];
+    int scope_depth;
+    Variable *variables;
+    int variable_count;
+
+    TailCall pending_tail_call;
+
+    // Every run of a loop gets a new activation id, see kvopt.c
+    unsigned long loop_activation_count;
+
+    // Function bodies are parsed when first called, see --lazy-functions
+    int lazy_function_bodies;
+
+    // Built-in and host functions, by kvstdlib_find() index, that a function
+    // of the same name defined in a script parsed here takes the place of
+    unsigned char *shadowed_builtins;
+    int shadowed_builtin_count;
+
+    // Arity errors reported in the statement being parsed and how deep in
+    // it the parser is, see parse_statement()
+    int bind_errors;
+    int parse_depth;
+
+    // NodeStates by node, allocated NODE_STATE_CHUNK at a time so they never move
+    NodeState **node_states;
+    int node_state_chunks;
+
+    // Runs part of a pfor loop, pfor loops in it run on this thread, see kvpar.c
+    int parallel_worker;
+
+    // Contexts running tasks or pfor chunks for another context: that context,
+    // whose functions they have. NULL otherwise
+    struct KvContext *origin;
+    unsigned long id;           // Never reused, unlike the address of a freed context
+
+    // Tasks spawned from here, or from contexts with this origin, and not
+    // synced yet, see kvtask.c
+    struct ScriptTask *unsynced_tasks;
+} KvContext;
+
+extern _Thread_local KvContext *kv_context;
+
 
 // Function declarations
 void tokenize_line(const char *line, Token tokens[], int *token_count);
 void duplicate_assoc_array(AssocArray *dup, AssocArray *array);
-void parse_and_execute(Token tokens[], int token_count);
+void init_assoc_array(AssocArray *array);
+void free_assoc_array(AssocArray *array);
+void set_assoc_array_value(AssocArray *array, const char *key, const char *value);
+void track_array_writes(AssocArray *array);
+void mark_array_written(AssocArray *array, long index);
+char* get_assoc_array_value(AssocArray *array, const char *key);
+int parse_and_execute(Token tokens[], int token_count);
 ASTNode* parse_print_statement(Token tokens[], int *pos, int token_count);
 void execute_ast(ASTNode *node);
 ASTNode* parse_comparison(Token tokens[], int *pos, int token_count);
@@ -190,19 +330,62 @@ ASTNode* parse_expression(Token tokens[], int *pos, int token_count);
 ASTNode* parse_additive(Token tokens[], int *pos, int token_count);
 void execute_assignment(ASTNode *node);
 Variable* get_variable(const char *name);
+Variable* find_variable(const char *name);
+Variable* lookup_identifier(ASTNode *node);
+Variable* create_variable(const char *name);
+void attach_variable_view(Variable *var, AssocArray *array, int index);
+void refresh_variable_view(Variable *var);
+void detach_variable_view(Variable *var);
+void free_variable_array(Variable *var);
+void set_variable_number(Variable *var, double value);
+void set_variable_element(Variable *var, struct TypedBuffer *buffer, long index);
+void store_variable_number(Variable *var, double value);
+void assign_variable_number(ASTNode *target, double value);
+int evaluate_number(ASTNode *node, double *value);
+void sync_variable_string(Variable *var);
+void format_number(double value, char *text);
 char* get_variable_value(const char *name);
 void set_variable_value(const char *name, const char *key, const char *value);
 void clear_variable_assoc_array(const char *name);
+void set_variable_assoc_array(const char *name, AssocArray *array_value);
+int push_scope();
+void pop_scope();
 ASTNode* parse_if_statement(Token tokens[], int *pos, int token_count);
 ASTNode* parse_statement(Token tokens[], int *pos, int token_count);
 ASTNode* parse_block(Token tokens[], int *pos, int token_count);
 ASTNode* parse_for_statement(Token tokens[], int *pos, int token_count);
 ASTNode* parse_while_statement(Token tokens[], int *pos, int token_count);
 ASTNode* parse_function_call(Token tokens[], int *pos, int token_count);
+void declare_functions(Token tokens[], int token_count);
+void bind_function_call(ASTNode *call_node);
+int find_function(const char *name);
+FunctionEntry* get_function(const char *name);
+void load_function_body(FunctionEntry *function);
+void register_function(ASTNode *def_node);
+void print_memo_stats();
+void register_functions(ASTNode *node);
+KvContext* create_context();
+void free_context(KvContext *context);
+NodeState* node_state(ASTNode *node);
+void release_node_state(ASTNode *node);
+unsigned long enter_loop(ASTNode *loop);
+void leave_loop(ASTNode *loop, unsigned long outer_activation);
+int evaluate_if_condition(ASTNode *node, int *condition_true);
+int evaluate_while_condition(ASTNode *node, int *condition_true);
 void execute_block(ASTNode *node);
 FunctionReturn execute_ast_with_return(ASTNode *node);
 FunctionReturn execute_block_with_return(ASTNode *node);
 FunctionReturn execute_function_call(ASTNode *call_node);
+FunctionReturn call_function(int idx, EvalResult args[], int argc);
+FunctionReturn execute_if_statement_with_return(ASTNode *node);
+FunctionReturn execute_for_statement_with_return(ASTNode *node);
+int is_range_loop(ASTNode *node);
+int evaluate_range(ASTNode *call_node, double *start_value, double *step_value, long *count);
+int evaluate_for_array(ASTNode *node, AssocArray *temp_array, AssocArray **array);
+FunctionReturn run_range_loop(ASTNode *node, double start, double step, long count);
+FunctionReturn run_array_loop(ASTNode *node, AssocArray *array, AssocArray *temp_array);
+FunctionReturn execute_while_statement_with_return(ASTNode *node);
+int prepare_tail_call(ASTNode *expr);
 ASTNode* parse_return_statement(Token tokens[], int *pos, int token_count);
 ASTNode* parse_function_definition(Token tokens[], int *pos, int token_count);
 
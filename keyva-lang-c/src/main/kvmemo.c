@@ -0,0 +1,207 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ *  Copyright (C) 2024 Gary Sims
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NDEBUG 1
+#include "debug_print.h"
+
+#include "kvlang_internals.h"
+
+#include "kvmemo.h"
+
+/*
+ * Result cache for 'memo def' functions
+ *
+ * Arguments are serialized into a key (type tag, then the number or the
+ * string with its terminator), hashed with FNV-1a and kept in a chained
+ * hash table. A doubly linked list orders the entries by last use, so the
+ * least recently used one can be evicted when the cache is full.
+ */
+
+#define MEMO_KEY_MAX (MAX_FUNC_PARAMS * (1 + MAX_TOKEN_LENGTH))
+
+// Returns the key length, or 0 if the arguments cannot be cached
+static size_t memo_make_key(const EvalResult args[], int argc, unsigned char *key) {
+    size_t length = 0;
+
+    key[length++] = (unsigned char) argc;
+    for (int i = 0; i < argc; i++) {
+        if (args[i].type == RESULT_NUMBER) {
+            key[length++] = RESULT_NUMBER;
+            memcpy(key + length, &args[i].number_value, sizeof(double));
+            length += sizeof(double);
+        } else if (args[i].type == RESULT_STRING) {
+            size_t string_length = strlen(args[i].string_value) + 1;
+            key[length++] = RESULT_STRING;
+            memcpy(key + length, args[i].string_value, string_length);
+            length += string_length;
+        } else {
+            return 0;
+        }
+    }
+    return length;
+}
+
+static unsigned long memo_hash(const unsigned char *key, size_t length) {
+    unsigned long hash = 2166136261UL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= key[i];
+        hash *= 16777619UL;
+    }
+    return hash;
+}
+
+static void lru_unlink(MemoCache *cache, MemoEntry *entry) {
+    if (entry->lru_prev != NULL) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        cache->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != NULL) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        cache->lru_tail = entry->lru_prev;
+    }
+}
+
+static void lru_push_front(MemoCache *cache, MemoEntry *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = cache->lru_head;
+    if (cache->lru_head != NULL) {
+        cache->lru_head->lru_prev = entry;
+    } else {
+        cache->lru_tail = entry;
+    }
+    cache->lru_head = entry;
+}
+
+static void free_entry(MemoEntry *entry) {
+    free(entry->key);
+    free(entry->string_value);
+    free(entry);
+}
+
+static void evict_lru(MemoCache *cache) {
+    MemoEntry *victim = cache->lru_tail;
+    MemoEntry **link = &cache->buckets[victim->hash % cache->bucket_count];
+    while (*link != victim) {
+        link = &(*link)->bucket_next;
+    }
+    *link = victim->bucket_next;
+    lru_unlink(cache, victim);
+    free_entry(victim);
+    cache->size--;
+    cache->evictions++;
+}
+
+MemoCache *memo_create(int capacity) {
+    MemoCache *cache = (MemoCache *) calloc(1, sizeof(MemoCache));
+    cache->capacity = capacity;
+    // Keep the load factor at or below 1/2
+    cache->bucket_count = capacity * 2 + 1;
+    cache->buckets = (MemoEntry **) calloc(cache->bucket_count, sizeof(MemoEntry *));
+    return cache;
+}
+
+void memo_free(MemoCache *cache) {
+    if (cache == NULL) {
+        return;
+    }
+    MemoEntry *entry = cache->lru_head;
+    while (entry != NULL) {
+        MemoEntry *next = entry->lru_next;
+        free_entry(entry);
+        entry = next;
+    }
+    free(cache->buckets);
+    free(cache);
+}
+
+int memo_lookup(MemoCache *cache, const EvalResult args[], int argc, FunctionReturn *result) {
+    unsigned char key[MEMO_KEY_MAX + 1];
+    size_t length = memo_make_key(args, argc, key);
+    if (length == 0) {
+        return 0;
+    }
+
+    unsigned long hash = memo_hash(key, length);
+    for (MemoEntry *entry = cache->buckets[hash % cache->bucket_count]; entry != NULL; entry = entry->bucket_next) {
+        if (entry->hash == hash && entry->key_length == length && memcmp(entry->key, key, length) == 0) {
+            lru_unlink(cache, entry);
+            lru_push_front(cache, entry);
+            cache->hits++;
+
+            memset(result, 0, sizeof(FunctionReturn));
+            result->has_return = 1;
+            result->type = entry->type;
+            if (entry->type == RESULT_NUMBER) {
+                result->number_value = entry->number_value;
+            } else {
+                strcpy(result->string_value, entry->string_value);
+            }
+            return 1;
+        }
+    }
+    cache->misses++;
+    return 0;
+}
+
+void memo_store(MemoCache *cache, const EvalResult args[], int argc, const FunctionReturn *result) {
+    if (result->type != RESULT_NUMBER && result->type != RESULT_STRING) {
+        return;
+    }
+
+    unsigned char key[MEMO_KEY_MAX + 1];
+    size_t length = memo_make_key(args, argc, key);
+    if (length == 0) {
+        return;
+    }
+
+    // A call that recursed with its own arguments has stored them already
+    unsigned long hash = memo_hash(key, length);
+    int bucket = hash % cache->bucket_count;
+    MemoEntry *entry;
+    for (entry = cache->buckets[bucket]; entry != NULL; entry = entry->bucket_next) {
+        if (entry->hash == hash && entry->key_length == length && memcmp(entry->key, key, length) == 0) {
+            lru_unlink(cache, entry);
+            free(entry->string_value);
+            entry->string_value = NULL;
+            break;
+        }
+    }
+
+    if (entry == NULL) {
+        if (cache->size >= cache->capacity) {
+            evict_lru(cache);
+        }
+        entry = (MemoEntry *) calloc(1, sizeof(MemoEntry));
+        entry->hash = hash;
+        entry->key = (unsigned char *) malloc(length);
+        memcpy(entry->key, key, length);
+        entry->key_length = length;
+        entry->bucket_next = cache->buckets[bucket];
+        cache->buckets[bucket] = entry;
+        cache->size++;
+    }
+
+    entry->type = result->type;
+    if (result->type == RESULT_NUMBER) {
+        entry->number_value = result->number_value;
+    } else {
+        entry->string_value = strdup(result->string_value);
+    }
+    lru_push_front(cache, entry);
+}
+
+void memo_print_stats(const char *name, const MemoCache *cache) {
+    unsigned long calls = cache->hits + cache->misses;
+    printf("memo %s: %lu hits, %lu misses (%.1f%% hit rate), %lu evictions, %d entries\n",
+           name, cache->hits, cache->misses, calls > 0 ? 100.0 * cache->hits / calls : 0.0,
+           cache->evictions, cache->size);
+}
@@ -0,0 +1,53 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ *  Copyright (C) 2024 Gary Sims
+ *
+ */
+
+#ifndef KVMEMO_H
+#define KVMEMO_H
+
+#include <stddef.h>
+
+#include "kvlang_internals.h"
+
+// Entries kept per 'memo def' function before the least recently used is evicted
+#define MEMO_CAPACITY 4096
+
+typedef struct MemoEntry {
+    unsigned long hash;
+    unsigned char *key;             // Serialized argument values
+    size_t key_length;
+    ResultType type;                // RESULT_NUMBER or RESULT_STRING
+    double number_value;
+    char *string_value;
+    struct MemoEntry *bucket_next;
+    struct MemoEntry *lru_prev;     // Towards the most recently used
+    struct MemoEntry *lru_next;
+} MemoEntry;
+
+typedef struct MemoCache {
+    MemoEntry **buckets;
+    int bucket_count;
+    int size;
+    int capacity;
+    MemoEntry *lru_head;            // Most recently used
+    MemoEntry *lru_tail;            // Next to be evicted
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+} MemoCache;
+
+MemoCache *memo_create(int capacity);
+void memo_free(MemoCache *cache);
+
+/*
+ * Calls with an array argument, and results that are arrays, are never
+ * cached. memo_lookup() returns 1 and fills in result on a hit.
+ */
+int memo_lookup(MemoCache *cache, const EvalResult args[], int argc, FunctionReturn *result);
+void memo_store(MemoCache *cache, const EvalResult args[], int argc, const FunctionReturn *result);
+
+void memo_print_stats(const char *name, const MemoCache *cache);
+
+#endif /* KVMEMO_H */
@@ -0,0 +1,1136 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ *  Copyright (C) 2024 Gary Sims
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#define NDEBUG 1
+#include "debug_print.h"
+
+#include "kvlang_internals.h"
+
+#include "kvstdlib.h"
+#include "kvopt.h"
+
+OptimizeOptions optimize_options = {
+    .inline_functions = 1,
+    .inline_threshold = 16,
+    .auto_parallel = 1,
+};
+
+/*
+ * Loop-invariant code motion
+ *
+ * An expression inside a while or for loop is invariant in that loop if it
+ * only reads variables the loop never writes, and only calls pure standard
+ * lib functions. User-defined functions run in their own frame and cannot
+ * write the caller's variables, but they may print, so calls to them are
+ * never hoisted (their arguments still can be).
+ *
+ * Hoisting is lazy: the expression is still evaluated where it appears, the
+ * first time it is reached in a run of the loop, and that value is reused
+ * until the loop finishes. An expression in a branch that is never taken
+ * is therefore never evaluated, and errors are reported exactly as before.
+ */
+
+#define MAX_LOOP_NESTING 64
+
+typedef struct {
+    ASTNode *loop;
+    const char **written;       // Names of variables written in the loop
+    int written_count;
+    int written_capacity;
+} LoopScope;
+
+static void add_written(LoopScope *scope, const char *name) {
+    for (int i = 0; i < scope->written_count; i++) {
+        if (strcmp(scope->written[i], name) == 0) {
+            return;
+        }
+    }
+    if (scope->written_count == scope->written_capacity) {
+        scope->written_capacity = scope->written_capacity > 0 ? scope->written_capacity * 2 : 8;
+        scope->written = (const char **) realloc(scope->written, sizeof(const char *) * scope->written_capacity);
+    }
+    scope->written[scope->written_count++] = name;
+}
+
+static int is_written(LoopScope *scope, const char *name) {
+    for (int i = 0; i < scope->written_count; i++) {
+        if (strcmp(scope->written[i], name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Collect the variables an expression may write: fill(b, v) writes b,
+// wherever the call is
+static void collect_expression_writes(ASTNode *node, LoopScope *scope) {
+    if (node == NULL) {
+        return;
+    }
+    switch (node->type) {
+        case AST_FUNCTION_CALL:
+            if (node->data.func_call.builtin >= 0 &&
+                (kvstdlib_entry(node->data.func_call.builtin)->flags & KVSTDLIB_WRITES_ARG) &&
+                node->data.func_call.arguments != NULL &&
+                node->data.func_call.arguments->type == AST_IDENTIFIER) {
+                add_written(scope, node->data.func_call.arguments->data.identifier);
+            }
+            for (ASTNode *arg = node->data.func_call.arguments; arg != NULL; arg = arg->nextblock) {
+                collect_expression_writes(arg, scope);
+            }
+            break;
+        case AST_ARRAY_ACCESS:
+        case AST_SPAWN:
+            collect_expression_writes(node->left, scope);
+            break;
+        case AST_BINARY_OP:
+            collect_expression_writes(node->left, scope);
+            collect_expression_writes(node->right, scope);
+            break;
+        default:
+            break;
+    }
+}
+
+// Collect the variables a block of statements may write
+static void collect_writes(ASTNode *node, LoopScope *scope) {
+    for (; node != NULL; node = node->nextblock) {
+        switch (node->type) {
+            case AST_PRINT:
+                collect_expression_writes(node->left, scope);
+                break;
+            case AST_ASSIGNMENT:
+                add_written(scope, node->left->data.identifier);
+                if (node->left->type == AST_ARRAY_ACCESS) {
+                    collect_expression_writes(node->left->left, scope);
+                }
+                collect_expression_writes(node->right, scope);
+                break;
+            case AST_IF_STATEMENT:
+                collect_expression_writes(node->data.if_stmt.condition, scope);
+                collect_writes(node->data.if_stmt.then_branch, scope);
+                collect_writes(node->data.if_stmt.else_branch, scope);
+                break;
+            case AST_FOR_STATEMENT:
+                add_written(scope, node->data.for_stmt.loop_var);
+                collect_expression_writes(node->data.for_stmt.expression, scope);
+                collect_writes(node->data.for_stmt.body, scope);
+                break;
+            case AST_WHILE_STATEMENT:
+                collect_expression_writes(node->data.while_stmt.condition, scope);
+                collect_writes(node->data.while_stmt.body, scope);
+                break;
+            case AST_BLOCK:
+                collect_writes(node->left, scope);
+                break;
+            case AST_FUNCTION_CALL:
+            case AST_SPAWN:
+                collect_expression_writes(node, scope);
+                break;
+            case AST_RETURN_STATEMENT:
+                collect_expression_writes(node->data.ret_stmt.expression, scope);
+                break;
+            default:
+                // A nested function definition has its own frame
+                break;
+        }
+    }
+}
+
+static int is_invariant(ASTNode *node, LoopScope *scope) {
+    switch (node->type) {
+        case AST_LITERAL:
+            return 1;
+        case AST_IDENTIFIER:
+            return !is_written(scope, node->data.identifier);
+        case AST_ARRAY_ACCESS:
+            return !is_written(scope, node->data.identifier) && is_invariant(node->left, scope);
+        case AST_BINARY_OP:
+            return is_invariant(node->left, scope) && is_invariant(node->right, scope);
+        case AST_FUNCTION_CALL: {
+            int builtin = node->data.func_call.builtin;
+            if (builtin < 0 || !(kvstdlib_entry(builtin)->flags & KVSTDLIB_PURE)) {
+                return 0;
+            }
+            for (ASTNode *arg = node->data.func_call.arguments; arg != NULL; arg = arg->nextblock) {
+                if (!is_invariant(arg, scope)) {
+                    return 0;
+                }
+            }
+            return 1;
+        }
+        default:
+            return 0;
+    }
+}
+
+static void hoist_expression(ASTNode *node, LoopScope loops[], int depth) {
+    if (node == NULL) {
+        return;
+    }
+
+    // Literals and plain variables are as cheap to evaluate as a cached value
+    if (node->type == AST_BINARY_OP || node->type == AST_ARRAY_ACCESS || node->type == AST_FUNCTION_CALL) {
+        // Invariant in an outer loop implies invariant in the loops inside it,
+        // so attach the expression to the outermost loop possible
+        for (int i = 0; i < depth; i++) {
+            if (is_invariant(node, &loops[i])) {
+                if (node->hoisted == NULL) {
+                    node->hoisted = (HoistedValue *) calloc(1, sizeof(HoistedValue));
+                }
+                node->hoisted->loop = loops[i].loop;
+                DEBUG_PRINT("hoisting node type %d out of loop type %d", node->type, loops[i].loop->type);
+                break;
+            }
+        }
+    }
+
+    // Parts of the expression may be invariant in a loop further out
+    switch (node->type) {
+        case AST_ARRAY_ACCESS:
+            hoist_expression(node->left, loops, depth);
+            break;
+        case AST_BINARY_OP:
+            hoist_expression(node->left, loops, depth);
+            hoist_expression(node->right, loops, depth);
+            break;
+        case AST_FUNCTION_CALL:
+            for (ASTNode *arg = node->data.func_call.arguments; arg != NULL; arg = arg->nextblock) {
+                hoist_expression(arg, loops, depth);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void hoist_block(ASTNode *node, LoopScope loops[], int depth);
+
+static void hoist_loop(ASTNode *node, LoopScope loops[], int depth) {
+    if (depth >= MAX_LOOP_NESTING) {
+        return;
+    }
+
+    LoopScope *scope = &loops[depth];
+    memset(scope, 0, sizeof(LoopScope));
+    scope->loop = node;
+
+    if (node->type == AST_FOR_STATEMENT) {
+        add_written(scope, node->data.for_stmt.loop_var);
+        collect_writes(node->data.for_stmt.body, scope);
+        hoist_block(node->data.for_stmt.body, loops, depth + 1);
+    } else {
+        collect_writes(node->data.while_stmt.body, scope);
+        hoist_expression(node->data.while_stmt.condition, loops, depth + 1);
+        hoist_block(node->data.while_stmt.body, loops, depth + 1);
+    }
+
+    free(scope->written);
+}
+
+static void hoist_block(ASTNode *node, LoopScope loops[], int depth) {
+    for (; node != NULL; node = node->nextblock) {
+        switch (node->type) {
+            case AST_PRINT:
+                hoist_expression(node->left, loops, depth);
+                break;
+            case AST_ASSIGNMENT:
+                if (node->left->type == AST_ARRAY_ACCESS) {
+                    hoist_expression(node->left->left, loops, depth);
+                }
+                hoist_expression(node->right, loops, depth);
+                break;
+            case AST_IF_STATEMENT:
+                hoist_expression(node->data.if_stmt.condition, loops, depth);
+                hoist_block(node->data.if_stmt.then_branch, loops, depth);
+                hoist_block(node->data.if_stmt.else_branch, loops, depth);
+                break;
+            case AST_FOR_STATEMENT:
+                // The array is evaluated once, before the loop starts
+                hoist_expression(node->data.for_stmt.expression, loops, depth);
+                hoist_loop(node, loops, depth);
+                break;
+            case AST_WHILE_STATEMENT:
+                hoist_loop(node, loops, depth);
+                break;
+            case AST_BLOCK:
+                hoist_block(node->left, loops, depth);
+                break;
+            case AST_FUNCTION_DEFINITION:
+                // The body runs in its own frame, outside any loop around the definition
+                hoist_block(node->data.func_def.body, loops, 0);
+                break;
+            case AST_FUNCTION_CALL:
+                hoist_expression(node, loops, depth);
+                break;
+            case AST_RETURN_STATEMENT:
+                hoist_expression(node->data.ret_stmt.expression, loops, depth);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+/*
+ * Inline expansion
+ *
+ * A call to a function whose body is a single 'return expression' is
+ * replaced by a copy of that expression, with each parameter replaced by a
+ * copy of its argument. The parameters are the only locals such a function
+ * can have, so this renaming keeps the caller's variables out of reach of
+ * the inlined expression, exactly as the function's own frame would.
+ *
+ * Only calls that behave the same either way are inlined:
+ * - the expression only reads parameters, and is no larger than
+ *   optimize_options.inline_threshold nodes
+ * - its result does not depend on the context the call is evaluated in
+ * - arguments have no side effects (no user function or impure builtin calls)
+ * - an argument that is not a literal or a variable is used exactly once,
+ *   so it is not evaluated more often than before, and every argument is
+ *   still evaluated at least once
+ * - parameters are not used as array names (p[...] or key(p)), a one
+ *   element array argument is passed as its value
+ * Recursive calls are left alone.
+ */
+
+#define MAX_INLINE_DEPTH 16
+
+static int count_nodes(ASTNode *node) {
+    if (node == NULL) {
+        return 0;
+    }
+    int count = 1 + count_nodes(node->left) + count_nodes(node->right);
+    if (node->type == AST_FUNCTION_CALL) {
+        for (ASTNode *arg = node->data.func_call.arguments; arg != NULL; arg = arg->nextblock) {
+            count += count_nodes(arg);
+        }
+    }
+    return count;
+}
+
+static int has_side_effects(ASTNode *node) {
+    if (node == NULL) {
+        return 0;
+    }
+    if (node->type == AST_FUNCTION_CALL) {
+        int builtin = node->data.func_call.builtin;
+        if (builtin < 0 || !(kvstdlib_entry(builtin)->flags & KVSTDLIB_PURE)) {
+            return 1;
+        }
+        for (ASTNode *arg = node->data.func_call.arguments; arg != NULL; arg = arg->nextblock) {
+            if (has_side_effects(arg)) {
+                return 1;
+            }
+        }
+    }
+    return has_side_effects(node->left) || has_side_effects(node->right);
+}
+
+static int find_parameter(ASTNode *params, const char *name) {
+    int index = 0;
+    for (ASTNode *param = params; param != NULL; param = param->right) {
+        if (strcmp(param->data.identifier, name) == 0) {
+            return index;
+        }
+        index++;
+    }
+    return -1;
+}
+
+// Count the uses of each parameter in expr, returns 0 if expr reads anything
+// but plain parameters
+static int count_parameter_uses(ASTNode *node, ASTNode *params, int uses[]) {
+    if (node == NULL) {
+        return 1;
+    }
+    switch (node->type) {
+        case AST_LITERAL:
+            return 1;
+        case AST_IDENTIFIER: {
+            int index = find_parameter(params, node->data.identifier);
+            if (index < 0) {
+                return 0;
+            }
+            uses[index]++;
+            return 1;
+        }
+        case AST_BINARY_OP:
+            return count_parameter_uses(node->left, params, uses) &&
+                   count_parameter_uses(node->right, params, uses);
+        case AST_FUNCTION_CALL: {
+            int builtin = node->data.func_call.builtin;
+            int key_args = builtin >= 0 && (kvstdlib_entry(builtin)->flags & KVSTDLIB_KEY_ARGS);
+            for (ASTNode *arg = node->data.func_call.arguments; arg != NULL; arg = arg->nextblock) {
+                if (key_args && arg->type == AST_IDENTIFIER) {
+                    return 0;
+                }
+                if (!count_parameter_uses(arg, params, uses)) {
+                    return 0;
+                }
+            }
+            return 1;
+        }
+        default:
+            // Includes AST_ARRAY_ACCESS, the array name cannot be substituted
+            return 0;
+    }
+}
+
+static int is_context_free(ASTNode *node) {
+    switch (node->type) {
+        case AST_LITERAL:
+        case AST_FUNCTION_CALL:
+            return 1;
+        case AST_BINARY_OP:
+            // Operands of arithmetic are always evaluated as numbers, operands of
+            // comparisons are evaluated in the caller's context
+            return node->data.operator == OP_ADD || node->data.operator == OP_SUBTRACT ||
+                   node->data.operator == OP_MULTIPLY || node->data.operator == OP_DIVIDE;
+        default:
+            return 0;
+    }
+}
+
+static int can_inline(FunctionEntry *function, ASTNode *call_node, ASTNode *args[]) {
+    ASTNode *body = function->body;
+    if (body == NULL || body->type != AST_RETURN_STATEMENT || body->nextblock != NULL) {
+        return 0;
+    }
+    ASTNode *expr = body->data.ret_stmt.expression;
+    if (expr == NULL || !is_context_free(expr) || count_nodes(expr) > optimize_options.inline_threshold) {
+        return 0;
+    }
+
+    int param_count = 0;
+    for (ASTNode *param = function->parameters; param != NULL; param = param->right) {
+        param_count++;
+    }
+    if (param_count != call_node->data.func_call.arg_count) {
+        // Missing parameters default to 0, extra arguments are never evaluated
+        return 0;
+    }
+
+    int uses[MAX_FUNC_PARAMS] = {0};
+    if (param_count > MAX_FUNC_PARAMS || !count_parameter_uses(expr, function->parameters, uses)) {
+        return 0;
+    }
+
+    int i = 0;
+    for (ASTNode *arg = call_node->data.func_call.arguments; arg != NULL; arg = arg->nextblock) {
+        if (has_side_effects(arg)) {
+            return 0;
+        }
+        if (arg->type == AST_LITERAL) {
+            // Nothing to evaluate
+        } else if (arg->type == AST_IDENTIFIER) {
+            if (uses[i] == 0) {
+                return 0;
+            }
+        } else if (uses[i] != 1) {
+            return 0;
+        }
+        args[i++] = arg;
+    }
+    return 1;
+}
+
+static ASTNode *substitute_parameters(ASTNode *node, ASTNode *params, ASTNode *args[]) {
+    if (node == NULL) {
+        return NULL;
+    }
+    if (node->type == AST_IDENTIFIER && params != NULL) {
+        int index = find_parameter(params, node->data.identifier);
+        if (index >= 0) {
+            return substitute_parameters(args[index], NULL, NULL);
+        }
+    }
+
+    ASTNode *copy = (ASTNode*)malloc(sizeof(ASTNode));
+    *copy = *node;
+    copy->hoisted = NULL;
+    copy->state = 0;
+    copy->inlined = 0;
+    copy->nextblock = NULL;
+    copy->left = substitute_parameters(node->left, params, args);
+    copy->right = substitute_parameters(node->right, params, args);
+    if (node->type == AST_FUNCTION_CALL) {
+        ASTNode **current = &copy->data.func_call.arguments;
+        for (ASTNode *arg = node->data.func_call.arguments; arg != NULL; arg = arg->nextblock) {
+            *current = substitute_parameters(arg, params, args);
+            current = &(*current)->nextblock;
+        }
+    }
+    return copy;
+}
+
+static void inline_expression(ASTNode *node, FunctionEntry *stack[], int depth);
+
+static void inline_call(ASTNode *call_node, FunctionEntry *stack[], int depth) {
+    FunctionEntry *function = get_function(call_node->data.func_call.name);
+    if (function == NULL || function->memo != NULL || depth >= MAX_INLINE_DEPTH) {
+        return;
+    }
+    for (int i = 0; i < depth; i++) {
+        if (stack[i] == function) {
+            return;
+        }
+    }
+    // With --lazy-functions, code about to run is reason enough to parse its callees
+    load_function_body(function);
+
+    ASTNode *args[MAX_FUNC_PARAMS];
+    if (!can_inline(function, call_node, args)) {
+        return;
+    }
+    DEBUG_PRINT("inlining call to %s", function->name);
+
+    // Replace the call node in place, it may be an argument in a chain
+    ASTNode *expr = substitute_parameters(function->body->data.ret_stmt.expression, function->parameters, args);
+    ASTNode *next = call_node->nextblock;
+    if (!optimize_options.static_ast) {
+        free_ast(call_node->data.func_call.arguments);
+    }
+    *call_node = *expr;
+    call_node->nextblock = next;
+    call_node->inlined = 1;
+    free(expr);
+
+    // Calls in the inlined expression, except recursive ones
+    stack[depth] = function;
+    inline_expression(call_node, stack, depth + 1);
+}
+
+static void inline_expression(ASTNode *node, FunctionEntry *stack[], int depth) {
+    if (node == NULL) {
+        return;
+    }
+    switch (node->type) {
+        case AST_ARRAY_ACCESS:
+            inline_expression(node->left, stack, depth);
+            break;
+        case AST_BINARY_OP:
+            inline_expression(node->left, stack, depth);
+            inline_expression(node->right, stack, depth);
+            break;
+        case AST_FUNCTION_CALL:
+            for (ASTNode *arg = node->data.func_call.arguments; arg != NULL; arg = arg->nextblock) {
+                inline_expression(arg, stack, depth);
+            }
+            if (node->data.func_call.builtin < 0) {
+                inline_call(node, stack, depth);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void inline_block(ASTNode *node) {
+    FunctionEntry *stack[MAX_INLINE_DEPTH];
+
+    for (; node != NULL; node = node->nextblock) {
+        switch (node->type) {
+            case AST_PRINT:
+                inline_expression(node->left, stack, 0);
+                break;
+            case AST_ASSIGNMENT:
+                if (node->left->type == AST_ARRAY_ACCESS) {
+                    inline_expression(node->left->left, stack, 0);
+                }
+                inline_expression(node->right, stack, 0);
+                break;
+            case AST_IF_STATEMENT:
+                inline_expression(node->data.if_stmt.condition, stack, 0);
+                inline_block(node->data.if_stmt.then_branch);
+                inline_block(node->data.if_stmt.else_branch);
+                break;
+            case AST_FOR_STATEMENT:
+                inline_expression(node->data.for_stmt.expression, stack, 0);
+                inline_block(node->data.for_stmt.body);
+                break;
+            case AST_WHILE_STATEMENT:
+                inline_expression(node->data.while_stmt.condition, stack, 0);
+                inline_block(node->data.while_stmt.body);
+                break;
+            case AST_BLOCK:
+                inline_block(node->left);
+                break;
+            case AST_FUNCTION_DEFINITION:
+                inline_block(node->data.func_def.body);
+                break;
+            case AST_FUNCTION_CALL:
+                // A call statement has no expression to replace it with, but its
+                // arguments may contain calls that do
+                for (ASTNode *arg = node->data.func_call.arguments; arg != NULL; arg = arg->nextblock) {
+                    inline_expression(arg, stack, 0);
+                }
+                break;
+            case AST_RETURN_STATEMENT:
+                inline_expression(node->data.ret_stmt.expression, stack, 0);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+/*
+ * Type inference
+ *
+ * Marks the expressions that yield a number, so the executor can run them
+ * with evaluate_number(). A statement, and each function body, is analysed
+ * on its own. Variables are assumed to hold numbers unless the code shows
+ * they may not: they are assigned a string or an array, have elements
+ * assigned, or iterate over an array. Variables from earlier statements
+ * and parameters are not known here, which is why evaluate_number() checks
+ * every variable it reads and the generic path takes over when one is not
+ * a native number.
+ */
+
+typedef struct {
+    const char **names;
+    int count;
+    int capacity;
+} NameSet;
+
+static int name_set_contains(NameSet *set, const char *name) {
+    for (int i = 0; i < set->count; i++) {
+        if (strcmp(set->names[i], name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int name_set_add(NameSet *set, const char *name) {
+    if (name_set_contains(set, name)) {
+        return 0;
+    }
+    if (set->count == set->capacity) {
+        set->capacity = set->capacity > 0 ? set->capacity * 2 : 8;
+        set->names = (const char **) realloc(set->names, sizeof(const char *) * set->capacity);
+    }
+    set->names[set->count++] = name;
+    return 1;
+}
+
+static int is_numeric_literal(const char *value) {
+    // The same test evaluate_expression() applies to literals
+    return isdigit((unsigned char) value[0]) || (value[0] == '-' && isdigit((unsigned char) value[1]));
+}
+
+static int is_range_call(ASTNode *node) {
+    return node != NULL && node->type == AST_FUNCTION_CALL && node->data.func_call.builtin >= 0 &&
+           kvstdlib_entry(node->data.func_call.builtin)->func == kvstdlib_range;
+}
+
+// Whether expr may yield a number, given the variables known not to hold one
+static int may_be_number(ASTNode *node, NameSet *non_numeric) {
+    switch (node->type) {
+        case AST_LITERAL:
+            return is_numeric_literal(node->data.string_value);
+        case AST_IDENTIFIER:
+            return !name_set_contains(non_numeric, node->data.identifier);
+        case AST_FUNCTION_CALL:
+            return !is_range_call(node);
+        default:
+            // Operators always yield numbers, array elements that look like
+            // numbers are read as numbers
+            return 1;
+    }
+}
+
+// Returns 1 if a name was added to non_numeric
+static int collect_non_numeric(ASTNode *node, NameSet *non_numeric) {
+    int changed = 0;
+    for (; node != NULL; node = node->nextblock) {
+        switch (node->type) {
+            case AST_ASSIGNMENT:
+                if (node->left->type == AST_ARRAY_ACCESS || !may_be_number(node->right, non_numeric)) {
+                    changed |= name_set_add(non_numeric, node->left->data.identifier);
+                }
+                break;
+            case AST_IF_STATEMENT:
+                changed |= collect_non_numeric(node->data.if_stmt.then_branch, non_numeric);
+                changed |= collect_non_numeric(node->data.if_stmt.else_branch, non_numeric);
+                break;
+            case AST_FOR_STATEMENT:
+                // range() loops count natively, other loops iterate over array elements
+                if (!is_range_call(node->data.for_stmt.expression)) {
+                    changed |= name_set_add(non_numeric, node->data.for_stmt.loop_var);
+                }
+                changed |= collect_non_numeric(node->data.for_stmt.body, non_numeric);
+                break;
+            case AST_WHILE_STATEMENT:
+                changed |= collect_non_numeric(node->data.while_stmt.body, non_numeric);
+                break;
+            case AST_BLOCK:
+                changed |= collect_non_numeric(node->left, non_numeric);
+                break;
+            default:
+                break;
+        }
+    }
+    return changed;
+}
+
+static int mark_numeric(ASTNode *node, NameSet *non_numeric) {
+    if (node == NULL) {
+        return 0;
+    }
+    switch (node->type) {
+        case AST_LITERAL:
+            if (is_numeric_literal(node->data.string_value)) {
+                node->number = atof(node->data.string_value);
+                node->numeric = 1;
+            }
+            break;
+        case AST_IDENTIFIER:
+            node->numeric = !name_set_contains(non_numeric, node->data.identifier);
+            break;
+        case AST_BINARY_OP: {
+            int left = mark_numeric(node->left, non_numeric);
+            int right = mark_numeric(node->right, non_numeric);
+            node->numeric = left && right;
+            break;
+        }
+        case AST_ARRAY_ACCESS:
+            mark_numeric(node->left, non_numeric);
+            break;
+        case AST_FUNCTION_CALL:
+            for (ASTNode *arg = node->data.func_call.arguments; arg != NULL; arg = arg->nextblock) {
+                mark_numeric(arg, non_numeric);
+            }
+            break;
+        case AST_SPAWN:
+            // A handle, but the arguments of the call may be numbers
+            mark_numeric(node->left, non_numeric);
+            break;
+        default:
+            break;
+    }
+    return node->numeric;
+}
+
+static void infer_region(ASTNode *node);
+
+static void mark_block(ASTNode *node, NameSet *non_numeric) {
+    for (; node != NULL; node = node->nextblock) {
+        switch (node->type) {
+            case AST_PRINT:
+                mark_numeric(node->left, non_numeric);
+                break;
+            case AST_ASSIGNMENT:
+                if (node->left->type == AST_ARRAY_ACCESS) {
+                    mark_numeric(node->left->left, non_numeric);
+                }
+                mark_numeric(node->right, non_numeric);
+                break;
+            case AST_IF_STATEMENT:
+                mark_numeric(node->data.if_stmt.condition, non_numeric);
+                mark_block(node->data.if_stmt.then_branch, non_numeric);
+                mark_block(node->data.if_stmt.else_branch, non_numeric);
+                break;
+            case AST_FOR_STATEMENT:
+                mark_numeric(node->data.for_stmt.expression, non_numeric);
+                mark_block(node->data.for_stmt.body, non_numeric);
+                break;
+            case AST_WHILE_STATEMENT:
+                mark_numeric(node->data.while_stmt.condition, non_numeric);
+                mark_block(node->data.while_stmt.body, non_numeric);
+                break;
+            case AST_BLOCK:
+                mark_block(node->left, non_numeric);
+                break;
+            case AST_FUNCTION_DEFINITION:
+                infer_region(node->data.func_def.body);
+                break;
+            case AST_FUNCTION_CALL:
+                mark_numeric(node, non_numeric);
+                break;
+            case AST_RETURN_STATEMENT:
+                mark_numeric(node->data.ret_stmt.expression, non_numeric);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+static void infer_region(ASTNode *node) {
+    NameSet non_numeric = {0};
+
+    // A variable assigned from one that is not numeric is not numeric either
+    while (collect_non_numeric(node, &non_numeric)) {
+    }
+    mark_block(node, &non_numeric);
+    free(non_numeric.names);
+}
+
+/*
+ * Automatic parallelization
+ *
+ * A for loop runs as a pfor loop (see kvpar.c) when no iteration depends on
+ * another, so that running the iterations in chunks on several threads and
+ * merging the changes of each chunk leaves the same variables as running
+ * them in order. That holds when the body only:
+ * - writes arrays at the key of the iteration, k in 'for k in range(...)'
+ *   and key(v) in 'for v in a', which no other iteration writes, and
+ *   reads those arrays at that key only
+ * - assigns other variables at its top level before using them, as
+ *   temporaries of the iteration. Anything may be done with them after
+ *   that, and after the loop they hold what the last iteration left
+ * - reads other variables only if the loop does not write them
+ * - calls standard lib functions without side effects, and user-defined
+ *   functions that do not print, spawn tasks, or call functions that do
+ * It must not print, return, or assign the loop variable. Error messages
+ * are the only output such a loop can have, and they may come out in a
+ * different order. Whether a loop found to be parallel is long enough to
+ * be worth running on several threads is decided when it runs, see
+ * execute_pfor_statement_with_return().
+ */
+
+typedef struct {
+    ASTNode *loop;
+    NameSet written;            // Variables the body may write
+    NameSet temporaries;        // Assigned at the top level of the body before any use
+    NameSet indexed;            // Written or read at the key of the iteration only
+    char reason[2 * MAX_TOKEN_LENGTH];  // Why the loop cannot run in parallel
+} LoopAnalysis;
+
+static int reject_loop(LoopAnalysis *analysis, const char *reason, const char *name) {
+    if (analysis->reason[0] == '\0') {
+        snprintf(analysis->reason, sizeof(analysis->reason), reason, name);
+    }
+    return 0;
+}
+
+static int is_builtin(ASTNode *node, kvstdlib_func_t func) {
+    return node != NULL && node->type == AST_FUNCTION_CALL && node->data.func_call.builtin >= 0 &&
+           kvstdlib_entry(node->data.func_call.builtin)->func == func;
+}
+
+// Whether key is one no other iteration uses. Numbers of range(...) are only
+// distinct keys while they keep few digits, which is checked when the loop runs
+static int is_iteration_key(LoopAnalysis *analysis, ASTNode *key) {
+    const char *loop_var = analysis->loop->data.for_stmt.loop_var;
+    if (is_range_call(analysis->loop->data.for_stmt.expression)) {
+        return key->type == AST_IDENTIFIER && strcmp(key->data.identifier, loop_var) == 0;
+    }
+    if (!is_builtin(key, kvstdlib_key)) {
+        return 0;
+    }
+    ASTNode *arg = key->data.func_call.arguments;
+    return arg->type == AST_IDENTIFIER && strcmp(arg->data.identifier, loop_var) == 0;
+}
+
+static int is_pure_code(ASTNode *node, NameSet *checked);
+
+// Functions in checked have been, or are being, found to be pure
+static int is_pure_function(const char *name, NameSet *checked) {
+    FunctionEntry *function = get_function(name);
+    if (function == NULL || function->body == NULL) {
+        // Not defined yet, or its body is not parsed yet (--lazy-functions)
+        return 0;
+    }
+    if (!name_set_add(checked, function->name)) {
+        return 1;
+    }
+    return is_pure_code(function->body, checked);
+}
+
+// Whether code running in a frame of its own has no effect besides its result
+static int is_pure_code(ASTNode *node, NameSet *checked) {
+    for (; node != NULL; node = node->nextblock) {
+        switch (node->type) {
+            case AST_PRINT:
+            case AST_SPAWN:
+            case AST_FUNCTION_DEFINITION:
+                return 0;
+            case AST_FUNCTION_CALL: {
+                int builtin = node->data.func_call.builtin;
+                if (builtin >= 0 ? !(kvstdlib_entry(builtin)->flags & KVSTDLIB_PURE)
+                                 : !is_pure_function(node->data.func_call.name, checked)) {
+                    return 0;
+                }
+                if (!is_pure_code(node->data.func_call.arguments, checked)) {
+                    return 0;
+                }
+                break;
+            }
+            case AST_IF_STATEMENT:
+                if (!is_pure_code(node->data.if_stmt.condition, checked) ||
+                    !is_pure_code(node->data.if_stmt.then_branch, checked) ||
+                    !is_pure_code(node->data.if_stmt.else_branch, checked)) {
+                    return 0;
+                }
+                break;
+            case AST_FOR_STATEMENT:
+                if (!is_pure_code(node->data.for_stmt.expression, checked) ||
+                    !is_pure_code(node->data.for_stmt.body, checked)) {
+                    return 0;
+                }
+                break;
+            case AST_WHILE_STATEMENT:
+                if (!is_pure_code(node->data.while_stmt.condition, checked) ||
+                    !is_pure_code(node->data.while_stmt.body, checked)) {
+                    return 0;
+                }
+                break;
+            case AST_RETURN_STATEMENT:
+                if (!is_pure_code(node->data.ret_stmt.expression, checked)) {
+                    return 0;
+                }
+                break;
+            default:
+                break;
+        }
+        if (!is_pure_code(node->left, checked) || !is_pure_code(node->right, checked)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// A variable read as a whole
+static int check_read(LoopAnalysis *analysis, const char *name) {
+    if (strcmp(name, analysis->loop->data.for_stmt.loop_var) == 0 ||
+        name_set_contains(&analysis->temporaries, name) || !name_set_contains(&analysis->written, name)) {
+        return 1;
+    }
+    return reject_loop(analysis, "reads '%s', which another iteration may have written", name);
+}
+
+static int check_expression(LoopAnalysis *analysis, ASTNode *node) {
+    switch (node->type) {
+        case AST_LITERAL:
+            return 1;
+        case AST_IDENTIFIER:
+            return check_read(analysis, node->data.identifier);
+        case AST_ARRAY_ACCESS: {
+            const char *name = node->data.identifier;
+            if (!check_expression(analysis, node->left)) {
+                return 0;
+            }
+            if (name_set_contains(&analysis->written, name) && !name_set_contains(&analysis->temporaries, name) &&
+                strcmp(name, analysis->loop->data.for_stmt.loop_var) != 0) {
+                if (!is_iteration_key(analysis, node->left)) {
+                    return reject_loop(analysis, "reads '%s' at a key another iteration may have written", name);
+                }
+                name_set_add(&analysis->indexed, name);
+            }
+            return 1;
+        }
+        case AST_BINARY_OP:
+            return check_expression(analysis, node->left) && check_expression(analysis, node->right);
+        case AST_FUNCTION_CALL: {
+            int builtin = node->data.func_call.builtin;
+            int key_args = 0;
+            if (builtin >= 0) {
+                const kvstdlib_lookup_entry_t *entry = kvstdlib_entry(builtin);
+                if (!(entry->flags & KVSTDLIB_PURE)) {
+                    return reject_loop(analysis, "calls %s(), which has side effects", entry->name);
+                }
+                key_args = entry->flags & KVSTDLIB_KEY_ARGS;
+            } else {
+                NameSet checked = {0};
+                int pure = is_pure_function(node->data.func_call.name, &checked);
+                free(checked.names);
+                if (!pure) {
+                    return reject_loop(analysis, "calls %s(), which may have side effects", node->data.func_call.name);
+                }
+            }
+            for (ASTNode *arg = node->data.func_call.arguments; arg != NULL; arg = arg->nextblock) {
+                int ok;
+                if (key_args && arg->type == AST_IDENTIFIER) {
+                    ok = check_read(analysis, arg->data.identifier);
+                } else if (key_args && arg->type == AST_ARRAY_ACCESS) {
+                    // Only the key is evaluated
+                    ok = check_expression(analysis, arg->left);
+                } else {
+                    ok = check_expression(analysis, arg);
+                }
+                if (!ok) {
+                    return 0;
+                }
+            }
+            return 1;
+        }
+        case AST_SPAWN:
+            return reject_loop(analysis, "spawns a task", NULL);
+        default:
+            return reject_loop(analysis, "has an expression it cannot analyse", NULL);
+    }
+}
+
+// A variable assigned as a whole, which has to be a temporary of the iteration
+static int check_assigned(LoopAnalysis *analysis, const char *name, int top_level) {
+    if (strcmp(name, analysis->loop->data.for_stmt.loop_var) == 0) {
+        return reject_loop(analysis, "assigns the loop variable '%s'", name);
+    }
+    if (name_set_contains(&analysis->temporaries, name)) {
+        return 1;
+    }
+    if (!top_level) {
+        return reject_loop(analysis, "assigns '%s' in a branch or an inner loop, before assigning it at the top", name);
+    }
+    if (name_set_contains(&analysis->indexed, name)) {
+        return reject_loop(analysis, "assigns '%s', which it also uses at the key of the iteration", name);
+    }
+    name_set_add(&analysis->temporaries, name);
+    return 1;
+}
+
+static int check_block(LoopAnalysis *analysis, ASTNode *node, int top_level) {
+    for (; node != NULL; node = node->nextblock) {
+        int ok = 1;
+        switch (node->type) {
+            case AST_ASSIGNMENT: {
+                ASTNode *target = node->left;
+                const char *name = target->data.identifier;
+                if (!check_expression(analysis, node->right)) {
+                    return 0;
+                }
+                if (target->type != AST_ARRAY_ACCESS) {
+                    ok = check_assigned(analysis, name, top_level);
+                    break;
+                }
+                if (!check_expression(analysis, target->left)) {
+                    return 0;
+                }
+                ASTNode *iterated = analysis->loop->data.for_stmt.expression;
+                if (strcmp(name, analysis->loop->data.for_stmt.loop_var) == 0) {
+                    ok = reject_loop(analysis, "assigns the loop variable '%s'", name);
+                } else if (name_set_contains(&analysis->temporaries, name)) {
+                    // Its own copy, any key will do
+                } else if (iterated->type == AST_IDENTIFIER && strcmp(iterated->data.identifier, name) == 0) {
+                    ok = reject_loop(analysis, "writes '%s', the array it iterates", name);
+                } else if (!is_iteration_key(analysis, target->left)) {
+                    ok = reject_loop(analysis, "writes '%s' at a key another iteration may use", name);
+                } else {
+                    name_set_add(&analysis->indexed, name);
+                }
+                break;
+            }
+            case AST_PRINT:
+                ok = reject_loop(analysis, "prints", NULL);
+                break;
+            case AST_RETURN_STATEMENT:
+                ok = reject_loop(analysis, "returns from inside the loop", NULL);
+                break;
+            case AST_FUNCTION_DEFINITION:
+                ok = reject_loop(analysis, "defines the function %s()", node->data.func_def.name);
+                break;
+            case AST_IF_STATEMENT:
+                ok = check_expression(analysis, node->data.if_stmt.condition) &&
+                     check_block(analysis, node->data.if_stmt.then_branch, 0) &&
+                     check_block(analysis, node->data.if_stmt.else_branch, 0);
+                break;
+            case AST_FOR_STATEMENT:
+                // An inner loop variable is assigned, and left empty, by every iteration
+                ok = check_expression(analysis, node->data.for_stmt.expression) &&
+                     check_assigned(analysis, node->data.for_stmt.loop_var, top_level) &&
+                     check_block(analysis, node->data.for_stmt.body, 0);
+                break;
+            case AST_WHILE_STATEMENT:
+                ok = check_expression(analysis, node->data.while_stmt.condition) &&
+                     check_block(analysis, node->data.while_stmt.body, 0);
+                break;
+            case AST_BLOCK:
+                ok = check_block(analysis, node->left, 0);
+                break;
+            default:
+                ok = check_expression(analysis, node);
+                break;
+        }
+        if (!ok) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void parallelize_loop(ASTNode *node) {
+    LoopAnalysis analysis = {0};
+    analysis.loop = node;
+
+    LoopScope scope = {0};
+    collect_writes(node->data.for_stmt.body, &scope);
+    for (int i = 0; i < scope.written_count; i++) {
+        name_set_add(&analysis.written, scope.written[i]);
+    }
+    free(scope.written);
+
+    int parallel = check_expression(&analysis, node->data.for_stmt.expression) &&
+                   check_block(&analysis, node->data.for_stmt.body, 1);
+    if (optimize_options.auto_parallel) {
+        node->data.for_stmt.parallel = parallel ? PARALLEL_AUTO : 0;
+    }
+    if (optimize_options.parallel_report) {
+        if (parallel) {
+            printf("line %d: for %s runs in parallel\n", node->line, node->data.for_stmt.loop_var);
+        } else {
+            printf("line %d: for %s runs in order, it %s\n", node->line, node->data.for_stmt.loop_var,
+                   analysis.reason);
+        }
+    }
+
+    free(analysis.written.names);
+    free(analysis.temporaries.names);
+    free(analysis.indexed.names);
+}
+
+static void parallelize_block(ASTNode *node) {
+    for (; node != NULL; node = node->nextblock) {
+        switch (node->type) {
+            case AST_IF_STATEMENT:
+                parallelize_block(node->data.if_stmt.then_branch);
+                parallelize_block(node->data.if_stmt.else_branch);
+                break;
+            case AST_FOR_STATEMENT:
+                if (node->data.for_stmt.parallel != PARALLEL_PFOR) {
+                    parallelize_loop(node);
+                }
+                parallelize_block(node->data.for_stmt.body);
+                break;
+            case AST_WHILE_STATEMENT:
+                parallelize_block(node->data.while_stmt.body);
+                break;
+            case AST_BLOCK:
+                parallelize_block(node->left);
+                break;
+            case AST_FUNCTION_DEFINITION:
+                parallelize_block(node->data.func_def.body);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+void optimize_ast(ASTNode *node) {
+    LoopScope loops[MAX_LOOP_NESTING];
+
+    // Only the statement itself, not the ones that follow it
+    ASTNode *next = node->nextblock;
+    node->nextblock = NULL;
+    // Inline first, so inlined expressions can be hoisted
+    if (optimize_options.inline_functions) {
+        inline_block(node);
+    }
+    infer_region(node);
+    hoist_block(node, loops, 0);
+    if (optimize_options.auto_parallel || optimize_options.parallel_report) {
+        parallelize_block(node);
+    }
+    node->nextblock = next;
+}
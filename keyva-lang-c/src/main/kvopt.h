@@ -0,0 +1,29 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ *  Copyright (C) 2024 Gary Sims
+ *
+ */
+
+#ifndef KVOPT_H
+#define KVOPT_H
+
+#include "kvlang_internals.h"
+
+typedef struct {
+    int inline_functions;   // Substitute calls to small functions, off with --no-inline
+    int inline_threshold;   // Largest return expression inlined, in AST nodes, --inline-threshold=N
+    int static_ast;         // The AST is static data (--emit-c programs), replaced nodes are not freed
+    int auto_parallel;      // Run for loops with independent iterations as pfor loops, off with --no-auto-parallel
+    int parallel_report;    // Print which for loops run in parallel, and why others do not, --parallel-report
+} OptimizeOptions;
+
+extern OptimizeOptions optimize_options;
+
+/*
+ * Optimization passes, run on each statement after it has been parsed and
+ * before it is executed for the first time. Function definitions are
+ * optimized together with the statement that contains them.
+ */
+void optimize_ast(ASTNode *node);
+
+#endif /* KVOPT_H */
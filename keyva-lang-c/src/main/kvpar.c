@@ -0,0 +1,450 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ *  Copyright (C) 2024 Gary Sims
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#define NDEBUG 1
+#include "debug_print.h"
+
+#include "kvlang_internals.h"
+#include "kvmemo.h"
+#include "kvprof.h"
+
+#include "kvtask.h"
+#include "kvbuffer.h"
+
+#include "kvpar.h"
+
+/*
+ * Parallel loops: pfor k in x ... end
+ *
+ * A pfor loop iterates like a for loop, over the pairs of an array or the
+ * numbers of range(...), but splits the iterations into one contiguous
+ * chunk per thread and runs the chunks at the same time. Each chunk runs
+ * in a context of its own, which starts with a copy of the functions and
+ * of the variables of the frame running the loop, so the chunks share
+ * nothing but the array being iterated, which nothing writes to until
+ * they are done.
+ *
+ * When all chunks are done, the changes each one made to the variables
+ * are applied to the frame, one chunk after the other in the order of the
+ * iterations: a key set by several chunks ends up with the value of the
+ * last one, as it would after a for loop, even when that is the value it
+ * had before the loop. Each chunk tracks the pairs and numbers it writes
+ * in its copies of the variables for this, see track_array_writes(). A variable assigned as a whole,
+ * or whose keys were removed, is replaced by the chunk's copy, and one
+ * assigned at the top level of the body ends up with the value the last
+ * iteration gave it. Buffers are merged the same way, number by number.
+ *
+ * Unlike in a for loop, an iteration does not see what other chunks
+ * wrote, and pairs added to the array being iterated are not iterated.
+ * A return ends its chunk, and the loop returns the value of the first
+ * chunk that returned, without the changes made by the chunks after it.
+ * Lines printed by different chunks come out in no particular order.
+ *
+ * for loops whose iterations kvopt.c found to be independent run the same
+ * way, when they have enough iterations, with the results of a for loop.
+ * Only the error messages of their chunks may come out interleaved.
+ */
+
+#define PARALLEL_AUTO_MIN_ITERATIONS 256     // Shorter for loops cost more to split than they gain
+
+int parallel_threads = 0;
+
+int parallel_thread_count(void) {
+    if (parallel_threads > 0) {
+        return parallel_threads;
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 1 ? (int) cpus : 1;
+}
+
+typedef struct {
+    Task task;
+    void (*run)(void *data, int index);
+    void *data;
+    int index;
+} IndexedTask;
+
+static void run_indexed_task(Task *task) {
+    IndexedTask *indexed = (IndexedTask *) task;
+    indexed->run(indexed->data, indexed->index);
+}
+
+void parallel_run(int count, void (*task)(void *data, int index), void *data) {
+    IndexedTask *tasks = (IndexedTask *) calloc(count + 1, sizeof(IndexedTask));
+    for (int i = 0; i < count; i++) {
+        tasks[i].task.run = run_indexed_task;
+        tasks[i].run = task;
+        tasks[i].data = data;
+        tasks[i].index = i;
+        task_submit(&tasks[i].task);
+    }
+    // The last one queued is the first this thread takes back
+    for (int i = count - 1; i >= 0; i--) {
+        task_wait(&tasks[i].task);
+    }
+    free(tasks);
+}
+
+// The profiler keeps one call stack for the process, so it sees one thread
+int parallel_loop_possible(void) {
+    return !kv_context->parallel_worker && !profile_enabled && parallel_thread_count() > 1;
+}
+
+typedef struct {
+    ASTNode *node;
+    KvContext *parent;
+    Variable *frame;            // Copy of the parent's frame before the loop
+    int frame_count;
+    AssocArray *array;          // Pairs or buffer iterated, NULL for range(...)
+    double start;               // range(...): iteration i has the value start + i * step
+    double step;
+    long count;                 // Iterations
+    int chunk_count;
+    KvContext **contexts;       // Of each chunk, NULL if it could not be created
+    FunctionReturn *returns;    // has_return if the chunk ended with a return
+} ParallelLoop;
+
+// A copy of a variable with an array of its own. The string of a native
+// number is brought up to date, so that the copy compares as an array
+static void copy_variable(Variable *copy, Variable *var) {
+    strcpy(copy->name, var->name);
+    copy->is_number = var->is_number;
+    copy->number_value = var->number_value;
+    copy->view = NULL;
+    copy->view_index = 0;
+    if (var->view != NULL) {
+        init_assoc_array(&copy->array);
+        if (var->view_index < var->view->size) {
+            KeyValuePair *pair = &var->view->pairs[var->view_index];
+            set_assoc_array_value(&copy->array, pair->key, pair->value);
+        }
+    } else if (var->array.capacity == 0) {
+        // Left empty by a loop
+        init_assoc_array(&copy->array);
+    } else {
+        duplicate_assoc_array(&copy->array, &var->array);
+    }
+    if (copy->is_number) {
+        format_number(copy->number_value, copy->array.pairs[0].value);
+    }
+}
+
+static void run_chunk(void *data, int chunk) {
+    ParallelLoop *loop = (ParallelLoop *) data;
+    KvContext *parent = loop->parent;
+    KvContext *outer = kv_context;
+    KvContext *context = create_context();
+    loop->contexts[chunk] = context;
+    if (context == NULL) {
+        return;
+    }
+    kv_context = context;
+    context->parallel_worker = 1;
+    context->origin = parent->origin != NULL ? parent->origin : parent;
+
+    // Function bodies are shared, the caches of their results are not
+    for (int i = 0; i < parent->function_count; i++) {
+        FunctionEntry *function = &context->functions[i];
+        *function = parent->functions[i];
+        function->memo = function->memo != NULL ? memo_create(MEMO_CAPACITY) : NULL;
+        function->calls = 0;
+        function->jit = NULL;
+    }
+    context->function_count = parent->function_count;
+    for (int i = 0; i < loop->frame_count; i++) {
+        copy_variable(&context->variables[i], &loop->frame[i]);
+        if (context->variables[i].array.shared == NULL) {
+            track_array_writes(&context->variables[i].array);
+        }
+    }
+    context->variable_count = loop->frame_count;
+
+    ASTNode *node = loop->node;
+    long first = loop->count * chunk / loop->chunk_count;
+    long last = loop->count * (chunk + 1) / loop->chunk_count;
+    unsigned long outer_activation = enter_loop(node);
+    Variable *var = find_variable(node->data.for_stmt.loop_var);
+    if (var == NULL) {
+        var = create_variable(node->data.for_stmt.loop_var);
+    }
+
+    FunctionReturn body_ret = {0};
+    for (long i = first; i < last && var != NULL; i++) {
+        if (loop->array != NULL && loop->array->buffer != NULL) {
+            set_variable_element(var, loop->array->buffer, i);
+        } else if (loop->array != NULL) {
+            attach_variable_view(var, loop->array, (int) i);
+        } else {
+            set_variable_number(var, loop->start + i * loop->step);
+        }
+        body_ret = execute_block_with_return(node->data.for_stmt.body);
+        if (body_ret.has_return) {
+            break;
+        }
+    }
+    leave_loop(node, outer_activation);
+
+    loop->returns[chunk] = body_ret;
+    kv_context = outer;
+}
+
+// Sets the pair at index of a variable's array, where it usually still is
+static void merge_pair(Variable *var, int index, KeyValuePair *pair) {
+    if (index < var->array.size && strcmp(var->array.pairs[index].key, pair->key) == 0) {
+        strcpy(var->array.pairs[index].value, pair->value);
+    } else {
+        set_assoc_array_value(&var->array, pair->key, pair->value);
+    }
+}
+
+// Gives the variable of the current frame the value a chunk left in after
+static void replace_variable(Variable *after) {
+    if (after->is_number) {
+        Variable *var = find_variable(after->name);
+        if (var == NULL) {
+            var = create_variable(after->name);
+        }
+        if (var != NULL) {
+            set_variable_number(var, after->number_value);
+        }
+        return;
+    }
+    if (after->view != NULL) {
+        refresh_variable_view(after);
+    }
+    set_variable_assoc_array(after->name, &after->array);
+}
+
+// A chunk's first write to a buffer copied it, the numbers it wrote are
+// written to the buffer of the frame
+static void merge_buffer(Variable *after) {
+    Variable *var = find_variable(after->name);
+    if (var == NULL || var->array.buffer == NULL || var->array.buffer->length != after->array.buffer->length ||
+        var->array.buffer->type != after->array.buffer->type) {
+        replace_variable(after);
+        return;
+    }
+    TypedBuffer *buffer = buffer_writable(&var->array.buffer);
+    if (buffer != NULL) {
+        buffer_merge(buffer, after->array.buffer, after->array.written);
+    }
+}
+
+// Applies the writes of a chunk to a variable to the current frame, given
+// its value before the loop, or NULL if the chunk created it. A variable
+// the chunk assigned as a whole is no longer tracked, and replaces the
+// frame's. Keys keep their positions when values are written or added
+static void merge_variable(Variable *after, Variable *before) {
+    if (before != NULL && before->array.shared == NULL && after->array.written == NULL) {
+        replace_variable(after);
+        return;
+    }
+    if (after->is_number) {
+        if (before == NULL || after->array.written[0]) {
+            replace_variable(after);
+        }
+        return;
+    }
+    if (after->array.shared != NULL || (before != NULL && before->array.shared != NULL)) {
+        // Writes to a shared array went to its table already
+        if (before == NULL || before->array.shared != after->array.shared) {
+            replace_variable(after);
+        }
+        return;
+    }
+    if (after->array.buffer != NULL || (before != NULL && before->array.buffer != NULL)) {
+        // Buffers the chunk did not write are still shared with the frame
+        TypedBuffer *old = before != NULL ? before->array.buffer : NULL;
+        if (old == NULL || after->array.buffer == NULL || old->length != after->array.buffer->length ||
+            old->type != after->array.buffer->type) {
+            replace_variable(after);
+        } else if (old != after->array.buffer) {
+            merge_buffer(after);
+        }
+        return;
+    }
+
+    if (after->view != NULL) {
+        refresh_variable_view(after);
+    }
+    AssocArray *array = &after->array;
+    AssocArray *old = before != NULL ? &before->array : NULL;
+    int old_size = old != NULL ? old->size : 0;
+    int replaced = array->size < old_size;
+    for (int i = 0; i < old_size && !replaced; i++) {
+        replaced = strcmp(array->pairs[i].key, old->pairs[i].key) != 0;
+    }
+    if (replaced) {
+        replace_variable(after);
+        return;
+    }
+
+    Variable *var = NULL;
+    for (int i = 0; i < array->size; i++) {
+        if (i < old_size && !array->written[i]) {
+            continue;
+        }
+        if (var == NULL) {
+            var = find_variable(after->name);
+            if (var == NULL) {
+                var = create_variable(after->name);
+                if (var == NULL) {
+                    return;
+                }
+            }
+            detach_variable_view(var);
+            sync_variable_string(var);
+        }
+        merge_pair(var, i, &array->pairs[i]);
+    }
+    if (before == NULL && var == NULL && find_variable(after->name) == NULL) {
+        create_variable(after->name);
+    }
+}
+
+static void merge_chunk(ParallelLoop *loop, KvContext *context) {
+    for (int i = 0; i < context->variable_count; i++) {
+        Variable *after = &context->variables[i];
+        if (strcmp(after->name, loop->node->data.for_stmt.loop_var) != 0) {
+            merge_variable(after, i < loop->frame_count ? &loop->frame[i] : NULL);
+        }
+    }
+}
+
+// Variables assigned at the top level of the body are assigned by every
+// iteration, so after the loop they hold what the last one left
+static void merge_temporaries(ParallelLoop *loop, KvContext *context) {
+    for (ASTNode *statement = loop->node->data.for_stmt.body; statement != NULL; statement = statement->nextblock) {
+        const char *name;
+        if (statement->type == AST_ASSIGNMENT && statement->left->type != AST_ARRAY_ACCESS) {
+            name = statement->left->data.identifier;
+        } else if (statement->type == AST_FOR_STATEMENT) {
+            name = statement->data.for_stmt.loop_var;
+        } else {
+            continue;
+        }
+        if (strcmp(name, loop->node->data.for_stmt.loop_var) == 0) {
+            continue;
+        }
+        for (int i = 0; i < context->variable_count; i++) {
+            if (strcmp(context->variables[i].name, name) == 0) {
+                replace_variable(&context->variables[i]);
+                break;
+            }
+        }
+    }
+}
+
+// Loops kvopt.c found to be parallel are not all worth running on several
+// threads, and the numbers of range(...) are distinct keys only while "%g"
+// prints all their digits
+static int worth_parallel(ParallelLoop *loop) {
+    if (loop->count < PARALLEL_AUTO_MIN_ITERATIONS) {
+        return 0;
+    }
+    if (loop->array != NULL) {
+        return 1;
+    }
+    double last = loop->start + (loop->count - 1) * loop->step;
+    return loop->start == floor(loop->start) && loop->step == floor(loop->step) &&
+           fabs(loop->start) < 1e6 && fabs(last) < 1e6;
+}
+
+FunctionReturn execute_pfor_statement_with_return(ASTNode *node) {
+    KvContext *ctx = kv_context;
+    FunctionReturn result = {0};
+
+    ParallelLoop loop = {0};
+    loop.node = node;
+    loop.parent = ctx;
+    AssocArray temp_array = {0};
+    if (is_range_loop(node)) {
+        if (!evaluate_range(node->data.for_stmt.expression, &loop.start, &loop.step, &loop.count)) {
+            return result;
+        }
+    } else {
+        if (!evaluate_for_array(node, &temp_array, &loop.array)) {
+            return result;
+        }
+        loop.count = loop.array->buffer != NULL ? loop.array->buffer->length : loop.array->size;
+    }
+    if (node->data.for_stmt.parallel == PARALLEL_AUTO && !worth_parallel(&loop)) {
+        if (loop.array == NULL) {
+            return run_range_loop(node, loop.start, loop.step, loop.count);
+        }
+        return run_array_loop(node, loop.array, &temp_array);
+    }
+
+    // Chunks only run what is already parsed
+    for (int i = 0; i < ctx->function_count; i++) {
+        load_function_body(&ctx->functions[i]);
+    }
+
+    loop.frame = (Variable *) malloc(sizeof(Variable) * (ctx->variable_count + 1));
+    for (int i = 0; i < ctx->variable_count; i++) {
+        copy_variable(&loop.frame[i], &ctx->variables[i]);
+    }
+    loop.frame_count = ctx->variable_count;
+
+    int threads = parallel_thread_count();
+    loop.chunk_count = loop.count < threads ? (int) loop.count : threads;
+    loop.contexts = (KvContext **) calloc(loop.chunk_count + 1, sizeof(KvContext *));
+    loop.returns = (FunctionReturn *) calloc(loop.chunk_count + 1, sizeof(FunctionReturn));
+    parallel_run(loop.chunk_count, run_chunk, &loop);
+
+    // Without all of its chunks the loop did not run all its iterations,
+    // and none of the changes to the variables are kept
+    int failed = 0;
+    for (int chunk = 0; chunk < loop.chunk_count; chunk++) {
+        failed |= loop.contexts[chunk] == NULL;
+    }
+    if (failed) {
+        printf("Error: Could not create the contexts to run a pfor loop in\n");
+    }
+
+    // In the order of the iterations, up to the first chunk that returned
+    int returned = failed;
+    for (int chunk = 0; chunk < loop.chunk_count; chunk++) {
+        FunctionReturn *chunk_ret = &loop.returns[chunk];
+        if (!returned) {
+            merge_chunk(&loop, loop.contexts[chunk]);
+            if (chunk_ret->has_return) {
+                result = *chunk_ret;
+                returned = 1;
+            } else if (chunk == loop.chunk_count - 1) {
+                merge_temporaries(&loop, loop.contexts[chunk]);
+            }
+        } else if (chunk_ret->has_return && chunk_ret->type == RESULT_ASSOC_ARRAY) {
+            free_assoc_array(chunk_ret->array_value);
+            free(chunk_ret->array_value);
+        }
+        free_context(loop.contexts[chunk]);
+    }
+
+    // Like other for loops, the loop variable is left empty
+    Variable *var = find_variable(node->data.for_stmt.loop_var);
+    if (var == NULL) {
+        var = create_variable(node->data.for_stmt.loop_var);
+    }
+    if (var != NULL) {
+        free_variable_array(var);
+    }
+
+    for (int i = 0; i < loop.frame_count; i++) {
+        free_assoc_array(&loop.frame[i].array);
+    }
+    free(loop.frame);
+    free(loop.contexts);
+    free(loop.returns);
+    free_assoc_array(&temp_array);
+    return result;
+}
@@ -0,0 +1,30 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ *  Copyright (C) 2024 Gary Sims
+ *
+ */
+
+#ifndef KVPAR_H
+#define KVPAR_H
+
+#include "kvlang_internals.h"
+
+// Threads running a pfor loop, 0 for one per online CPU (--threads=N)
+extern int parallel_threads;
+
+// The number of threads parallel_run() uses
+int parallel_thread_count(void);
+
+/*
+ * Calls task(data, i) for each i below count as tasks of kvtask.c, the
+ * calling thread running some of them, and returns when all have returned
+ */
+void parallel_run(int count, void (*task)(void *data, int index), void *data);
+
+// 0 if a pfor loop has to run as a for loop: on one thread, inside
+// another pfor loop, or while profiling
+int parallel_loop_possible(void);
+
+FunctionReturn execute_pfor_statement_with_return(ASTNode *node);
+
+#endif /* KVPAR_H */
@@ -0,0 +1,420 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ *  Copyright (C) 2024 Gary Sims
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/time.h>
+
+#define NDEBUG 1
+#include "debug_print.h"
+
+#include "kvlang_internals.h"
+
+#include "kvprof.h"
+
+/*
+ * Deterministic profiler
+ *
+ * Statements are timed from before to after they execute, so the time of
+ * a line includes the statements nested in it and the functions they call.
+ * Like the inclusive time of functions, it only counts the outermost of
+ * the statements of a line being executed, so recursion is not counted
+ * twice. Lines are keyed by the line number alone, a script run from the
+ * REPL has each input numbered from 1.
+ *
+ * Function calls are kept on a stack of their own. The time of a call is
+ * added to its caller's children, so the exclusive time of a function is
+ * its time less that of the calls it makes. The inclusive time of a
+ * recursive function only counts its outermost call. Statements compiled
+ * to machine code by --jit, or to C by --emit-c, are not seen one by one.
+ *
+ * Sampling profiler
+ *
+ * With --sample-profile the same hooks only maintain a shadow stack: the
+ * functions being called, each with the line it is executing. Frame 0 is
+ * the script itself. A SIGPROF timer interrupts the interpreter, and the
+ * handler adds the shadow stack to a table of stacks with their sample
+ * counts. The table is allocated up front and the handler does nothing
+ * but read the stack and update the table, so it is safe in a signal
+ * handler. The stacks are written in the folded format of flamegraph.pl,
+ * one per line: "main:12;fib:5;fib:5 42".
+ */
+
+#define PROFILE_MAX_FUNCTIONS 128
+#define PROFILE_MAX_DEPTH 1024
+#define PROFILE_SOURCE_WIDTH 48
+
+#define SAMPLE_INTERVAL_US 1000     // Of process CPU time
+#define SAMPLE_MAX_DEPTH 64         // Deeper stacks keep their outermost frames
+#define SAMPLE_TABLE_SIZE 4096      // Distinct stacks, a power of 2
+#define SAMPLE_MAX_PROBES 64
+
+int profile_enabled = 0;
+
+typedef struct {
+    unsigned long count;
+    unsigned long long time;    // Nanoseconds
+    int active;                 // Statements of the line being executed
+} LineProfile;
+
+typedef struct {
+    FunctionEntry *function;
+    unsigned long calls;
+    unsigned long long inclusive;
+    unsigned long long exclusive;
+    int active;                 // Calls of the function on the stack
+} FunctionProfile;
+
+typedef struct {
+    FunctionProfile *profile;   // NULL if there are too many functions
+    unsigned long long start;
+    unsigned long long children;
+} CallFrame;
+
+static LineProfile *lines = NULL;
+static int line_capacity = 0;
+static unsigned long statement_count = 0;
+static unsigned long long total_time = 0;
+static int statement_depth = 0;
+
+static FunctionProfile function_profiles[PROFILE_MAX_FUNCTIONS];
+static int function_profile_count = 0;
+static CallFrame call_stack[PROFILE_MAX_DEPTH];
+static int call_depth = 0;
+static int untracked_depth = 0;     // Calls deeper than PROFILE_MAX_DEPTH
+
+typedef struct {
+    const char *name;
+    int line;
+} ShadowFrame;
+
+typedef struct {
+    unsigned long hash;
+    unsigned long count;        // 0 for free slots
+    int depth;
+    ShadowFrame frames[SAMPLE_MAX_DEPTH];
+} SampledStack;
+
+static int sampling = 0;
+static const char *sample_path = NULL;
+static volatile ShadowFrame shadow_stack[PROFILE_MAX_DEPTH];
+static volatile sig_atomic_t shadow_depth = 1;
+static SampledStack *sample_table = NULL;
+static volatile unsigned long samples_dropped = 0;
+
+static unsigned long long profile_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + (unsigned long long) ts.tv_nsec;
+}
+
+static LineProfile *line_profile(int line) {
+    if (line >= line_capacity) {
+        int new_capacity = line_capacity > 0 ? line_capacity : 256;
+        while (new_capacity <= line) {
+            new_capacity *= 2;
+        }
+        LineProfile *new_lines = realloc(lines, new_capacity * sizeof(LineProfile));
+        if (new_lines == NULL) {
+            return NULL;
+        }
+        memset(new_lines + line_capacity, 0, (new_capacity - line_capacity) * sizeof(LineProfile));
+        lines = new_lines;
+        line_capacity = new_capacity;
+    }
+    return &lines[line];
+}
+
+void profile_begin_statement(ProfileMark *mark, const ASTNode *node) {
+    if (sampling) {
+        // The line to go back to when the statement is done
+        volatile ShadowFrame *frame = &shadow_stack[shadow_depth - 1];
+        mark->line = frame->line;
+        frame->line = node->line;
+        return;
+    }
+    LineProfile *line = line_profile(node->line);
+    mark->line = -1;
+    if (line != NULL) {
+        line->count++;
+        line->active++;
+        mark->line = node->line;
+    }
+    statement_count++;
+    statement_depth++;
+    mark->start = profile_now();
+}
+
+void profile_end_statement(const ProfileMark *mark) {
+    if (sampling) {
+        shadow_stack[shadow_depth - 1].line = mark->line;
+        return;
+    }
+    unsigned long long elapsed = profile_now() - mark->start;
+    if (--statement_depth == 0) {
+        total_time += elapsed;
+    }
+    // Nested statements may have grown lines, so it is indexed again
+    if (mark->line >= 0 && --lines[mark->line].active == 0) {
+        lines[mark->line].time += elapsed;
+    }
+}
+
+static FunctionProfile *find_profile(FunctionEntry *function) {
+    for (int i = 0; i < function_profile_count; i++) {
+        if (function_profiles[i].function == function) {
+            return &function_profiles[i];
+        }
+    }
+    if (function_profile_count == PROFILE_MAX_FUNCTIONS) {
+        return NULL;
+    }
+    FunctionProfile *profile = &function_profiles[function_profile_count++];
+    profile->function = function;
+    return profile;
+}
+
+void profile_enter_function(FunctionEntry *function) {
+    if (sampling) {
+        if (shadow_depth == PROFILE_MAX_DEPTH) {
+            untracked_depth++;
+            return;
+        }
+        // The frame is complete before the handler can see it
+        shadow_stack[shadow_depth].name = function->name;
+        shadow_stack[shadow_depth].line = 0;
+        shadow_depth++;
+        return;
+    }
+    if (call_depth == PROFILE_MAX_DEPTH) {
+        untracked_depth++;
+        return;
+    }
+    CallFrame *frame = &call_stack[call_depth++];
+    frame->profile = find_profile(function);
+    frame->children = 0;
+    if (frame->profile != NULL) {
+        frame->profile->calls++;
+        frame->profile->active++;
+    }
+    frame->start = profile_now();
+}
+
+void profile_leave_function() {
+    if (untracked_depth > 0) {
+        untracked_depth--;
+        return;
+    }
+    if (sampling) {
+        shadow_depth--;
+        return;
+    }
+    CallFrame *frame = &call_stack[--call_depth];
+    unsigned long long elapsed = profile_now() - frame->start;
+    if (frame->profile != NULL) {
+        frame->profile->exclusive += elapsed - frame->children;
+        if (--frame->profile->active == 0) {
+            frame->profile->inclusive += elapsed;
+        }
+    }
+    if (call_depth > 0) {
+        call_stack[call_depth - 1].children += elapsed;
+    }
+}
+
+// Not memcmp(), which is not async-signal-safe
+static int same_frames(const ShadowFrame *a, const ShadowFrame *b, int depth) {
+    for (int i = 0; i < depth; i++) {
+        if (a[i].name != b[i].name || a[i].line != b[i].line) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void sample_handler(int signal) {
+    (void) signal;
+    int depth = shadow_depth;
+    if (depth > SAMPLE_MAX_DEPTH) {
+        depth = SAMPLE_MAX_DEPTH;
+    }
+
+    ShadowFrame frames[SAMPLE_MAX_DEPTH];
+    unsigned long hash = 2166136261UL;
+    for (int i = 0; i < depth; i++) {
+        frames[i].name = shadow_stack[i].name;
+        frames[i].line = shadow_stack[i].line;
+        hash = (hash ^ (unsigned long) frames[i].name) * 16777619UL;
+        hash = (hash ^ (unsigned long) frames[i].line) * 16777619UL;
+    }
+
+    for (int probe = 0; probe < SAMPLE_MAX_PROBES; probe++) {
+        SampledStack *stack = &sample_table[(hash + probe) & (SAMPLE_TABLE_SIZE - 1)];
+        if (stack->count == 0) {
+            stack->hash = hash;
+            stack->depth = depth;
+            for (int i = 0; i < depth; i++) {
+                stack->frames[i] = frames[i];
+            }
+            stack->count = 1;
+            return;
+        }
+        if (stack->hash == hash && stack->depth == depth && same_frames(stack->frames, frames, depth)) {
+            stack->count++;
+            return;
+        }
+    }
+    samples_dropped++;
+}
+
+int profile_start_sampling(const char *path) {
+    sample_table = calloc(SAMPLE_TABLE_SIZE, sizeof(SampledStack));
+    if (sample_table == NULL) {
+        printf("Error: Memory allocation failed\n");
+        return 0;
+    }
+    sample_path = path;
+    sampling = 1;
+    profile_enabled = 1;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = sample_handler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    struct itimerval timer = { { 0, SAMPLE_INTERVAL_US }, { 0, SAMPLE_INTERVAL_US } };
+    if (sigaction(SIGPROF, &action, NULL) != 0 || setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+        printf("Error: Could not start the sampling timer\n");
+        return 0;
+    }
+    return 1;
+}
+
+static void write_samples() {
+    struct itimerval timer = { { 0, 0 }, { 0, 0 } };
+    setitimer(ITIMER_PROF, &timer, NULL);
+
+    FILE *out = fopen(sample_path, "w");
+    if (out == NULL) {
+        printf("Error: Could not write profile '%s'\n", sample_path);
+        return;
+    }
+    unsigned long total = 0;
+    for (int i = 0; i < SAMPLE_TABLE_SIZE; i++) {
+        SampledStack *stack = &sample_table[i];
+        if (stack->count == 0) {
+            continue;
+        }
+        for (int f = 0; f < stack->depth; f++) {
+            // A function which has not started or has finished its statements has no line
+            const char *name = f == 0 ? "main" : stack->frames[f].name;
+            fprintf(out, "%s%s", f > 0 ? ";" : "", name);
+            if (stack->frames[f].line > 0) {
+                fprintf(out, ":%d", stack->frames[f].line);
+            }
+        }
+        fprintf(out, " %lu\n", stack->count);
+        total += stack->count;
+    }
+    fclose(out);
+
+    if (samples_dropped > 0) {
+        printf("Warning: %lu samples dropped, too many distinct stacks\n", samples_dropped);
+    }
+    printf("Wrote %lu samples to %s\n", total, sample_path);
+}
+
+static int compare_functions(const void *a, const void *b) {
+    const FunctionProfile *x = a;
+    const FunctionProfile *y = b;
+    return (x->exclusive < y->exclusive) - (x->exclusive > y->exclusive);
+}
+
+static const LineProfile *sorted_base;
+
+static int compare_lines(const void *a, const void *b) {
+    const LineProfile *x = &sorted_base[*(const int *) a];
+    const LineProfile *y = &sorted_base[*(const int *) b];
+    if (x->time != y->time) {
+        return (x->time < y->time) - (x->time > y->time);
+    }
+    return *(const int *) a - *(const int *) b;
+}
+
+static double percent(unsigned long long time) {
+    return total_time > 0 ? 100.0 * (double) time / (double) total_time : 0.0;
+}
+
+// Prints line number line of source, without its indentation
+static void print_source_line(const char *source, int line) {
+    if (source == NULL || line < 1) {
+        return;
+    }
+    const char *p = source;
+    for (int i = 1; i < line && p != NULL; i++) {
+        p = strchr(p, '\n');
+        if (p != NULL) {
+            p++;
+        }
+    }
+    if (p == NULL) {
+        return;
+    }
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+    int length = (int) strcspn(p, "\r\n");
+    if (length > PROFILE_SOURCE_WIDTH) {
+        printf("  %.*s...", PROFILE_SOURCE_WIDTH - 3, p);
+    } else {
+        printf("  %.*s", length, p);
+    }
+}
+
+void profile_report(const char *source) {
+    if (sampling) {
+        write_samples();
+        return;
+    }
+    printf("\nProfile: %lu statements in %.6f s\n", statement_count, total_time / 1e9);
+
+    if (function_profile_count > 0) {
+        qsort(function_profiles, function_profile_count, sizeof(FunctionProfile), compare_functions);
+        printf("\n%-24s %12s %14s %8s %14s %8s\n",
+               "function", "calls", "inclusive (s)", "%", "exclusive (s)", "%");
+        for (int i = 0; i < function_profile_count; i++) {
+            FunctionProfile *profile = &function_profiles[i];
+            printf("%-24s %12lu %14.6f %7.1f%% %14.6f %7.1f%%\n", profile->function->name, profile->calls,
+                   profile->inclusive / 1e9, percent(profile->inclusive),
+                   profile->exclusive / 1e9, percent(profile->exclusive));
+        }
+    }
+
+    int executed = 0;
+    int *order = malloc((line_capacity > 0 ? line_capacity : 1) * sizeof(int));
+    if (order == NULL) {
+        return;
+    }
+    for (int line = 0; line < line_capacity; line++) {
+        if (lines[line].count > 0) {
+            order[executed++] = line;
+        }
+    }
+    sorted_base = lines;
+    qsort(order, executed, sizeof(int), compare_lines);
+
+    printf("\n%6s %12s %14s %8s  %s\n", "line", "count", "time (s)", "%", "source");
+    for (int i = 0; i < executed; i++) {
+        LineProfile *profile = &lines[order[i]];
+        printf("%6d %12lu %14.6f %7.1f%%", order[i], profile->count, profile->time / 1e9, percent(profile->time));
+        print_source_line(source, order[i]);
+        printf("\n");
+    }
+    free(order);
+}
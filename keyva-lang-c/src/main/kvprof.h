@@ -0,0 +1,50 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ *  Copyright (C) 2024 Gary Sims
+ *
+ */
+
+#ifndef KVPROF_H
+#define KVPROF_H
+
+#include "kvlang_internals.h"
+
+/*
+ * Deterministic profiler (--profile)
+ *
+ * Every statement executed by the interpreter is counted and timed, and
+ * so is every call of a user function. The hooks in kvinterp.c only test
+ * profile_enabled, so a run without --profile does no other work.
+ *
+ * Sampling profiler (--sample-profile=FILE)
+ *
+ * The same hooks keep a stack of the functions being called and their
+ * current lines, which is sampled on a timer and written to FILE as
+ * folded stacks for flamegraph.pl.
+ */
+
+extern int profile_enabled;
+
+// A statement being timed
+typedef struct {
+    int line;                   // -1 if the line is not counted, the line to restore when sampling
+    unsigned long long start;
+} ProfileMark;
+
+// Around each statement executed
+void profile_begin_statement(ProfileMark *mark, const ASTNode *node);
+void profile_end_statement(const ProfileMark *mark);
+
+// Around each call of a user function, after its arguments are evaluated
+void profile_enter_function(FunctionEntry *function);
+void profile_leave_function();
+
+// Switches the hooks to sampling, returns 0 if the timer cannot be started
+int profile_start_sampling(const char *path);
+
+// Prints the functions and lines, the most expensive first. source is the
+// program text, to show the lines, or NULL. When sampling, writes the
+// sampled stacks instead
+void profile_report(const char *source);
+
+#endif /* KVPROF_H */
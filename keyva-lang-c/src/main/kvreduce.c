@@ -0,0 +1,335 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ *  Copyright (C) 2024 Gary Sims
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define NDEBUG 1
+#include "debug_print.h"
+
+#include "kvlang_internals.h"
+
+#include "kvreduce.h"
+#include "kvpar.h"
+#include "kvbuffer.h"
+
+/*
+ * Reductions of arrays: sum(), min(), max(), mean() and count_if()
+ *
+ * The values are parsed a block at a time into doubles, and each block is
+ * added up and compared with SSE2 where the compiler targets it. Arrays are
+ * cut into chunks of a fixed number of values, reduced on the threads of
+ * kvpar.c when there are enough of them, and the chunk results combined in
+ * order, so the result does not depend on the number of threads. It may
+ * differ from a for loop in the last bits of a sum, which is added in a
+ * different order.
+ *
+ * The numbers of a buffer (kvbuffer.c) need no parsing: doubles are
+ * reduced where they are, and integers converted to doubles a block at a
+ * time.
+ */
+
+#define REDUCE_BLOCK 256                // Values parsed before they are reduced
+#define REDUCE_CHUNK 16384              // Values per chunk
+#define REDUCE_PARALLEL_MIN 65536       // Values from which chunks run on several threads
+
+typedef struct {
+    const AssocArray *array;
+    OperatorType op;                    // count_array()
+    const EvalResult *operand;
+    Reduction *reductions;              // Of each chunk
+    long *counts;
+    int *bad;                           // Of each chunk, -1 if all values could be used
+    Reduction first_reduction;          // Used when there is one chunk, as most arrays have
+    long first_count;
+    int first_bad;
+} ReduceJob;
+
+// Powers of ten a double holds exactly
+static const double powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Decimals of up to 15 digits and no exponent are converted exactly without
+// strtod(): the digits and the power of ten are exact doubles, so their
+// quotient is the correctly rounded value, as atof() gives
+int parse_number(const char *value, double *number) {
+    if (!(isdigit((unsigned char) value[0]) || (value[0] == '-' && isdigit((unsigned char) value[1])))) {
+        return 0;
+    }
+    const char *p = value[0] == '-' ? value + 1 : value;
+    unsigned long long digits = 0;
+    int count = 0;
+    int decimals = 0;
+    for (; isdigit((unsigned char) *p) && count < 15; p++, count++) {
+        digits = digits * 10 + (*p - '0');
+    }
+    if (*p == '.') {
+        for (p++; isdigit((unsigned char) *p) && count < 15; p++, count++, decimals++) {
+            digits = digits * 10 + (*p - '0');
+        }
+    }
+    if (*p != '\0') {
+        *number = atof(value);
+        return 1;
+    }
+    double result = (double) digits / powers_of_ten[decimals];
+    *number = value[0] == '-' ? -result : result;
+    return 1;
+}
+
+static void reduce_block(const double *values, int n, Reduction *reduction) {
+    int i = 0;
+    double sum = 0;
+#ifdef __SSE2__
+    if (n >= 4) {
+        __m128d sum0 = _mm_setzero_pd();
+        __m128d sum1 = _mm_setzero_pd();
+        __m128d low = _mm_set1_pd(reduction->min);
+        __m128d high = _mm_set1_pd(reduction->max);
+        for (; i + 4 <= n; i += 4) {
+            __m128d a = _mm_loadu_pd(values + i);
+            __m128d b = _mm_loadu_pd(values + i + 2);
+            sum0 = _mm_add_pd(sum0, a);
+            sum1 = _mm_add_pd(sum1, b);
+            low = _mm_min_pd(low, _mm_min_pd(a, b));
+            high = _mm_max_pd(high, _mm_max_pd(a, b));
+        }
+        double lanes[2];
+        _mm_storeu_pd(lanes, _mm_add_pd(sum0, sum1));
+        sum = lanes[0] + lanes[1];
+        _mm_storeu_pd(lanes, low);
+        reduction->min = lanes[0] < lanes[1] ? lanes[0] : lanes[1];
+        _mm_storeu_pd(lanes, high);
+        reduction->max = lanes[0] > lanes[1] ? lanes[0] : lanes[1];
+    }
+#endif
+    for (; i < n; i++) {
+        sum += values[i];
+        if (values[i] < reduction->min) {
+            reduction->min = values[i];
+        }
+        if (values[i] > reduction->max) {
+            reduction->max = values[i];
+        }
+    }
+    reduction->sum += sum;
+    reduction->count += n;
+}
+
+static int compare_numbers(OperatorType op, double a, double b) {
+    switch (op) {
+        case OP_EQUAL: return a == b;
+        case OP_NOT_EQUAL: return a != b;
+        case OP_LESS_THAN: return a < b;
+        case OP_LESS_EQUAL: return a <= b;
+        case OP_GREATER_THAN: return a > b;
+        case OP_GREATER_EQUAL: return a >= b;
+        default: return 0;
+    }
+}
+
+static long count_block(const double *values, int n, OperatorType op, double operand) {
+    long count = 0;
+    int i = 0;
+#ifdef __SSE2__
+    __m128d b = _mm_set1_pd(operand);
+    for (; i + 2 <= n; i += 2) {
+        __m128d a = _mm_loadu_pd(values + i);
+        __m128d match;
+        switch (op) {
+            case OP_EQUAL: match = _mm_cmpeq_pd(a, b); break;
+            case OP_NOT_EQUAL: match = _mm_cmpneq_pd(a, b); break;
+            case OP_LESS_THAN: match = _mm_cmplt_pd(a, b); break;
+            case OP_LESS_EQUAL: match = _mm_cmple_pd(a, b); break;
+            case OP_GREATER_THAN: match = _mm_cmpgt_pd(a, b); break;
+            case OP_GREATER_EQUAL: match = _mm_cmpge_pd(a, b); break;
+            default: match = _mm_setzero_pd(); break;
+        }
+        count += __builtin_popcount(_mm_movemask_pd(match));
+    }
+#endif
+    for (; i < n; i++) {
+        count += compare_numbers(op, values[i], operand);
+    }
+    return count;
+}
+
+// Values of array, the numbers of its buffer if it has one
+static long array_length(const AssocArray *array) {
+    return array->buffer != NULL ? array->buffer->length : array->size;
+}
+
+static void reduce_chunk(void *data, int chunk) {
+    ReduceJob *job = (ReduceJob *) data;
+    const KeyValuePair *pairs = job->array->pairs;
+    const TypedBuffer *buffer = job->array->buffer;
+    long first = (long) chunk * REDUCE_CHUNK;
+    long last = first + REDUCE_CHUNK < array_length(job->array) ? first + REDUCE_CHUNK : array_length(job->array);
+    Reduction reduction = { 0, INFINITY, -INFINITY, 0 };
+    double block[REDUCE_BLOCK];
+
+    job->bad[chunk] = -1;
+    if (buffer != NULL) {
+        for (long i = first; i < last; i += REDUCE_BLOCK) {
+            int n = last - i < REDUCE_BLOCK ? (int) (last - i) : REDUCE_BLOCK;
+            reduce_block(buffer_doubles(buffer, i, n, block), n, &reduction);
+        }
+        job->reductions[chunk] = reduction;
+        return;
+    }
+    for (int i = first; i < last; i += REDUCE_BLOCK) {
+        int n = last - i < REDUCE_BLOCK ? last - i : REDUCE_BLOCK;
+        for (int j = 0; j < n; j++) {
+            if (!parse_number(pairs[i + j].value, &block[j])) {
+                job->bad[chunk] = i + j;
+                return;
+            }
+        }
+        reduce_block(block, n, &reduction);
+    }
+    job->reductions[chunk] = reduction;
+}
+
+static void count_chunk(void *data, int chunk) {
+    ReduceJob *job = (ReduceJob *) data;
+    const KeyValuePair *pairs = job->array->pairs;
+    const TypedBuffer *buffer = job->array->buffer;
+    long first = (long) chunk * REDUCE_CHUNK;
+    long last = first + REDUCE_CHUNK < array_length(job->array) ? first + REDUCE_CHUNK : array_length(job->array);
+    int by_string = job->op == OP_EQUAL || job->op == OP_NOT_EQUAL;
+    const EvalResult *operand = job->operand;
+    char operand_string[MAX_TOKEN_LENGTH];
+    double block[REDUCE_BLOCK];
+    long count = 0;
+
+    job->bad[chunk] = -1;
+    if (buffer != NULL) {
+        if (operand->type != RESULT_NUMBER) {
+            // Only == and != take a string, which no number is equal to
+            job->counts[chunk] = job->op == OP_NOT_EQUAL ? last - first : 0;
+            return;
+        }
+        for (long i = first; i < last; i += REDUCE_BLOCK) {
+            int n = last - i < REDUCE_BLOCK ? (int) (last - i) : REDUCE_BLOCK;
+            count += count_block(buffer_doubles(buffer, i, n, block), n, job->op, operand->number_value);
+        }
+        job->counts[chunk] = count;
+        return;
+    }
+
+    if (operand->type == RESULT_NUMBER) {
+        snprintf(operand_string, MAX_TOKEN_LENGTH, "%g", operand->number_value);
+    } else {
+        strcpy(operand_string, operand->string_value);
+    }
+    for (int i = first; i < last; i += REDUCE_BLOCK) {
+        int n = last - i < REDUCE_BLOCK ? last - i : REDUCE_BLOCK;
+        int numbers = operand->type == RESULT_NUMBER;
+        for (int j = 0; j < n && numbers; j++) {
+            numbers = parse_number(pairs[i + j].value, &block[j]);
+        }
+        if (numbers) {
+            count += count_block(block, n, job->op, operand->number_value);
+            continue;
+        }
+        // Some values are strings, compare them one by one
+        for (int j = 0; j < n; j++) {
+            double value;
+            if (operand->type == RESULT_NUMBER && parse_number(pairs[i + j].value, &value)) {
+                count += compare_numbers(job->op, value, operand->number_value);
+            } else if (by_string) {
+                int equal = strcmp(pairs[i + j].value, operand_string) == 0;
+                count += job->op == OP_EQUAL ? equal : !equal;
+            } else {
+                job->bad[chunk] = i + j;
+                return;
+            }
+        }
+    }
+    job->counts[chunk] = count;
+}
+
+// Runs each chunk of job, on several threads if there are enough values
+static int run_chunks(ReduceJob *job, void (*run)(void *data, int chunk)) {
+    long size = array_length(job->array);
+    int chunks = (int) ((size + REDUCE_CHUNK - 1) / REDUCE_CHUNK);
+    if (chunks == 0) {
+        return 0;
+    }
+    if (chunks == 1) {
+        job->reductions = &job->first_reduction;
+        job->counts = &job->first_count;
+        job->bad = &job->first_bad;
+        run(job, 0);
+        return 1;
+    }
+    job->reductions = (Reduction *) malloc(sizeof(Reduction) * chunks);
+    job->counts = (long *) malloc(sizeof(long) * chunks);
+    job->bad = (int *) malloc(sizeof(int) * chunks);
+    if (size >= REDUCE_PARALLEL_MIN && parallel_loop_possible()) {
+        parallel_run(chunks, run, job);
+    } else {
+        for (int i = 0; i < chunks; i++) {
+            run(job, i);
+        }
+    }
+    return chunks;
+}
+
+static void free_job(ReduceJob *job) {
+    if (job->reductions == &job->first_reduction) {
+        return;
+    }
+    free(job->reductions);
+    free(job->counts);
+    free(job->bad);
+}
+
+int reduce_array(const AssocArray *array, Reduction *reduction, int *bad) {
+    ReduceJob job = { .array = array };
+    int chunks = run_chunks(&job, reduce_chunk);
+    Reduction total = { 0, INFINITY, -INFINITY, 0 };
+    int ok = 1;
+    for (int i = 0; i < chunks; i++) {
+        if (job.bad[i] >= 0) {
+            *bad = job.bad[i];
+            ok = 0;
+            break;
+        }
+        total.sum += job.reductions[i].sum;
+        total.min = job.reductions[i].min < total.min ? job.reductions[i].min : total.min;
+        total.max = job.reductions[i].max > total.max ? job.reductions[i].max : total.max;
+        total.count += job.reductions[i].count;
+    }
+    free_job(&job);
+    *reduction = total;
+    return ok;
+}
+
+long count_array(const AssocArray *array, OperatorType op, const EvalResult *operand, int *bad) {
+    ReduceJob job = { .array = array, .op = op, .operand = operand };
+    int chunks = run_chunks(&job, count_chunk);
+    long count = 0;
+    for (int i = 0; i < chunks; i++) {
+        if (job.bad[i] >= 0) {
+            *bad = job.bad[i];
+            count = -1;
+            break;
+        }
+        count += job.counts[i];
+    }
+    free_job(&job);
+    return count;
+}
@@ -0,0 +1,34 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ *  Copyright (C) 2024 Gary Sims
+ *
+ */
+
+#ifndef KVREDUCE_H
+#define KVREDUCE_H
+
+#include "kvlang_internals.h"
+
+typedef struct {
+    double sum;
+    double min;
+    double max;
+    long count;
+} Reduction;
+
+// The number in value, as the interpreter reads one: 0 if it does not start
+// with a digit or a minus sign and a digit
+int parse_number(const char *value, double *number);
+
+// Sums the values of array and finds the smallest and largest. Returns 0,
+// with the index of the first value that is not a number in bad, if there
+// is one
+int reduce_array(const AssocArray *array, Reduction *reduction, int *bad);
+
+// Counts the values v of array for which v op operand holds (OP_EQUAL to
+// OP_GREATER_EQUAL). == and != compare as strings unless both sides are
+// numbers, the others need numbers: returns -1, with the index of the
+// value in bad, otherwise
+long count_array(const AssocArray *array, OperatorType op, const EvalResult *operand, int *bad);
+
+#endif /* KVREDUCE_H */
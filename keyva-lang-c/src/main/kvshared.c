@@ -0,0 +1,380 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ *  Copyright (C) 2024 Gary Sims
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define NDEBUG 1
+#include "debug_print.h"
+
+#include "kvlang_internals.h"
+
+#include "kvshared.h"
+
+/*
+ * Shared arrays: t = shared("name")
+ *
+ * A shared array is a table of the process, the same for every context and
+ * thread that asks for its name, meant for data that many threads read and
+ * few write, like configuration and lookup tables. Variables and arguments
+ * hold a handle to the table, in AssocArray.shared: set_assoc_array_value()
+ * and get_assoc_array_value() go to the table, and a variable read as a
+ * whole gets a snapshot of it, sorted by key so that it does not depend on
+ * the order in which threads added their keys.
+ *
+ * The table is a chained hash table whose entries are never changed once
+ * they are linked. A read walks a chain without taking any lock, while a
+ * write takes the lock of the chain's stripe, links a new entry in place
+ * of the old one, and retires the old one. Growing the table takes every
+ * stripe lock and links copies of all entries into a new array of chains.
+ *
+ * Retired memory is freed with epoch-based reclamation: each thread
+ * announces the global epoch while it reads, and memory retired in epoch E
+ * is freed once the epoch has reached E + 2, which it can only do after
+ * every thread that was reading in epoch E has finished.
+ */
+
+#define SHARED_STRIPES 64           // Writer locks, a power of 2
+#define SHARED_MIN_BUCKETS 64       // A power of 2, not below SHARED_STRIPES, so a chain has one stripe
+#define SHARED_RECLAIM_EVERY 64     // Retirements between attempts to free retired memory
+
+_Thread_local unsigned long shared_reads = 0;
+
+// Memory waiting until no thread can still be reading it
+typedef struct Retired {
+    struct Retired *next;
+    unsigned long epoch;
+} Retired;
+
+typedef struct SharedEntry {
+    Retired retired;                // First, so that a Retired is freed as the entry
+    struct SharedEntry *next;       // In the chain
+    unsigned long hash;
+    char key[MAX_TOKEN_LENGTH];
+    char value[MAX_TOKEN_LENGTH];
+} SharedEntry;
+
+typedef struct {
+    Retired retired;
+    unsigned long count;            // Chains, a power of 2
+    SharedEntry *heads[];
+} SharedBuckets;
+
+typedef struct {
+    pthread_mutex_t lock;
+} __attribute__((aligned(64))) SharedStripe;
+
+struct SharedTable {
+    struct SharedTable *next;       // In the list of all tables
+    char name[MAX_TOKEN_LENGTH];
+    SharedBuckets *buckets;
+    int size;
+    SharedStripe stripes[SHARED_STRIPES];   // Chain i is written under stripes[i % SHARED_STRIPES]
+};
+
+static SharedTable *tables = NULL;
+static pthread_mutex_t tables_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// A thread that reads or writes shared arrays. Kept for good, and taken
+// over by a new thread when its thread ends
+typedef struct EpochThread {
+    struct EpochThread *next;
+    int in_use;
+    unsigned long epoch;            // Announced while reading, 0 otherwise
+    int nesting;
+    Retired *retired;               // Most recently retired first
+    unsigned long retire_count;
+} EpochThread;
+
+static EpochThread *epoch_threads = NULL;
+static unsigned long global_epoch = 1;
+static pthread_key_t epoch_key;
+static pthread_once_t epoch_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local EpochThread *own_thread = NULL;
+
+static void release_epoch_thread(void *data) {
+    EpochThread *self = (EpochThread *) data;
+    // What it retired is freed by the next thread to take it over
+    __atomic_store_n(&self->epoch, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&self->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void create_epoch_key(void) {
+    pthread_key_create(&epoch_key, release_epoch_thread);
+}
+
+static EpochThread *epoch_thread(void) {
+    if (own_thread != NULL) {
+        return own_thread;
+    }
+    pthread_once(&epoch_key_once, create_epoch_key);
+    EpochThread *self = NULL;
+    for (EpochThread *t = __atomic_load_n(&epoch_threads, __ATOMIC_ACQUIRE); t != NULL; t = t->next) {
+        int free_record = 0;
+        if (__atomic_compare_exchange_n(&t->in_use, &free_record, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            self = t;
+            break;
+        }
+    }
+    if (self == NULL) {
+        self = (EpochThread *) calloc(1, sizeof(EpochThread));
+        self->in_use = 1;
+        self->next = __atomic_load_n(&epoch_threads, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&epoch_threads, &self->next, self, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    }
+    pthread_setspecific(epoch_key, self);
+    own_thread = self;
+    return self;
+}
+
+static EpochThread *epoch_enter(void) {
+    EpochThread *self = epoch_thread();
+    if (self->nesting++ == 0) {
+        __atomic_store_n(&self->epoch, __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+        // The announcement is seen before anything is read
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+    return self;
+}
+
+static void epoch_exit(EpochThread *self) {
+    if (--self->nesting == 0) {
+        __atomic_store_n(&self->epoch, 0, __ATOMIC_RELEASE);
+    }
+}
+
+// Moves to the next epoch if every thread reading has seen this one
+static void try_advance_epoch(void) {
+    unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    for (EpochThread *t = __atomic_load_n(&epoch_threads, __ATOMIC_ACQUIRE); t != NULL; t = t->next) {
+        unsigned long announced = __atomic_load_n(&t->epoch, __ATOMIC_SEQ_CST);
+        if (announced != 0 && announced != epoch) {
+            return;
+        }
+    }
+    __atomic_compare_exchange_n(&global_epoch, &epoch, epoch + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+static void reclaim(EpochThread *self) {
+    unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    // Older memory follows newer, so everything from the first that can go can go
+    Retired **link = &self->retired;
+    while (*link != NULL && (*link)->epoch + 2 > epoch) {
+        link = &(*link)->next;
+    }
+    Retired *retired = *link;
+    *link = NULL;
+    while (retired != NULL) {
+        Retired *next = retired->next;
+        free(retired);
+        retired = next;
+    }
+}
+
+// Memory that was unlinked, to be freed when no reader can reach it anymore
+static void retire(EpochThread *self, Retired *retired) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    retired->epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    retired->next = self->retired;
+    self->retired = retired;
+    if (++self->retire_count % SHARED_RECLAIM_EVERY == 0) {
+        try_advance_epoch();
+        reclaim(self);
+    }
+}
+
+// FNV-1a, as in kvmemo.c
+static unsigned long shared_hash(const char *key) {
+    unsigned long hash = 2166136261UL;
+    for (const unsigned char *p = (const unsigned char *) key; *p != '\0'; p++) {
+        hash ^= *p;
+        hash *= 16777619UL;
+    }
+    return hash;
+}
+
+static SharedBuckets *new_buckets(unsigned long count) {
+    SharedBuckets *buckets = (SharedBuckets *) calloc(1, sizeof(SharedBuckets) + count * sizeof(SharedEntry *));
+    if (buckets != NULL) {
+        buckets->count = count;
+    }
+    return buckets;
+}
+
+SharedTable *shared_table(const char *name) {
+    pthread_mutex_lock(&tables_lock);
+    SharedTable *table;
+    for (table = tables; table != NULL; table = table->next) {
+        if (strcmp(table->name, name) == 0) {
+            break;
+        }
+    }
+    if (table == NULL) {
+        table = (SharedTable *) calloc(1, sizeof(SharedTable));
+        SharedBuckets *buckets = new_buckets(SHARED_MIN_BUCKETS);
+        if (table == NULL || buckets == NULL) {
+            printf("Error: Memory allocation failed\n");
+            free(table);
+            free(buckets);
+            pthread_mutex_unlock(&tables_lock);
+            return NULL;
+        }
+        strcpy(table->name, name);
+        table->buckets = buckets;
+        for (int i = 0; i < SHARED_STRIPES; i++) {
+            pthread_mutex_init(&table->stripes[i].lock, NULL);
+        }
+        table->next = tables;
+        tables = table;
+    }
+    pthread_mutex_unlock(&tables_lock);
+    return table;
+}
+
+const char *shared_table_name(SharedTable *table) {
+    return table->name;
+}
+
+int shared_get(SharedTable *table, const char *key, char *value) {
+    unsigned long hash = shared_hash(key);
+    int found = 0;
+    EpochThread *self = epoch_enter();
+    SharedBuckets *buckets = __atomic_load_n(&table->buckets, __ATOMIC_ACQUIRE);
+    SharedEntry *entry = __atomic_load_n(&buckets->heads[hash & (buckets->count - 1)], __ATOMIC_ACQUIRE);
+    for (; entry != NULL; entry = __atomic_load_n(&entry->next, __ATOMIC_ACQUIRE)) {
+        if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+            strcpy(value, entry->value);
+            found = 1;
+            break;
+        }
+    }
+    epoch_exit(self);
+    shared_reads++;
+    return found;
+}
+
+// Doubles the number of chains, unless another thread just did
+static void shared_grow(SharedTable *table, unsigned long count) {
+    EpochThread *self = epoch_thread();
+    for (int i = 0; i < SHARED_STRIPES; i++) {
+        pthread_mutex_lock(&table->stripes[i].lock);
+    }
+    SharedBuckets *old = table->buckets;
+    SharedBuckets *buckets = old->count == count ? new_buckets(count * 2) : NULL;
+    if (buckets != NULL) {
+        // Readers may be walking the old chains, which stay as they are
+        for (unsigned long i = 0; i < old->count; i++) {
+            for (SharedEntry *entry = old->heads[i]; entry != NULL; entry = entry->next) {
+                SharedEntry *copy = (SharedEntry *) malloc(sizeof(SharedEntry));
+                if (copy == NULL) {
+                    continue;
+                }
+                *copy = *entry;
+                SharedEntry **head = &buckets->heads[entry->hash & (buckets->count - 1)];
+                copy->next = *head;
+                *head = copy;
+            }
+        }
+        __atomic_store_n(&table->buckets, buckets, __ATOMIC_RELEASE);
+        for (unsigned long i = 0; i < old->count; i++) {
+            SharedEntry *entry = old->heads[i];
+            while (entry != NULL) {
+                SharedEntry *next = entry->next;
+                retire(self, &entry->retired);
+                entry = next;
+            }
+        }
+        retire(self, &old->retired);
+    }
+    for (int i = SHARED_STRIPES - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&table->stripes[i].lock);
+    }
+}
+
+void shared_set(SharedTable *table, const char *key, const char *value) {
+    unsigned long hash = shared_hash(key);
+    EpochThread *self = epoch_thread();
+    pthread_mutex_t *lock = &table->stripes[hash & (SHARED_STRIPES - 1)].lock;
+    pthread_mutex_lock(lock);
+
+    SharedBuckets *buckets = table->buckets;
+    SharedEntry **link = &buckets->heads[hash & (buckets->count - 1)];
+    SharedEntry *entry;
+    for (entry = *link; entry != NULL; link = &entry->next, entry = *link) {
+        if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+            break;
+        }
+    }
+    if (entry != NULL && strcmp(entry->value, value) == 0) {
+        pthread_mutex_unlock(lock);
+        return;
+    }
+
+    SharedEntry *fresh = (SharedEntry *) malloc(sizeof(SharedEntry));
+    if (fresh == NULL) {
+        pthread_mutex_unlock(lock);
+        printf("Error: Memory allocation failed\n");
+        return;
+    }
+    fresh->hash = hash;
+    strcpy(fresh->key, key);
+    strcpy(fresh->value, value);
+    if (entry != NULL) {
+        // In place of the old entry, which readers may still be looking at
+        fresh->next = entry->next;
+        __atomic_store_n(link, fresh, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(lock);
+        retire(self, &entry->retired);
+        return;
+    }
+
+    SharedEntry **head = &buckets->heads[hash & (buckets->count - 1)];
+    fresh->next = *head;
+    __atomic_store_n(head, fresh, __ATOMIC_RELEASE);
+    int size = __atomic_add_fetch(&table->size, 1, __ATOMIC_RELAXED);
+    unsigned long count = buckets->count;
+    pthread_mutex_unlock(lock);
+    if ((unsigned long) size > 2 * count) {
+        shared_grow(table, count);
+    }
+}
+
+int shared_size(SharedTable *table) {
+    return __atomic_load_n(&table->size, __ATOMIC_RELAXED);
+}
+
+static int compare_pairs(const void *a, const void *b) {
+    return strcmp(((const KeyValuePair *) a)->key, ((const KeyValuePair *) b)->key);
+}
+
+void shared_snapshot(SharedTable *table, AssocArray *array) {
+    array->size = 0;
+    EpochThread *self = epoch_enter();
+    SharedBuckets *buckets = __atomic_load_n(&table->buckets, __ATOMIC_ACQUIRE);
+    for (unsigned long i = 0; i < buckets->count; i++) {
+        SharedEntry *entry = __atomic_load_n(&buckets->heads[i], __ATOMIC_ACQUIRE);
+        for (; entry != NULL; entry = __atomic_load_n(&entry->next, __ATOMIC_ACQUIRE)) {
+            if (array->size == array->capacity) {
+                int capacity = array->capacity > 0 ? array->capacity * 2 : 4;
+                KeyValuePair *pairs = (KeyValuePair *) realloc(array->pairs, sizeof(KeyValuePair) * capacity);
+                if (pairs == NULL) {
+                    break;
+                }
+                array->pairs = pairs;
+                array->capacity = capacity;
+            }
+            strcpy(array->pairs[array->size].key, entry->key);
+            strcpy(array->pairs[array->size].value, entry->value);
+            array->size++;
+        }
+    }
+    epoch_exit(self);
+    shared_reads++;
+    qsort(array->pairs, array->size, sizeof(KeyValuePair), compare_pairs);
+}
@@ -0,0 +1,34 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ *  Copyright (C) 2024 Gary Sims
+ *
+ */
+
+#ifndef KVSHARED_H
+#define KVSHARED_H
+
+#include "kvlang_internals.h"
+
+typedef struct SharedTable SharedTable;
+
+// Reads of shared arrays by this thread so far, see evaluate_expression()
+extern _Thread_local unsigned long shared_reads;
+
+// The table shared(name) returns, created empty on first use. Tables are
+// never freed
+SharedTable *shared_table(const char *name);
+const char *shared_table_name(SharedTable *table);
+
+// Copies the value of key into value (MAX_TOKEN_LENGTH bytes), returns 0 if
+// the table has no such key. Never waits for a lock
+int shared_get(SharedTable *table, const char *key, char *value);
+
+void shared_set(SharedTable *table, const char *key, const char *value);
+
+int shared_size(SharedTable *table);
+
+// Replaces the pairs of array with a copy of those of the table, in the
+// order of their keys
+void shared_snapshot(SharedTable *table, AssocArray *array);
+
+#endif /* KVSHARED_H */
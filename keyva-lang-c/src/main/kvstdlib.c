@@ -8,6 +8,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <math.h>
 
 // #define NDEBUG 1
 #define DEBUG 1
@@ -16,33 +17,75 @@
 #include "kvlang_internals.h"
 
 #include "kvstdlib.h"
+#include "kvtask.h"
+#include "kvshared.h"
+#include "kvreduce.h"
+#include "kvbuffer.h"
 
-FunctionReturn kvstdlib_len(ASTNode *arg) {
-    FunctionReturn result = {0};
+#define KVSTDLIB_BUILTIN_COUNT ((int) (sizeof(kvstdlib_lookup_table) / sizeof(kvstdlib_lookup_table[0])) - 1)
 
-    // len requires exactly one argument
-    if (arg == NULL || arg->right != NULL) {
-        printf("Error: len() requires exactly one argument\n");
-        result.has_return = 1;
-        result.type = RESULT_NUMBER;
-        result.number_value = 0;
-        return result;
+static kvstdlib_lookup_entry_t host_entries[KVSTDLIB_MAX_HOST_FUNCTIONS];
+static kvstdlib_host_func_t host_funcs[KVSTDLIB_MAX_HOST_FUNCTIONS];
+static void *host_data[KVSTDLIB_MAX_HOST_FUNCTIONS];
+static int host_count = 0;
+
+int kvstdlib_find(const char *name) {
+    for (int i = 0; kvstdlib_lookup_table[i].name != NULL; i++) {
+        if (strcmp(kvstdlib_lookup_table[i].name, name) == 0) {
+            return i;
+        }
+    }
+    for (int i = 0; i < host_count; i++) {
+        if (strcmp(host_entries[i].name, name) == 0) {
+            return KVSTDLIB_BUILTIN_COUNT + i;
+        }
     }
+    return -1;
+}
 
-    EvalResult arg_val;
-    if (!evaluate_expression(arg, &arg_val, EVAL_PRINT)) {
-        printf("Error: Failed to evaluate argument in len()\n");
-        result.has_return = 1;
-        result.type = RESULT_NUMBER;
-        result.number_value = 0;
-        return result;
+int kvstdlib_register(const char *name, kvstdlib_host_func_t func, void *data, int min_args, int max_args) {
+    if (kvstdlib_find(name) >= 0 || host_count >= KVSTDLIB_MAX_HOST_FUNCTIONS) {
+        return -1;
     }
+    char *copy = strdup(name);
+    if (copy == NULL) {
+        return -1;
+    }
+    host_entries[host_count].name = copy;
+    host_entries[host_count].func = NULL;
+    host_entries[host_count].min_args = min_args;
+    host_entries[host_count].max_args = max_args;
+    host_entries[host_count].flags = 0;
+    host_funcs[host_count] = func;
+    host_data[host_count] = data;
+    return KVSTDLIB_BUILTIN_COUNT + host_count++;
+}
+
+const kvstdlib_lookup_entry_t *kvstdlib_entry(int index) {
+    if (index < KVSTDLIB_BUILTIN_COUNT) {
+        return &kvstdlib_lookup_table[index];
+    }
+    return &host_entries[index - KVSTDLIB_BUILTIN_COUNT];
+}
+
+FunctionReturn kvstdlib_call(int index, int argc, const EvalResult *argv) {
+    if (index < KVSTDLIB_BUILTIN_COUNT) {
+        return kvstdlib_lookup_table[index].func(argc, argv);
+    }
+    index -= KVSTDLIB_BUILTIN_COUNT;
+    return host_funcs[index](host_data[index], argc, argv);
+}
 
-    int length = 0;
-    switch (arg_val.type) {
+FunctionReturn kvstdlib_len(int argc, const EvalResult *argv) {
+    (void) argc;
+    FunctionReturn result = {0};
+
+    long length = 0;
+    switch (argv[0].type) {
         case RESULT_ASSOC_ARRAY:
-            // Just return array size
-            length = arg_val.array_value->size;
+            // Just return array size, or the length of a buffer
+            length = argv[0].array_value->buffer != NULL ? argv[0].array_value->buffer->length
+                                                         : argv[0].array_value->size;
             break;
         case RESULT_NUMBER:
         case RESULT_STRING:
@@ -61,98 +104,412 @@ FunctionReturn kvstdlib_len(ASTNode *arg) {
     return result;
 }
 
-FunctionReturn kvstdlib_key(ASTNode *arg) {
+FunctionReturn kvstdlib_key(int argc, const EvalResult *argv) {
+    (void) argc;
     FunctionReturn result = {0};
     result.has_return = 1;
+    result.type = RESULT_STRING;
 
-    // Requires exactly one argument
-    if (arg == NULL || arg->right != NULL) {
-        printf("Error: key() requires exactly one argument\n");
-        result.type = RESULT_STRING;
+    // The interpreter has already turned the argument into the key it names
+    if (argv[0].type == RESULT_STRING) {
+        strcpy(result.string_value, argv[0].string_value);
+    } else {
         strcpy(result.string_value, "");
+    }
+    return result;
+}
+
+FunctionReturn kvstdlib_mod(int argc, const EvalResult *argv) {
+    (void) argc;
+    FunctionReturn result = {0};
+    result.has_return = 1;
+    result.type = RESULT_NUMBER;
+
+    if(argv[0].type!=RESULT_NUMBER || argv[1].type!=RESULT_NUMBER) {
+        result.number_value = 0;
         return result;
     }
 
-    if(arg->type == AST_IDENTIFIER) {
-        Variable *var = get_variable(arg->data.identifier);
-        if (var != NULL) {
-            result.type = RESULT_STRING;
-            strcpy(result.string_value, var->array.pairs[0].key);
-            return result;
-        }
-    } else if(arg->type == AST_ARRAY_ACCESS) {
-        EvalResult key_result;
-        if (!evaluate_expression(arg->left, &key_result, EVAL_ARITHMETIC)) {
-            printf("Error: Failed to evaluate array index\n");
-            result.type = RESULT_STRING;
-            strcpy(result.string_value, "");
-            return result;
-        }
-        if (key_result.type != RESULT_STRING && key_result.type != RESULT_NUMBER) {
-            printf("Error: Array index must be a string or number\n");
-            result.type = RESULT_STRING;
-            strcpy(result.string_value, "");
+    result.number_value = ((int) argv[0].number_value) % ((int) argv[1].number_value);
+    return result;
+}
+
+FunctionReturn kvstdlib_bar(int argc, const EvalResult *argv) {
+    (void) argc;
+    (void) argv;
+    FunctionReturn result = {0};
+    result.has_return = 1;
+    return result;
+}
+
+/*
+ * range(stop), range(start, stop) or range(start, stop, step)
+ *
+ * Builds an array keyed by position. A for loop over range() does not call
+ * this, it counts natively instead.
+ */
+FunctionReturn kvstdlib_range(int argc, const EvalResult *argv) {
+    FunctionReturn result = {0};
+    result.has_return = 1;
+
+    for (int i = 0; i < argc; i++) {
+        if (argv[i].type != RESULT_NUMBER) {
+            printf("Error: range() arguments must be numbers\n");
+            result.type = RESULT_NUMBER;
+            result.number_value = 0;
             return result;
         }
+    }
 
-        // Convert numeric index to string if necessary
-        if (key_result.type == RESULT_NUMBER) {
-            snprintf(result.string_value, MAX_TOKEN_LENGTH, "%g", key_result.number_value);
-        } else {
-            strcpy(result.string_value, key_result.string_value);
+    double start = 0, stop, step = 1;
+    if (argc == 1) {
+        stop = argv[0].number_value;
+    } else {
+        start = argv[0].number_value;
+        stop = argv[1].number_value;
+        if (argc == 3) {
+            step = argv[2].number_value;
         }
-        result.type = RESULT_STRING;
+    }
+    if (step == 0) {
+        printf("Error: range() step must not be zero\n");
+        result.type = RESULT_NUMBER;
+        result.number_value = 0;
         return result;
     }
 
-    // Default
-    result.has_return = 1;
-    result.type = RESULT_STRING;
-    strcpy(result.string_value, "");
+    double steps = ceil((stop - start) / step);
+    long count = steps > 0 ? (long) steps : 0;
+
+    result.type = RESULT_ASSOC_ARRAY;
+    result.array_value = (AssocArray *) malloc(sizeof(AssocArray));
+    init_assoc_array(result.array_value);
+    for (long i = 0; i < count; i++) {
+        char key[MAX_TOKEN_LENGTH];
+        char value[MAX_TOKEN_LENGTH];
+        snprintf(key, MAX_TOKEN_LENGTH, "%ld", i);
+        format_number(start + i * step, value);
+        set_assoc_array_value(result.array_value, key, value);
+    }
+    return result;
+}
+
+/*
+ * sync(t): waits for the task t = spawn f(...) and returns what f returned.
+ * A task is synced once.
+ */
+FunctionReturn kvstdlib_sync(int argc, const EvalResult *argv) {
+    (void) argc;
+    FunctionReturn result = {0};
+    if (argv[0].type != RESULT_NUMBER || !sync_task(argv[0].number_value, &result)) {
+        printf("Error: sync() of something that is not a running task\n");
+        result.has_return = 1;
+        result.type = RESULT_NUMBER;
+        result.number_value = 0;
+    }
     return result;
 }
 
-FunctionReturn kvstdlib_mod(ASTNode *arg) {
+/*
+ * shared(name): the shared array called name, which every thread reads and
+ * writes, see kvshared.c. It is created empty on first use.
+ */
+FunctionReturn kvstdlib_shared(int argc, const EvalResult *argv) {
+    (void) argc;
     FunctionReturn result = {0};
     result.has_return = 1;
 
-    // Requires exactly one argument
-    if (arg == NULL || arg->right == NULL) {
-        printf("Error: mod() requires exactly two argument\n");
+    char name[MAX_TOKEN_LENGTH];
+    if (argv[0].type == RESULT_STRING) {
+        strcpy(name, argv[0].string_value);
+    } else if (argv[0].type == RESULT_NUMBER) {
+        snprintf(name, MAX_TOKEN_LENGTH, "%g", argv[0].number_value);
+    } else {
+        printf("Error: shared() name must be a string or number\n");
         result.type = RESULT_NUMBER;
         result.number_value = 0;
         return result;
     }
 
-    EvalResult arg_val1;
-    if (!evaluate_expression(arg, &arg_val1, EVAL_ARITHMETIC)) {
-        printf("Error: Failed to evaluate 1st argument in mod()\n");
+    SharedTable *table = shared_table(name);
+    if (table == NULL) {
         result.type = RESULT_NUMBER;
         result.number_value = 0;
         return result;
     }
+    result.type = RESULT_ASSOC_ARRAY;
+    result.array_value = (AssocArray *) malloc(sizeof(AssocArray));
+    init_assoc_array(result.array_value);
+    shared_snapshot(table, result.array_value);
+    result.array_value->shared = table;
+    return result;
+}
 
-    EvalResult arg_val2;
-    if (!evaluate_expression(arg->right, &arg_val2, EVAL_ARITHMETIC)) {
-        printf("Error: Failed to evaluate 2nd argument in mod()\n");
-        result.type = RESULT_NUMBER;
-        result.number_value = 0;
+/*
+ * sum(x), min(x), max(x) and mean(x) of the values of an array, which must
+ * all be numbers, see kvreduce.c. A number is an array of one value.
+ */
+static int reduce_argument(const char *name, const EvalResult *arg, Reduction *reduction) {
+    int bad;
+    switch (arg->type) {
+        case RESULT_NUMBER:
+            reduction->sum = reduction->min = reduction->max = arg->number_value;
+            reduction->count = 1;
+            return 1;
+        case RESULT_ASSOC_ARRAY:
+            if (reduce_array(arg->array_value, reduction, &bad)) {
+                return 1;
+            }
+            printf("Error: %s() of an array with the value '%s' at key '%s', which is not a number\n", name,
+                   arg->array_value->pairs[bad].value, arg->array_value->pairs[bad].key);
+            return 0;
+        default:
+            printf("Error: %s() of '%s', which is not a number\n", name, arg->string_value);
+            return 0;
+    }
+}
+
+static FunctionReturn reduce(const char *name, const EvalResult *arg) {
+    FunctionReturn result = {0};
+    result.has_return = 1;
+    result.type = RESULT_NUMBER;
+    result.number_value = 0;
+
+    Reduction reduction;
+    if (!reduce_argument(name, arg, &reduction)) {
+        return result;
+    }
+    if (reduction.count == 0 && strcmp(name, "sum") != 0) {
+        printf("Error: %s() of an empty array\n", name);
+        return result;
+    }
+    if (strcmp(name, "sum") == 0) {
+        result.number_value = reduction.sum;
+    } else if (strcmp(name, "min") == 0) {
+        result.number_value = reduction.min;
+    } else if (strcmp(name, "max") == 0) {
+        result.number_value = reduction.max;
+    } else {
+        result.number_value = reduction.sum / reduction.count;
+    }
+    return result;
+}
+
+FunctionReturn kvstdlib_sum(int argc, const EvalResult *argv) {
+    (void) argc;
+    return reduce("sum", &argv[0]);
+}
+
+FunctionReturn kvstdlib_min(int argc, const EvalResult *argv) {
+    (void) argc;
+    return reduce("min", &argv[0]);
+}
+
+FunctionReturn kvstdlib_max(int argc, const EvalResult *argv) {
+    (void) argc;
+    return reduce("max", &argv[0]);
+}
+
+FunctionReturn kvstdlib_mean(int argc, const EvalResult *argv) {
+    (void) argc;
+    return reduce("mean", &argv[0]);
+}
+
+/*
+ * count_if(x, op, v): how many values of x compare to v as op says, one of
+ * "==", "!=", "<", "<=", ">" or ">=". == and != also compare strings.
+ */
+FunctionReturn kvstdlib_count_if(int argc, const EvalResult *argv) {
+    (void) argc;
+    static const struct {
+        const char *name;
+        OperatorType op;
+    } operators[] = {
+        { "==", OP_EQUAL }, { "!=", OP_NOT_EQUAL }, { "<", OP_LESS_THAN },
+        { "<=", OP_LESS_EQUAL }, { ">", OP_GREATER_THAN }, { ">=", OP_GREATER_EQUAL }
+    };
+    FunctionReturn result = {0};
+    result.has_return = 1;
+    result.type = RESULT_NUMBER;
+    result.number_value = 0;
+
+    int found = -1;
+    for (int i = 0; argv[1].type == RESULT_STRING && i < (int) (sizeof(operators) / sizeof(operators[0])); i++) {
+        if (strcmp(argv[1].string_value, operators[i].name) == 0) {
+            found = i;
+        }
+    }
+    if (found < 0) {
+        printf("Error: count_if() operator must be \"==\", \"!=\", \"<\", \"<=\", \">\" or \">=\"\n");
+        return result;
+    }
+    OperatorType op = operators[found].op;
+    if (argv[2].type == RESULT_ASSOC_ARRAY || (argv[2].type != RESULT_NUMBER && op != OP_EQUAL && op != OP_NOT_EQUAL)) {
+        printf("Error: count_if() with %s needs a number to compare with\n", operators[found].name);
         return result;
     }
 
-    if(arg_val1.type!=RESULT_NUMBER || arg_val2.type!=RESULT_NUMBER) {
+    // A number or string is an array of one value
+    KeyValuePair single;
+    AssocArray one = { &single, 1, 0, NULL, NULL, NULL };
+    const AssocArray *array = &one;
+    if (argv[0].type == RESULT_ASSOC_ARRAY) {
+        array = argv[0].array_value;
+    } else {
+        single.key[0] = '\0';
+        if (argv[0].type == RESULT_NUMBER) {
+            format_number(argv[0].number_value, single.value);
+        } else {
+            strcpy(single.value, argv[0].string_value);
+        }
+    }
+
+    int bad;
+    long count = count_array(array, op, &argv[2], &bad);
+    if (count < 0) {
+        printf("Error: count_if() with %s of the value '%s' at key '%s', which is not a number\n",
+               operators[found].name, array->pairs[bad].value, array->pairs[bad].key);
+        return result;
+    }
+    result.number_value = count;
+    return result;
+}
+
+// A new array of buffer, 0 if it could not be created
+static FunctionReturn buffer_result(TypedBuffer *buffer) {
+    FunctionReturn result = {0};
+    result.has_return = 1;
+    if (buffer == NULL) {
         result.type = RESULT_NUMBER;
         result.number_value = 0;
         return result;
     }
+    result.type = RESULT_ASSOC_ARRAY;
+    result.array_value = (AssocArray *) malloc(sizeof(AssocArray));
+    init_assoc_array(result.array_value);
+    result.array_value->buffer = buffer;
+    return result;
+}
+
+static FunctionReturn new_buffer(const char *name, BufferType type, const EvalResult *arg) {
+    if (arg->type != RESULT_NUMBER || !(arg->number_value >= 0 && arg->number_value < 1e15) ||
+        arg->number_value != floor(arg->number_value)) {
+        printf("Error: %s() length must be a whole number, at least 0\n", name);
+        return buffer_result(NULL);
+    }
+    return buffer_result(buffer_create(type, (long) arg->number_value));
+}
+
+/*
+ * f64buf(n) and i64buf(n): a buffer of n doubles or 64-bit integers, all 0,
+ * see kvbuffer.c. b[i] reads and writes number i of a buffer b, and a for
+ * loop over it gives each number with its index as the key.
+ */
+FunctionReturn kvstdlib_f64buf(int argc, const EvalResult *argv) {
+    (void) argc;
+    return new_buffer("f64buf", BUFFER_F64, &argv[0]);
+}
+
+FunctionReturn kvstdlib_i64buf(int argc, const EvalResult *argv) {
+    (void) argc;
+    return new_buffer("i64buf", BUFFER_I64, &argv[0]);
+}
+
+/*
+ * fill(b, v): sets every number of the buffer b to v, in place. kvopt.c
+ * sees it as an assignment to b, wherever the call is.
+ */
+FunctionReturn kvstdlib_fill(int argc, const EvalResult *argv) {
+    (void) argc;
+    FunctionReturn result = {0};
+    result.has_return = 1;
+    result.type = RESULT_NUMBER;
+    result.number_value = 0;
+
+    if (argv[0].type != RESULT_ASSOC_ARRAY || argv[0].array_value->buffer == NULL) {
+        printf("Error: fill() of something that is not a buffer\n");
+        return result;
+    }
+    if (argv[1].type != RESULT_NUMBER) {
+        printf("Error: fill() value must be a number\n");
+        return result;
+    }
+    TypedBuffer *buffer = buffer_writable(&argv[0].array_value->buffer);
+    if (buffer != NULL) {
+        buffer_fill(buffer, argv[1].number_value);
+        mark_array_written(argv[0].array_value, -1);
+    }
+    return result;
+}
 
+/*
+ * dot(a, b): the sum of the products of the numbers of two buffers of the
+ * same length
+ */
+FunctionReturn kvstdlib_dot(int argc, const EvalResult *argv) {
+    (void) argc;
+    FunctionReturn result = {0};
+    result.has_return = 1;
     result.type = RESULT_NUMBER;
-    result.number_value = ((int) arg_val1.number_value) % ((int) arg_val2.number_value);
+    result.number_value = 0;
+
+    if (argv[0].type != RESULT_ASSOC_ARRAY || argv[0].array_value->buffer == NULL ||
+        argv[1].type != RESULT_ASSOC_ARRAY || argv[1].array_value->buffer == NULL) {
+        printf("Error: dot() of something that is not a buffer\n");
+        return result;
+    }
+    TypedBuffer *a = argv[0].array_value->buffer;
+    TypedBuffer *b = argv[1].array_value->buffer;
+    if (a->length != b->length) {
+        printf("Error: dot() of buffers of %ld and %ld numbers, which must be as long\n", a->length, b->length);
+        return result;
+    }
+    result.number_value = buffer_dot(a, b);
     return result;
 }
 
-FunctionReturn kvstdlib_bar(ASTNode *arg) {
+/*
+ * slice(x, start, stop): a copy of the numbers of the buffer x from index
+ * start up to, not including, stop, or of the pairs of the array x at
+ * those positions. Both are limited to the length of x.
+ */
+FunctionReturn kvstdlib_slice(int argc, const EvalResult *argv) {
+    (void) argc;
+    if (argv[0].type != RESULT_ASSOC_ARRAY) {
+        printf("Error: slice() of something that is not an array or a buffer\n");
+        return buffer_result(NULL);
+    }
+    if (argv[1].type != RESULT_NUMBER || argv[2].type != RESULT_NUMBER) {
+        printf("Error: slice() start and stop must be numbers\n");
+        return buffer_result(NULL);
+    }
+    AssocArray *array = argv[0].array_value;
+    long length = array->buffer != NULL ? array->buffer->length : array->size;
+    double bounds[2] = { argv[1].number_value, argv[2].number_value };
+    long positions[2];
+    for (int i = 0; i < 2; i++) {
+        positions[i] = bounds[i] < 0 ? 0 : bounds[i] > length ? length : (long) bounds[i];
+    }
+    long start = positions[0];
+    long stop = positions[1] > start ? positions[1] : start;
+    if (array->buffer != NULL) {
+        return buffer_result(buffer_slice(array->buffer, start, stop));
+    }
+
     FunctionReturn result = {0};
     result.has_return = 1;
+    result.type = RESULT_ASSOC_ARRAY;
+    result.array_value = (AssocArray *) malloc(sizeof(AssocArray));
+    init_assoc_array(result.array_value);
+    if (stop - start > result.array_value->capacity) {
+        result.array_value->capacity = (int) (stop - start);
+        result.array_value->pairs = (KeyValuePair *) realloc(result.array_value->pairs,
+                                                             sizeof(KeyValuePair) * result.array_value->capacity);
+    }
+    // The keys of an array are distinct, so its pairs are copied as they are
+    if (stop > start) {
+        memcpy(result.array_value->pairs, array->pairs + start, sizeof(KeyValuePair) * (stop - start));
+    }
+    result.array_value->size = (int) (stop - start);
     return result;
 }
@@ -1,4 +1,3 @@
-
 /* SPDX-License-Identifier: GPL-2.0-only */
 /*
  *  Copyright (C) 2024 Gary Sims
@@ -10,29 +9,88 @@
 
 #include "kvlang_internals.h"
 
-/* Define a standard lib function type */
-typedef FunctionReturn (*kvstdlib_func_t)(ASTNode *arg);
+/*
+ * Define a standard lib function type
+ *
+ * Arguments are evaluated by the interpreter before the call, and the number
+ * of arguments has already been checked against the lookup table entry when
+ * the call was bound at parse time.
+ */
+typedef FunctionReturn (*kvstdlib_func_t)(int argc, const EvalResult *argv);
+
+/* Flags for standard lib functions */
+#define KVSTDLIB_PURE       0x01 /* No side effects, result depends only on the arguments */
+#define KVSTDLIB_KEY_ARGS   0x02 /* Each argument is evaluated to the key it names, not its value */
+#define KVSTDLIB_WRITES_ARG 0x04 /* Writes the variable its first argument names, like an assignment */
 
 /* Forward declarations of standard lib functions */
-FunctionReturn kvstdlib_len(ASTNode *arg);
-FunctionReturn kvstdlib_key(ASTNode *arg);
-FunctionReturn kvstdlib_mod(ASTNode *arg);
-FunctionReturn kvstdlib_bar(ASTNode *arg);
+FunctionReturn kvstdlib_len(int argc, const EvalResult *argv);
+FunctionReturn kvstdlib_key(int argc, const EvalResult *argv);
+FunctionReturn kvstdlib_mod(int argc, const EvalResult *argv);
+FunctionReturn kvstdlib_bar(int argc, const EvalResult *argv);
+FunctionReturn kvstdlib_range(int argc, const EvalResult *argv);
+FunctionReturn kvstdlib_sync(int argc, const EvalResult *argv);
+FunctionReturn kvstdlib_shared(int argc, const EvalResult *argv);
+FunctionReturn kvstdlib_sum(int argc, const EvalResult *argv);
+FunctionReturn kvstdlib_min(int argc, const EvalResult *argv);
+FunctionReturn kvstdlib_max(int argc, const EvalResult *argv);
+FunctionReturn kvstdlib_mean(int argc, const EvalResult *argv);
+FunctionReturn kvstdlib_count_if(int argc, const EvalResult *argv);
+FunctionReturn kvstdlib_f64buf(int argc, const EvalResult *argv);
+FunctionReturn kvstdlib_i64buf(int argc, const EvalResult *argv);
+FunctionReturn kvstdlib_fill(int argc, const EvalResult *argv);
+FunctionReturn kvstdlib_dot(int argc, const EvalResult *argv);
+FunctionReturn kvstdlib_slice(int argc, const EvalResult *argv);
 
 /* Structure to associate a string with its function */
 typedef struct {
     const char *name;
     kvstdlib_func_t func;
+    int min_args;
+    int max_args;
+    unsigned int flags;
 } kvstdlib_lookup_entry_t;
 
 /* Array of name/callback pairs */
 static const kvstdlib_lookup_entry_t kvstdlib_lookup_table[] = {
-    { "len", kvstdlib_len },
-    { "key", kvstdlib_key },
-    { "mod", kvstdlib_mod },
-    { "bar", kvstdlib_bar },
-    { NULL, NULL } /* Sentinel to mark the end of the array */
+    { "len", kvstdlib_len, 1, 1, KVSTDLIB_PURE },
+    { "key", kvstdlib_key, 1, 1, KVSTDLIB_PURE | KVSTDLIB_KEY_ARGS },
+    { "mod", kvstdlib_mod, 2, 2, KVSTDLIB_PURE },
+    { "bar", kvstdlib_bar, 0, MAX_FUNC_PARAMS, 0 },
+    { "range", kvstdlib_range, 1, 3, KVSTDLIB_PURE },
+    { "sync", kvstdlib_sync, 1, 1, 0 },
+    { "shared", kvstdlib_shared, 1, 1, 0 },
+    { "sum", kvstdlib_sum, 1, 1, KVSTDLIB_PURE },
+    { "min", kvstdlib_min, 1, 1, KVSTDLIB_PURE },
+    { "max", kvstdlib_max, 1, 1, KVSTDLIB_PURE },
+    { "mean", kvstdlib_mean, 1, 1, KVSTDLIB_PURE },
+    { "count_if", kvstdlib_count_if, 3, 3, KVSTDLIB_PURE },
+    { "f64buf", kvstdlib_f64buf, 1, 1, KVSTDLIB_PURE },
+    { "i64buf", kvstdlib_i64buf, 1, 1, KVSTDLIB_PURE },
+    { "fill", kvstdlib_fill, 2, 2, KVSTDLIB_WRITES_ARG },
+    { "dot", kvstdlib_dot, 2, 2, KVSTDLIB_PURE },
+    { "slice", kvstdlib_slice, 3, 3, KVSTDLIB_PURE },
+    { NULL, NULL, 0, 0, 0 } /* Sentinel to mark the end of the array */
 };
 
+/*
+ * Functions registered by a host program, see kv_register_function()
+ *
+ * They are numbered after the entries of kvstdlib_lookup_table, and their
+ * entries have no func: kvstdlib_call() passes the registered data to them.
+ */
+typedef FunctionReturn (*kvstdlib_host_func_t)(void *data, int argc, const EvalResult *argv);
+
+#define KVSTDLIB_MAX_HOST_FUNCTIONS 64
+
+/* Returns the index of the new function, or -1 if the name is taken or the table is full */
+int kvstdlib_register(const char *name, kvstdlib_host_func_t func, void *data, int min_args, int max_args);
+
+/* Returns the index of name among the built-in and host functions, or -1 */
+int kvstdlib_find(const char *name);
+
+/* Entry and call of the function at an index returned by kvstdlib_find() */
+const kvstdlib_lookup_entry_t *kvstdlib_entry(int index);
+FunctionReturn kvstdlib_call(int index, int argc, const EvalResult *argv);
 
 #endif /* KVSTDLIB_H */
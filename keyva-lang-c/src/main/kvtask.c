@@ -0,0 +1,513 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ *  Copyright (C) 2024 Gary Sims
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#define NDEBUG 1
+#include "debug_print.h"
+
+#include "kvlang_internals.h"
+#include "kvmemo.h"
+#include "kvprof.h"
+#include "kvpar.h"
+
+#include "kvtask.h"
+
+/*
+ * Tasks: spawn f(...), sync(t), and the chunks of pfor loops
+ *
+ * Each thread queues the tasks it submits on a deque of its own, the
+ * Chase-Lev work-stealing deque: the thread pushes and takes tasks at the
+ * bottom, without locking, while other threads steal from the top. The
+ * worker threads, one less than the number of threads (--threads=N), run
+ * their own tasks first and otherwise steal the oldest task of another
+ * thread, which in divide and conquer code is the largest piece of work
+ * left. A thread waiting for a task runs other tasks meanwhile, so a sync
+ * in the middle of a recursion keeps its thread busy.
+ *
+ * spawn f(...) evaluates the arguments in the spawning frame and runs the
+ * call in a frame of its own, as execute_function_call() would, on
+ * whichever thread gets to it. Tasks run in a context with the functions
+ * of the context they were spawned from: that context itself on the thread
+ * running it, and a context of their own on other threads, kept by each
+ * thread for the next tasks. A task shares no variables with its spawner,
+ * it only returns a value.
+ *
+ * A task that is never synced is still run. Until it is synced it is on a
+ * list of the context it was spawned from, and task_drain() waits for the
+ * tasks left on it and frees them before that context is freed.
+ */
+
+#define TASK_DEQUE_SIZE 4096        // Tasks queued per thread, a power of 2. Others run at once
+#define TASK_MAX_THREADS 256        // Threads with a deque, others run their tasks at once
+#define TASK_SLOT_CHUNK 4096
+#define TASK_SLOT_CHUNKS 4096       // Spawned tasks not synced yet, at most
+#define TASK_STACK_SIZE (8 * 1024 * 1024)
+
+typedef struct {
+    long top;                       // Next to be stolen
+    long bottom;                    // Next to be pushed
+    Task *tasks[TASK_DEQUE_SIZE];
+} TaskDeque;
+
+static TaskDeque *deques[TASK_MAX_THREADS];
+static int deque_count = 0;
+static pthread_mutex_t deque_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local TaskDeque *own_deque = NULL;
+static _Thread_local int own_deque_failed = 0;
+static _Thread_local unsigned int steal_seed = 0;
+
+// Idle workers sleep until a task is queued
+static long queued = 0;
+static int sleepers = 0;
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_wake = PTHREAD_COND_INITIALIZER;
+static pthread_once_t workers_started = PTHREAD_ONCE_INIT;
+
+static int deque_push(TaskDeque *deque, Task *task) {
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    if (bottom - top >= TASK_DEQUE_SIZE) {
+        return 0;
+    }
+    __atomic_store_n(&deque->tasks[bottom & (TASK_DEQUE_SIZE - 1)], task, __ATOMIC_RELAXED);
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static Task *deque_take(TaskDeque *deque) {
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+    if (top > bottom) {
+        // Empty
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELEASE);
+        return NULL;
+    }
+    Task *task = __atomic_load_n(&deque->tasks[bottom & (TASK_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (top == bottom) {
+        // The last task, which a thief may be taking too
+        if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            task = NULL;
+        }
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELEASE);
+    }
+    return task;
+}
+
+static Task *deque_steal(TaskDeque *deque) {
+    long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+    if (top >= bottom) {
+        return NULL;
+    }
+    Task *task = __atomic_load_n(&deque->tasks[top & (TASK_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        // Taken by the owner or another thief
+        return NULL;
+    }
+    return task;
+}
+
+// This thread's deque, NULL if there are too many threads
+static TaskDeque *thread_deque(void) {
+    if (own_deque != NULL || own_deque_failed) {
+        return own_deque;
+    }
+    TaskDeque *deque = (TaskDeque *) calloc(1, sizeof(TaskDeque));
+    pthread_mutex_lock(&deque_lock);
+    if (deque != NULL && deque_count < TASK_MAX_THREADS) {
+        deques[deque_count] = deque;
+        __atomic_store_n(&deque_count, deque_count + 1, __ATOMIC_RELEASE);
+        own_deque = deque;
+    } else {
+        free(deque);
+        own_deque_failed = 1;
+    }
+    pthread_mutex_unlock(&deque_lock);
+    return own_deque;
+}
+
+static Task *take_task(void) {
+    Task *task = own_deque != NULL ? deque_take(own_deque) : NULL;
+    if (task != NULL) {
+        __atomic_sub_fetch(&queued, 1, __ATOMIC_SEQ_CST);
+    }
+    return task;
+}
+
+static Task *steal_task(void) {
+    int count = __atomic_load_n(&deque_count, __ATOMIC_ACQUIRE);
+    if (count == 0) {
+        return NULL;
+    }
+    // Victims are tried from a random one on, so thieves spread out
+    if (steal_seed == 0) {
+        steal_seed = (unsigned int) (size_t) &steal_seed | 1;
+    }
+    steal_seed ^= steal_seed << 13;
+    steal_seed ^= steal_seed >> 17;
+    steal_seed ^= steal_seed << 5;
+    int start = (int) (steal_seed % (unsigned int) count);
+    for (int i = 0; i < count; i++) {
+        TaskDeque *deque = deques[(start + i) % count];
+        if (deque == own_deque) {
+            continue;
+        }
+        Task *task = deque_steal(deque);
+        if (task != NULL) {
+            __atomic_sub_fetch(&queued, 1, __ATOMIC_SEQ_CST);
+            return task;
+        }
+    }
+    return NULL;
+}
+
+static void run_task(Task *task) {
+    task->run(task);
+    // The waiting thread may free the task from here on
+    __atomic_store_n(&task->done, 1, __ATOMIC_RELEASE);
+}
+
+static void *worker_thread(void *arg) {
+    (void) arg;
+    // Tasks run in contexts of their own, see task_context()
+    kv_context = NULL;
+    thread_deque();
+    while (1) {
+        Task *task = take_task();
+        if (task == NULL) {
+            task = steal_task();
+        }
+        if (task != NULL) {
+            run_task(task);
+            continue;
+        }
+        pthread_mutex_lock(&idle_lock);
+        __atomic_add_fetch(&sleepers, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&queued, __ATOMIC_SEQ_CST) == 0) {
+            pthread_cond_wait(&idle_wake, &idle_lock);
+        }
+        __atomic_sub_fetch(&sleepers, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&idle_lock);
+    }
+    return NULL;
+}
+
+static void start_workers(void) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, TASK_STACK_SIZE);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (int i = 1; i < parallel_thread_count(); i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, worker_thread, NULL) != 0) {
+            break;
+        }
+    }
+    pthread_attr_destroy(&attr);
+}
+
+void task_submit(Task *task) {
+    // The profiler keeps one call stack for the process, so it sees one thread
+    if (parallel_thread_count() <= 1 || profile_enabled) {
+        run_task(task);
+        return;
+    }
+    pthread_once(&workers_started, start_workers);
+    TaskDeque *deque = thread_deque();
+    if (deque == NULL || !deque_push(deque, task)) {
+        run_task(task);
+        return;
+    }
+    __atomic_add_fetch(&queued, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&sleepers, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&idle_lock);
+        pthread_cond_signal(&idle_wake);
+        pthread_mutex_unlock(&idle_lock);
+    }
+}
+
+void task_wait(Task *task) {
+    while (!__atomic_load_n(&task->done, __ATOMIC_ACQUIRE)) {
+        Task *next = take_task();
+        // A stolen task may run on top of this thread's frames, which are limited
+        if (next == NULL && (kv_context == NULL || kv_context->scope_depth < MAX_SCOPES / 2)) {
+            next = steal_task();
+        }
+        if (next != NULL) {
+            run_task(next);
+        } else {
+            sched_yield();
+        }
+    }
+}
+
+typedef struct ScriptTask {
+    Task task;
+    KvContext *origin;                  // Whose functions[function] is called
+    unsigned long origin_id;
+    int function;
+    int argc;
+    EvalResult args[MAX_FUNC_PARAMS];   // Array arguments are owned copies
+    FunctionReturn result;
+    int handle;
+    struct ScriptTask *prev;            // On origin->unsynced_tasks
+    struct ScriptTask *next;
+} ScriptTask;
+
+// Contexts this thread runs tasks of other contexts in, by origin
+typedef struct WorkerContext {
+    KvContext *context;
+    unsigned long origin_id;
+    struct WorkerContext *next;
+} WorkerContext;
+
+static _Thread_local WorkerContext *worker_contexts = NULL;
+
+static KvContext *context_origin(KvContext *context) {
+    return context->origin != NULL ? context->origin : context;
+}
+
+// The context running the thread if it has the task's functions, otherwise
+// the thread's context for the task's origin, with the functions it has now
+static KvContext *task_context(ScriptTask *task) {
+    if (kv_context != NULL && context_origin(kv_context) == task->origin) {
+        return kv_context;
+    }
+
+    WorkerContext *worker = worker_contexts;
+    while (worker != NULL && (worker->context->origin != task->origin || worker->origin_id != task->origin_id)) {
+        worker = worker->next;
+    }
+    if (worker == NULL) {
+        KvContext *context = create_context();
+        worker = (WorkerContext *) malloc(sizeof(WorkerContext));
+        if (context == NULL || worker == NULL) {
+            free_context(context);
+            free(worker);
+            return NULL;
+        }
+        context->origin = task->origin;
+        worker->context = context;
+        worker->origin_id = task->origin_id;
+        worker->next = worker_contexts;
+        worker_contexts = worker;
+    }
+
+    // Function bodies are shared, the caches of their results are not
+    KvContext *context = worker->context;
+    KvContext *origin = task->origin;
+    while (context->function_count < origin->function_count) {
+        FunctionEntry *function = &context->functions[context->function_count];
+        FunctionEntry *source = &origin->functions[context->function_count];
+        memset(function, 0, sizeof(FunctionEntry));
+        strcpy(function->name, source->name);
+        function->parameters = source->parameters;
+        function->body = source->body;
+        function->memo = source->memo != NULL ? memo_create(MEMO_CAPACITY) : NULL;
+        context->function_count++;
+    }
+    return context;
+}
+
+static void run_script_task(Task *run) {
+    ScriptTask *task = (ScriptTask *) run;
+    KvContext *outer = kv_context;
+    KvContext *context = task_context(task);
+    if (context != NULL) {
+        kv_context = context;
+        task->result = call_function(task->function, task->args, task->argc);
+        kv_context = outer;
+    } else {
+        task->result.has_return = 1;
+        task->result.type = RESULT_NUMBER;
+        task->result.number_value = 0;
+    }
+    for (int i = 0; i < task->argc; i++) {
+        if (task->args[i].type == RESULT_ASSOC_ARRAY) {
+            free_assoc_array(task->args[i].array_value);
+            free(task->args[i].array_value);
+        }
+    }
+}
+
+/*
+ * A handle is the index of the slot holding its task until it is synced.
+ * Slots are reused by the thread that synced them, so handles stay small
+ * enough to be stored as array values.
+ */
+static ScriptTask **task_slots[TASK_SLOT_CHUNKS];
+static int slot_count = 1;                      // Handle 0 is never used
+static _Thread_local int *free_slots = NULL;
+static _Thread_local int free_slot_count = 0;
+static _Thread_local int free_slot_capacity = 0;
+
+static ScriptTask **task_slot(int handle) {
+    ScriptTask **chunk = __atomic_load_n(&task_slots[handle / TASK_SLOT_CHUNK], __ATOMIC_ACQUIRE);
+    return chunk != NULL ? &chunk[handle % TASK_SLOT_CHUNK] : NULL;
+}
+
+// Returns 0 if there are too many tasks
+static int new_slot(void) {
+    if (free_slot_count > 0) {
+        return free_slots[--free_slot_count];
+    }
+    int handle = __atomic_fetch_add(&slot_count, 1, __ATOMIC_RELAXED);
+    if (handle >= TASK_SLOT_CHUNK * TASK_SLOT_CHUNKS) {
+        return 0;
+    }
+    ScriptTask ***chunk = &task_slots[handle / TASK_SLOT_CHUNK];
+    ScriptTask **slots = __atomic_load_n(chunk, __ATOMIC_ACQUIRE);
+    if (slots == NULL) {
+        ScriptTask **fresh = (ScriptTask **) calloc(TASK_SLOT_CHUNK, sizeof(ScriptTask *));
+        if (fresh == NULL) {
+            return 0;
+        }
+        if (!__atomic_compare_exchange_n(chunk, &slots, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            free(fresh);
+        }
+    }
+    return handle;
+}
+
+// The lists of tasks not synced yet of all contexts
+static pthread_mutex_t unsynced_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void link_unsynced(ScriptTask *task) {
+    pthread_mutex_lock(&unsynced_lock);
+    task->prev = NULL;
+    task->next = task->origin->unsynced_tasks;
+    if (task->next != NULL) {
+        task->next->prev = task;
+    }
+    task->origin->unsynced_tasks = task;
+    pthread_mutex_unlock(&unsynced_lock);
+}
+
+// Called with unsynced_lock held
+static void unlink_unsynced(ScriptTask *task) {
+    if (task->prev != NULL) {
+        task->prev->next = task->next;
+    } else {
+        task->origin->unsynced_tasks = task->next;
+    }
+    if (task->next != NULL) {
+        task->next->prev = task->prev;
+    }
+}
+
+static void release_slot(int handle) {
+    if (free_slot_count == free_slot_capacity) {
+        int capacity = free_slot_capacity > 0 ? free_slot_capacity * 2 : 64;
+        int *slots = (int *) realloc(free_slots, sizeof(int) * capacity);
+        if (slots == NULL) {
+            return;
+        }
+        free_slots = slots;
+        free_slot_capacity = capacity;
+    }
+    free_slots[free_slot_count++] = handle;
+}
+
+double spawn_task(int function, EvalResult args[], int argc) {
+    KvContext *ctx = kv_context;
+    int handle = new_slot();
+    ScriptTask *task = handle > 0 ? (ScriptTask *) malloc(sizeof(ScriptTask)) : NULL;
+    if (task == NULL) {
+        printf("Error: Too many tasks running\n");
+        return 0;
+    }
+
+    // Other threads only run what is already parsed
+    for (int i = 0; i < ctx->function_count; i++) {
+        load_function_body(&ctx->functions[i]);
+    }
+
+    task->task.run = run_script_task;
+    task->task.done = 0;
+    task->origin = context_origin(ctx);
+    task->origin_id = task->origin->id;
+    task->function = function;
+    task->argc = argc;
+    task->handle = handle;
+    for (int i = 0; i < argc; i++) {
+        task->args[i] = args[i];
+        if (args[i].type == RESULT_ASSOC_ARRAY) {
+            task->args[i].array_value = (AssocArray *) malloc(sizeof(AssocArray));
+            duplicate_assoc_array(task->args[i].array_value, args[i].array_value);
+        }
+    }
+    link_unsynced(task);
+    __atomic_store_n(task_slot(handle), task, __ATOMIC_RELEASE);
+    task_submit(&task->task);
+    return handle;
+}
+
+int sync_task(double value, FunctionReturn *result) {
+    if (value < 1 || value >= TASK_SLOT_CHUNK * TASK_SLOT_CHUNKS || value != (int) value) {
+        return 0;
+    }
+    int handle = (int) value;
+    ScriptTask **slot = task_slot(handle);
+    ScriptTask *task = slot != NULL ? __atomic_exchange_n(slot, NULL, __ATOMIC_ACQ_REL) : NULL;
+    if (task == NULL) {
+        return 0;
+    }
+    task_wait(&task->task);
+    *result = task->result;
+    pthread_mutex_lock(&unsynced_lock);
+    unlink_unsynced(task);
+    pthread_mutex_unlock(&unsynced_lock);
+    free(task);
+    release_slot(handle);
+    return 1;
+}
+
+void task_drain(KvContext *context) {
+    if (context == NULL || context->origin != NULL) {
+        // Tasks are listed by the context their spawner's functions are from
+        return;
+    }
+    while (1) {
+        // A task on the list is not freed, so its slot can only hold it or NULL
+        ScriptTask *claimed = NULL;
+        pthread_mutex_lock(&unsynced_lock);
+        ScriptTask *task = context->unsynced_tasks;
+        while (task != NULL && claimed == NULL) {
+            ScriptTask *expected = task;
+            if (__atomic_compare_exchange_n(task_slot(task->handle), &expected, NULL, 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                claimed = task;
+                unlink_unsynced(task);
+            }
+            task = task->next;
+        }
+        int left = context->unsynced_tasks != NULL;
+        pthread_mutex_unlock(&unsynced_lock);
+
+        if (claimed != NULL) {
+            task_wait(&claimed->task);
+            if (claimed->result.type == RESULT_ASSOC_ARRAY && claimed->result.array_value != NULL) {
+                free_assoc_array(claimed->result.array_value);
+                free(claimed->result.array_value);
+            }
+            release_slot(claimed->handle);
+            free(claimed);
+        } else if (left) {
+            // The others are being synced on other threads
+            sched_yield();
+        } else {
+            return;
+        }
+    }
+}
@@ -0,0 +1,40 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ *  Copyright (C) 2024 Gary Sims
+ *
+ */
+
+#ifndef KVTASK_H
+#define KVTASK_H
+
+#include "kvlang_internals.h"
+
+/*
+ * Work to be run once, by any thread. done is 0 when it is submitted, and
+ * the task stays allocated until task_wait() for it has returned.
+ */
+typedef struct Task {
+    void (*run)(struct Task *task);
+    int done;
+} Task;
+
+// Queues task on this thread's deque, to be run by this thread or stolen by
+// another. With one thread, or when the deque is full, it runs now
+void task_submit(Task *task);
+
+// Runs queued tasks, this thread's most recent first, until task is done
+void task_wait(Task *task);
+
+/*
+ * spawn f(...) and sync(t): a task calling functions[function] of the
+ * current context, with evaluated arguments, and its handle. sync_task()
+ * waits for it and frees it, and returns 0 if handle is not a running task.
+ */
+double spawn_task(int function, EvalResult args[], int argc);
+int sync_task(double handle, FunctionReturn *result);
+
+// Waits for the tasks spawned from context that were not synced, and frees
+// them with their results. Called before context is freed, and on exit
+void task_drain(KvContext *context);
+
+#endif /* KVTASK_H */
@@ -0,0 +1,341 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ *  Copyright (C) 2024 Gary Sims
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+#define NDEBUG 1
+#include "debug_print.h"
+
+#include "kvlang_internals.h"
+
+#include "kvvector.h"
+#include "kvreduce.h"
+
+/*
+ * Element-wise arithmetic on arrays: z = x * y + 1
+ *
+ * Two arrays are combined key by key, and the result has the keys present
+ * in both, in the order of the left one: keys present on one side only are
+ * left out. An array and a number combine each value with the number.
+ *
+ * Values are parsed a block at a time into doubles, combined by a kernel
+ * chosen once from what the CPU supports (AVX2, SSE2, or plain C), and
+ * formatted with %g like any other number stored in an array. Arrays built
+ * the same way have their keys in the same order, so keys are matched by
+ * position first, and through a hash of the right array's keys from the
+ * first one that differs.
+ *
+ * Buffers (kvbuffer.c) hold numbers already, and are combined index by
+ * index into a buffer, by the same kernels for doubles. Integers stay
+ * integers for +, - and *, and wrap around on overflow.
+ */
+
+#define VECTOR_BLOCK 256        // Values combined by one call of a kernel
+
+typedef void (*VectorKernel)(OperatorType op, const double *a, const double *b, double *out, int n);
+
+static void kernel_plain(OperatorType op, const double *a, const double *b, double *out, int n) {
+    for (int i = 0; i < n; i++) {
+        switch (op) {
+            case OP_ADD: out[i] = a[i] + b[i]; break;
+            case OP_SUBTRACT: out[i] = a[i] - b[i]; break;
+            case OP_MULTIPLY: out[i] = a[i] * b[i]; break;
+            default: out[i] = a[i] / b[i]; break;
+        }
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("sse2")))
+static void kernel_sse2(OperatorType op, const double *a, const double *b, double *out, int n) {
+    int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128d x = _mm_loadu_pd(a + i);
+        __m128d y = _mm_loadu_pd(b + i);
+        switch (op) {
+            case OP_ADD: _mm_storeu_pd(out + i, _mm_add_pd(x, y)); break;
+            case OP_SUBTRACT: _mm_storeu_pd(out + i, _mm_sub_pd(x, y)); break;
+            case OP_MULTIPLY: _mm_storeu_pd(out + i, _mm_mul_pd(x, y)); break;
+            default: _mm_storeu_pd(out + i, _mm_div_pd(x, y)); break;
+        }
+    }
+    kernel_plain(op, a + i, b + i, out + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void kernel_avx2(OperatorType op, const double *a, const double *b, double *out, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d x = _mm256_loadu_pd(a + i);
+        __m256d y = _mm256_loadu_pd(b + i);
+        switch (op) {
+            case OP_ADD: _mm256_storeu_pd(out + i, _mm256_add_pd(x, y)); break;
+            case OP_SUBTRACT: _mm256_storeu_pd(out + i, _mm256_sub_pd(x, y)); break;
+            case OP_MULTIPLY: _mm256_storeu_pd(out + i, _mm256_mul_pd(x, y)); break;
+            default: _mm256_storeu_pd(out + i, _mm256_div_pd(x, y)); break;
+        }
+    }
+    kernel_plain(op, a + i, b + i, out + i, n - i);
+}
+#endif
+
+static VectorKernel vector_kernel = NULL;
+
+// The widest kernel the CPU runs, looked up on first use
+static VectorKernel select_kernel(void) {
+    VectorKernel kernel = __atomic_load_n(&vector_kernel, __ATOMIC_RELAXED);
+    if (kernel != NULL) {
+        return kernel;
+    }
+    kernel = kernel_plain;
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        kernel = kernel_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        kernel = kernel_sse2;
+    }
+#endif
+    __atomic_store_n(&vector_kernel, kernel, __ATOMIC_RELAXED);
+    return kernel;
+}
+
+static int reserve_pairs(AssocArray *result, int size) {
+    result->size = 0;
+    result->shared = NULL;
+    buffer_release(result->buffer);
+    result->buffer = NULL;
+    if (size <= result->capacity) {
+        return 1;
+    }
+    int capacity = size > 4 ? size : 4;
+    KeyValuePair *pairs = (KeyValuePair *) realloc(result->pairs, sizeof(KeyValuePair) * capacity);
+    if (pairs == NULL) {
+        printf("Error: Memory allocation failed\n");
+        return 0;
+    }
+    result->pairs = pairs;
+    result->capacity = capacity;
+    return 1;
+}
+
+static int parse_value(const KeyValuePair *pair, double *number) {
+    if (!parse_number(pair->value, number)) {
+        printf("Error: Value '%s' at key '%s' is not a number, in arithmetic on arrays\n", pair->value, pair->key);
+        return 0;
+    }
+    return 1;
+}
+
+// Combines the values of a block and appends them to result under keys
+static void append_block(AssocArray *result, const KeyValuePair *const *keys, OperatorType op,
+                         const double *a, const double *b, int n) {
+    double out[VECTOR_BLOCK];
+    select_kernel()(op, a, b, out, n);
+    for (int i = 0; i < n; i++) {
+        KeyValuePair *pair = &result->pairs[result->size++];
+        strcpy(pair->key, keys[i]->key);
+        format_number(out[i], pair->value);
+    }
+}
+
+// FNV-1a, as in kvmemo.c
+static unsigned long hash_key(const char *key) {
+    unsigned long hash = 2166136261UL;
+    for (const unsigned char *p = (const unsigned char *) key; *p != '\0'; p++) {
+        hash ^= *p;
+        hash *= 16777619UL;
+    }
+    return hash;
+}
+
+// Positions of the keys of an array, in an open addressing table
+typedef struct {
+    int *slots;                 // Index + 1 of the pair, 0 for an empty slot
+    unsigned long mask;
+} KeyIndex;
+
+static int build_key_index(KeyIndex *index, const AssocArray *array) {
+    unsigned long count = 16;
+    while (count < (unsigned long) array->size * 2) {
+        count *= 2;
+    }
+    index->slots = (int *) calloc(count, sizeof(int));
+    index->mask = count - 1;
+    if (index->slots == NULL) {
+        printf("Error: Memory allocation failed\n");
+        return 0;
+    }
+    for (int i = 0; i < array->size; i++) {
+        unsigned long slot = hash_key(array->pairs[i].key) & index->mask;
+        while (index->slots[slot] != 0) {
+            slot = (slot + 1) & index->mask;
+        }
+        index->slots[slot] = i + 1;
+    }
+    return 1;
+}
+
+static const KeyValuePair *find_key(const KeyIndex *index, const AssocArray *array, const char *key) {
+    unsigned long slot = hash_key(key) & index->mask;
+    while (index->slots[slot] != 0) {
+        const KeyValuePair *pair = &array->pairs[index->slots[slot] - 1];
+        if (strcmp(pair->key, key) == 0) {
+            return pair;
+        }
+        slot = (slot + 1) & index->mask;
+    }
+    return NULL;
+}
+
+int elementwise_arrays(OperatorType op, const AssocArray *x, const AssocArray *y, AssocArray *result) {
+    if (!reserve_pairs(result, x->size)) {
+        return 0;
+    }
+    const KeyValuePair *keys[VECTOR_BLOCK];
+    double a[VECTOR_BLOCK];
+    double b[VECTOR_BLOCK];
+    KeyIndex index = { NULL, 0 };
+    int n = 0;
+    int ok = 1;
+
+    for (int i = 0; i < x->size && ok; i++) {
+        const KeyValuePair *left = &x->pairs[i];
+        const KeyValuePair *right = NULL;
+        if (index.slots == NULL && i < y->size && strcmp(y->pairs[i].key, left->key) == 0) {
+            right = &y->pairs[i];
+        } else {
+            if (index.slots == NULL && !build_key_index(&index, y)) {
+                ok = 0;
+                break;
+            }
+            right = find_key(&index, y, left->key);
+        }
+        if (right == NULL) {
+            continue;
+        }
+        ok = parse_value(left, &a[n]) && parse_value(right, &b[n]);
+        keys[n++] = left;
+        if (n == VECTOR_BLOCK && ok) {
+            append_block(result, keys, op, a, b, n);
+            n = 0;
+        }
+    }
+    if (ok) {
+        append_block(result, keys, op, a, b, n);
+    }
+    free(index.slots);
+    return ok;
+}
+
+int elementwise_number(OperatorType op, const AssocArray *x, double number, int number_left, AssocArray *result) {
+    if (!reserve_pairs(result, x->size)) {
+        return 0;
+    }
+    const KeyValuePair *keys[VECTOR_BLOCK];
+    double values[VECTOR_BLOCK];
+    double numbers[VECTOR_BLOCK];
+    for (int i = 0; i < VECTOR_BLOCK; i++) {
+        numbers[i] = number;
+    }
+
+    for (int i = 0; i < x->size; i += VECTOR_BLOCK) {
+        int n = x->size - i < VECTOR_BLOCK ? x->size - i : VECTOR_BLOCK;
+        for (int j = 0; j < n; j++) {
+            keys[j] = &x->pairs[i + j];
+            if (!parse_value(keys[j], &values[j])) {
+                return 0;
+            }
+        }
+        if (number_left) {
+            append_block(result, keys, op, numbers, values, n);
+        } else {
+            append_block(result, keys, op, values, numbers, n);
+        }
+    }
+    return 1;
+}
+
+// The buffer of result, reused for the same type and length if nothing else refers to it
+static TypedBuffer *reserve_buffer(AssocArray *result, BufferType type, long length) {
+    result->size = 0;
+    result->shared = NULL;
+    TypedBuffer *buffer = result->buffer;
+    if (buffer != NULL && buffer->type == type && buffer->length == length &&
+        __atomic_load_n(&buffer->references, __ATOMIC_ACQUIRE) == 1) {
+        return buffer;
+    }
+    buffer_release(buffer);
+    result->buffer = buffer_create(type, length);
+    return result->buffer;
+}
+
+// +, - or *, computed unsigned so that overflow wraps around
+static void integer_kernel(OperatorType op, const long long *a, const long long *b, long long *out, int n) {
+    for (int i = 0; i < n; i++) {
+        unsigned long long x = (unsigned long long) a[i];
+        unsigned long long y = (unsigned long long) b[i];
+        switch (op) {
+            case OP_ADD: out[i] = (long long) (x + y); break;
+            case OP_SUBTRACT: out[i] = (long long) (x - y); break;
+            default: out[i] = (long long) (x * y); break;
+        }
+    }
+}
+
+// x op y, or with y NULL x op number, or number op x when number_left is set
+static int combine_buffers(OperatorType op, const TypedBuffer *x, const TypedBuffer *y,
+                           double number, int number_left, AssocArray *result) {
+    int integers = op != OP_DIVIDE && x->type == BUFFER_I64 &&
+                   (y != NULL ? y->type == BUFFER_I64 : number == floor(number) && fabs(number) < 9e18);
+    TypedBuffer *out = reserve_buffer(result, integers ? BUFFER_I64 : BUFFER_F64, x->length);
+    if (out == NULL) {
+        return 0;
+    }
+    VectorKernel kernel = select_kernel();
+    double numbers[VECTOR_BLOCK];
+    long long integer_numbers[VECTOR_BLOCK];
+    double x_scratch[VECTOR_BLOCK];
+    double y_scratch[VECTOR_BLOCK];
+    for (int i = 0; i < VECTOR_BLOCK; i++) {
+        numbers[i] = number;
+        integer_numbers[i] = integers && y == NULL ? (long long) number : 0;
+    }
+
+    for (long first = 0; first < x->length; first += VECTOR_BLOCK) {
+        int n = x->length - first < VECTOR_BLOCK ? (int) (x->length - first) : VECTOR_BLOCK;
+        if (integers) {
+            const long long *a = x->i64 + first;
+            const long long *b = y != NULL ? y->i64 + first : integer_numbers;
+            integer_kernel(op, number_left ? b : a, number_left ? a : b, out->i64 + first, n);
+        } else {
+            const double *a = buffer_doubles(x, first, n, x_scratch);
+            const double *b = y != NULL ? buffer_doubles(y, first, n, y_scratch) : numbers;
+            kernel(op, number_left ? b : a, number_left ? a : b, out->f64 + first, n);
+        }
+    }
+    return 1;
+}
+
+int elementwise_buffers(OperatorType op, const TypedBuffer *x, const TypedBuffer *y, AssocArray *result) {
+    if (x->length != y->length) {
+        printf("Error: Arithmetic on buffers of %ld and %ld numbers, which must be as long\n", x->length, y->length);
+        return 0;
+    }
+    return combine_buffers(op, x, y, 0, 0, result);
+}
+
+int elementwise_buffer_number(OperatorType op, const TypedBuffer *x, double number, int number_left, AssocArray *result) {
+    return combine_buffers(op, x, NULL, number, number_left, result);
+}
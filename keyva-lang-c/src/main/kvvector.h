@@ -0,0 +1,28 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ *  Copyright (C) 2024 Gary Sims
+ *
+ */
+
+#ifndef KVVECTOR_H
+#define KVVECTOR_H
+
+#include "kvlang_internals.h"
+#include "kvbuffer.h"
+
+// result = x op y for two arrays (OP_ADD to OP_DIVIDE), value by value. The
+// result has the keys present in both, in the order of x. Returns 0 after
+// printing an error if a value is not a number
+int elementwise_arrays(OperatorType op, const AssocArray *x, const AssocArray *y, AssocArray *result);
+
+// result = x op number, or number op x when number_left is set
+int elementwise_number(OperatorType op, const AssocArray *x, double number, int number_left, AssocArray *result);
+
+// result = x op y for two buffers of the same length, number by number. The
+// result is a buffer of integers if both are and op is not OP_DIVIDE
+int elementwise_buffers(OperatorType op, const TypedBuffer *x, const TypedBuffer *y, AssocArray *result);
+
+// The same with a number, which keeps integers integers if it is a whole number
+int elementwise_buffer_number(OperatorType op, const TypedBuffer *x, double number, int number_left, AssocArray *result);
+
+#endif /* KVVECTOR_H */
@@ -0,0 +1,228 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ *  Copyright (C) 2024 Gary Sims
+ *
+ */
+
+/*
+ * Test of the embedding API of keyva.h, linked with libkeyva as a host
+ * program is
+ *
+ *   keyva_api_test
+ *
+ * Values are set from C, used by a compiled program and read back, a
+ * registered C function is called by it, and sources that do not parse
+ * or call a function with the wrong number of arguments must not compile.
+ * Prints what failed and exits with 1, or exits with 0.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "keyva.h"
+
+static int failures = 0;
+
+#define CHECK(condition) check((condition), #condition, __LINE__)
+
+static void check(int passed, const char *what, int line) {
+    if (!passed) {
+        printf("FAIL line %d: %s\n", line, what);
+        failures++;
+    }
+}
+
+static int numbers_equal(KvContext *context, const char *name, double expected) {
+    double value = -1;
+    return kv_get_number(context, name, &value) && value == expected;
+}
+
+static int strings_equal(const char *value, const char *expected) {
+    return value != NULL && strcmp(value, expected) == 0;
+}
+
+// scale(x, [factor]) is x times factor, or times 3. Counts its calls in user_data
+static int host_scale(int argc, const KvValue *argv, KvValue *result, void *user_data) {
+    int *calls = (int *) user_data;
+    if (argv[0].type != KV_NUMBER) {
+        return 0;
+    }
+    (*calls)++;
+    double factor = argc > 1 ? argv[1].number : 3;
+    result->number = argv[0].number * factor;
+    return 1;
+}
+
+// describe(x) is "number", "string" or "array:" and the number of elements
+static int host_describe(int argc, const KvValue *argv, KvValue *result, void *user_data) {
+    static char text[32];
+    (void) argc;
+    (void) user_data;
+    if (argv[0].type == KV_NUMBER) {
+        result->string = "number";
+    } else if (argv[0].type == KV_STRING) {
+        result->string = "string";
+    } else {
+        snprintf(text, sizeof(text), "array:%g", argv[0].number);
+        result->string = text;
+    }
+    result->type = KV_STRING;
+    return 1;
+}
+
+static int host_fail(int argc, const KvValue *argv, KvValue *result, void *user_data) {
+    (void) argc;
+    (void) argv;
+    (void) user_data;
+    result->number = 99;
+    return 0;
+}
+
+static void test_registration(int *calls) {
+    CHECK(kv_register_function("scale", host_scale, 1, 2, calls));
+    CHECK(kv_register_function("describe", host_describe, 1, 1, NULL));
+    CHECK(kv_register_function("fail", host_fail, 0, 0, NULL));
+
+    // Names already taken, by a host function or a built-in one
+    CHECK(!kv_register_function("scale", host_scale, 1, 1, NULL));
+    CHECK(!kv_register_function("len", host_scale, 1, 1, NULL));
+    CHECK(!kv_register_function("", host_scale, 1, 1, NULL));
+    CHECK(!kv_register_function("bad_range", host_scale, 2, 1, NULL));
+}
+
+static void test_values(void) {
+    KvContext *context = kv_create_context();
+    CHECK(context != NULL);
+
+    CHECK(kv_set_number(context, "n", 2.5));
+    CHECK(numbers_equal(context, "n", 2.5));
+    CHECK(kv_set_string(context, "s", "hello"));
+    CHECK(strings_equal(kv_get_string(context, "s"), "hello"));
+    CHECK(kv_set_element(context, "a", "x", "1"));
+    CHECK(kv_set_element(context, "a", "y", "two"));
+    CHECK(strings_equal(kv_get_element(context, "a", "x"), "1"));
+    CHECK(strings_equal(kv_get_element(context, "a", "y"), "two"));
+
+    // A string that is a number reads as one, any other does not
+    CHECK(kv_set_string(context, "t", "42"));
+    CHECK(numbers_equal(context, "t", 42));
+    double value = -1;
+    CHECK(!kv_get_number(context, "s", &value));
+
+    // Variables that do not exist
+    CHECK(!kv_get_number(context, "missing", &value));
+    CHECK(kv_get_string(context, "missing") == NULL);
+    CHECK(kv_get_element(context, "missing", "x") == NULL);
+    CHECK(kv_get_element(context, "a", "z") == NULL);
+
+    // Each context has its own variables
+    KvContext *other = kv_create_context();
+    CHECK(other != NULL);
+    CHECK(!kv_get_number(other, "n", &value));
+    kv_free_context(other);
+
+    kv_free_context(context);
+}
+
+static void test_program(int *calls) {
+    KvProgram *program = kv_compile(
+        "def twice(x)\n"
+        "    return x * 2\n"
+        "end\n"
+        "total = twice(n) + scale(n)\n"
+        "scaled = scale(n, 10)\n"
+        "a[\"sum\"] = a[\"x\"] + a[\"y\"]\n"
+        "kind_n = describe(n)\n"
+        "kind_s = describe(s)\n"
+        "kind_a = describe(a)\n"
+        "runs = runs + 1\n");
+    CHECK(program != NULL);
+    if (program == NULL) {
+        return;
+    }
+
+    KvContext *context = kv_create_context();
+    CHECK(context != NULL);
+    CHECK(kv_set_number(context, "n", 4));
+    CHECK(kv_set_string(context, "s", "text"));
+    CHECK(kv_set_element(context, "a", "x", "5"));
+    CHECK(kv_set_element(context, "a", "y", "6"));
+    CHECK(kv_set_number(context, "runs", 0));
+
+    int before = *calls;
+    CHECK(kv_run(context, program));
+    CHECK(numbers_equal(context, "total", 4 * 2 + 4 * 3));
+    CHECK(numbers_equal(context, "scaled", 40));
+    CHECK(strings_equal(kv_get_element(context, "a", "sum"), "11"));
+    CHECK(strings_equal(kv_get_string(context, "kind_n"), "number"));
+    CHECK(strings_equal(kv_get_string(context, "kind_s"), "string"));
+    CHECK(strings_equal(kv_get_string(context, "kind_a"), "array:3"));
+    CHECK(*calls == before + 2);
+
+    // The same program runs again with new values, and in a second context
+    CHECK(kv_set_number(context, "n", 1));
+    CHECK(kv_run(context, program));
+    CHECK(numbers_equal(context, "total", 1 * 2 + 1 * 3));
+    CHECK(numbers_equal(context, "runs", 2));
+
+    KvContext *other = kv_create_context();
+    CHECK(other != NULL);
+    CHECK(kv_set_number(other, "n", 10));
+    CHECK(kv_set_string(other, "s", "text"));
+    CHECK(kv_set_element(other, "a", "x", "1"));
+    CHECK(kv_set_element(other, "a", "y", "2"));
+    CHECK(kv_set_number(other, "runs", 0));
+    CHECK(kv_run(other, program));
+    CHECK(numbers_equal(other, "total", 10 * 2 + 10 * 3));
+    CHECK(numbers_equal(other, "runs", 1));
+    CHECK(strings_equal(kv_get_element(other, "a", "sum"), "3"));
+    CHECK(numbers_equal(context, "total", 5));
+    kv_free_context(other);
+
+    // kv_eval() sees the functions and variables the program left
+    CHECK(kv_eval(context, "e = twice(total)\n"));
+    CHECK(numbers_equal(context, "e", 10));
+
+    kv_free_context(context);
+    kv_free_program(program);
+}
+
+static void test_errors(void) {
+    // Sources that do not parse
+    CHECK(kv_compile("x = (1 + \n") == NULL);
+    CHECK(kv_compile("def f(x)\n    return x\n") == NULL);
+
+    // Calls with the wrong number of arguments, of host and built-in functions
+    CHECK(kv_compile("x = scale()\n") == NULL);
+    CHECK(kv_compile("x = scale(1, 2, 3)\n") == NULL);
+    CHECK(kv_compile("x = describe(1, 2)\n") == NULL);
+    CHECK(kv_compile("x = len()\n") == NULL);
+
+    // A host function that fails evaluates to 0, and the program goes on
+    KvProgram *program = kv_compile("x = fail()\ny = 7\n");
+    CHECK(program != NULL);
+    KvContext *context = kv_create_context();
+    CHECK(context != NULL);
+    CHECK(kv_run(context, program));
+    CHECK(numbers_equal(context, "x", 0));
+    CHECK(numbers_equal(context, "y", 7));
+    kv_free_context(context);
+    kv_free_program(program);
+
+    CHECK(!kv_run(NULL, NULL));
+}
+
+int main() {
+    int calls = 0;
+    test_registration(&calls);
+    test_values();
+    test_program(&calls);
+    test_errors();
+    if (failures > 0) {
+        printf("%d check%s failed\n", failures, failures == 1 ? "" : "s");
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}
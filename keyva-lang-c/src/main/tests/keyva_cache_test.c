@@ -0,0 +1,111 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ *  Copyright (C) 2024 Gary Sims
+ *
+ */
+
+/*
+ * Test of damaged --cache files (kvcache.c)
+ *
+ *   keyva_cache_test
+ *
+ * Caches a script in cache_test.kvc, in the working directory, and changes
+ * one character of a literal in it. The tree in the cache is still valid,
+ * so only the hash of its payload shows the damage: the script must be
+ * parsed again instead of running the damaged literal, and the cache
+ * written again. Prints what failed and exits with 1, or exits with 0.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kvlang_internals.h"
+#include "kvcache.h"
+
+#define SCRIPT "cache_test.kv"
+#define CACHE "cache_test.kvc"
+
+static const char *source = "x = \"cached_value_1\"\n";
+
+static int failures = 0;
+
+static void check(int passed, const char *what) {
+    if (!passed) {
+        printf("FAIL %s\n", what);
+        failures++;
+    }
+}
+
+static void parse_and_cache(void) {
+    Token *tokens = (Token *) malloc(sizeof(Token) * (strlen(source) + 1));
+    int token_count = 0;
+    tokenize_line(source, tokens, &token_count);
+    cache_parse_and_execute(SCRIPT, source, strlen(source), tokens, token_count);
+    free(tokens);
+}
+
+static int x_is(const char *expected) {
+    const char *value = get_variable_value("x");
+    return value != NULL && strcmp(value, expected) == 0;
+}
+
+// Replaces the first from in the file with to, of the same length
+static int replace_in_file(const char *path, const char *from, const char *to) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return 0;
+    }
+    char data[4096];
+    size_t size = fread(data, 1, sizeof(data), file);
+    fclose(file);
+    size_t length = strlen(from);
+    for (size_t i = 0; i + length <= size; i++) {
+        if (memcmp(data + i, from, length) == 0) {
+            memcpy(data + i, to, length);
+            file = fopen(path, "wb");
+            if (file == NULL) {
+                return 0;
+            }
+            int ok = fwrite(data, 1, size, file) == size;
+            return fclose(file) == 0 && ok;
+        }
+    }
+    return 0;
+}
+
+int main() {
+    FILE *script = fopen(SCRIPT, "w");
+    if (script == NULL || fputs(source, script) < 0 || fclose(script) != 0) {
+        printf("Error: Could not write %s\n", SCRIPT);
+        return 1;
+    }
+    remove(CACHE);
+    size_t length = strlen(source);
+
+    parse_and_cache();
+    check(x_is("cached_value_1"), "the parsed script did not set x");
+    set_variable_value("x", NULL, "");
+    check(cache_run_program(SCRIPT, source, length), "an intact cache did not run");
+    check(x_is("cached_value_1"), "the cache did not set x");
+
+    check(replace_in_file(CACHE, "cached_value_1", "cached_value_2"), "could not damage " CACHE);
+    set_variable_value("x", NULL, "");
+    check(!cache_run_program(SCRIPT, source, length), "a damaged cache ran");
+    check(x_is(""), "a damaged cache set x");
+
+    // Parsing again replaces the damaged cache
+    parse_and_cache();
+    set_variable_value("x", NULL, "");
+    check(cache_run_program(SCRIPT, source, length), "the cache written again did not run");
+    check(x_is("cached_value_1"), "the cache written again did not set x");
+
+    remove(SCRIPT);
+    remove(CACHE);
+    if (failures > 0) {
+        printf("%d check%s failed\n", failures, failures == 1 ? "" : "s");
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}
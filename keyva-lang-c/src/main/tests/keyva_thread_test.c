@@ -0,0 +1,189 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ *  Copyright (C) 2024 Gary Sims
+ *
+ */
+
+/*
+ * Test of contexts running on several threads at once
+ *
+ *   keyva_thread_test [THREADS]
+ *
+ * One compiled program runs in a context of its own on each of THREADS
+ * threads (8 by default), several times, with a different input on each
+ * thread. Each thread checks what its context computed, and the host
+ * function they all call counts its calls. Each thread then spawns tasks
+ * it never syncs, which must all have run once its context is freed, and
+ * spawned tasks run on THREADS threads. Built with KEYVA_SANITIZE=thread
+ * (see CMakeLists.txt), ThreadSanitizer also reports what the contexts share.
+ * Prints what failed and exits with 1, or exits with 0.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "keyva.h"
+#include "kvpar.h"
+
+#define MAX_THREADS 64
+#define RUNS 20
+#define UNSYNCED_TASKS 200
+
+static const char *source =
+    "def fib(n)\n"
+    "    if n < 2\n"
+    "        return n\n"
+    "    end\n"
+    "    return fib(n - 1) + fib(n - 2)\n"
+    "end\n"
+    "squares = 0\n"
+    "for i in range(1, seed + 1)\n"
+    "    squares[i] = i * i\n"
+    "end\n"
+    "total = sum(squares)\n"
+    "f = fib(seed)\n"
+    "tagged = tag(seed)\n";
+
+static const char *unsynced_source =
+    "def work(n)\n"
+    "    return counted(n)\n"
+    "end\n"
+    "for i in range(0, tasks)\n"
+    "    t = spawn work(i)\n"
+    "end\n";
+
+typedef struct {
+    KvProgram *program;
+    KvProgram *unsynced;
+    int seed;
+    int failures;
+    pthread_t thread;
+} Worker;
+
+static pthread_mutex_t calls_lock = PTHREAD_MUTEX_INITIALIZER;
+static long calls = 0;
+static long task_calls = 0;
+
+// tag(x) is 1000 + x
+static int host_tag(int argc, const KvValue *argv, KvValue *result, void *user_data) {
+    (void) argc;
+    (void) user_data;
+    pthread_mutex_lock(&calls_lock);
+    calls++;
+    pthread_mutex_unlock(&calls_lock);
+    result->number = 1000 + argv[0].number;
+    return 1;
+}
+
+// counted(x) is x, called by tasks
+static int host_counted(int argc, const KvValue *argv, KvValue *result, void *user_data) {
+    (void) argc;
+    (void) user_data;
+    __atomic_add_fetch(&task_calls, 1, __ATOMIC_RELAXED);
+    result->number = argv[0].number;
+    return 1;
+}
+
+static double fib(int n) {
+    return n < 2 ? n : fib(n - 1) + fib(n - 2);
+}
+
+static void expect(Worker *worker, KvContext *context, const char *name, double expected) {
+    double value = -1;
+    if (!kv_get_number(context, name, &value) || value != expected) {
+        printf("FAIL thread with seed %d: %s is %g, not %g\n", worker->seed, name, value, expected);
+        worker->failures++;
+    }
+}
+
+static void *run_worker(void *arg) {
+    Worker *worker = (Worker *) arg;
+    KvContext *context = kv_create_context();
+    if (context == NULL) {
+        printf("FAIL thread with seed %d: no context\n", worker->seed);
+        worker->failures++;
+        return NULL;
+    }
+    int n = worker->seed;
+    double squares = 0;
+    for (int i = 1; i <= n; i++) {
+        squares += i * i;
+    }
+    for (int run = 0; run < RUNS && worker->failures == 0; run++) {
+        if (!kv_set_number(context, "seed", n) || !kv_run(context, worker->program)) {
+            printf("FAIL thread with seed %d: run %d failed\n", n, run);
+            worker->failures++;
+            break;
+        }
+        expect(worker, context, "total", squares);
+        expect(worker, context, "f", fib(n));
+        expect(worker, context, "tagged", 1000 + n);
+    }
+    kv_free_context(context);
+
+    // Tasks left behind by a program
+    context = kv_create_context();
+    if (context == NULL || !kv_set_number(context, "tasks", UNSYNCED_TASKS) ||
+        !kv_run(context, worker->unsynced)) {
+        printf("FAIL thread with seed %d: unsynced tasks did not run\n", worker->seed);
+        worker->failures++;
+    }
+    kv_free_context(context);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int threads = argc > 1 ? atoi(argv[1]) : 8;
+    if (threads < 1 || threads > MAX_THREADS) {
+        printf("Error: THREADS is from 1 to %d\n", MAX_THREADS);
+        return 1;
+    }
+    if (!kv_register_function("tag", host_tag, 1, 1, NULL) ||
+        !kv_register_function("counted", host_counted, 1, 1, NULL)) {
+        return 1;
+    }
+    KvProgram *program = kv_compile(source);
+    KvProgram *unsynced = kv_compile(unsynced_source);
+    if (program == NULL || unsynced == NULL) {
+        return 1;
+    }
+    parallel_threads = threads;
+
+    Worker workers[MAX_THREADS];
+    for (int i = 0; i < threads; i++) {
+        workers[i].program = program;
+        workers[i].unsynced = unsynced;
+        workers[i].seed = 5 + i;
+        workers[i].failures = 0;
+        if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) != 0) {
+            printf("Error: Could not start thread %d\n", i);
+            return 1;
+        }
+    }
+    int failures = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        failures += workers[i].failures;
+    }
+    kv_free_program(program);
+    kv_free_program(unsynced);
+
+    long expected_calls = failures == 0 ? (long) threads * RUNS : calls;
+    if (calls != expected_calls) {
+        printf("FAIL tag() was called %ld times, not %ld\n", calls, expected_calls);
+        failures++;
+    }
+    // Every context was freed, with the tasks it did not sync
+    long expected_tasks = (long) threads * UNSYNCED_TASKS;
+    if (task_calls != expected_tasks) {
+        printf("FAIL tasks called counted() %ld times, not %ld\n", task_calls, expected_tasks);
+        failures++;
+    }
+    if (failures > 0) {
+        printf("%d check%s failed\n", failures, failures == 1 ? "" : "s");
+        return 1;
+    }
+    printf("All checks passed on %d threads\n", threads);
+    return 0;
+}